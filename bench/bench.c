@@ -0,0 +1,880 @@
+/**
+ *   \file bench.c
+ *   \brief Allocation-heavy workloads run on the collector and on
+ *   malloc/free
+ *
+ *   Every workload is written once against a small allocation
+ *   interface (bench_new, bench_free, bench_store) and run twice: on
+ *   a heap of the collector, where bench_free does nothing, and on
+ *   the system allocator, where garbage is freed explicitly. Each run
+ *   is forked into a process of its own, so that its peak resident
+ *   memory (getrusage) is its own.
+ *
+ *   For each run the benchmark reports the wall time, the throughput
+ *   (operations per second, an operation being one object allocated
+ *   or one update of a data structure), percentiles of the latency of
+ *   the workload's iterations, and for the collector the number of
+ *   collections and percentiles of their pauses (from h_stats).
+ *
+ *   Workloads:
+ *   - binary-trees -- GCBench: a long-lived tree and array, and many
+ *     temporary trees of increasing depth, built top-down and
+ *     bottom-up.
+ *   - list-churn -- a long circular list whose nodes are replaced at
+ *     random.
+ *   - hash-map -- a chained hash map with random inserts, replacements,
+ *     lookups and deletions.
+ *   - large-mix -- a ring of recent objects, mostly small ones and
+ *     some larger than a page.
+ *   - deep-stack -- a deep recursion holding an object per frame, with
+ *     collections at the bottom, which scan the whole stack.
+ */
+
+#define _GNU_SOURCE // wait4, MAP_ANONYMOUS, must be defined before includes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "gc.h"
+
+/**
+ *  \def BENCH_RING
+ *  The amount of objects the large-mix workload keeps.
+ */
+#define BENCH_RING 256
+
+/**
+ *  \def BENCH_BUCKETS
+ *  The amount of buckets of the hash-map workload, in chunks of
+ *  BENCH_CHUNK.
+ */
+#define BENCH_BUCKETS 4096
+#define BENCH_CHUNK 64
+
+typedef struct bench bench_t;
+typedef struct bench_result bench_result_t;
+typedef struct bench_workload bench_workload_t;
+
+/**
+ *  The state of one run.
+ *
+ *  h         The heap, NULL when running on malloc/free.
+ *  barrier   Whether pointer stores need h_write_barrier (the heap
+ *            is generational or collects incrementally).
+ *  seed      State of the random number generator.
+ *  ops       Operations done.
+ *  samples   Latency of every iteration (in ns), n_samples of them
+ *            in room for capacity.
+ *  start     When the current iteration started.
+ */
+struct bench {
+  heap_t *h;
+  bool barrier;
+  uint64_t seed;
+  uint64_t ops;
+  uint64_t *samples;
+  size_t n_samples;
+  size_t capacity;
+  uint64_t start;
+};
+
+/**
+ *  The result of one run, written by the forked process.
+ *
+ *  ok          Set if the run finished.
+ *  seconds     Wall time of the workload.
+ *  ops         Operations done.
+ *  iter        50th, 99th, 99.9th percentile and maximum of the
+ *              iteration latencies (ns).
+ *  collections Stop-the-world collections.
+ *  pause       50th and 99th percentile and maximum of their pauses
+ *              (ns). Percentiles are the upper bounds of h_stats'
+ *              histogram buckets.
+ *  cycles      Finished incremental cycles.
+ *  step        50th and 99th percentile and maximum of the pauses of
+ *              incremental steps (ns), like pause.
+ *  max_rss     Peak resident memory (kB).
+ */
+struct bench_result {
+  bool ok;
+  double seconds;
+  uint64_t ops;
+  uint64_t iter[4];
+  uint64_t collections;
+  uint64_t pause[3];
+  uint64_t cycles;
+  uint64_t step[3];
+  long max_rss;
+};
+
+/**
+ *  A workload.
+ *
+ *  name        Its name on the command line and in the report.
+ *  iterations  Upper bound of its iterations at scale 1.
+ *  run         Runs it at a scale.
+ */
+struct bench_workload {
+  const char *name;
+  size_t iterations;
+  long (*run)(bench_t *b, int scale);
+};
+
+/**
+ *  The benchmark's settings, see bench_usage.
+ */
+typedef struct bench_config {
+  int scale;
+  int repeat;
+  size_t heap_bytes;
+  float gc_threshold;
+  float gc_overhead;
+  size_t target_bytes;
+  h_options_t opts;
+} bench_config_t;
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns the time of a monotonic clock in nanoseconds.
+ */
+uint64_t bench_now();
+
+/**
+ *  Returns a pseudo-random number (xorshift64*), the same sequence
+ *  in every run.
+ *
+ *  \param   b  the run
+ *  \return  the number
+ */
+uint64_t bench_random(bench_t *b);
+
+/**
+ *  Runs a workload on malloc/free (h == NULL) or a new heap, in a
+ *  process of its own.
+ *
+ *  \param   w       the workload
+ *  \param   config  the settings
+ *  \param   gc      true to run on the collector
+ *  \param   result  where to store the result
+ */
+void bench_fork(bench_workload_t *w, bench_config_t *config, bool gc, bench_result_t *result);
+
+////////////////// ALLOCATION INTERFACE //////////////////
+
+/**
+ *  Allocates a zeroed object.
+ *
+ *  \param   b       the run
+ *  \param   layout  its format string (see h_alloc_struct)
+ *  \param   bytes   its size
+ *  \return  the object
+ */
+static inline void *bench_new(bench_t *b, char *layout, size_t bytes)
+{
+  b->ops++;
+  return b->h != NULL ? h_alloc_struct(b->h, layout) : calloc(1, bytes);
+}
+
+/**
+ *  Allocates a zeroed object without pointers.
+ *
+ *  \param   b      the run
+ *  \param   bytes  its size
+ *  \return  the object
+ */
+static inline void *bench_data(bench_t *b, size_t bytes)
+{
+  b->ops++;
+  return b->h != NULL ? h_alloc_data(b->h, bytes) : calloc(1, bytes);
+}
+
+/**
+ *  Frees an object that has become garbage. Nothing to do on the
+ *  collector.
+ *
+ *  \param   b    the run
+ *  \param   obj  the object
+ */
+static inline void bench_free(bench_t *b, void *obj)
+{
+  if (b->h == NULL) {
+    free(obj);
+  }
+}
+
+/**
+ *  Stores a pointer into a field of an object that may be older than
+ *  the last collection.
+ *
+ *  \param   b      the run
+ *  \param   obj    the object
+ *  \param   field  the field
+ *  \param   value  the pointer
+ */
+static inline void bench_store(bench_t *b, void *obj, void *field, void *value)
+{
+  if (b->barrier) {
+    h_write_barrier(b->h, obj, field, value);
+  }
+  else {
+    *(void **)field = value;
+  }
+}
+
+/**
+ *  Starts timing an iteration.
+ *
+ *  \param   b  the run
+ */
+static inline void bench_begin(bench_t *b)
+{
+  b->start = bench_now();
+}
+
+/**
+ *  Records the latency of the iteration started by bench_begin.
+ *
+ *  \param   b  the run
+ */
+static inline void bench_end(bench_t *b)
+{
+  if (b->n_samples < b->capacity) {
+    b->samples[b->n_samples++] = bench_now() - b->start;
+  }
+}
+
+////////////////// WORKLOADS //////////////////
+
+/**
+ *  A node of binary-trees.
+ */
+typedef struct tree {
+  struct tree *left;
+  struct tree *right;
+  long i;
+  long j;
+} tree_t;
+
+static tree_t *tree_new(bench_t *b, tree_t *left, tree_t *right)
+{
+  tree_t *t = bench_new(b, "**ll", sizeof(tree_t));
+  t->left = left;
+  t->right = right;
+  return t;
+}
+
+static void tree_populate(bench_t *b, int depth, tree_t *t)
+{
+  if (depth <= 0) {
+    return;
+  }
+  // t may be older than the children when they trigger a collection
+  tree_t *left = tree_new(b, NULL, NULL);
+  bench_store(b, t, &t->left, left);
+  tree_t *right = tree_new(b, NULL, NULL);
+  bench_store(b, t, &t->right, right);
+  tree_populate(b, depth - 1, t->left);
+  tree_populate(b, depth - 1, t->right);
+}
+
+static tree_t *tree_make(bench_t *b, int depth)
+{
+  if (depth <= 0) {
+    return tree_new(b, NULL, NULL);
+  }
+  tree_t *left = tree_make(b, depth - 1);
+  tree_t *right = tree_make(b, depth - 1);
+  return tree_new(b, left, right);
+}
+
+static void tree_free(bench_t *b, tree_t *t)
+{
+  if (b->h != NULL || t == NULL) {
+    return;
+  }
+  tree_free(b, t->left);
+  tree_free(b, t->right);
+  free(t);
+}
+
+static long tree_check(tree_t *t)
+{
+  return t == NULL ? 0 : 1 + tree_check(t->left) + tree_check(t->right);
+}
+
+static long bench_binary_trees(bench_t *b, int scale)
+{
+  // Two levels less than GCBench's 18 and 16
+  const int stretch = 16;
+  const int long_lived = 14;
+  const int min_depth = 4;
+
+  tree_t *temp = tree_make(b, stretch + 1);
+  long check = tree_check(temp);
+  tree_free(b, temp);
+
+  tree_t *keep = bench_new(b, "**ll", sizeof(tree_t));
+  tree_populate(b, long_lived, keep);
+  size_t n_doubles = 500000;
+  double *array = bench_data(b, n_doubles*sizeof(double));
+  for (size_t i = 0; i < n_doubles/2; ++i) {
+    array[i] = 1.0/(double)(i + 1);
+  }
+
+  for (int depth = min_depth; depth <= long_lived; depth += 2) {
+    long iterations = scale*(2L << (stretch - depth));
+    for (long i = 0; i < iterations; ++i) {
+      bench_begin(b);
+      temp = bench_new(b, "**ll", sizeof(tree_t));
+      tree_populate(b, depth, temp);
+      check += tree_check(temp);
+      tree_free(b, temp);
+      bench_end(b);
+
+      bench_begin(b);
+      temp = tree_make(b, depth);
+      check += tree_check(temp);
+      tree_free(b, temp);
+      bench_end(b);
+    }
+  }
+
+  check += tree_check(keep) + (long)(array[1000]*1000);
+  tree_free(b, keep);
+  bench_free(b, array);
+  return check;
+}
+
+/**
+ *  A node of list-churn and deep-stack.
+ */
+typedef struct node {
+  struct node *next;
+  long value;
+  long pad;
+} node_t;
+
+static long bench_list_churn(bench_t *b, int scale)
+{
+  const size_t length = 100000;
+  const size_t iterations = 2000*(size_t)scale;
+  const size_t ops = 1000;
+
+  node_t *head = bench_new(b, "*ll", sizeof(node_t));
+  head->next = head;
+  for (size_t i = 1; i < length; ++i) {
+    node_t *node = bench_new(b, "*ll", sizeof(node_t));
+    node->value = (long)i;
+    node->next = head->next;
+    bench_store(b, head, &head->next, node);
+  }
+
+  long check = 0;
+  node_t *cursor = head;
+  for (size_t i = 0; i < iterations; ++i) {
+    bench_begin(b);
+    for (size_t j = 0; j < ops; ++j) {
+      for (uint64_t steps = bench_random(b) % 16; steps > 0; --steps) {
+        cursor = cursor->next;
+      }
+      // Replace the node after the cursor (never the head)
+      node_t *old = cursor->next;
+      if (old == head) {
+        continue;
+      }
+      node_t *node = bench_new(b, "*ll", sizeof(node_t));
+      node->value = old->value + 1;
+      node->next = old->next;
+      bench_store(b, cursor, &cursor->next, node);
+      bench_free(b, old);
+      check += node->value;
+    }
+    bench_end(b);
+  }
+
+  node_t *node = head->next;
+  while (node != head) {
+    node_t *next = node->next;
+    bench_free(b, node);
+    node = next;
+  }
+  bench_free(b, head);
+  return check;
+}
+
+/**
+ *  An entry of hash-map.
+ */
+typedef struct entry {
+  struct entry *next;
+  long key;
+  long value;
+} entry_t;
+
+/**
+ *  Finds the link to the entry of a key in a table of
+ *  BENCH_BUCKETS/BENCH_CHUNK chunks of buckets: the field holding
+ *  the entry, or the NULL at the end of its bucket.
+ *
+ *  \param   table  the table
+ *  \param   key    the key
+ *  \param   owner  set to the object holding the link
+ *  \return  the link
+ */
+static entry_t **map_find(void **table, long key, void **owner)
+{
+  size_t hash = (size_t)key*0x9E3779B97F4A7C15u >> 52;
+  entry_t **chunk = table[hash/BENCH_CHUNK];
+  entry_t **link = &chunk[hash % BENCH_CHUNK];
+  *owner = chunk;
+  while (*link != NULL && (*link)->key != key) {
+    *owner = *link;
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static long bench_hash_map(bench_t *b, int scale)
+{
+  const long keys = 65536;
+  const size_t iterations = 1000*(size_t)scale;
+  const size_t ops = 1000;
+  _Static_assert(BENCH_BUCKETS == 1 << 12, "map_find assumes 4096 buckets");
+
+  char chunk_layout[BENCH_CHUNK + 1];
+  memset(chunk_layout, '*', BENCH_CHUNK);
+  chunk_layout[BENCH_CHUNK] = '\0';
+  void **table = bench_new(b, chunk_layout, BENCH_CHUNK*sizeof(void *));
+  for (size_t i = 0; i < BENCH_BUCKETS/BENCH_CHUNK; ++i) {
+    void *chunk = bench_new(b, chunk_layout, BENCH_CHUNK*sizeof(void *));
+    bench_store(b, table, &table[i], chunk);
+  }
+
+  long check = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    bench_begin(b);
+    for (size_t j = 0; j < ops; ++j) {
+      uint64_t r = bench_random(b);
+      long key = (long)(r % (uint64_t)keys);
+      unsigned op = (unsigned)(r >> 32) % 4;
+      entry_t *entry = NULL;
+      if (op < 2) {
+        // Allocated before the lookup, as a collection may move what
+        // it finds
+        entry = bench_new(b, "*ll", sizeof(entry_t));
+        entry->key = key;
+        entry->value = (long)(r >> 40);
+      }
+      void *owner;
+      entry_t **link = map_find(table, key, &owner);
+      entry_t *found = *link;
+      if (entry != NULL) {
+        // Insert or replace, the replaced entry becomes garbage
+        entry->next = found != NULL ? found->next : NULL;
+        bench_store(b, owner, link, entry);
+        if (found != NULL) {
+          bench_free(b, found);
+        }
+      }
+      else if (op == 2 && found != NULL) {
+        bench_store(b, owner, link, found->next);
+        bench_free(b, found);
+      }
+      else if (found != NULL) {
+        check += found->value;
+      }
+    }
+    bench_end(b);
+  }
+
+  for (size_t i = 0; i < BENCH_BUCKETS/BENCH_CHUNK; ++i) {
+    entry_t **chunk = table[i];
+    for (size_t j = 0; j < BENCH_CHUNK; ++j) {
+      for (entry_t *entry = chunk[j]; entry != NULL;) {
+        entry_t *next = entry->next;
+        check += entry->key;
+        bench_free(b, entry);
+        entry = next;
+      }
+    }
+    bench_free(b, chunk);
+  }
+  bench_free(b, table);
+  return check;
+}
+
+static long bench_large_mix(bench_t *b, int scale)
+{
+  const size_t iterations = 2000*(size_t)scale;
+  const size_t ops = 100;
+
+  char ring_layout[BENCH_RING + 1];
+  memset(ring_layout, '*', BENCH_RING);
+  ring_layout[BENCH_RING] = '\0';
+  char **ring = bench_new(b, ring_layout, BENCH_RING*sizeof(void *));
+
+  long check = 0;
+  size_t next = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    bench_begin(b);
+    for (size_t j = 0; j < ops; ++j) {
+      uint64_t r = bench_random(b);
+      // One in ten objects is 4 kB to 256 kB, the others up to 512 B
+      size_t bytes = r % 10 == 0 ? 4096 + (r >> 8) % (252*1024) : 16 + (r >> 8) % 496;
+      char *data = bench_data(b, bytes);
+      data[0] = (char)r;
+      data[bytes - 1] = (char)(r >> 8);
+      char *old = ring[next];
+      if (old != NULL) {
+        check += old[0];
+      }
+      bench_store(b, ring, &ring[next], data);
+      bench_free(b, old);
+      next = (next + 1) % BENCH_RING;
+    }
+    bench_end(b);
+  }
+
+  for (size_t i = 0; i < BENCH_RING; ++i) {
+    bench_free(b, ring[i]);
+  }
+  bench_free(b, ring);
+  return check;
+}
+
+/**
+ *  The bottom of deep-stack: allocates enough garbage to trigger
+ *  collections, which scan the frames above, then walks the chain
+ *  of objects they hold.
+ */
+static long deep_bottom(bench_t *b, node_t *chain)
+{
+  const size_t garbage = 100000;
+  long check = 0;
+  for (size_t i = 0; i < garbage; ++i) {
+    node_t *node = bench_new(b, "*ll", sizeof(node_t));
+    node->value = (long)i;
+    check += node->value;
+    bench_free(b, node);
+  }
+  for (node_t *node = chain; node != NULL; node = node->next) {
+    check += node->value;
+  }
+  return check;
+}
+
+__attribute__((noinline))
+static long deep_recurse(bench_t *b, int depth, node_t *parent)
+{
+  node_t *node = bench_new(b, "*ll", sizeof(node_t));
+  node->next = parent;
+  node->value = depth;
+  long check = depth == 0 ? deep_bottom(b, node) : deep_recurse(b, depth - 1, node);
+  // Uses node after the call, so the frame (and the object) stays
+  check += node->value;
+  bench_free(b, node);
+  return check;
+}
+
+static long bench_deep_stack(bench_t *b, int scale)
+{
+  const int depth = 20000;
+  const size_t iterations = 50*(size_t)scale;
+
+  long check = 0;
+  for (size_t i = 0; i < iterations; ++i) {
+    bench_begin(b);
+    check += deep_recurse(b, depth, NULL);
+    bench_end(b);
+  }
+  return check;
+}
+
+/**
+ *  The workloads, with upper bounds of their iterations at scale 1.
+ */
+static bench_workload_t bench_workloads[] = {
+  { "binary-trees", 2*((2 << 12) + (2 << 10) + (2 << 8) + (2 << 6) + (2 << 4) + (2 << 2)), bench_binary_trees },
+  { "list-churn", 2000, bench_list_churn },
+  { "hash-map", 1000, bench_hash_map },
+  { "large-mix", 2000, bench_large_mix },
+  { "deep-stack", 50, bench_deep_stack },
+};
+
+#define BENCH_WORKLOADS (sizeof(bench_workloads)/sizeof(bench_workloads[0]))
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+uint64_t bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_random(bench_t *b)
+{
+  b->seed ^= b->seed >> 12;
+  b->seed ^= b->seed << 25;
+  b->seed ^= b->seed >> 27;
+  return b->seed*0x2545F4914F6CDD1Du;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ *  Returns a percentile of sorted samples.
+ */
+static uint64_t bench_percentile(uint64_t *sorted, size_t n, double q)
+{
+  if (n == 0) {
+    return 0;
+  }
+  size_t i = (size_t)(q*(double)(n - 1) + 0.5);
+  return sorted[i];
+}
+
+/**
+ *  Returns a percentile of pauses from their histogram: the upper
+ *  bound of the bucket it falls in, at most the longest pause.
+ */
+static uint64_t bench_pause_percentile(gc_pause_t *pause, double q)
+{
+  if (pause->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(q*(double)(pause->count - 1)) + 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < GC_STATS_BUCKETS; ++i) {
+    seen += pause->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = (uint64_t)2000 << i;
+      return bound < pause->max_ns ? bound : pause->max_ns;
+    }
+  }
+  return pause->max_ns;
+}
+
+/**
+ *  Runs a workload in the forked process and fills in its result.
+ */
+static void bench_child(bench_workload_t *w, bench_config_t *config, bool gc, bench_result_t *result)
+{
+  bench_t b = { 0 };
+  b.seed = 0x9E3779B97F4A7C15u;
+  b.capacity = w->iterations*(size_t)config->scale;
+  b.samples = malloc(b.capacity*sizeof(uint64_t));
+  if (b.samples == NULL) {
+    return;
+  }
+  if (gc) {
+    // Optimised code keeps pointers derived from objects (e.g. past
+    // the end of an array) on the stack, which only unsafe stacks allow
+    b.h = h_init_opt(config->heap_bytes, true, config->gc_threshold, &config->opts);
+    if (b.h == NULL) {
+      fprintf(stderr, "bench: could not create a heap of %zu bytes\n", config->heap_bytes);
+      return;
+    }
+    h_set_targets(b.h, config->gc_overhead, config->target_bytes);
+    b.barrier = config->opts.tenure_age != 0 || config->opts.gc_step_ns != 0;
+  }
+
+  uint64_t start = bench_now();
+  volatile long check = w->run(&b, config->scale);
+  uint64_t end = bench_now();
+  (void)check;
+
+  result->seconds = (double)(end - start)/1e9;
+  result->ops = b.ops;
+  qsort(b.samples, b.n_samples, sizeof(uint64_t), bench_compare);
+  result->iter[0] = bench_percentile(b.samples, b.n_samples, 0.5);
+  result->iter[1] = bench_percentile(b.samples, b.n_samples, 0.99);
+  result->iter[2] = bench_percentile(b.samples, b.n_samples, 0.999);
+  result->iter[3] = b.n_samples > 0 ? b.samples[b.n_samples - 1] : 0;
+  if (gc) {
+    gc_stats_t stats;
+    h_stats(b.h, &stats);
+    result->collections = stats.collections;
+    result->pause[0] = bench_pause_percentile(&stats.pause, 0.5);
+    result->pause[1] = bench_pause_percentile(&stats.pause, 0.99);
+    result->pause[2] = stats.pause.max_ns;
+    // Incremental collection pauses in its steps
+    result->cycles = stats.incremental_cycles;
+    result->step[0] = bench_pause_percentile(&stats.step, 0.5);
+    result->step[1] = bench_pause_percentile(&stats.step, 0.99);
+    result->step[2] = stats.step.max_ns;
+    h_delete(b.h);
+  }
+  free(b.samples);
+  result->ok = true;
+}
+
+void bench_fork(bench_workload_t *w, bench_config_t *config, bool gc, bench_result_t *result)
+{
+  // Shared with the child, which writes its result there
+  bench_result_t *shared = mmap(NULL, sizeof(bench_result_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  memset(result, 0, sizeof(bench_result_t));
+  if (shared == MAP_FAILED) {
+    return;
+  }
+  memset(shared, 0, sizeof(bench_result_t));
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    bench_child(w, config, gc, shared);
+    _exit(shared->ok ? 0 : 1);
+  }
+  int status;
+  struct rusage usage;
+  if (pid > 0 && wait4(pid, &status, 0, &usage) == pid) {
+    *result = *shared;
+    result->ok = result->ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    result->max_rss = usage.ru_maxrss;
+  }
+  munmap(shared, sizeof(bench_result_t));
+}
+
+/**
+ *  Prints one row of the report.
+ */
+static void bench_print(const char *workload, bool gc, bench_result_t *r)
+{
+  const char *alloc = gc ? "gc" : "malloc";
+  if (!r->ok) {
+    printf("%-13s %-7s  FAILED\n", workload, alloc);
+    return;
+  }
+  printf("%-13s %-7s %9.1f %9.2f %8.1f %8.1f %8.1f %9.1f",
+         workload, alloc, r->seconds*1e3, (double)r->ops/r->seconds/1e6,
+         r->iter[0]/1e3, r->iter[1]/1e3, r->iter[2]/1e3, r->iter[3]/1e3);
+  if (gc) {
+    printf(" %6llu %8.1f %8.1f %9.1f", (unsigned long long)r->collections,
+           r->pause[0]/1e3, r->pause[1]/1e3, r->pause[2]/1e3);
+    printf(" %6llu %8.1f %8.1f %9.1f", (unsigned long long)r->cycles,
+           r->step[0]/1e3, r->step[1]/1e3, r->step[2]/1e3);
+  }
+  else {
+    printf(" %6s %8s %8s %9s", "-", "-", "-", "-");
+    printf(" %6s %8s %8s %9s", "-", "-", "-", "-");
+  }
+  printf(" %9.1f\n", r->max_rss/1024.0);
+}
+
+static void bench_usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options] [workload...]\n"
+          "  -s N    scale: multiply the iterations by N (default 1)\n"
+          "  -r N    run each workload N times, report the median (default 1)\n"
+          "  -m MB   heap size (default 64)\n"
+          "  -x MB   make the heap growable up to this size\n"
+          "  -p B    page size in bytes (default 2048)\n"
+          "  -T F    gc_threshold (default 0.5)\n"
+          "  -O F    target share of time spent collecting, sizes the heap\n"
+          "          adaptively instead of -T (default 0, none)\n"
+          "  -H MB   target heap size, sizes the heap adaptively (default 0, none)\n"
+          "  -t N    collector threads (default 1)\n"
+          "  -g N    tenure age, makes the heap generational (default 0)\n"
+          "  -i NS   incremental step budget in ns (default 0)\n"
+          "  -h      print this help\n"
+          "workloads:", name);
+  for (size_t i = 0; i < BENCH_WORKLOADS; ++i) {
+    fprintf(stderr, " %s", bench_workloads[i].name);
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+  bench_config_t config = {
+    .scale = 1,
+    .repeat = 1,
+    .heap_bytes = (size_t)64 << 20,
+    .gc_threshold = 0.5f,
+  };
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:m:x:p:T:O:H:t:g:i:h")) != -1) {
+    switch (opt) {
+    case 's': config.scale = atoi(optarg); break;
+    case 'r': config.repeat = atoi(optarg); break;
+    case 'm': config.heap_bytes = (size_t)atol(optarg) << 20; break;
+    case 'x': config.opts.max_bytes = (size_t)atol(optarg) << 20; break;
+    case 'p': config.opts.page_size = (size_t)atol(optarg); break;
+    case 'T': config.gc_threshold = (float)atof(optarg); break;
+    case 'O': config.gc_overhead = (float)atof(optarg); break;
+    case 'H': config.target_bytes = (size_t)atol(optarg) << 20; break;
+    case 't': config.opts.gc_threads = (size_t)atol(optarg); break;
+    case 'g': config.opts.tenure_age = (unsigned)atoi(optarg); break;
+    case 'i': config.opts.gc_step_ns = (uint64_t)atoll(optarg); break;
+    case 'h':
+      bench_usage(argv[0]);
+      return 0;
+    default:
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (config.scale < 1 || config.repeat < 1 || config.gc_overhead < 0 || config.gc_overhead >= 1) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  printf("heap %zu MB, threshold %.2f, %zu gc threads, scale %d, %d run(s)\n",
+         config.heap_bytes >> 20, config.gc_threshold,
+         config.opts.gc_threads ? config.opts.gc_threads : 1, config.scale, config.repeat);
+  printf("%-13s %-7s %9s %9s %8s %8s %8s %9s %6s %8s %8s %9s %6s %8s %8s %9s %9s\n",
+         "workload", "alloc", "time ms", "Mops/s", "p50 us", "p99 us", "p99.9 us", "max us",
+         "gcs", "gc p50", "gc p99", "gc max", "cycles", "step p50", "step p99", "step max", "RSS MB");
+
+  int failed = 0;
+  for (size_t i = 0; i < BENCH_WORKLOADS; ++i) {
+    bench_workload_t *w = &bench_workloads[i];
+    bool selected = optind == argc;
+    for (int a = optind; a < argc; ++a) {
+      selected = selected || strcmp(argv[a], w->name) == 0;
+    }
+    if (!selected) {
+      continue;
+    }
+    for (int gc = 0; gc <= 1; ++gc) {
+      bench_result_t runs[config.repeat];
+      for (int r = 0; r < config.repeat; ++r) {
+        bench_fork(w, &config, gc, &runs[r]);
+      }
+      // The median run by time (insertion sort, the runs are few)
+      for (int r = 1; r < config.repeat; ++r) {
+        bench_result_t run = runs[r];
+        int j = r;
+        while (j > 0 && runs[j - 1].seconds > run.seconds) {
+          runs[j] = runs[j - 1];
+          --j;
+        }
+        runs[j] = run;
+      }
+      bench_result_t *median = &runs[config.repeat/2];
+      for (int r = 0; r < config.repeat; ++r) {
+        if (!runs[r].ok) {
+          median = &runs[r];
+        }
+      }
+      failed += !median->ok;
+      bench_print(w->name, gc, median);
+    }
+  }
+  return failed != 0;
+}
@@ -1,3 +1,120 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <assert.h>
+
+#include "gc.h"
+#include "object.h"
+#include "h_alloc.h"
+#include "h_thread.h"
+#include "gc_incremental.h"
+#include "h_large.h"
+#include "gc_stats.h"
+#include "h_policy.h"
+#include "gc_roots.h"
+
+void *h_alloc_struct(heap_t *h, char *layout)
+{
+  return o_alloc_struct(h, layout);
+}
+
+void *h_alloc_array(heap_t *h, char *layout, size_t count)
+{
+  return o_alloc_array(h, layout, count);
+}
+
+void *h_alloc_ptr_array(heap_t *h, size_t count)
+{
+  return o_alloc_array(h, "*", count);
+}
+
+size_t h_array_length(void *array)
+{
+  return o_array_length(array);
+}
+
+void *h_alloc_union(heap_t *h, size_t bytes, s_trace_f f)
+{
+  return o_alloc_union(h, bytes, f);
+}
+
+void *h_alloc_data(heap_t *h, size_t bytes)
+{
+  return o_alloc_raw(h, bytes);
+}
+
+bool h_register_thread(heap_t *h)
+{
+  return h_thread_register(h);
+}
+
+void h_unregister_thread(heap_t *h)
+{
+  h_thread_unregister(h);
+}
+
+void h_safepoint(heap_t *h)
+{
+  h_thread_safepoint(h);
+}
+
+void h_write_barrier(heap_t *h, void *obj, void **field, void *value)
+{
+  // Heap objects outside the pages are large objects
+  bool large = (uintptr_t)obj - (uintptr_t)h->pages >= h->total_pages*h->pagesize;
+  assert((large || ((uintptr_t)obj & ~(uintptr_t)(h->pagesize - 1)) ==
+          ((uintptr_t)field & ~(uintptr_t)(h->pagesize - 1))) && "Field outside of object");
+  gc_incremental_barrier(h, *field);
+  *field = value;
+  if (h->cards != NULL) {
+    if (large) {
+      // A large object is its own card
+      __atomic_store_n(&h_large_of(obj)->dirty, true, __ATOMIC_RELAXED);
+    }
+    else {
+      // Atomic, as several threads may mark the same card
+      uintptr_t offset = (uintptr_t)field - (uintptr_t)h->pages;
+      __atomic_store_n(&h->cards[offset >> H_CARD_SHIFT], 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+size_t h_avail(heap_t *h)
+{
+  return h_alloc_free_bytes(h);
+}
+
+bool h_add_root(heap_t *h, void **slot)
+{
+  return gc_roots_register(h, slot);
+}
+
+void h_remove_root(heap_t *h, void **slot)
+{
+  gc_roots_unregister(h, slot);
+}
+
+void h_set_targets(heap_t *h, float gc_overhead, size_t heap_bytes)
+{
+  // Allocating threads read the policy
+  h_thread_stop(h);
+  h_policy_set_targets(h, gc_overhead, heap_bytes);
+  h_thread_resume(h);
+}
+
+size_t h_used(heap_t *h)
+{
+  size_t bytes = __atomic_load_n(&h->large_bytes, __ATOMIC_RELAXED);
+  size_t committed = __atomic_load_n(&h->committed_pages, __ATOMIC_ACQUIRE);
+  for (size_t i = 0; i < committed; ++i) {
+    if (h_page_in_use(h, i)) {
+      bytes += h_page(h, i)->distance_front - PAGE_HEADER_SIZE;
+    }
+  }
+  return bytes;
+}
+
+void h_stats(heap_t *h, gc_stats_t *stats)
+{
+  gc_stats_read(h, stats);
+}
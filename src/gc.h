@@ -14,8 +14,9 @@ typedef struct heap heap_t;
 typedef void *(*trace_f)(heap_t *h, void *obj);
 
 /// The signature of object-specific trace functions. It will be
-/// called for its specific objects, and be given a generic trace
-/// function f to be called on each pointer inside obj.
+/// called for its specific objects, and be given the heap h of obj
+/// and a generic trace function f to be called (with h) on each
+/// pointer inside obj.
 typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
 
 /// Create a new heap with bytes total size (including both spaces
@@ -28,6 +29,84 @@ typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
 /// \return the new heap
 heap_t *h_init(size_t bytes, bool unsafe_stack, float gc_threshold);
 
+/// What collections do with the memory of the heap's free pages.
+///
+/// - H_RELEASE_NEVER -- it stays resident, as the pages will be
+///   used again.
+/// - H_RELEASE_EXCESS -- it is returned to the system (madvise
+///   MADV_DONTNEED), except for the pages the heap can still hand
+///   out before it reaches its gc_threshold again.
+/// - H_RELEASE_ALL -- all of it is returned to the system.
+///
+/// Returned pages read as zeroes and are backed by memory again
+/// when they are next used.
+typedef enum h_release {
+  H_RELEASE_NEVER,
+  H_RELEASE_EXCESS,
+  H_RELEASE_ALL
+} h_release_t;
+
+/// Optional heap settings for h_init_opt. A zero-initialised
+/// struct gives the same heap as h_init.
+///
+/// - gc_threads -- the number of threads that copy objects during
+///   a collection, including the thread calling h_gc. 0 or 1
+///   collects on the calling thread only, as do compactions (see
+///   h_gc).
+/// - tenure_age -- makes the heap generational: objects that have
+///   survived this many collections are tenured (old), and are left
+///   alone by minor collections. At most 15, 0 for a heap that is
+///   not generational. Pointer stores into objects of a
+///   generational heap must go through h_write_barrier.
+/// - nursery_pages -- the number of pages allocated into that
+///   triggers a minor collection, 0 for an eighth of the heap.
+/// - gc_step_ns -- makes the allocator collect incrementally: once
+///   half of gc_threshold is reached, every page it hands out is
+///   preceded by an h_gc_step with this budget (in nanoseconds).
+///   0 leaves all collection to full collections.
+/// - max_bytes -- makes the heap growable: address space for a heap
+///   of max_bytes is reserved up front, but only bytes of it is
+///   committed. More is committed as the heap grows, when a page is
+///   needed that the committed part does not have. gc_threshold is a
+///   share of the committed part. 0 for a heap of a fixed size.
+/// - release -- what collections do with the memory of free pages,
+///   see h_release_t.
+/// - page_size -- the size of the heap's pages, a power of 2 from
+///   256 bytes to 1 GB, 0 for the default of 2048. Larger pages
+///   mean fewer page headers and pages to visit, but the pinned
+///   objects of a page keep it in use until they die, and objects
+///   larger than a page get a mapping of their own.
+/// - huge_pages -- backs the heap with 2 MB huge pages: explicit
+///   ones (MAP_HUGETLB) when the system has enough reserved,
+///   transparent ones (madvise MADV_HUGEPAGE) otherwise. Memory is
+///   then committed and released in whole huge pages.
+/// - precise_roots -- stacks are not scanned: the only roots are
+///   the slots registered with h_add_root and the shadow stack
+///   frames pushed with H_PUSH_ROOTS. No object is then pinned by
+///   an ambiguous root, so collections evacuate all of them, and
+///   unsafe_stack no longer matters. Every pointer into the heap
+///   that lives across an allocation must then be in a root.
+typedef struct h_options {
+  size_t gc_threads;
+  unsigned tenure_age;
+  size_t nursery_pages;
+  uint64_t gc_step_ns;
+  size_t max_bytes;
+  h_release_t release;
+  size_t page_size;
+  bool huge_pages;
+  bool precise_roots;
+} h_options_t;
+
+/// Create a new heap like h_init, with additional settings.
+///
+/// \param bytes the total size of the heap in bytes
+/// \param unsafe_stack true if pointers on the stack are to be considered unsafe pointers
+/// \param gc_threshold the memory pressure at which gc should be triggered (1.0 = full memory)
+/// \param opts the settings, NULL for the defaults
+/// \return the new heap, NULL if it (or its GC threads) could not be created
+heap_t *h_init_opt(size_t bytes, bool unsafe_stack, float gc_threshold, const h_options_t *opts);
+
 /// Delete a heap.
 ///
 /// \param h the heap
@@ -39,6 +118,125 @@ void h_delete(heap_t *h);
 /// \param dbg_value a value to be written into every pointer into h on the stack
 void h_delete_dbg(heap_t *h, void *dbg_value);
 
+/// Save a heap to a file, after a full collection, so that a later
+/// run can start from it with h_snapshot_load instead of building it
+/// again. The file holds the live objects, the pages they are in and
+/// the compiled layouts. No other thread may use the heap meanwhile.
+///
+/// \param h the heap
+/// \param path the file, created or truncated
+/// \param root the object to start from in the loaded heap, may be NULL
+/// \return false if the file could not be written
+bool h_snapshot_save(heap_t *h, const char *path, void *root);
+
+/// Create a heap from a file written by h_snapshot_save. The pages
+/// of the file are mapped copy-on-write, so they are read when
+/// touched. If the heap cannot be created at the address it was
+/// saved from, the pointers in its objects are relocated. Unions
+/// (h_alloc_union) store the address of their trace function, so a
+/// snapshot with unions is only loaded by the program that saved it,
+/// as told by its build-id; other programs get NULL.
+///
+/// \param path the file
+/// \param root set to the object saved as root, may be NULL
+/// \return the heap, NULL if the file is not a snapshot this program can load
+heap_t *h_snapshot_load(const char *path, void **root);
+
+/// Register the calling thread with a heap, so that it may use the
+/// heap while other threads do. A registered thread allocates into
+/// pages of its own (a thread-local allocation buffer) without any
+/// synchronisation. Threads that are not registered share one page,
+/// so at most one of them may use the heap at a time.
+///
+/// A collection stops all other registered threads at their next
+/// safepoint: a call to h_safepoint, or an allocation that needs a
+/// fresh page. Their stacks (and registers) are then scanned for
+/// roots just like the collecting thread's. A registered thread
+/// must therefore reach safepoints regularly, and unregister before
+/// blocking for long (e.g. joining a thread that allocates).
+///
+/// \param h the heap
+/// \return false if out of memory or the thread's stack could not be found
+bool h_register_thread(heap_t *h);
+
+/// Unregister the calling thread from a heap. Every registered
+/// thread must unregister before it exits and before the heap is
+/// deleted. Pointers on its stack are no longer roots once it has.
+///
+/// \param h the heap
+void h_unregister_thread(heap_t *h);
+
+/// Safepoint poll for registered threads: parks the calling thread
+/// while another thread collects. Cheap when no collection is
+/// pending, so it can be called in loops that do not allocate.
+///
+/// \param h the heap
+void h_safepoint(heap_t *h);
+
+/// Register a root: a variable outside of the heap (e.g. a global)
+/// holding a pointer into it, or NULL. Collections keep the object
+/// it points to alive, and update the variable when they move it.
+/// Unlike a pointer found on a stack, a registered root never pins
+/// its object's page.
+///
+/// \param h the heap
+/// \param slot the address of the variable
+/// \return false if out of memory
+bool h_add_root(heap_t *h, void **slot);
+
+/// Unregister a root registered with h_add_root.
+///
+/// \param h the heap
+/// \param slot the address of the variable
+void h_remove_root(heap_t *h, void **slot);
+
+/// A frame of a shadow stack, the precise roots of a function's
+/// local variables, see H_PUSH_ROOTS.
+///
+/// - prev -- the frame pushed before, NULL for none.
+/// - heap -- the heap the variables point into.
+/// - count -- the amount of variables.
+/// - slots -- the addresses of the variables.
+typedef struct h_frame {
+  struct h_frame *prev;
+  heap_t *heap;
+  size_t count;
+  void **slots;
+} h_frame_t;
+
+/// The top of the calling thread's shadow stack, shared by all
+/// heaps: collections skip the frames of other heaps. Only pushed
+/// and popped by H_PUSH_ROOTS and H_POP_ROOTS.
+extern __thread h_frame_t *h_frames;
+
+/// Make local variables precise roots until H_POP_ROOTS, e.g.
+///
+///     node_t *list = NULL, *node = NULL;
+///     H_PUSH_ROOTS(h, &list, &node);
+///     ...
+///     H_POP_ROOTS(h);
+///
+/// Like registered roots, they never pin, and collections update
+/// them in place. The frame lives in the calling block, so it must
+/// be popped before the block is left (return included), and a
+/// block pushes at most one frame. The frames of a thread are seen
+/// by collections on that thread, and by collections on others once
+/// it is registered (h_register_thread).
+///
+/// \param h the heap
+/// \param ... the addresses of the variables
+#define H_PUSH_ROOTS(h, ...)                                            \
+  void *h_frame_slots[] = { __VA_ARGS__ };                             \
+  h_frame_t h_frame = {                                                \
+    h_frames, (h), sizeof(h_frame_slots)/sizeof(void *), h_frame_slots \
+  };                                                                   \
+  h_frames = &h_frame
+
+/// Pop the frame pushed by H_PUSH_ROOTS in the same block.
+///
+/// \param h the heap
+#define H_POP_ROOTS(h) ((void)(h), h_frames = h_frame.prev)
+
 /// Allocate a new object on a heap with a given format string.
 ///
 /// Valid characters in format strings are:
@@ -50,6 +248,9 @@ void h_delete_dbg(heap_t *h, void *dbg_value);
 /// - '*' -- for a sizeof(void *) bytes pointer value
 /// - '\0' -- null-character terminates the format string
 ///
+/// A character may be preceded by a repeat count: "3*2d" is the
+/// same as "***dd".
+///
 /// \param h the heap
 /// \param layout the format string
 /// \return the newly allocated object
@@ -57,6 +258,34 @@ void h_delete_dbg(heap_t *h, void *dbg_value);
 /// Note: the heap does *not* retain an alias to layout.
 void *h_alloc_struct(heap_t *h, char *layout);
 
+/// Allocate an array of structs on a heap, laid out like a C array:
+/// count elements with the format string of h_alloc_struct. The
+/// whole array has a single header (two words: the element layout
+/// and the length), where count objects would have one each, and
+/// collections trace it in one loop over the elements.
+///
+/// \param h the heap
+/// \param layout the format string of an element
+/// \param count the amount of elements
+/// \return the newly allocated array, NULL if layout is invalid
+void *h_alloc_array(heap_t *h, char *layout, size_t count);
+
+/// Allocate an array of count pointers on a heap, the same as
+/// h_alloc_array(h, "*", count). Collections prefetch the objects
+/// ahead of those they trace.
+///
+/// \param h the heap
+/// \param count the amount of pointers
+/// \return the newly allocated array
+void *h_alloc_ptr_array(heap_t *h, size_t count);
+
+/// Returns the amount of elements of an array allocated with
+/// h_alloc_array or h_alloc_ptr_array.
+///
+/// \param array the array
+/// \return the amount of elements, 0 for other objects
+size_t h_array_length(void *array);
+
 /// Allocate a new object on a heap with a given size, and
 /// object-specific trace function. 
 ///
@@ -76,12 +305,22 @@ void *h_alloc_union(heap_t *h, size_t bytes, s_trace_f f);
 /// Objects allocated with this function will *not* be 
 /// further traced for pointers. 
 ///
+/// Objects larger than a page (of any kind) get a memory mapping of
+/// their own and are never moved by the collector; their memory
+/// counts towards the size of the heap.
+///
 /// \param h the heap
 /// \param bytes the size in bytes
 /// \return the newly allocated object
 void *h_alloc_data(heap_t *h, size_t bytes);
 
-/// Manually trigger garbage collection.
+/// Manually trigger garbage collection. On a generational heap this
+/// is a full collection, including tenured objects.
+///
+/// A full collection copies the reachable objects into free pages.
+/// When there are too few of those for the survivors, it compacts
+/// the heap in place instead, sliding the reachable objects together
+/// within the pages in use, so a heap can run nearly full.
 ///
 /// Garbage collection is otherwise run when an allocation is
 /// impossible in the available consecutive free memory.
@@ -90,6 +329,42 @@ void *h_alloc_data(heap_t *h, size_t bytes);
 /// \return the number of bytes collected
 size_t h_gc(heap_t *h);
 
+/// Manually trigger a minor garbage collection, which only collects
+/// objects that have not been tenured. Pointers from tenured objects
+/// are found through the cards marked by h_write_barrier. On a heap
+/// that is not generational this is the same as h_gc.
+///
+/// \param h the heap
+/// \return the number of bytes collected
+size_t h_gc_minor(heap_t *h);
+
+/// Do a bounded slice of incremental collection work and return.
+///
+/// The first step of a cycle scans the stack; later steps mark
+/// reachable objects and then release pages without live objects.
+/// Objects are not moved by incremental collection. While a cycle
+/// runs, all pointer stores into objects allocated before it
+/// started must go through h_write_barrier. A full collection
+/// (h_gc) abandons a running cycle.
+///
+/// \param h the heap
+/// \param budget_ns the time budget in nanoseconds, 0 to finish the cycle
+/// \return the number of bytes collected in this step
+size_t h_gc_step(heap_t *h, uint64_t budget_ns);
+
+/// Store a pointer in a field of a heap object. On a generational
+/// heap all pointer stores into objects that may have survived a
+/// collection must use this function (stores into objects allocated
+/// since the last collection need not), so that minor collections
+/// find pointers from old objects to young ones. The same goes for
+/// any heap while an incremental collection (h_gc_step) runs.
+///
+/// \param h the heap
+/// \param obj the object written to
+/// \param field the address of the pointer field in obj
+/// \param value the pointer to store
+void h_write_barrier(heap_t *h, void *obj, void **field, void *value);
+
 /// Manually trigger garbage collection with the ability to 
 /// override the setting for how stack pointers are treated. 
 /// 
@@ -116,4 +391,158 @@ size_t h_avail(heap_t *h);
 /// \return the bytes currently in use by user structures. 
 size_t h_used(heap_t *h);
 
+/// Sets targets that size the heap adaptively instead of by its
+/// gc_threshold. The heap measures its allocation rate, the time
+/// its collections take and how much of it survives them, and
+/// after every full collection picks when to run the next one, and
+/// how much room it keeps for copying the survivors, to meet:
+///
+/// - gc_overhead -- the share of time spent collecting, e.g. 0.05
+///   for 5%. A lower share lets the heap grow further between
+///   collections.
+/// - heap_bytes -- the size of the heap, the copy reserve included.
+///   The heap collects more often to stay below it, but never so
+///   often that it only collects (it grows above a target smaller
+///   than its live data).
+///
+/// With both targets the smaller heap wins. 0 disables a target;
+/// with none, the heap goes back to its gc_threshold. Targets never
+/// take a heap beyond the size given to h_init.
+///
+/// \param h the heap
+/// \param gc_overhead the target share of time spent collecting, below 1
+/// \param heap_bytes the target size of the heap in bytes
+void h_set_targets(heap_t *h, float gc_overhead, size_t heap_bytes);
+
+/// The amount of buckets of a pause time histogram.
+#define GC_STATS_BUCKETS 32
+
+/// Pause times of one phase of collection.
+///
+/// - count -- the number of pauses.
+/// - total_ns -- their total time in nanoseconds.
+/// - max_ns -- the longest pause in nanoseconds.
+/// - buckets -- a histogram on a log scale: bucket i counts the
+///   pauses of 2^i to 2^(i+1) microseconds. Bucket 0 also counts
+///   the shorter ones, the last bucket the longer ones.
+typedef struct gc_pause {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[GC_STATS_BUCKETS];
+} gc_pause_t;
+
+/// Statistics of a heap, from its creation on.
+///
+/// - collections -- the number of stop-the-world collections
+///   (h_gc and h_gc_minor, and those triggered by allocation).
+/// - minor_collections -- how many of those were minor ones.
+/// - compactions -- how many were compacting ones, run instead of
+///   copying when the free pages could not hold the survivors.
+/// - incremental_cycles -- the number of finished incremental
+///   collection cycles (see h_gc_step).
+/// - pause -- the pauses of stop-the-world collections, from
+///   stopping the world to resuming it.
+/// - root_scan -- the part of those spent finding and handling the
+///   stack roots.
+/// - copy -- the part spent copying the reachable objects.
+/// - page_release -- the part spent releasing the pages left
+///   behind and sizing the heap.
+/// - step -- the pauses of incremental steps.
+/// - bytes_allocated -- the bytes of all objects allocated, headers
+///   and rounding to size classes included.
+/// - bytes_copied -- the bytes copied (or slid, by compactions) by
+///   collections, headers and rounding to size classes included.
+/// - bytes_reclaimed -- the bytes collected, see h_gc.
+/// - bytes_live -- the bytes in use (see h_used) right after the
+///   last collection or incremental cycle.
+/// - pages_promoted -- the pages collections kept in place with all
+///   their objects rather than evacuate them: those kept when the
+///   free pages run out, and the pages ambiguous roots point into
+///   during a compaction.
+/// - objects_pinned -- the objects ambiguous (unsafe) roots point
+///   into, which copying collections leave in place. The other
+///   objects of their pages are still evacuated.
+/// - root_candidates -- the stack words that looked like pointers
+///   into the heap at first sight.
+/// - roots_confirmed -- how many of those did point into an object
+///   in use.
+typedef struct gc_stats {
+  uint64_t collections;
+  uint64_t minor_collections;
+  uint64_t compactions;
+  uint64_t incremental_cycles;
+  gc_pause_t pause;
+  gc_pause_t root_scan;
+  gc_pause_t copy;
+  gc_pause_t page_release;
+  gc_pause_t step;
+  uint64_t bytes_allocated;
+  uint64_t bytes_copied;
+  uint64_t bytes_reclaimed;
+  uint64_t bytes_live;
+  uint64_t pages_promoted;
+  uint64_t objects_pinned;
+  uint64_t root_candidates;
+  uint64_t roots_confirmed;
+} gc_stats_t;
+
+/// Returns the statistics of a heap. Keeping them costs next to
+/// nothing: collections update them with the world stopped, and
+/// the allocation fast path not at all (the bytes allocated into a
+/// page are counted when it is full). Reading them does not visit
+/// the heap's pages, unlike h_used.
+///
+/// \param h the heap
+/// \param stats where to store the statistics
+void h_stats(heap_t *h, gc_stats_t *stats);
+
+/// Start the allocation profiler, or change its rate. It samples an
+/// allocation about every rate bytes, at random, and records its
+/// call stack and what was allocated (the format string, or union
+/// or data). Sampled objects are followed through collections, to
+/// tell which allocations survive them. Allocating is no slower
+/// while sampling, except for the sampled allocations themselves,
+/// so the profiler can stay on. Sampling starts as threads take new
+/// pages. Names of functions are only known to the profiler if the
+/// program is linked with -rdynamic.
+///
+/// \param h the heap
+/// \param rate the mean amount of bytes between samples, 0 for 512 KiB
+/// \return false if out of memory
+bool h_profile_start(heap_t *h, size_t rate);
+
+/// Stop taking samples. Those taken are kept, and still followed,
+/// until the heap is deleted (or the profiler started again, which
+/// adds to them).
+///
+/// \param h the heap
+void h_profile_stop(heap_t *h);
+
+/// What h_profile_write weighs the call stacks of allocations by.
+///
+/// - H_PROFILE_ALLOCATED -- the bytes allocated.
+/// - H_PROFILE_SURVIVED -- the bytes that survived a collection.
+/// - H_PROFILE_LIVE -- the bytes that are still live, as of the
+///   last collection.
+///
+/// All are estimated from the samples.
+typedef enum h_profile_metric {
+  H_PROFILE_ALLOCATED,
+  H_PROFILE_SURVIVED,
+  H_PROFILE_LIVE
+} h_profile_metric_t;
+
+/// Write the samples of the allocation profiler to a file, in the
+/// folded stack format of flame graph tools: a line per call stack
+/// and type of object, with its frames from the outermost in,
+/// separated by semicolons, the type as the last frame, and the
+/// bytes, e.g. "main;make_list;h_alloc_struct;o_alloc_struct;struct:*l 524288".
+///
+/// \param h the heap
+/// \param path the file, created or truncated
+/// \param metric what to weigh the stacks by
+/// \return false if the file could not be written
+bool h_profile_write(heap_t *h, const char *path, h_profile_metric_t metric);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,528 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gc_compact.h"
+#include "gc_copy.h"
+#include "gc_incremental.h"
+#include "gc_roots.h"
+#include "h_alloc.h"
+#include "h_large.h"
+#include "h_profile.h"
+#include "object.h"
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns the page an address inside the heap's pages belongs to.
+ *
+ *  \param   h     the heap
+ *  \param   addr  address inside a page
+ *  \return  the page header
+ */
+page_t *gc_compact_page_of(heap_t *h, void *addr);
+
+/**
+ *  Marks the large object an address points into, if any, pushing
+ *  it on the mark stack.
+ *
+ *  \param   h     the heap
+ *  \param   addr  an address outside the heap's pages
+ */
+void gc_compact_mark_large(heap_t *h, void *addr);
+
+/**
+ *  Marks an object, pushing it on the mark stack, unless it is
+ *  already marked. Pointers to neither an object in a used page nor
+ *  a large object are ignored.
+ *
+ *  \param   h    the heap
+ *  \param   obj  the object
+ */
+void gc_compact_mark_object(heap_t *h, void *obj);
+
+/**
+ *  Pointer visitor that marks the object a slot points to.
+ *
+ *  \param   slot  the slot
+ *  \param   h     the heap
+ */
+void gc_compact_slot(void **slot, void *h);
+
+/**
+ *  Pins the page an unsafe root points into, marking the object it
+ *  points into, or marks the large object it points into.
+ *
+ *  \param   h     the heap
+ *  \param   addr  the root's value
+ */
+void gc_compact_pin(heap_t *h, void *addr);
+
+/**
+ *  Handles a safe root, marking the object it points to. Values that
+ *  point into the heap but not at an object are treated as unsafe.
+ *
+ *  \param   h    the heap
+ *  \param   ptr  the root's value
+ */
+void gc_compact_root(heap_t *h, void *ptr);
+
+/**
+ *  Counts the marked objects of a page below an address.
+ *
+ *  \param   h     the heap
+ *  \param   page  the page
+ *  \param   addr  an address in the page, or the end of the page
+ *  \return  the amount of objects
+ */
+size_t gc_compact_rank(heap_t *h, page_t *page, void *addr);
+
+/**
+ *  Returns the amount of chunks of a page of one size class.
+ *
+ *  \param   h     the heap
+ *  \param   page  the page
+ *  \return  the amount of chunks (slots) that fit in the page
+ */
+size_t gc_compact_slots(heap_t *h, page_t *page);
+
+/**
+ *  The compacted pages of one size class and age, while forwarding
+ *  addresses are computed.
+ *
+ *  last    the last page lined up so far, NULL when none
+ *  target  the page the next live object goes to
+ *  slot    the chunk of target it goes to
+ */
+typedef struct gc_compact_line {
+  page_t *last;
+  page_t *target;
+  size_t slot;
+} gc_compact_line_t;
+
+/**
+ *  Lines up the compacted pages of every size class and age, and
+ *  records where the first live object of each one goes.
+ *
+ *  \param   h  the heap
+ */
+void gc_compact_forward(heap_t *h);
+
+/**
+ *  Returns the forwarding address of a live object in a compacted
+ *  page.
+ *
+ *  \param   h     the heap
+ *  \param   page  the object's page
+ *  \param   obj   the object
+ *  \param   rank  the amount of marked objects before it in the page
+ *  \return  the object's address after the collection
+ */
+void *gc_compact_destination(heap_t *h, page_t *page, void *obj, size_t rank);
+
+/**
+ *  Returns the address of an object after the collection. Pointers
+ *  to pages that are not compacted, and outside the heap's pages,
+ *  are returned as they are.
+ *
+ *  \param   h    the heap
+ *  \param   ptr  a pointer to a live object (or anywhere)
+ *  \return  its forwarding address
+ */
+void *gc_compact_address(heap_t *h, void *ptr);
+
+/**
+ *  Returns where a marked object will slide to, see
+ *  h_profile_survivors.
+ *
+ *  \param   h    the heap
+ *  \param   obj  an object that was live before the collection
+ *  \return  its address after the collection, NULL if it is dead
+ */
+void *gc_compact_survivor(heap_t *h, void *obj);
+
+/**
+ *  Updates the roots in the root buffer. A slot found twice is only
+ *  updated once, as it no longer holds the value it was found with.
+ *
+ *  \param   h  the heap
+ */
+void gc_compact_update_roots(heap_t *h);
+
+/**
+ *  State of gc_compact_update_slot while updating one object.
+ *
+ *  h      the heap
+ *  young  set if a slot points to an object that stays young
+ */
+typedef struct gc_compact_scan {
+  heap_t *h;
+  bool young;
+} gc_compact_scan_t;
+
+/**
+ *  Pointer visitor that updates a slot to the forwarding address.
+ *
+ *  \param   slot  the slot
+ *  \param   scan  the gc_compact_scan_t of the object
+ */
+void gc_compact_update_slot(void **slot, void *scan);
+
+/**
+ *  Updates the pointers of a live object, remembering the object at
+ *  its new address if it is old and points to young objects.
+ *
+ *  \param   h    the heap
+ *  \param   obj  the object
+ */
+void gc_compact_update_object(heap_t *h, void *obj);
+
+/**
+ *  Slides the live objects of a compacted page to their forwarding
+ *  addresses, and zeroes what they leave behind.
+ *
+ *  \param   h     the heap
+ *  \param   page  the page
+ */
+void gc_compact_slide(heap_t *h, page_t *page);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+page_t *gc_compact_page_of(heap_t *h, void *addr)
+{
+  return (page_t *)((uintptr_t)addr & ~(uintptr_t)(h->pagesize - 1));
+}
+
+bool gc_compact_needed(heap_t *h)
+{
+  size_t used = h->used_pages + h->large_pages;
+  size_t free_pages = h->total_pages > used ? h->total_pages - used : 0;
+  size_t survivors = h->survivor_pages < h->used_pages ? h->survivor_pages : h->used_pages;
+  return free_pages < survivors + H_MIXED_CLASS + 1;
+}
+
+void gc_compact_begin(heap_t *h)
+{
+  // Marks are clear outside of incremental cycles
+  gc_copy_begin(h, false);
+}
+
+void gc_compact_mark_large(heap_t *h, void *addr)
+{
+  h_large_t *large = h_large_find(h, addr);
+  if (large == NULL || large->marked) {
+    return;
+  }
+  large->marked = true;
+  gc_incremental_push(h, h_large_object(large));
+}
+
+void gc_compact_mark_object(heap_t *h, void *obj)
+{
+  if (!address_within_pages(h, obj)) {
+    gc_compact_mark_large(h, obj);
+    return;
+  }
+  page_t *page = gc_compact_page_of(h, obj);
+  uint64_t *marks = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  if (marks[bit/64] & (1UL << (bit%64))) {
+    return;
+  }
+  marks[bit/64] |= 1UL << (bit%64);
+  gc_incremental_push(h, obj);
+}
+
+void gc_compact_slot(void **slot, void *h)
+{
+  gc_compact_mark_object(h, *slot);
+}
+
+void gc_compact_pin(heap_t *h, void *addr)
+{
+  if (!address_within_pages(h, addr)) {
+    gc_compact_mark_large(h, addr);
+    return;
+  }
+  // The page stays in place, its unmarked objects are swept
+  page_t *page = gc_compact_page_of(h, addr);
+  page->promoted = true;
+  void *obj = gc_copy_object_at(page, addr);
+  if (obj != NULL) {
+    gc_compact_mark_object(h, obj);
+  }
+}
+
+void gc_compact_root(heap_t *h, void *ptr)
+{
+  if (!address_within_pages(h, ptr)) {
+    gc_compact_mark_large(h, ptr);
+  }
+  else if (!gc_copy_is_object(gc_compact_page_of(h, ptr), ptr)) {
+    gc_compact_pin(h, ptr);
+  }
+  else {
+    gc_compact_mark_object(h, ptr);
+  }
+}
+
+void gc_compact_roots(heap_t *h, h_stack_t *stacks, size_t n_stacks, bool unsafe_stack)
+{
+  gc_roots_scan(h, stacks, n_stacks);
+  gc_roots_sort(h, unsafe_stack);
+  for (size_t i = 0; i < h->root_count; ++i) {
+    if (i + GC_ROOTS_PREFETCH < h->root_count) {
+      gc_roots_prefetch(h, &h->roots[i + GC_ROOTS_PREFETCH], unsafe_stack);
+    }
+    if (unsafe_stack) {
+      gc_compact_pin(h, h->roots[i].value);
+    }
+    else {
+      gc_compact_root(h, h->roots[i].value);
+    }
+  }
+  // Unsafe roots are not updated, they pinned their pages. The others
+  // stay in the buffer for gc_compact_move, a slot that is both a
+  // stack and a precise root is found twice before either is updated.
+  size_t first = unsafe_stack ? 0 : h->root_count;
+  h->root_count = first;
+  gc_roots_add_precise(h);
+  for (size_t i = first; i < h->root_count; ++i) {
+    gc_compact_root(h, h->roots[i].value);
+  }
+}
+
+void gc_compact_mark(heap_t *h)
+{
+  for (;;) {
+    while (h->grey_count > 0) {
+      void *obj = h->grey[--h->grey_count];
+      o_foreach_pointer(h, obj, gc_compact_slot, h);
+    }
+    if (!h->grey_overflow) {
+      return;
+    }
+    // Some marked objects could not be pushed, all are scanned again
+    gc_incremental_rescan(h, gc_compact_slot);
+  }
+}
+
+size_t gc_compact_rank(heap_t *h, page_t *page, void *addr)
+{
+  uint64_t *marks = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)addr - (char *)page)/WORDSIZE;
+  size_t rank = 0;
+  for (size_t i = 0; i < bit/64; ++i) {
+    rank += (size_t)__builtin_popcountll(marks[i]);
+  }
+  if (bit%64 != 0) {
+    rank += (size_t)__builtin_popcountll(marks[bit/64] & ((1UL << (bit%64)) - 1));
+  }
+  return rank;
+}
+
+size_t gc_compact_slots(heap_t *h, page_t *page)
+{
+  return (h->pagesize - PAGE_HEADER_SIZE)/page->chunk_size;
+}
+
+void gc_compact_forward(heap_t *h)
+{
+  gc_compact_line_t lines[H_MAX_AGE + 1][H_SIZE_CLASSES];
+  memset(lines, 0, sizeof(lines));
+
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    page_t *page = h_page(h, i);
+    if (!h_page_in_use(h, i) || page->chunk_size == 0 || page->promoted) {
+      continue;
+    }
+    page->next = NULL;
+    gc_compact_line_t *line = &lines[page->age][page->size_class];
+    if (line->last == NULL) {
+      line->target = page;
+      line->slot = 0;
+    }
+    else {
+      line->last->next = page;
+      // At most one page further: a page holds no more live objects
+      // than it has slots
+      size_t slots = gc_compact_slots(h, page);
+      if (line->slot >= slots) {
+        line->target = line->target->next;
+        line->slot -= slots;
+      }
+    }
+    line->last = page;
+    page->target = line->target;
+    page->free = (uint32_t)line->slot;
+    line->slot += gc_compact_rank(h, page, (char *)page + h->pagesize);
+  }
+}
+
+void *gc_compact_destination(heap_t *h, page_t *page, void *obj, size_t rank)
+{
+  size_t slots = gc_compact_slots(h, page);
+  size_t slot = page->free + rank;
+  page_t *target = page->target;
+  if (slot >= slots) {
+    target = target->next;
+    slot -= slots;
+  }
+  size_t offset = (size_t)((char *)obj - (char *)page) - PAGE_HEADER_SIZE;
+  return (char *)target + PAGE_HEADER_SIZE + slot*page->chunk_size + offset%page->chunk_size;
+}
+
+void *gc_compact_address(heap_t *h, void *ptr)
+{
+  if (!address_within_pages(h, ptr)) {
+    return ptr;
+  }
+  page_t *page = gc_compact_page_of(h, ptr);
+  if (page->target == NULL) {
+    return ptr;
+  }
+  return gc_compact_destination(h, page, ptr, gc_compact_rank(h, page, ptr));
+}
+
+void *gc_compact_survivor(heap_t *h, void *obj)
+{
+  if (!address_within_pages(h, obj)) {
+    return h_large_of(obj)->marked ? obj : NULL;
+  }
+  page_t *page = gc_compact_page_of(h, obj);
+  uint64_t *marks = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  return (marks[bit/64] & (1UL << (bit%64))) ? gc_compact_address(h, obj) : NULL;
+}
+
+void gc_compact_update_roots(heap_t *h)
+{
+  for (size_t i = 0; i < h->root_count; ++i) {
+    h_root_t *root = &h->roots[i];
+    if (*root->slot == root->value) {
+      *root->slot = gc_compact_address(h, root->value);
+    }
+  }
+}
+
+void gc_compact_update_slot(void **slot, void *scan)
+{
+  gc_compact_scan_t *state = scan;
+  // Young before the update: the new address may be past the front
+  // of its page until the objects have slid
+  if (gc_copy_is_young(state->h, *slot)) {
+    state->young = true;
+  }
+  *slot = gc_compact_address(state->h, *slot);
+}
+
+void gc_compact_update_object(heap_t *h, void *obj)
+{
+  gc_compact_scan_t scan = { h, false };
+  o_foreach_pointer(h, obj, gc_compact_update_slot, &scan);
+  if (scan.young) {
+    gc_copy_remember(h, gc_compact_address(h, obj));
+  }
+}
+
+void gc_compact_slide(heap_t *h, page_t *page)
+{
+  uint64_t *marks = h_page_marks(h, page);
+  size_t words = H_MARK_WORDS(h->pagesize);
+  size_t front = page->distance_front;
+  // Refilled by the objects sliding into the page, none of which
+  // come from pages before it
+  page->distance_front = PAGE_HEADER_SIZE;
+  size_t rank = 0;
+  for (size_t w = 0; w < words; ++w) {
+    uint64_t bits = marks[w];
+    while (bits != 0) {
+      void *obj = (char *)page + (w*64 + (size_t)__builtin_ctzll(bits))*WORDSIZE;
+      bits &= bits - 1;
+      char *moved = gc_compact_destination(h, page, obj, rank++);
+      char *chunk = (char *)obj - ((size_t)((char *)obj - (char *)page) - PAGE_HEADER_SIZE)%page->chunk_size;
+      char *to = moved - ((char *)obj - chunk);
+      if (to != chunk) {
+        memmove(to, chunk, page->chunk_size);
+        h->stats.bytes_copied += page->chunk_size;
+      }
+      page_t *target = gc_compact_page_of(h, to);
+      target->distance_front = (size_t)(to + page->chunk_size - (char *)target);
+    }
+  }
+  memset(marks, 0, words*sizeof(uint64_t));
+  // Pages are zeroed past their front, as allocation does not clear
+  if (front > page->distance_front) {
+    memset((char *)page + page->distance_front, 0, front - page->distance_front);
+  }
+}
+
+void gc_compact_move(heap_t *h)
+{
+  gc_compact_forward(h);
+  gc_compact_update_roots(h);
+  h_profile_survivors(h, gc_compact_survivor);
+
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    if (!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    uint64_t *marks = h_page_marks(h, page);
+    for (size_t w = 0; w < H_MARK_WORDS(h->pagesize); ++w) {
+      uint64_t bits = marks[w];
+      while (bits != 0) {
+        void *obj = (char *)page + (w*64 + (size_t)__builtin_ctzll(bits))*WORDSIZE;
+        bits &= bits - 1;
+        gc_compact_update_object(h, obj);
+      }
+    }
+  }
+  for (size_t i = 0; i < h->large_count; ++i) {
+    if (h->large[i]->marked) {
+      gc_compact_update_object(h, h_large_object(h->large[i]));
+    }
+  }
+
+  // In address order, so that every object slides into room that has
+  // been vacated already
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    page_t *page = h_page(h, i);
+    if (h_page_in_use(h, i) && page->target != NULL) {
+      gc_compact_slide(h, page);
+    }
+  }
+}
+
+void gc_compact_end(heap_t *h)
+{
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    if (!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    page->age = (unsigned char)gc_copy_target_age(h, page);
+    if (page->target == NULL) {
+      // Pinned and mixed pages stay where they are
+      if (page->promoted) {
+        h->stats.pages_promoted++;
+        page->promoted = false;
+      }
+      page->next = NULL;
+      gc_incremental_sweep_page(h, page);
+      continue;
+    }
+    page->target = NULL;
+    page->next = NULL;
+    page->free = 0;
+    if (page->distance_front == PAGE_HEADER_SIZE) {
+      h_page_release(h, page);
+    }
+    else {
+      h_alloc_offer(h, page);
+    }
+  }
+  gc_copy_sweep_large(h);
+  h->nursery_pages = 0;
+  h->survivor_pages = h->used_pages;
+}
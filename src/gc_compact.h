@@ -0,0 +1,105 @@
+/**
+ *   \file gc_compact.h
+ *   \brief Sliding mark-compact collection, for when copying cannot
+ *   fit the survivors
+ *
+ *   A copying collection needs free pages for its survivors. When the
+ *   heap is so full that they would not fit, a full collection
+ *   compacts it in place instead, so a heap can run at nearly all of
+ *   its pages in use. Compaction runs on the collecting thread only.
+ *
+ *   1. Marking sets the side mark bits (see h_page_marks) of the
+ *      objects reachable from the roots, with the grey stack as its
+ *      mark stack. Ambiguous roots mark the object they point into
+ *      and pin its page, which is kept in place and swept like a
+ *      page with pinned objects when copying. Mixed pages and large
+ *      objects are never moved.
+ *   2. Forwarding addresses are computed from the mark bits alone,
+ *      so headers stay intact for the passes below. The pages of
+ *      every size class and age are lined up in address order and
+ *      their live objects packed into the lowest ones: each page
+ *      only records where its first live object goes (target, and
+ *      the slot in free), the n-th live object of the page goes n
+ *      slots further.
+ *   3. Every pointer in a live object, and every safe or precise
+ *      root, is updated to the forwarding address. The cards of a
+ *      generational heap are rebuilt on the way.
+ *   4. The live objects slide down to their new address, in address
+ *      order, so none overwrites one that has not moved yet. Pages
+ *      left empty are released, the others are offered to the
+ *      allocator, and the pages kept in place are swept.
+ *
+ *   Order of calls:
+ *   1. gc_compact_begin
+ *   2. gc_compact_roots
+ *   3. gc_compact_mark
+ *   4. gc_compact_move
+ *   5. gc_compact_end
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __gc_compact__
+#define __gc_compact__
+
+/**
+ *  Checks if a full collection should compact rather than copy: if
+ *  the free pages cannot hold as many survivors as the last full
+ *  collection left (and a partly filled page per size class).
+ *
+ *  \param   h  the heap
+ *  \return  true if the heap is too full to copy
+ */
+bool gc_compact_needed(heap_t *h);
+
+/**
+ *  Starts a compacting (full) collection.
+ *
+ *  \param   h  the heap
+ */
+void gc_compact_begin(heap_t *h);
+
+/**
+ *  Marks the objects the roots point to: those on the stacks (which
+ *  pin their page if unsafe) and the precise ones. The roots to be
+ *  updated are left in the root buffer.
+ *
+ *  \param   h             the heap
+ *  \param   stacks        the stacks
+ *  \param   n_stacks      amount of stacks
+ *  \param   unsafe_stack  true if the stack roots are unsafe
+ */
+void gc_compact_roots(heap_t *h, h_stack_t *stacks, size_t n_stacks, bool unsafe_stack);
+
+/**
+ *  Marks every object reachable from the marked ones.
+ *  Uses constant native stack space.
+ *
+ *  \param   h  the heap
+ */
+void gc_compact_mark(heap_t *h);
+
+/**
+ *  Computes the forwarding addresses, updates the roots and the
+ *  pointers in every live object, and slides the objects down. The
+ *  root buffer must still hold the roots gc_compact_roots left in
+ *  it.
+ *
+ *  \param   h  the heap
+ */
+void gc_compact_move(heap_t *h);
+
+/**
+ *  Ends a compacting collection: releases the pages left empty,
+ *  sweeps the pages kept in place and the large objects, and ages
+ *  the survivors.
+ *
+ *  \param   h  the heap
+ */
+void gc_compact_end(heap_t *h);
+
+#endif
@@ -0,0 +1,670 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gc_copy.h"
+#include "object.h"
+#include "h_alloc.h"
+#include "gc_incremental.h"
+#include "h_profile.h"
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns the page an address inside the heap's pages belongs to.
+ *
+ *  \param   h     the heap
+ *  \param   addr  address inside a page
+ *  \return  the page header
+ */
+page_t *gc_copy_page_of(heap_t *h, void *addr);
+
+/**
+ *  Allocates a chunk in to-space, taking a new to-space page (and
+ *  appending it to the scan queue) when the current one of the
+ *  chunk's size class is full.
+ *
+ *  \param   h      the heap
+ *  \param   bytes  size of the object's chunk
+ *  \param   age    age of the to-space page
+ *  \return  the chunk, NULL if there are no free pages left
+ */
+void *gc_copy_alloc(heap_t *h, size_t bytes, unsigned age);
+
+/**
+ *  Promotes a from-space page, queueing it for scanning.
+ *
+ *  \param   h     the heap
+ *  \param   page  the page
+ */
+void gc_copy_promote(heap_t *h, page_t *page);
+
+/**
+ *  State of gc_copy_slot while scanning one object.
+ *
+ *  h      the heap
+ *  young  set if a slot points to an object that stays young
+ */
+typedef struct gc_copy_scan {
+  heap_t *h;
+  bool young;
+} gc_copy_scan_t;
+
+/**
+ *  Pointer visitor that evacuates the object a slot points to.
+ *
+ *  \param   slot  the slot
+ *  \param   scan  the gc_copy_scan_t of the scanned object
+ */
+void gc_copy_slot(void **slot, void *scan);
+
+/**
+ *  Evacuates everything an object points to, remembering the object
+ *  if it is old and keeps pointing to young objects.
+ *
+ *  \param   obj  the object
+ *  \param   h    the heap
+ */
+void gc_copy_scan_object(void *obj, void *h);
+
+/**
+ *  Scans every object (that has not been copied away) in a
+ *  promoted page.
+ *
+ *  \param   h     the heap
+ *  \param   page  the promoted page
+ */
+void gc_copy_scan_page(heap_t *h, page_t *page);
+
+/**
+ *  Scans the copied objects of one age that have not been scanned
+ *  yet.
+ *
+ *  \param   h      the heap
+ *  \param   space  the destination of that age
+ *  \return  true if any object was scanned
+ */
+bool gc_copy_scan_space(heap_t *h, h_space_t *space);
+
+/**
+ *  Returns the age a page will have after the collection.
+ *
+ *  \param   h     the heap
+ *  \param   page  a used page
+ *  \return  the age
+ */
+unsigned gc_copy_age_after(heap_t *h, page_t *page);
+
+/**
+ *  Overwrites the chunks of forwarded objects in a promoted page with
+ *  raw filler objects (holes, in a page of one size class), as their
+ *  forwarding pointers are only valid during a collection.
+ *
+ *  \param   page  the promoted page
+ */
+void gc_copy_fill_forwarded(page_t *page);
+
+/**
+ *  Returns the age a large object will have after the collection.
+ *
+ *  \param   h      the heap
+ *  \param   large  a large object
+ *  \return  the age
+ */
+unsigned gc_copy_large_age_after(heap_t *h, h_large_t *large);
+
+/**
+ *  Marks the large object an address points into, if the collection
+ *  collects it, queueing it to be scanned.
+ *
+ *  \param   h     the heap
+ *  \param   addr  an address outside the heap's pages
+ */
+void gc_copy_mark_large(heap_t *h, void *addr);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+page_t *gc_copy_page_of(heap_t *h, void *addr)
+{
+  return (page_t *)((uintptr_t)addr & ~(uintptr_t)(h->pagesize - 1));
+}
+
+void gc_copy_begin(heap_t *h, bool minor)
+{
+  h_alloc_tlabs_retire(h);
+  for (size_t age = 0; age <= H_MAX_AGE; ++age) {
+    for (size_t c = 0; c <= H_MIXED_CLASS; ++c) {
+      h->to_space[age][c].page = &h->full_page;
+      h->to_space[age][c].scan_page = NULL;
+      h->to_space[age][c].scan_offset = 0;
+    }
+  }
+  h->promoted = NULL;
+  h->large_grey = NULL;
+  // Pinned objects, the pin bits are clear outside of incremental
+  // cycles
+  h->grey_count = 0;
+  h->grey_overflow = false;
+  h->minor = minor && h->tenure_age > 0;
+  h->to_space_full = false;
+  if (h->cards != NULL && !h->minor) {
+    // Rebuilt while scanning, as every live object is scanned
+    memset(h->cards, 0, h->committed_pages << (h->page_shift - H_CARD_SHIFT));
+    for (size_t i = 0; i < h->large_count; ++i) {
+      h->large[i]->dirty = false;
+    }
+  }
+}
+
+bool gc_copy_collects(heap_t *h, page_t *page)
+{
+  return !page->new_space && !(h->minor && h_page_is_old(h, page));
+}
+
+bool gc_copy_collects_large(heap_t *h, h_large_t *large)
+{
+  return !(h->minor && large->age >= h->tenure_age);
+}
+
+unsigned gc_copy_target_age(heap_t *h, page_t *page)
+{
+  if (h->tenure_age == 0) {
+    return 0;
+  }
+  return page->age < h->tenure_age ? page->age + 1u : h->tenure_age;
+}
+
+unsigned gc_copy_age_after(heap_t *h, page_t *page)
+{
+  if (gc_copy_collects(h, page)) {
+    return gc_copy_target_age(h, page);
+  }
+  return page->age;
+}
+
+unsigned gc_copy_large_age_after(heap_t *h, h_large_t *large)
+{
+  if (!gc_copy_collects_large(h, large) || h->tenure_age == 0) {
+    return large->age;
+  }
+  return large->age < h->tenure_age ? large->age + 1u : h->tenure_age;
+}
+
+bool gc_copy_is_young(heap_t *h, void *ptr)
+{
+  if (h->cards == NULL) {
+    return false;
+  }
+  if (address_within_pages(h, ptr)) {
+    return gc_copy_age_after(h, gc_copy_page_of(h, ptr)) < h->tenure_age;
+  }
+  h_large_t *large = h_large_find(h, ptr);
+  return large != NULL && gc_copy_large_age_after(h, large) < h->tenure_age;
+}
+
+void gc_copy_remember(heap_t *h, void *obj)
+{
+  // Not address_within_pages: a compaction remembers objects at their
+  // new address, which may be past the front of its page for now
+  if ((uintptr_t)obj - (uintptr_t)h->pages >= h->total_pages*h->pagesize) {
+    h_large_t *large = h_large_of(obj);
+    if (gc_copy_large_age_after(h, large) >= h->tenure_age) {
+      __atomic_store_n(&large->dirty, true, __ATOMIC_RELAXED);
+    }
+  }
+  else if (gc_copy_age_after(h, gc_copy_page_of(h, obj)) >= h->tenure_age) {
+    // The card of the header, as custom trace functions do not tell
+    // where their pointer fields are
+    unsigned char *card = h->cards + (((char *)obj - sizeof(intptr_t) - h->pages) >> H_CARD_SHIFT);
+    __atomic_store_n(card, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void *gc_copy_alloc(heap_t *h, size_t bytes, unsigned age)
+{
+  size_t size_class = h_size_class(h, bytes);
+  h_space_t *space = &h->to_space[age][size_class];
+  page_t *page = space->page;
+  if (size_class != H_MIXED_CLASS) {
+    bytes = H_CLASS_SIZE(size_class);
+  }
+  if (page->distance_front + bytes > h->pagesize) {
+    page_t *fresh = h_page_take(h, size_class);
+    if (fresh == NULL) {
+      return NULL;
+    }
+    fresh->new_space = true;
+    fresh->age = age;
+    if (page == &h->full_page) {
+      space->scan_page = fresh;
+      space->scan_offset = PAGE_HEADER_SIZE;
+    }
+    else {
+      page->next = fresh;
+    }
+    space->page = page = fresh;
+  }
+  void *chunk = (char *)page + page->distance_front;
+  page->distance_front += bytes;
+  return chunk;
+}
+
+void gc_copy_promote(heap_t *h, page_t *page)
+{
+  if (page->promoted || !gc_copy_collects(h, page)) {
+    return;
+  }
+  page->promoted = true;
+  page->next = h->promoted;
+  h->promoted = page;
+}
+
+void gc_copy_pin(heap_t *h, void *addr)
+{
+  if (!address_within_pages(h, addr)) {
+    gc_copy_mark_large(h, addr);
+    return;
+  }
+  page_t *page = gc_copy_page_of(h, addr);
+  void *obj = gc_copy_object_at(page, addr);
+  if (obj == NULL || !gc_copy_collects(h, page)) {
+    return;
+  }
+  uint64_t *pins = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  if (pins[bit/64] & (1UL << (bit%64))) {
+    return;
+  }
+  pins[bit/64] |= 1UL << (bit%64);
+  page->pinned = true;
+  h->stats.objects_pinned++;
+  if (!gc_incremental_push(h, obj)) {
+    // Out of room to queue it, like out of to-space: the page stays
+    gc_copy_promote(h, page);
+  }
+}
+
+bool gc_copy_is_pinned(heap_t *h, page_t *page, void *obj)
+{
+  if (!page->pinned) {
+    return false;
+  }
+  uint64_t *pins = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  return (pins[bit/64] & (1UL << (bit%64))) != 0;
+}
+
+void gc_copy_mark_large(heap_t *h, void *addr)
+{
+  h_large_t *large = h_large_find(h, addr);
+  if (large == NULL || large->marked || !gc_copy_collects_large(h, large)) {
+    return;
+  }
+  large->marked = true;
+  large->next = h->large_grey;
+  h->large_grey = large;
+}
+
+void *gc_copy_object_at(page_t *page, void *addr)
+{
+  char *end = (char *)page + page->distance_front;
+  if ((char *)addr < (char *)page + PAGE_HEADER_SIZE || (char *)addr >= end) {
+    return NULL;
+  }
+  if (page->chunk_size != 0) {
+    // Chunks of one size, the one addr is in is found directly
+    size_t offset = (size_t)((char *)addr - (char *)page) - PAGE_HEADER_SIZE;
+    char *chunk = (char *)addr - offset % page->chunk_size;
+    return h_chunk_is_hole(page, chunk) ? NULL : o_chunk_object(chunk);
+  }
+  char *cursor = (char *)page + PAGE_HEADER_SIZE;
+  while (cursor < end) {
+    size_t size = o_chunk_size(cursor);
+    if ((char *)addr < cursor + size) {
+      return o_chunk_object(cursor);
+    }
+    cursor += size;
+  }
+  return NULL;
+}
+
+bool gc_copy_is_object(page_t *page, void *addr)
+{
+  return gc_copy_object_at(page, addr) == addr;
+}
+
+page_t *gc_copy_interior_page(heap_t *h, void *addr)
+{
+  if (!address_within_pages(h, addr)) {
+    return NULL;
+  }
+  page_t *page = gc_copy_page_of(h, addr);
+  if (page->promoted || !gc_copy_collects(h, page) || gc_copy_is_object(page, addr)) {
+    return NULL;
+  }
+  return page;
+}
+
+void gc_copy_interior(heap_t *h, void *addr)
+{
+  page_t *page = gc_copy_interior_page(h, addr);
+  if (page != NULL) {
+    gc_copy_promote(h, page);
+  }
+}
+
+void gc_copy_root(heap_t *h, void **slot)
+{
+  void *ptr = *slot;
+  if (!address_within_pages(h, ptr)) {
+    gc_copy_mark_large(h, ptr);
+    return;
+  }
+  page_t *page = gc_copy_page_of(h, ptr);
+  if (!gc_copy_collects(h, page)) {
+    return;
+  }
+  if (!gc_copy_is_object(page, ptr)) {
+    gc_copy_promote(h, page);
+    return;
+  }
+  *slot = gc_copy_evacuate(h, ptr);
+}
+
+void *gc_copy_evacuate(heap_t *h, void *ptr)
+{
+  if (!address_within_pages(h, ptr)) {
+    gc_copy_mark_large(h, ptr);
+    return ptr;
+  }
+  page_t *page = gc_copy_page_of(h, ptr);
+  if (!gc_copy_collects(h, page)) {
+    return ptr;
+  }
+  intptr_t header = o_get_header(ptr);
+  if (O_HEADER_GET_TYPE(header) == 3) {
+    return (void *)O_HEADER_GET_PTR(header);
+  }
+  // Checked after the header: an object copied before its page was
+  // promoted has still moved
+  if (page->promoted || gc_copy_is_pinned(h, page, ptr)) {
+    return ptr;
+  }
+
+  void *chunk = o_get_chunk(ptr);
+  size_t size = o_chunk_size(chunk);
+  void *copy = gc_copy_alloc(h, size, gc_copy_target_age(h, page));
+  if (copy == NULL) {
+    // Out of to-space, the object stays (and keeps its page alive)
+    h->to_space_full = true;
+    gc_copy_promote(h, page);
+    return ptr;
+  }
+  memcpy(copy, chunk, size);
+  void *moved = (char *)copy + ((char *)ptr - (char *)chunk);
+  *((intptr_t *)ptr - 1) = O_HEADER_SET_TYPE((intptr_t)moved, 3L);
+  return moved;
+}
+
+void gc_copy_slot(void **slot, void *scan)
+{
+  gc_copy_scan_t *state = scan;
+  *slot = gc_copy_evacuate(state->h, *slot);
+  if (gc_copy_is_young(state->h, *slot)) {
+    state->young = true;
+  }
+}
+
+void gc_copy_scan_object(void *obj, void *h)
+{
+  gc_copy_scan_t scan = { h, false };
+  o_foreach_pointer(h, obj, gc_copy_slot, &scan);
+  if (scan.young) {
+    gc_copy_remember(h, obj);
+  }
+}
+
+void gc_copy_scan_page(heap_t *h, page_t *page)
+{
+  char *cursor = (char *)page + PAGE_HEADER_SIZE;
+  while (cursor < (char *)page + page->distance_front) {
+    void *obj = o_chunk_object(cursor);
+    size_t size = h_chunk_size(page, cursor);
+    if (O_HEADER_GET_TYPE(o_get_header(obj)) != 3) {
+      gc_copy_scan_object(obj, h);
+    }
+    cursor += size;
+  }
+}
+
+void gc_copy_cards(heap_t *h, gc_scan_f f, void *ctx)
+{
+  if (!h->minor) {
+    return;
+  }
+  size_t n_cards = h->pagesize >> H_CARD_SHIFT;
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    page_t *page = h_page(h, i);
+    if (!h_page_in_use(h, i) || gc_copy_collects(h, page)) {
+      continue;
+    }
+    // Dirty cards become 2 while scanned, the visitor sets them
+    // back to 1 where young objects are still pointed to
+    unsigned char *cards = h_page_cards(h, page);
+    uint64_t any = 0;
+    size_t c = 0;
+    for (; c + sizeof(uint64_t) <= n_cards; c += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, cards + c, sizeof(word));
+      any |= word;
+    }
+    for (; c < n_cards; ++c) {
+      any |= cards[c];
+    }
+    if (any == 0) {
+      continue;
+    }
+    bool dirty = false;
+    for (size_t c = 0; c < n_cards; ++c) {
+      if (cards[c] == 1) {
+        cards[c] = 2;
+        dirty = true;
+      }
+    }
+    if (!dirty) {
+      continue;
+    }
+    char *cursor = (char *)page + PAGE_HEADER_SIZE;
+    char *end = (char *)page + page->distance_front;
+    while (cursor < end) {
+      size_t size = h_chunk_size(page, cursor);
+      size_t first = (size_t)(cursor - (char *)page) >> H_CARD_SHIFT;
+      size_t last = (size_t)(cursor + size - 1 - (char *)page) >> H_CARD_SHIFT;
+      for (size_t c = first; c <= last; ++c) {
+        if (cards[c] != 0) {
+          f(o_chunk_object(cursor), ctx);
+          break;
+        }
+      }
+      cursor += size;
+    }
+    for (size_t c = 0; c < n_cards; ++c) {
+      if (cards[c] == 2) {
+        cards[c] = 0;
+      }
+    }
+  }
+  for (size_t i = 0; i < h->large_count; ++i) {
+    h_large_t *large = h->large[i];
+    if (large->dirty && !gc_copy_collects_large(h, large)) {
+      large->dirty = false;
+      f(h_large_object(large), ctx);
+    }
+  }
+}
+
+bool gc_copy_scan_space(heap_t *h, h_space_t *space)
+{
+  bool scanned = false;
+  for (;;) {
+    page_t *page = space->scan_page;
+    if (page != NULL && space->scan_offset < page->distance_front) {
+      void *chunk = (char *)page + space->scan_offset;
+      space->scan_offset += h_chunk_size(page, chunk);
+      gc_copy_scan_object(o_chunk_object(chunk), h);
+      scanned = true;
+    }
+    else if (page != NULL && page->next != NULL) {
+      space->scan_page = page->next;
+      space->scan_offset = PAGE_HEADER_SIZE;
+    }
+    else {
+      return scanned;
+    }
+  }
+}
+
+void gc_copy_scan(heap_t *h)
+{
+  gc_copy_cards(h, gc_copy_scan_object, h);
+  // Scanning one age copies into others, so repeat until no age (and
+  // no promoted page) has anything left
+  bool scanned = true;
+  while (scanned) {
+    scanned = false;
+    for (size_t age = 0; age <= H_MAX_AGE; ++age) {
+      for (size_t c = 0; c <= H_MIXED_CLASS; ++c) {
+        scanned |= gc_copy_scan_space(h, &h->to_space[age][c]);
+      }
+    }
+    while (h->grey_count > 0) {
+      gc_copy_scan_object(h->grey[--h->grey_count], h);
+      scanned = true;
+    }
+    while (h->promoted != NULL) {
+      page_t *promoted = h->promoted;
+      h->promoted = promoted->next;
+      promoted->next = NULL;
+      gc_copy_scan_page(h, promoted);
+      scanned = true;
+    }
+    while (h->large_grey != NULL) {
+      h_large_t *large = h->large_grey;
+      h->large_grey = large->next;
+      large->next = NULL;
+      gc_copy_scan_object(h_large_object(large), h);
+      scanned = true;
+    }
+  }
+}
+
+void gc_copy_fill_forwarded(page_t *page)
+{
+  char *cursor = (char *)page + PAGE_HEADER_SIZE;
+  while (cursor < (char *)page + page->distance_front) {
+    void *obj = o_chunk_object(cursor);
+    size_t size = h_chunk_size(page, cursor);
+    if (O_HEADER_GET_TYPE(o_get_header(obj)) == 3) {
+      h_alloc_hole(page, cursor);
+    }
+    cursor += size;
+  }
+}
+
+void gc_copy_sweep_large(heap_t *h)
+{
+  for (size_t i = 0; i < h->large_count; ++i) {
+    h_large_t *large = h->large[i];
+    if (large->marked) {
+      large->age = (unsigned char)gc_copy_large_age_after(h, large);
+      large->marked = false;
+    }
+    else if (gc_copy_collects_large(h, large)) {
+      h_large_free(h, i);
+    }
+  }
+  h_large_compact(h);
+}
+
+void *gc_copy_survivor(heap_t *h, void *obj)
+{
+  if ((uintptr_t)obj - (uintptr_t)h->pages >= h->total_pages*h->pagesize) {
+    h_large_t *large = h_large_of(obj);
+    return large->marked || !gc_copy_collects_large(h, large) ? obj : NULL;
+  }
+  page_t *page = gc_copy_page_of(h, obj);
+  if (!gc_copy_collects(h, page)) {
+    return obj;
+  }
+  intptr_t header = o_get_header(obj);
+  if (O_HEADER_GET_TYPE(header) == 3) {
+    return (void *)O_HEADER_GET_PTR(header);
+  }
+  return page->promoted || gc_copy_is_pinned(h, page, obj) ? obj : NULL;
+}
+
+void gc_copy_end(heap_t *h)
+{
+  // Before the pages the dead samples are in are released
+  h_profile_survivors(h, gc_copy_survivor);
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    if (!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    if (page->new_space) {
+      // To-space pages are fresh, so all they hold has been copied
+      page->new_space = false;
+      h->stats.bytes_copied += page->distance_front - PAGE_HEADER_SIZE;
+    }
+    else if (!gc_copy_collects(h, page)) {
+      // An old page during a minor collection
+    }
+    else if (page->promoted) {
+      h->stats.pages_promoted++;
+      gc_copy_fill_forwarded(page);
+      if (page->pinned) {
+        memset(h_page_marks(h, page), 0, H_MARK_WORDS(h->pagesize)*sizeof(uint64_t));
+        page->pinned = false;
+      }
+      page->promoted = false;
+      page->age = gc_copy_target_age(h, page);
+    }
+    else if (page->pinned) {
+      // Only the pinned objects stay, the chunks of the others (copied
+      // or dead) become holes
+      page->pinned = false;
+      page->age = gc_copy_target_age(h, page);
+      page->next = NULL;
+      gc_incremental_sweep_page(h, page);
+      continue;
+    }
+    else {
+      h_page_release(h, page);
+      continue;
+    }
+    page->next = NULL;
+    if (page != h->to_space[0][page->size_class].page) {
+      h_alloc_offer(h, page);
+    }
+  }
+  // Keep allocating after the survivors, unless they have aged (new
+  // objects belong in the nursery)
+  page_t **current = h_alloc_current(h);
+  for (size_t c = 0; c <= H_MIXED_CLASS; ++c) {
+    if (h->to_space[0][c].page != &h->full_page) {
+      h_alloc_use(&current[c], h->to_space[0][c].page);
+    }
+    for (size_t age = 0; age <= H_MAX_AGE; ++age) {
+      h->to_space[age][c].page = &h->full_page;
+      h->to_space[age][c].scan_page = NULL;
+    }
+  }
+  gc_copy_sweep_large(h);
+  h->nursery_pages = 0;
+  if (!h->minor) {
+    h->survivor_pages = h->used_pages;
+  }
+  h->minor = false;
+}
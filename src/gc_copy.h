@@ -0,0 +1,245 @@
+/**
+ *   \file gc_copy.h
+ *   \brief Breadth-first (Cheney) copying of live objects
+ *
+ *   A collection flips all used pages into from-space, handles the
+ *   roots, and then scans to-space breadth-first: the copied objects
+ *   themselves form the work queue, so the collector needs no stack
+ *   or queue of its own. Objects unsafe stack pointers point into
+ *   are pinned: they stay in place, their pin bits are set (see
+ *   h_page_marks) and they are scanned from the grey stack. The other
+ *   objects of their page are still evacuated, and the page is swept
+ *   into holes at the end. Pages whose objects cannot all move (out
+ *   of to-space) are promoted, kept in place with all their objects
+ *   scanned.
+ *
+ *   On a generational heap survivors are copied into to-space pages
+ *   one age older than the page they come from, so there is one
+ *   queue per age. A minor collection leaves the old pages alone and
+ *   treats the objects on their dirty cards as roots.
+ *
+ *   Large objects (see h_large.h) are never copied: pointers to them
+ *   mark them, and marked ones are scanned like to-space objects.
+ *   Unmarked ones are unmapped at the end of the collection. They
+ *   age like pages, and an old large object is its own card.
+ *
+ *   Order of calls:
+ *   1. gc_copy_begin
+ *   2. gc_copy_pin / gc_copy_root for every root, safe ones after
+ *      gc_copy_interior for all of them
+ *   3. gc_copy_scan
+ *   4. gc_copy_end
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+#include "h_large.h"
+#include "object.h"
+
+#ifndef __gc_copy__
+#define __gc_copy__
+
+/**
+ *  Starts a collection, turning every used page into from-space
+ *  (only the young ones for a minor collection).
+ *
+ *  \param   h      the heap
+ *  \param   minor  true for a minor collection, ignored if the heap
+ *                  is not generational
+ */
+void gc_copy_begin(heap_t *h, bool minor);
+
+/**
+ *  Checks if a page is collected, i.e. part of from-space.
+ *
+ *  \param   h     the heap
+ *  \param   page  a used page
+ *  \return  true if objects in the page are copied (or the page
+ *           promoted) when reachable
+ */
+bool gc_copy_collects(heap_t *h, page_t *page);
+
+/**
+ *  Checks if a large object is collected, i.e. unmapped unless it is
+ *  reachable.
+ *
+ *  \param   h      the heap
+ *  \param   large  a large object
+ *  \return  true if the collection marks (and scans) the object when
+ *           reachable
+ */
+bool gc_copy_collects_large(heap_t *h, h_large_t *large);
+
+/**
+ *  Returns the age of the to-space pages the objects of a collected
+ *  page are copied into.
+ *
+ *  \param   h     the heap
+ *  \param   page  a collected page
+ *  \return  the age
+ */
+unsigned gc_copy_target_age(heap_t *h, page_t *page);
+
+/**
+ *  Checks if a pointer will point to a young object after the
+ *  collection.
+ *
+ *  \param   h    the heap
+ *  \param   ptr  an updated pointer
+ *  \return  true if the heap is generational and the object young
+ */
+bool gc_copy_is_young(heap_t *h, void *ptr);
+
+/**
+ *  Marks the card of an object's header (or the large object) if the
+ *  object will be old after the collection. Called for scanned
+ *  objects that point to young objects.
+ *
+ *  \param   h    a generational heap
+ *  \param   obj  the object, in a used page
+ */
+void gc_copy_remember(heap_t *h, void *obj);
+
+/**
+ *  The signature of functions that scan (evacuate the pointers of,
+ *  and remember) one object.
+ */
+typedef void (*gc_scan_f)(void *obj, void *ctx);
+
+/**
+ *  Calls \a f on every object in an old page that overlaps a dirty
+ *  card, and on every dirty old large object. Only does anything in a
+ *  minor collection. Cards are cleaned, \a f marks them again for
+ *  objects still pointing to young ones.
+ *
+ *  \param   h    the heap
+ *  \param   f    scans an object
+ *  \param   ctx  context passed on to \a f
+ */
+void gc_copy_cards(heap_t *h, gc_scan_f f, void *ctx);
+
+/**
+ *  Handles an unsafe (ambiguous) root. If \a addr points into an
+ *  object in a from-space page, the object is pinned so it is not
+ *  moved. If it points into a large object, the object is marked.
+ *
+ *  \param   h     the heap
+ *  \param   addr  a value that may point into the heap
+ */
+void gc_copy_pin(heap_t *h, void *addr);
+
+/**
+ *  Checks if an object is pinned, see gc_copy_pin.
+ *
+ *  \param   h     the heap
+ *  \param   page  the object's page
+ *  \param   obj   the object
+ *  \return  true if the object stays in place
+ */
+bool gc_copy_is_pinned(heap_t *h, page_t *page, void *obj);
+
+/**
+ *  Handles a safe root. If \a slot holds a pointer to an object in
+ *  from-space, the object is copied and \a slot updated. Values that
+ *  point into the heap but not at an object are treated as unsafe.
+ *
+ *  \param   h     the heap
+ *  \param   slot  address of the root
+ */
+void gc_copy_root(heap_t *h, void **slot);
+
+/**
+ *  Promotes the page of a safe root that points into it but not at
+ *  an object. Interior roots must keep their pages before any safe
+ *  root is evacuated: an exact root to the same object moved first
+ *  would leave them pointing into the old copy.
+ *
+ *  \param   h     the heap
+ *  \param   addr  the value of the root
+ */
+void gc_copy_interior(heap_t *h, void *addr);
+
+/**
+ *  Returns the page gc_copy_interior promotes for a root.
+ *
+ *  \param   h     the heap
+ *  \param   addr  the value of the root
+ *  \return  the page, NULL if the root keeps none (or its page is
+ *           promoted already)
+ */
+page_t *gc_copy_interior_page(heap_t *h, void *addr);
+
+/**
+ *  Returns the object whose chunk holds an address. In a page of one
+ *  size class the chunk is found directly, mixed pages are walked
+ *  chunk by chunk. Holes are not objects.
+ *
+ *  \param   page  the page
+ *  \param   addr  address inside the page
+ *  \return  the object, NULL if addr is in no object's chunk
+ */
+void *gc_copy_object_at(page_t *page, void *addr);
+
+/**
+ *  Checks if an address is the start of an object in a page, see
+ *  gc_copy_object_at.
+ *
+ *  \param   page  the page
+ *  \param   addr  address inside the page
+ *  \return  true if an object starts at addr
+ */
+bool gc_copy_is_object(page_t *page, void *addr);
+
+/**
+ *  Returns the to-space address of an object, copying it there if
+ *  needed. Pointers to pinned objects, promoted pages, to-space and
+ *  outside the heap are returned as they are; large objects are
+ *  marked.
+ *
+ *  \param   h    the heap
+ *  \param   ptr  an object pointer (or NULL)
+ *  \return  the object's address after the collection
+ */
+void *gc_copy_evacuate(heap_t *h, void *ptr);
+
+/**
+ *  Scans dirty cards (in a minor collection), then to-space, pinned
+ *  objects, promoted pages and marked large objects until every
+ *  reachable object has been copied.
+ *  Uses constant native stack space.
+ *
+ *  \param   h  the heap
+ */
+void gc_copy_scan(heap_t *h);
+
+/**
+ *  Unmaps the collected large objects that were not marked, and ages
+ *  the marked ones. Part of gc_copy_end, and of compactions.
+ *
+ *  \param   h  the heap
+ */
+void gc_copy_sweep_large(heap_t *h);
+
+/**
+ *  Returns where an object is after the collection, once the
+ *  live objects have been copied or marked, see h_profile_survivors.
+ *
+ *  \param   h    the heap
+ *  \param   obj  an object that was live before the collection
+ *  \return  its address after the collection, NULL if it is dead
+ */
+void *gc_copy_survivor(heap_t *h, void *obj);
+
+/**
+ *  Ends a collection, releasing every from-space page that was not
+ *  promoted (sweeping those with pinned objects) and unmapping the
+ *  unmarked large objects it collects.
+ *
+ *  \param   h  the heap
+ */
+void gc_copy_end(heap_t *h);
+
+#endif
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE // mremap, must be defined before includes
+
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "gc_incremental.h"
+#include "object.h"
+#include "h_alloc.h"
+#include "h_large.h"
+#include "h_profile.h"
+
+/**
+ *  \def GC_STEP_CHECK
+ *  Amount of objects or pages processed between checks of the clock.
+ */
+#define GC_STEP_CHECK 64
+
+/**
+ *  \def GC_GREY_CAPACITY
+ *  Initial capacity of the grey stack. It grows when full and keeps
+ *  its size for later cycles. It is mapped rather than allocated, as
+ *  collections must not call the system allocator.
+ */
+#define GC_GREY_CAPACITY 1024
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns the current time.
+ *
+ *  \return  monotonic time in nanoseconds
+ */
+uint64_t gc_incremental_now();
+
+/**
+ *  Checks if a page was handed out during the running cycle.
+ *
+ *  \param   h     the heap
+ *  \param   page  a used page
+ *  \return  true if all objects in the page are new
+ */
+bool gc_incremental_is_new(heap_t *h, page_t *page);
+
+/**
+ *  Marks an object and pushes it on the grey stack, unless it is
+ *  already marked or new. Only called by the collector, while the
+ *  world is stopped.
+ *
+ *  \param   h    the heap
+ *  \param   obj  an object inside a used page
+ */
+void gc_incremental_shade(heap_t *h, void *obj);
+
+/**
+ *  Like gc_incremental_shade, for write barriers, which several
+ *  threads run at once: the mark bit is set atomically, and the
+ *  push is serialised.
+ *
+ *  \param   h    the heap
+ *  \param   obj  an object inside a used page
+ */
+void gc_incremental_shade_shared(heap_t *h, void *obj);
+
+/**
+ *  Marks a large object and pushes it on the grey stack, unless it
+ *  is already marked or new.
+ *
+ *  \param   h       the heap
+ *  \param   large   the large object
+ *  \param   shared  true if called by a write barrier, see
+ *                   gc_incremental_shade_shared
+ */
+void gc_incremental_shade_large(heap_t *h, h_large_t *large, bool shared);
+
+/**
+ *  Unmaps the large objects older than the cycle that were not
+ *  marked, and clears the marks of the others.
+ *
+ *  \param   h  the heap
+ *  \return  the number of bytes released
+ */
+size_t gc_incremental_sweep_large(heap_t *h);
+
+/**
+ *  Tells if an object survives the cycle, once marking is done, see
+ *  h_profile_survivors.
+ *
+ *  \param   h    the heap
+ *  \param   obj  an object that was live before the cycle
+ *  \return  the object, NULL if it is dead
+ */
+void *gc_incremental_survivor(heap_t *h, void *obj);
+
+/**
+ *  Pointer visitor that marks the object a slot points to.
+ *
+ *  \param   slot  the slot
+ *  \param   h     the heap
+ */
+void gc_incremental_slot(void **slot, void *h);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+uint64_t gc_incremental_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+bool gc_incremental_is_new(heap_t *h, page_t *page)
+{
+  return page->cycle == h->gc_cycle;
+}
+
+void gc_incremental_begin(heap_t *h)
+{
+  assert(!gc_incremental_running(h));
+  h->gc_cycle++;
+  h->gc_phase = GC_PHASE_MARK;
+  h->grey_count = 0;
+  h->grey_overflow = false;
+  h->sweep_next = 0;
+  // New objects go into pages of the cycle
+  h_alloc_tlabs_retire(h);
+}
+
+void gc_incremental_shade(heap_t *h, void *obj)
+{
+  page_t *page = (page_t *)((uintptr_t)obj & ~(uintptr_t)(h->pagesize - 1));
+  if (gc_incremental_is_new(h, page)) {
+    return;
+  }
+  uint64_t *marks = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  if (marks[bit/64] & (1UL << (bit%64))) {
+    return;
+  }
+  marks[bit/64] |= 1UL << (bit%64);
+  gc_incremental_push(h, obj);
+}
+
+void gc_incremental_shade_shared(heap_t *h, void *obj)
+{
+  page_t *page = (page_t *)((uintptr_t)obj & ~(uintptr_t)(h->pagesize - 1));
+  if (gc_incremental_is_new(h, page)) {
+    return;
+  }
+  uint64_t *marks = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  uint64_t mask = 1UL << (bit%64);
+  if (__atomic_fetch_or(&marks[bit/64], mask, __ATOMIC_RELAXED) & mask) {
+    return;
+  }
+  pthread_mutex_lock(&h->grey_lock);
+  gc_incremental_push(h, obj);
+  pthread_mutex_unlock(&h->grey_lock);
+}
+
+void gc_incremental_shade_large(heap_t *h, h_large_t *large, bool shared)
+{
+  if (large->cycle == h->gc_cycle) {
+    return;
+  }
+  if (!shared) {
+    if (!large->marked) {
+      large->marked = true;
+      gc_incremental_push(h, h_large_object(large));
+    }
+    return;
+  }
+  if (__atomic_exchange_n(&large->marked, true, __ATOMIC_RELAXED)) {
+    return;
+  }
+  pthread_mutex_lock(&h->grey_lock);
+  gc_incremental_push(h, h_large_object(large));
+  pthread_mutex_unlock(&h->grey_lock);
+}
+
+bool gc_incremental_push(heap_t *h, void *obj)
+{
+  if (h->grey_count == h->grey_capacity) {
+    size_t capacity = h->grey_capacity ? 2*h->grey_capacity : GC_GREY_CAPACITY;
+    void *grey;
+    if (h->grey != NULL) {
+      grey = mremap(h->grey, h->grey_capacity*sizeof(void *), capacity*sizeof(void *), MREMAP_MAYMOVE);
+    }
+    else {
+      grey = mmap(NULL, capacity*sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (grey == MAP_FAILED) {
+      // The object stays marked, and is scanned by gc_incremental_rescan
+      h->grey_overflow = true;
+      return false;
+    }
+    h->grey = grey;
+    h->grey_capacity = capacity;
+  }
+  h->grey[h->grey_count++] = obj;
+  return true;
+}
+
+void gc_incremental_rescan(heap_t *h, o_pointer_f visit)
+{
+  h->grey_overflow = false;
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    if (!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    uint64_t *marks = h_page_marks(h, page);
+    for (size_t w = 0; w < H_MARK_WORDS(h->pagesize); ++w) {
+      uint64_t bits = marks[w];
+      while (bits != 0) {
+        void *obj = (char *)page + (w*64 + (size_t)__builtin_ctzll(bits))*WORDSIZE;
+        bits &= bits - 1;
+        o_foreach_pointer(h, obj, visit, h);
+      }
+    }
+  }
+  for (size_t i = 0; i < h->large_count; ++i) {
+    if (h->large[i]->marked) {
+      o_foreach_pointer(h, h_large_object(h->large[i]), visit, h);
+    }
+  }
+}
+
+void gc_incremental_root(heap_t *h, void *addr)
+{
+  if (!address_within_pages(h, addr)) {
+    h_large_t *large = h_large_find(h, addr);
+    if (large != NULL) {
+      gc_incremental_shade_large(h, large, false);
+    }
+    return;
+  }
+  // Mark the object the address points into, if any
+  page_t *page = (page_t *)((uintptr_t)addr & ~(uintptr_t)(h->pagesize - 1));
+  if (page->chunk_size != 0) {
+    size_t offset = (size_t)((char *)addr - (char *)page) - PAGE_HEADER_SIZE;
+    char *chunk = (char *)addr - offset % page->chunk_size;
+    if (!h_chunk_is_hole(page, chunk)) {
+      gc_incremental_shade(h, o_chunk_object(chunk));
+    }
+    return;
+  }
+  char *cursor = (char *)page + PAGE_HEADER_SIZE;
+  char *end = (char *)page + page->distance_front;
+  while (cursor < end) {
+    size_t size = o_chunk_size(cursor);
+    if ((char *)addr < cursor + size) {
+      gc_incremental_shade(h, o_chunk_object(cursor));
+      return;
+    }
+    cursor += size;
+  }
+}
+
+void gc_incremental_slot(void **slot, void *h)
+{
+  if (address_within_pages(h, *slot)) {
+    gc_incremental_shade(h, *slot);
+    return;
+  }
+  h_large_t *large = h_large_find(h, *slot);
+  if (large != NULL) {
+    gc_incremental_shade_large(h, large, false);
+  }
+}
+
+void gc_incremental_barrier(heap_t *h, void *old)
+{
+  if (h->gc_phase != GC_PHASE_MARK) {
+    return;
+  }
+  if (address_within_pages(h, old)) {
+    gc_incremental_shade_shared(h, old);
+    return;
+  }
+  if (old == NULL) {
+    return;
+  }
+  // Other threads may be allocating large objects
+  pthread_mutex_lock(&h->large_lock);
+  h_large_t *large = h_large_find(h, old);
+  pthread_mutex_unlock(&h->large_lock);
+  if (large != NULL) {
+    gc_incremental_shade_large(h, large, true);
+  }
+}
+
+void *gc_incremental_survivor(heap_t *h, void *obj)
+{
+  if (!address_within_pages(h, obj)) {
+    h_large_t *large = h_large_of(obj);
+    return large->marked || large->cycle == h->gc_cycle ? obj : NULL;
+  }
+  page_t *page = (page_t *)((uintptr_t)obj & ~(uintptr_t)(h->pagesize - 1));
+  if (gc_incremental_is_new(h, page)) {
+    return obj;
+  }
+  uint64_t *marks = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  return (marks[bit/64] & (1UL << (bit%64))) ? obj : NULL;
+}
+
+size_t gc_incremental_sweep_large(heap_t *h)
+{
+  size_t released = 0;
+  for (size_t i = 0; i < h->large_count; ++i) {
+    h_large_t *large = h->large[i];
+    if (large->marked) {
+      large->marked = false;
+    }
+    else if (large->cycle != h->gc_cycle) {
+      released += h_large_free(h, i);
+    }
+  }
+  h_large_compact(h);
+  return released;
+}
+
+size_t gc_incremental_sweep_page(heap_t *h, page_t *page)
+{
+  uint64_t *marks = h_page_marks(h, page);
+  uint64_t any = 0;
+  for (size_t i = 0; i < H_MARK_WORDS(h->pagesize); ++i) {
+    any |= marks[i];
+  }
+  if (any == 0) {
+    size_t bytes = page->distance_front - PAGE_HEADER_SIZE;
+    h_page_release(h, page);
+    return bytes;
+  }
+
+  // Dead objects may point into released pages, so they must not
+  // be scanned again. Holes are never marked, so the free list is
+  // rebuilt from scratch.
+  page->free = 0;
+  char *cursor = (char *)page + PAGE_HEADER_SIZE;
+  while (cursor < (char *)page + page->distance_front) {
+    void *obj = o_chunk_object(cursor);
+    size_t size = h_chunk_size(page, cursor);
+    size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+    if (!(marks[bit/64] & (1UL << (bit%64)))) {
+      h_alloc_hole(page, cursor);
+    }
+    cursor += size;
+  }
+  memset(marks, 0, H_MARK_WORDS(h->pagesize)*sizeof(uint64_t));
+  h_alloc_offer(h, page);
+  return 0;
+}
+
+size_t gc_incremental_work(heap_t *h, uint64_t budget_ns)
+{
+  uint64_t deadline = budget_ns ? gc_incremental_now() + budget_ns : UINT64_MAX;
+  size_t released = 0;
+  size_t work = 0;
+
+  while (h->gc_phase == GC_PHASE_MARK) {
+    if (h->grey_count == 0 && h->grey_overflow) {
+      // Some marked objects could not be pushed, all are scanned again
+      gc_incremental_rescan(h, gc_incremental_slot);
+      continue;
+    }
+    if (h->grey_count == 0) {
+      // Large objects are swept at once, pages in steps below
+      h_profile_survivors(h, gc_incremental_survivor);
+      released += gc_incremental_sweep_large(h);
+      h->gc_phase = GC_PHASE_SWEEP;
+      break;
+    }
+    void *obj = h->grey[--h->grey_count];
+    o_foreach_pointer(h, obj, gc_incremental_slot, h);
+    if (++work % GC_STEP_CHECK == 0 && gc_incremental_now() >= deadline) {
+      return released;
+    }
+  }
+
+  while (h->sweep_next < h->committed_pages) {
+    size_t i = h->sweep_next++;
+    page_t *page = h_page(h, i);
+    if (h_page_in_use(h, i) && !gc_incremental_is_new(h, page)) {
+      released += gc_incremental_sweep_page(h, page);
+    }
+    if (++work % GC_STEP_CHECK == 0 && gc_incremental_now() >= deadline) {
+      return released;
+    }
+  }
+  h->gc_phase = GC_PHASE_IDLE;
+  return released;
+}
+
+void gc_incremental_abort(heap_t *h)
+{
+  if (!gc_incremental_running(h)) {
+    return;
+  }
+  memset(h->mark_bits, 0, h->committed_pages*H_MARK_WORDS(h->pagesize)*sizeof(uint64_t));
+  for (size_t i = 0; i < h->large_count; ++i) {
+    h->large[i]->marked = false;
+  }
+  h->grey_count = 0;
+  h->grey_overflow = false;
+  h->gc_phase = GC_PHASE_IDLE;
+}
@@ -0,0 +1,132 @@
+/**
+ *   \file gc_incremental.h
+ *   \brief Incremental collection in bounded steps
+ *
+ *   Objects cannot be moved while the mutator runs between steps, as
+ *   it holds (and writes through) plain pointers to them. An
+ *   incremental collection therefore marks in place and only
+ *   reclaims memory by releasing pages without live objects; full
+ *   (stop-the-world) collections still copy and compact.
+ *
+ *   A cycle starts by taking a snapshot: the stack roots are marked
+ *   and all pages handed out from then on belong to the cycle, so
+ *   new objects count as marked. Marking then proceeds in steps. The
+ *   write barrier marks the old value of every overwritten pointer
+ *   field (a snapshot-at-the-beginning barrier), so every object
+ *   reachable at the snapshot gets marked even if the mutator moves
+ *   its only reference around. Finally the pages older than the
+ *   cycle are swept in steps: pages without marked objects are
+ *   released, the dead objects of the others are overwritten with
+ *   raw filler, which becomes holes for later objects in pages of
+ *   one size class (see h_alloc.h). Unmarked large objects older than
+ *   the cycle are unmapped when marking ends.
+ *
+ *   A stop-the-world collection abandons a running cycle.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+#include "object.h"
+
+#ifndef __gc_incremental__
+#define __gc_incremental__
+
+/**
+ *  The phases of an incremental collection, kept in heap_t.gc_phase.
+ */
+enum gc_phase {
+  GC_PHASE_IDLE,   ///< no cycle running
+  GC_PHASE_MARK,   ///< marking from the snapshot
+  GC_PHASE_SWEEP   ///< releasing pages older than the cycle
+};
+
+/**
+ *  Checks if an incremental cycle is running.
+ *
+ *  \param   h  the heap
+ *  \return  true between gc_incremental_begin and the end of sweeping
+ */
+static inline bool gc_incremental_running(heap_t *h)
+{
+  return h->gc_phase != GC_PHASE_IDLE;
+}
+
+/**
+ *  Starts a cycle. Must be followed by gc_incremental_root for every
+ *  stack root.
+ *
+ *  \param   h  the heap
+ */
+void gc_incremental_begin(heap_t *h);
+
+/**
+ *  Marks the object an (unsafe or safe) root points into.
+ *
+ *  \param   h     the heap
+ *  \param   addr  a value that may point into the heap
+ */
+void gc_incremental_root(heap_t *h, void *addr);
+
+/**
+ *  Runs the cycle until it ends or the time budget is used up.
+ *
+ *  \param   h          the heap
+ *  \param   budget_ns  time budget in nanoseconds, 0 to finish
+ *  \return  the number of bytes released
+ */
+size_t gc_incremental_work(heap_t *h, uint64_t budget_ns);
+
+/**
+ *  Write barrier part of the incremental collector: marks the old
+ *  value of a pointer field while marking.
+ *
+ *  \param   h    the heap
+ *  \param   old  the pointer about to be overwritten
+ */
+void gc_incremental_barrier(heap_t *h, void *old);
+
+/**
+ *  Pushes a marked object on the grey stack, growing it when full.
+ *  Also the mark stack of compactions (see gc_compact.h). When the
+ *  stack cannot grow, the object is left out and grey_overflow set.
+ *
+ *  \param   h    the heap
+ *  \param   obj  the object
+ *  \return  false if the object could not be pushed
+ */
+bool gc_incremental_push(heap_t *h, void *obj);
+
+/**
+ *  Scans every marked object again, after pushes have failed, and
+ *  clears grey_overflow. Marking then goes on from the objects this
+ *  marks, until a rescan marks nothing that cannot be pushed.
+ *
+ *  \param   h      the heap
+ *  \param   visit  the pointer visitor of the marking collector,
+ *                  given the heap
+ */
+void gc_incremental_rescan(heap_t *h, o_pointer_f visit);
+
+/**
+ *  Sweeps a page by its mark bits: releases it if none is set, or
+ *  else turns its unmarked chunks into holes, clears the marks and
+ *  offers the page to the allocator. Also sweeps the pages a
+ *  compaction leaves in place.
+ *
+ *  \param   h     the heap
+ *  \param   page  a used page
+ *  \return  the number of bytes released
+ */
+size_t gc_incremental_sweep_page(heap_t *h, page_t *page);
+
+/**
+ *  Abandons a running cycle, clearing all marks.
+ *
+ *  \param   h  the heap
+ */
+void gc_incremental_abort(heap_t *h);
+
+#endif
@@ -0,0 +1,1083 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, must be defined before includes
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gc_parallel.h"
+#include "gc_copy.h"
+#include "h_alloc.h"
+#include "object.h"
+#include "stacktrace.h"
+#include "gc_roots.h"
+
+/**
+ *  \def GC_BUSY
+ *  Header of an object while a worker is copying it: a forwarding
+ *  header without an address.
+ */
+#define GC_BUSY ((intptr_t)3)
+
+/**
+ *  \def GC_DEQUE_CAPACITY
+ *  Initial capacity of a worker's deque. Deques grow when full and
+ *  keep their size for later collections. Their buffers are mapped
+ *  rather than allocated, as collections must not call the system
+ *  allocator.
+ */
+#define GC_DEQUE_CAPACITY 1024
+
+/**
+ *  \def GC_PAGE_TAG
+ *  Set in deque items that are promoted pages rather than objects.
+ *  Objects are word aligned, so the bit is free.
+ */
+#define GC_PAGE_TAG ((uintptr_t)1)
+
+/**
+ *  \def GC_STACK_SEGMENT
+ *  Amount of stack (in bytes) a worker claims at a time when
+ *  scanning stacks for roots.
+ */
+#define GC_STACK_SEGMENT 4096
+
+/**
+ *  \def GC_ROOT_CHUNK
+ *  Amount of (sorted) roots a worker claims at a time.
+ */
+#define GC_ROOT_CHUNK 64
+
+typedef struct gc_deque_buffer gc_deque_buffer_t;
+typedef struct gc_deque gc_deque_t;
+typedef struct gc_worker gc_worker_t;
+typedef struct gc_pool gc_pool_t;
+
+/**
+ *  Storage of a deque. Buffers replaced while growing stay valid
+ *  until the end of the collection, as thieves may still read them.
+ *
+ *  capacity  Amount of items (a power of 2).
+ *  retired   The buffer this one replaced.
+ *  items     The items, indexed modulo capacity.
+ */
+struct gc_deque_buffer {
+  long capacity;
+  gc_deque_buffer_t *retired;
+  void *items[];
+};
+
+/**
+ *  A Chase-Lev work-stealing deque. The owner pushes and takes at
+ *  the bottom, other workers steal from the top.
+ */
+struct gc_deque {
+  long top;
+  long bottom;
+  gc_deque_buffer_t *buffer;
+};
+
+/**
+ *  The state of one GC worker.
+ *
+ *  pool      The pool the worker belongs to.
+ *  id        Index of the worker, 0 is the collecting thread.
+ *  deque     Grey (copied or pinned) objects and promoted pages
+ *            to scan.
+ *  to_space  The pages the worker copies into, one per age and
+ *            size class.
+ *  seed      State of the victim selection when stealing.
+ *  young     Set if the object being scanned points to an object
+ *            that stays young.
+ */
+struct gc_worker {
+  gc_pool_t *pool;
+  size_t id;
+  gc_deque_t deque;
+  page_t *to_space[H_MAX_AGE + 1][H_SIZE_CLASSES + 1];
+  unsigned seed;
+  bool young;
+};
+
+/**
+ *  The worker threads of a heap.
+ *
+ *  h          The heap.
+ *  n_workers  Amount of workers, including the collecting thread.
+ *  workers    The workers.
+ *  threads    Threads of workers 1 and up.
+ *  lock       Protects epoch, finished and shutdown.
+ *  wake       Signalled when a collection starts (or on shutdown).
+ *  done       Signalled when the last thread finishes its work.
+ *  epoch      Number of the current collection.
+ *  finished   Threads that are done with the current collection.
+ *  shutdown   Set when the threads should exit.
+ *  idle       Workers currently out of work, for termination.
+ *  job        What the workers do when woken.
+ *  stacks     The stacks scanned for roots, n_stacks of them.
+ *  unsafe     Whether the roots on the stacks are unsafe.
+ *  cursor     Index of the next stack segment (or chunk of roots)
+ *             to claim.
+ *  overflow   Set when a deque could not grow and an item was left
+ *             out of it, see gc_parallel_rescan.
+ */
+struct gc_pool {
+  heap_t *h;
+  size_t n_workers;
+  gc_worker_t *workers;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  unsigned long epoch;
+  size_t finished;
+  bool shutdown;
+  size_t idle;
+  void (*job)(gc_worker_t *w);
+  h_stack_t *stacks;
+  size_t n_stacks;
+  bool unsafe;
+  size_t cursor;
+  bool overflow;
+};
+
+/**
+ *  The roots a worker has found in a stack segment, before they are
+ *  added to the heap's root buffer.
+ *
+ *  count  Amount of roots.
+ *  roots  The roots.
+ */
+typedef struct gc_root_batch {
+  size_t count;
+  h_root_t roots[GC_STACK_SEGMENT/sizeof(void *)];
+} gc_root_batch_t;
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Maps a deque buffer.
+ *
+ *  \param   capacity  amount of items (a power of 2)
+ *  \return  the buffer, NULL if out of memory
+ */
+gc_deque_buffer_t *gc_deque_map(long capacity);
+
+/**
+ *  Initialises an empty deque.
+ *
+ *  \param   d  the deque
+ *  \return  false if out of memory
+ */
+bool gc_deque_init(gc_deque_t *d);
+
+/**
+ *  Frees a deque's buffers, except the current one when \a keep.
+ *
+ *  \param   d     the deque
+ *  \param   keep  whether to keep the current buffer
+ */
+void gc_deque_free(gc_deque_t *d, bool keep);
+
+/**
+ *  Pushes an item at the bottom. Only called by the owner.
+ *
+ *  \param   d     the deque
+ *  \param   item  the item (not NULL)
+ *  \return  false if the deque was full and could not grow
+ */
+bool gc_deque_push(gc_deque_t *d, void *item);
+
+/**
+ *  Takes the item at the bottom. Only called by the owner.
+ *
+ *  \param   d  the deque
+ *  \return  the item, NULL if the deque is empty
+ */
+void *gc_deque_take(gc_deque_t *d);
+
+/**
+ *  Steals the item at the top.
+ *
+ *  \param   d  the deque
+ *  \return  the item, NULL if the deque is empty or another worker
+ *           got the item first
+ */
+void *gc_deque_steal(gc_deque_t *d);
+
+/**
+ *  Checks if a deque looks non-empty.
+ *
+ *  \param   d  the deque
+ *  \return  true if there are items to steal
+ */
+bool gc_deque_has_items(gc_deque_t *d);
+
+/**
+ *  Main function of the worker threads.
+ *
+ *  \param   arg  the worker
+ *  \return  NULL
+ */
+void *gc_parallel_thread(void *arg);
+
+/**
+ *  Runs a job on all workers, the collecting thread being worker 0,
+ *  and returns when every worker is done with it.
+ *
+ *  \param   pool  the pool
+ *  \param   job   the job
+ */
+void gc_parallel_run(gc_pool_t *pool, void (*job)(gc_worker_t *w));
+
+/**
+ *  Scans stack segments for roots until all have been claimed,
+ *  adding them to the heap's root buffer.
+ *
+ *  \param   w  the worker
+ */
+void gc_parallel_scan_stacks(gc_worker_t *w);
+
+/**
+ *  Handles chunks of the heap's (sorted) roots until all have been
+ *  claimed.
+ *
+ *  \param   w  the worker
+ */
+void gc_parallel_handle_roots(gc_worker_t *w);
+
+/**
+ *  stack_root_f adding a root found on a stack to a batch.
+ *
+ *  \param   slot   the root
+ *  \param   batch  the batch
+ */
+void gc_parallel_stack_root(void **slot, void *batch);
+
+/**
+ *  Handles an unsafe root on behalf of a worker, see gc_copy_pin.
+ *
+ *  \param   w     the worker
+ *  \param   addr  a value that may point into the heap
+ */
+void gc_parallel_pin_worker(gc_worker_t *w, void *addr);
+
+/**
+ *  Handles a safe root on behalf of a worker, see gc_copy_root.
+ *
+ *  \param   w     the worker
+ *  \param   slot  address of the root
+ */
+void gc_parallel_root_worker(gc_worker_t *w, void **slot);
+
+/**
+ *  Scans grey objects and promoted pages until no worker has work.
+ *
+ *  \param   w  the worker
+ */
+void gc_parallel_work(gc_worker_t *w);
+
+/**
+ *  Steals an item from another worker.
+ *
+ *  \param   w  the thief
+ *  \return  the item, NULL if none was found
+ */
+void *gc_parallel_steal(gc_worker_t *w);
+
+/**
+ *  Marks a worker as idle and waits for either more work or all
+ *  workers being idle.
+ *
+ *  \param   w  the worker
+ *  \return  true when the collection is done, false on more work
+ */
+bool gc_parallel_idle(gc_worker_t *w);
+
+/**
+ *  Queues an item on a worker's deque. An item that does not fit is
+ *  left out: it is marked, pinned, promoted or in to-space already,
+ *  so gc_parallel_rescan finds it.
+ *
+ *  \param   w     the worker
+ *  \param   item  the item
+ */
+void gc_parallel_push(gc_worker_t *w, void *item);
+
+/**
+ *  Scans every object the collection has queued so far again, after
+ *  items have been left out of full deques: those in to-space pages
+ *  and promoted pages, pinned objects and marked large objects. Run
+ *  by the collecting thread alone, the objects this evacuates are
+ *  then scanned by all workers again.
+ *
+ *  \param   w  the collecting thread's worker
+ */
+void gc_parallel_rescan(gc_worker_t *w);
+
+/**
+ *  Allocates a chunk in a worker's to-space page.
+ *
+ *  \param   w      the worker
+ *  \param   bytes  size of the object's chunk
+ *  \param   age    age of the to-space page
+ *  \return  the chunk, NULL if there are no free pages left
+ */
+void *gc_parallel_alloc(gc_worker_t *w, size_t bytes, unsigned age);
+
+/**
+ *  Promotes a from-space page, queueing it for scanning unless
+ *  another worker already did.
+ *
+ *  \param   w     the worker
+ *  \param   page  the page
+ */
+void gc_parallel_promote(gc_worker_t *w, page_t *page);
+
+/**
+ *  Marks the large object an address points into on behalf of a
+ *  worker, see gc_copy_mark_large. The first worker to mark it
+ *  queues it to be scanned.
+ *
+ *  \param   w     the worker
+ *  \param   addr  an address outside the heap's pages
+ */
+void gc_parallel_mark_large(gc_worker_t *w, void *addr);
+
+/**
+ *  Returns the to-space address of an object, copying it there if
+ *  needed, see gc_copy_evacuate.
+ *
+ *  \param   w    the worker
+ *  \param   ptr  an object pointer (or NULL)
+ *  \return  the object's address after the collection
+ */
+void *gc_parallel_evacuate(gc_worker_t *w, void *ptr);
+
+/**
+ *  Pointer visitor that evacuates the object a slot points to.
+ *
+ *  \param   slot  the slot
+ *  \param   w     the worker
+ */
+void gc_parallel_slot(void **slot, void *w);
+
+/**
+ *  Evacuates everything an object points to, remembering the object
+ *  if it is old and keeps pointing to young objects.
+ *
+ *  \param   w       the worker
+ *  \param   obj     the object
+ *  \param   header  the object's header
+ */
+void gc_parallel_scan_object(gc_worker_t *w, void *obj, intptr_t header);
+
+/**
+ *  gc_scan_f for the dirty cards, scanned before the workers start.
+ *
+ *  \param   obj  the object
+ *  \param   w    the collecting thread's worker
+ */
+void gc_parallel_scan_card(void *obj, void *w);
+
+/**
+ *  Returns the header of an object, waiting while it is claimed.
+ *
+ *  \param   ptr  the object
+ *  \return  the header, never GC_BUSY
+ */
+intptr_t gc_parallel_header(void *ptr);
+
+/**
+ *  Scans every object (that has not been copied away) in a
+ *  promoted page.
+ *
+ *  \param   w     the worker
+ *  \param   page  the promoted page
+ */
+void gc_parallel_scan_page(gc_worker_t *w, page_t *page);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+gc_deque_buffer_t *gc_deque_map(long capacity)
+{
+  gc_deque_buffer_t *buffer = mmap(NULL, sizeof(gc_deque_buffer_t) + (size_t)capacity*sizeof(void *),
+                                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    return NULL;
+  }
+  buffer->capacity = capacity;
+  buffer->retired = NULL;
+  return buffer;
+}
+
+bool gc_deque_init(gc_deque_t *d)
+{
+  gc_deque_buffer_t *buffer = gc_deque_map(GC_DEQUE_CAPACITY);
+  if (buffer == NULL) {
+    return false;
+  }
+  d->top = 0;
+  d->bottom = 0;
+  d->buffer = buffer;
+  return true;
+}
+
+void gc_deque_free(gc_deque_t *d, bool keep)
+{
+  gc_deque_buffer_t *buffer = keep ? d->buffer->retired : d->buffer;
+  if (keep) {
+    d->buffer->retired = NULL;
+  }
+  while (buffer != NULL) {
+    gc_deque_buffer_t *retired = buffer->retired;
+    munmap(buffer, sizeof(gc_deque_buffer_t) + (size_t)buffer->capacity*sizeof(void *));
+    buffer = retired;
+  }
+}
+
+bool gc_deque_push(gc_deque_t *d, void *item)
+{
+  long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  gc_deque_buffer_t *buffer = d->buffer;
+  if (bottom - top >= buffer->capacity) {
+    gc_deque_buffer_t *grown = gc_deque_map(2*buffer->capacity);
+    if (grown == NULL) {
+      return false;
+    }
+    grown->retired = buffer;
+    for (long i = top; i < bottom; ++i) {
+      grown->items[i & (grown->capacity - 1)] = buffer->items[i & (buffer->capacity - 1)];
+    }
+    __atomic_store_n(&d->buffer, grown, __ATOMIC_RELEASE);
+    buffer = grown;
+  }
+  __atomic_store_n(&buffer->items[bottom & (buffer->capacity - 1)], item, __ATOMIC_RELAXED);
+  // Publishes the item, and the object copied into it, to thieves
+  __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void *gc_deque_take(gc_deque_t *d)
+{
+  long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  gc_deque_buffer_t *buffer = d->buffer;
+  __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  void *item = NULL;
+  if (top <= bottom) {
+    item = __atomic_load_n(&buffer->items[bottom & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // The last item, race the thieves for it
+      if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        item = NULL;
+      }
+      __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  }
+  else {
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return item;
+}
+
+void *gc_deque_steal(gc_deque_t *d)
+{
+  long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
+  }
+  gc_deque_buffer_t *buffer = __atomic_load_n(&d->buffer, __ATOMIC_ACQUIRE);
+  void *item = __atomic_load_n(&buffer->items[top & (buffer->capacity - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return item;
+}
+
+bool gc_deque_has_items(gc_deque_t *d)
+{
+  long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  long bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  return top < bottom;
+}
+
+bool gc_parallel_init(heap_t *h, size_t n_threads)
+{
+  assert(n_threads > 1);
+  gc_pool_t *pool = calloc(1, sizeof(gc_pool_t));
+  if (pool == NULL) {
+    return false;
+  }
+  pool->h = h;
+  pool->workers = calloc(n_threads, sizeof(gc_worker_t));
+  pool->threads = calloc(n_threads, sizeof(pthread_t));
+  if (pool->workers == NULL || pool->threads == NULL) {
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+    return false;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  h->gc_pool = pool;
+
+  for (size_t i = 0; i < n_threads; ++i) {
+    gc_worker_t *w = &pool->workers[i];
+    w->pool = pool;
+    w->id = i;
+    for (size_t age = 0; age <= H_MAX_AGE; ++age) {
+      for (size_t c = 0; c <= H_MIXED_CLASS; ++c) {
+        w->to_space[age][c] = &h->full_page;
+      }
+    }
+    w->seed = (unsigned)i*2654435761u + 1;
+    if (!gc_deque_init(&w->deque)) {
+      gc_parallel_free(h);
+      return false;
+    }
+    pool->n_workers = i + 1;
+    // Worker 0 is the thread calling h_gc
+    if (i > 0 && pthread_create(&pool->threads[i], NULL, gc_parallel_thread, w) != 0) {
+      gc_deque_free(&w->deque, false);
+      pool->n_workers = i;
+      gc_parallel_free(h);
+      return false;
+    }
+  }
+  return true;
+}
+
+void gc_parallel_free(heap_t *h)
+{
+  gc_pool_t *pool = h->gc_pool;
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->n_workers; ++i) {
+    if (i > 0) {
+      pthread_join(pool->threads[i], NULL);
+    }
+    gc_deque_free(&pool->workers[i].deque, false);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+  h->gc_pool = NULL;
+}
+
+void *gc_parallel_thread(void *arg)
+{
+  gc_worker_t *w = arg;
+  gc_pool_t *pool = w->pool;
+  unsigned long seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->epoch == seen && !pool->shutdown) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->epoch;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->job(w);
+
+    pthread_mutex_lock(&pool->lock);
+    if (++pool->finished == pool->n_workers - 1) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+void gc_parallel_begin(heap_t *h, bool minor)
+{
+  gc_pool_t *pool = h->gc_pool;
+  gc_copy_begin(h, minor);
+  for (size_t i = 0; i < pool->n_workers; ++i) {
+    for (size_t age = 0; age <= H_MAX_AGE; ++age) {
+      for (size_t c = 0; c <= H_MIXED_CLASS; ++c) {
+        pool->workers[i].to_space[age][c] = &h->full_page;
+      }
+    }
+  }
+}
+
+void *gc_parallel_alloc(gc_worker_t *w, size_t bytes, unsigned age)
+{
+  heap_t *h = w->pool->h;
+  size_t size_class = h_size_class(h, bytes);
+  page_t *page = w->to_space[age][size_class];
+  if (size_class != H_MIXED_CLASS) {
+    bytes = H_CLASS_SIZE(size_class);
+  }
+  if (page->distance_front + bytes > h->pagesize) {
+    page_t *fresh = h_page_take(h, size_class);
+    if (fresh == NULL) {
+      return NULL;
+    }
+    // Set before any pointer into the page is published
+    fresh->new_space = true;
+    fresh->age = age;
+    w->to_space[age][size_class] = page = fresh;
+  }
+  void *chunk = (char *)page + page->distance_front;
+  // Other workers read it when checking pointers into the page
+  __atomic_store_n(&page->distance_front, page->distance_front + bytes, __ATOMIC_RELAXED);
+  return chunk;
+}
+
+void gc_parallel_push(gc_worker_t *w, void *item)
+{
+  if (!gc_deque_push(&w->deque, item)) {
+    __atomic_store_n(&w->pool->overflow, true, __ATOMIC_RELAXED);
+  }
+}
+
+void gc_parallel_rescan(gc_worker_t *w)
+{
+  heap_t *h = w->pool->h;
+  w->pool->overflow = false;
+  for (size_t i = 0; i < h->committed_pages; ++i) {
+    if (!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    if (page->new_space || page->promoted) {
+      gc_parallel_scan_page(w, page);
+    }
+    else if (page->pinned) {
+      uint64_t *pins = h_page_marks(h, page);
+      for (size_t j = 0; j < H_MARK_WORDS(h->pagesize); ++j) {
+        uint64_t bits = pins[j];
+        while (bits != 0) {
+          void *obj = (char *)page + (j*64 + (size_t)__builtin_ctzll(bits))*WORDSIZE;
+          bits &= bits - 1;
+          gc_parallel_scan_object(w, obj, o_get_header(obj));
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < h->large_count; ++i) {
+    if (h->large[i]->marked) {
+      void *obj = h_large_object(h->large[i]);
+      gc_parallel_scan_object(w, obj, o_get_header(obj));
+    }
+  }
+}
+
+void gc_parallel_promote(gc_worker_t *w, page_t *page)
+{
+  if (!gc_copy_collects(w->pool->h, page)) {
+    return;
+  }
+  if (!__atomic_exchange_n(&page->promoted, true, __ATOMIC_SEQ_CST)) {
+    gc_parallel_push(w, (void *)((uintptr_t)page | GC_PAGE_TAG));
+  }
+}
+
+void gc_parallel_mark_large(gc_worker_t *w, void *addr)
+{
+  heap_t *h = w->pool->h;
+  h_large_t *large = h_large_find(h, addr);
+  if (large == NULL || !gc_copy_collects_large(h, large)) {
+    return;
+  }
+  if (!__atomic_exchange_n(&large->marked, true, __ATOMIC_SEQ_CST)) {
+    gc_parallel_push(w, h_large_object(large));
+  }
+}
+
+void gc_parallel_pin_worker(gc_worker_t *w, void *addr)
+{
+  heap_t *h = w->pool->h;
+  if (!address_within_pages(h, addr)) {
+    gc_parallel_mark_large(w, addr);
+    return;
+  }
+  page_t *page = (page_t *)((uintptr_t)addr & ~(uintptr_t)(h->pagesize - 1));
+  void *obj = gc_copy_object_at(page, addr);
+  if (obj == NULL || !gc_copy_collects(h, page)) {
+    return;
+  }
+  uint64_t *pins = h_page_marks(h, page);
+  size_t bit = (size_t)((char *)obj - (char *)page)/WORDSIZE;
+  uint64_t mask = 1UL << (bit%64);
+  if (__atomic_fetch_or(&pins[bit/64], mask, __ATOMIC_RELAXED) & mask) {
+    return;
+  }
+  __atomic_store_n(&page->pinned, true, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->stats.objects_pinned, 1, __ATOMIC_RELAXED);
+  gc_parallel_push(w, obj);
+}
+
+void gc_parallel_root_worker(gc_worker_t *w, void **slot)
+{
+  heap_t *h = w->pool->h;
+  void *ptr = *slot;
+  if (!address_within_pages(h, ptr)) {
+    gc_parallel_mark_large(w, ptr);
+    return;
+  }
+  page_t *page = (page_t *)((uintptr_t)ptr & ~(uintptr_t)(h->pagesize - 1));
+  if (!gc_copy_collects(h, page)) {
+    return;
+  }
+  if (!gc_copy_is_object(page, ptr)) {
+    gc_parallel_promote(w, page);
+    return;
+  }
+  *slot = gc_parallel_evacuate(w, ptr);
+}
+
+void gc_parallel_pin(heap_t *h, void *addr)
+{
+  gc_parallel_pin_worker(&h->gc_pool->workers[0], addr);
+}
+
+void gc_parallel_root(heap_t *h, void **slot)
+{
+  gc_parallel_root_worker(&h->gc_pool->workers[0], slot);
+}
+
+void gc_parallel_scan_stacks(gc_worker_t *w)
+{
+  gc_pool_t *pool = w->pool;
+  gc_root_batch_t batch;
+  for (;;) {
+    // Find the stack and offset of the claimed segment
+    size_t segment = __atomic_fetch_add(&pool->cursor, 1, __ATOMIC_RELAXED);
+    char *start = NULL;
+    char *end = NULL;
+    for (size_t i = 0; i < pool->n_stacks && start == NULL; ++i) {
+      char *top = pool->stacks[i].top;
+      char *bottom = pool->stacks[i].bottom;
+      size_t segments = (size_t)(bottom - top + GC_STACK_SEGMENT - 1)/GC_STACK_SEGMENT;
+      if (segment < segments) {
+        start = top + segment*GC_STACK_SEGMENT;
+        end = bottom - start > GC_STACK_SEGMENT ? start + GC_STACK_SEGMENT : bottom;
+      }
+      else {
+        segment -= segments;
+      }
+    }
+    if (start == NULL) {
+      return;
+    }
+
+    batch.count = 0;
+    stack_scan(pool->h, start, end, gc_parallel_stack_root, &batch);
+    if (batch.count > 0) {
+      memcpy(gc_roots_claim(pool->h, batch.count), batch.roots, batch.count*sizeof(h_root_t));
+    }
+  }
+}
+
+void gc_parallel_stack_root(void **slot, void *batch)
+{
+  gc_root_batch_t *b = batch;
+  b->roots[b->count].value = *slot;
+  b->roots[b->count].slot = slot;
+  b->count++;
+}
+
+void gc_parallel_handle_roots(gc_worker_t *w)
+{
+  gc_pool_t *pool = w->pool;
+  heap_t *h = pool->h;
+  for (;;) {
+    size_t first = __atomic_fetch_add(&pool->cursor, GC_ROOT_CHUNK, __ATOMIC_RELAXED);
+    if (first >= h->root_count) {
+      return;
+    }
+    size_t last = first + GC_ROOT_CHUNK < h->root_count ? first + GC_ROOT_CHUNK : h->root_count;
+    for (size_t i = first; i < last; ++i) {
+      h_root_t *root = &h->roots[i];
+      if (i + GC_ROOTS_PREFETCH < last) {
+        gc_roots_prefetch(h, root + GC_ROOTS_PREFETCH, pool->unsafe);
+      }
+      if (pool->unsafe) {
+        gc_parallel_pin_worker(w, root->value);
+      }
+      else {
+        gc_parallel_root_worker(w, root->slot);
+      }
+    }
+  }
+}
+
+void gc_parallel_roots(heap_t *h, h_stack_t *stacks, size_t n_stacks, bool unsafe)
+{
+  gc_pool_t *pool = h->gc_pool;
+  bool reserved = gc_roots_reserve(h, gc_roots_words(stacks, n_stacks));
+  assert(reserved && "Out of memory reserving the root buffer");
+  (void)reserved;
+  pool->stacks = stacks;
+  pool->n_stacks = n_stacks;
+  pool->unsafe = unsafe;
+  pool->cursor = 0;
+  gc_parallel_run(pool, gc_parallel_scan_stacks);
+
+  gc_roots_sort(h, unsafe);
+  // Interior roots keep their pages before any root is evacuated,
+  // see gc_copy_interior
+  for (size_t i = 0; i < h->root_count && !unsafe; ++i) {
+    page_t *page = gc_copy_interior_page(h, h->roots[i].value);
+    if (page != NULL) {
+      gc_parallel_promote(&pool->workers[0], page);
+    }
+  }
+  pool->cursor = 0;
+  gc_parallel_run(pool, gc_parallel_handle_roots);
+
+  // Precise roots come once every page is pinned, an object copied
+  // out of a page pinned later would have two copies
+  gc_roots_precise(h);
+  gc_roots_sort(h, false);
+  pool->unsafe = false;
+  pool->cursor = 0;
+  gc_parallel_run(pool, gc_parallel_handle_roots);
+}
+
+intptr_t gc_parallel_header(void *ptr)
+{
+  intptr_t *header = (intptr_t *)ptr - 1;
+  intptr_t value;
+  while ((value = __atomic_load_n(header, __ATOMIC_SEQ_CST)) == GC_BUSY) {
+    sched_yield();
+  }
+  return value;
+}
+
+void *gc_parallel_evacuate(gc_worker_t *w, void *ptr)
+{
+  heap_t *h = w->pool->h;
+  if (!address_within_pages(h, ptr)) {
+    gc_parallel_mark_large(w, ptr);
+    return ptr;
+  }
+  page_t *page = (page_t *)((uintptr_t)ptr & ~(uintptr_t)(h->pagesize - 1));
+  if (!gc_copy_collects(h, page)) {
+    return ptr;
+  }
+  // Objects are only pinned before any is evacuated
+  if (gc_copy_is_pinned(h, page, ptr)) {
+    return ptr;
+  }
+
+  // Claim the object. The page is checked before the header: once a
+  // page is promoted, later claims see it and are undone below.
+  intptr_t *slot = (intptr_t *)ptr - 1;
+  intptr_t header;
+  for (;;) {
+    bool promoted = __atomic_load_n(&page->promoted, __ATOMIC_SEQ_CST);
+    header = gc_parallel_header(ptr);
+    if (O_HEADER_GET_TYPE(header) == 3) {
+      return (void *)O_HEADER_GET_PTR(header);
+    }
+    if (promoted) {
+      return ptr;
+    }
+    if (__atomic_compare_exchange_n(slot, &header, GC_BUSY, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+  }
+  if (__atomic_load_n(&page->promoted, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(slot, header, __ATOMIC_SEQ_CST);
+    return ptr;
+  }
+
+  // Unions and arrays have their size prefix before the header
+  size_t prefix = O_HEADER_PREFIX_SIZE(header);
+  char *chunk = (char *)slot - prefix;
+  size_t size = H_CHUNK_SIZE(o_size_from_header(ptr, header) + prefix);
+  char *copy = gc_parallel_alloc(w, size, gc_copy_target_age(h, page));
+  if (copy == NULL) {
+    // Out of to-space, the object stays (and keeps its page alive)
+    __atomic_store_n(&h->to_space_full, true, __ATOMIC_RELAXED);
+    gc_parallel_promote(w, page);
+    __atomic_store_n(slot, header, __ATOMIC_SEQ_CST);
+    return ptr;
+  }
+  memcpy(copy, chunk, size);
+  void *moved = copy + prefix + sizeof(intptr_t);
+  *((intptr_t *)moved - 1) = header;
+  __atomic_store_n(slot, O_HEADER_SET_TYPE((intptr_t)moved, 3L), __ATOMIC_SEQ_CST);
+  gc_parallel_push(w, moved);
+  return moved;
+}
+
+void gc_parallel_slot(void **slot, void *w)
+{
+  void *ptr = *slot;
+  gc_worker_t *worker = w;
+  void *moved = gc_parallel_evacuate(worker, ptr);
+  if (moved != ptr) {
+    *slot = moved;
+  }
+  if (gc_copy_is_young(worker->pool->h, moved)) {
+    worker->young = true;
+  }
+}
+
+void gc_parallel_scan_object(gc_worker_t *w, void *obj, intptr_t header)
+{
+  w->young = false;
+  o_foreach_pointer_header(w->pool->h, obj, header, gc_parallel_slot, w);
+  if (w->young) {
+    gc_copy_remember(w->pool->h, obj);
+  }
+}
+
+void gc_parallel_scan_card(void *obj, void *w)
+{
+  gc_parallel_scan_object(w, obj, o_get_header(obj));
+}
+
+void gc_parallel_scan_page(gc_worker_t *w, page_t *page)
+{
+  char *cursor = (char *)page + PAGE_HEADER_SIZE;
+  while (cursor < (char *)page + page->distance_front) {
+    void *obj = o_chunk_object(cursor);
+    size_t prefix = (char *)obj - cursor - sizeof(intptr_t);
+    intptr_t header = gc_parallel_header(obj);
+    if (O_HEADER_GET_TYPE(header) != 3) {
+      gc_parallel_scan_object(w, obj, header);
+    }
+    cursor += page->chunk_size != 0 ? page->chunk_size :
+      H_CHUNK_SIZE(o_size_from_header(obj, header) + prefix);
+  }
+}
+
+void *gc_parallel_steal(gc_worker_t *w)
+{
+  gc_pool_t *pool = w->pool;
+  w->seed = w->seed*1103515245u + 12345u;
+  size_t start = w->seed % pool->n_workers;
+  for (size_t i = 0; i < pool->n_workers; ++i) {
+    gc_worker_t *victim = &pool->workers[(start + i) % pool->n_workers];
+    if (victim == w) {
+      continue;
+    }
+    void *item = gc_deque_steal(&victim->deque);
+    if (item != NULL) {
+      return item;
+    }
+  }
+  return NULL;
+}
+
+bool gc_parallel_idle(gc_worker_t *w)
+{
+  gc_pool_t *pool = w->pool;
+  __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+  for (;;) {
+    // Only busy workers push, so with every worker idle the deques
+    // can no longer change
+    bool all_idle = __atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == pool->n_workers;
+    bool work = false;
+    for (size_t i = 0; i < pool->n_workers && !work; ++i) {
+      work = gc_deque_has_items(&pool->workers[i].deque);
+    }
+    if (work) {
+      __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      return false;
+    }
+    if (all_idle) {
+      return true;
+    }
+    sched_yield();
+  }
+}
+
+void gc_parallel_work(gc_worker_t *w)
+{
+  for (;;) {
+    void *item = gc_deque_take(&w->deque);
+    if (item == NULL) {
+      item = gc_parallel_steal(w);
+    }
+    if (item == NULL) {
+      if (gc_parallel_idle(w)) {
+        return;
+      }
+      continue;
+    }
+    if ((uintptr_t)item & GC_PAGE_TAG) {
+      gc_parallel_scan_page(w, (page_t *)((uintptr_t)item & ~GC_PAGE_TAG));
+    }
+    else {
+      gc_parallel_scan_object(w, item, o_get_header(item));
+    }
+  }
+}
+
+void gc_parallel_scan(heap_t *h)
+{
+  gc_pool_t *pool = h->gc_pool;
+  // Dirty cards are roots, found by the collecting thread alone
+  gc_copy_cards(h, gc_parallel_scan_card, &pool->workers[0]);
+  gc_parallel_run(pool, gc_parallel_work);
+  while (pool->overflow) {
+    // Items were left out of full deques, their objects are found again
+    gc_parallel_rescan(&pool->workers[0]);
+    gc_parallel_run(pool, gc_parallel_work);
+  }
+}
+
+void gc_parallel_run(gc_pool_t *pool, void (*job)(gc_worker_t *w))
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->job = job;
+  pool->finished = 0;
+  pool->idle = 0;
+  pool->epoch++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  job(&pool->workers[0]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->finished < pool->n_workers - 1) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void gc_parallel_end(heap_t *h)
+{
+  gc_pool_t *pool = h->gc_pool;
+  for (size_t i = 0; i < pool->n_workers; ++i) {
+    gc_worker_t *w = &pool->workers[i];
+    gc_deque_free(&w->deque, true);
+    w->deque.top = w->deque.bottom = 0;
+  }
+  // The collecting thread's pages are kept for allocation, the other
+  // workers' last pages are offered to the allocator like promoted
+  // ones
+  for (size_t c = 0; c <= H_MIXED_CLASS; ++c) {
+    h->to_space[0][c].page = pool->workers[0].to_space[0][c];
+  }
+  gc_copy_end(h);
+}
@@ -0,0 +1,110 @@
+/**
+ *   \file gc_parallel.h
+ *   \brief Parallel copying of live objects with work stealing
+ *
+ *   The parallel counterpart of gc_copy. A pool of worker threads,
+ *   created with the heap, copies live objects together with the
+ *   thread running the collection. Every worker owns a deque of grey
+ *   objects (copied but not yet scanned) and promoted pages: it pops
+ *   work from the bottom of its own deque and steals from the top of
+ *   the others' when it runs dry. Each worker copies into a to-space
+ *   page of its own, so only taking a fresh page (which is lock-free)
+ *   touches shared state.
+ *
+ *   Workers race to copy an object by claiming its header with a CAS
+ *   (replacing it with a busy marker) and publish the forwarding
+ *   header once the copy is done. A worker that sees the marker waits
+ *   for the forwarding header. A claim made after the object's page
+ *   was promoted is undone, so an object is either copied or kept in
+ *   place, never both.
+ *
+ *   Order of calls:
+ *   1. gc_parallel_begin
+ *   2. gc_parallel_roots, and/or gc_parallel_pin / gc_parallel_root
+ *      for every root
+ *   3. gc_parallel_scan
+ *   4. gc_parallel_end
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+#include "h_thread.h"
+
+#ifndef __gc_parallel__
+#define __gc_parallel__
+
+/**
+ *  Starts the worker threads of a heap, which then collects in
+ *  parallel.
+ *
+ *  \param   h          the heap
+ *  \param   n_threads  threads copying during a collection, including
+ *                      the collecting thread (> 1)
+ *  \return  false if the threads could not be created
+ */
+bool gc_parallel_init(heap_t *h, size_t n_threads);
+
+/**
+ *  Stops the worker threads of a heap, if it has any.
+ *
+ *  \param   h  the heap
+ */
+void gc_parallel_free(heap_t *h);
+
+/**
+ *  Starts a parallel collection, see gc_copy_begin.
+ *
+ *  \param   h      the heap
+ *  \param   minor  true for a minor collection
+ */
+void gc_parallel_begin(heap_t *h, bool minor);
+
+/**
+ *  Handles an unsafe (ambiguous) root, see gc_copy_pin.
+ *
+ *  \param   h     the heap
+ *  \param   addr  a value that may point into the heap
+ */
+void gc_parallel_pin(heap_t *h, void *addr);
+
+/**
+ *  Handles a safe root, see gc_copy_root.
+ *
+ *  \param   h     the heap
+ *  \param   slot  address of the root
+ */
+void gc_parallel_root(heap_t *h, void **slot);
+
+/**
+ *  Handles the roots on a set of stacks. The stacks are split into
+ *  segments that the workers scan in parallel, gathering the roots
+ *  into the heap's root buffer; once sorted, the workers handle them
+ *  in chunks.
+ *
+ *  \param   h         the heap
+ *  \param   stacks    the stacks
+ *  \param   n_stacks  amount of stacks
+ *  \param   unsafe    true if the roots are unsafe (ambiguous)
+ */
+void gc_parallel_roots(heap_t *h, h_stack_t *stacks, size_t n_stacks, bool unsafe);
+
+/**
+ *  Copies everything reachable from the roots (and dirty cards),
+ *  using all workers. Returns when every worker has run out of
+ *  work.
+ *
+ *  \param   h  the heap
+ */
+void gc_parallel_scan(heap_t *h);
+
+/**
+ *  Ends a parallel collection, see gc_copy_end.
+ *
+ *  \param   h  the heap
+ */
+void gc_parallel_end(heap_t *h);
+
+#endif
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE // mremap, must be defined before includes
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gc_roots.h"
+#include "stacktrace.h"
+#include "h_thread.h"
+
+/**
+ *  \def GC_ROOTS_INSERTION
+ *  Ranges of at most this many roots are sorted by insertion.
+ */
+#define GC_ROOTS_INSERTION 16
+
+
+__thread h_frame_t *h_frames = NULL;
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Sorts roots by value. An in-place quicksort, as qsort may
+ *  allocate memory.
+ *
+ *  \param   roots  the roots
+ *  \param   n      amount of roots
+ */
+void gc_roots_quicksort(h_root_t *roots, size_t n);
+
+/**
+ *  Counts the roots of a heap in a shadow stack, and adds them to the
+ *  buffer.
+ *
+ *  \param   h      the heap
+ *  \param   frame  the top of the shadow stack
+ *  \param   add    false to only count them
+ *  \return  the amount of roots
+ */
+size_t gc_roots_frames(heap_t *h, h_frame_t *frame, bool add);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+bool gc_roots_reserve(heap_t *h, size_t n)
+{
+  h->root_count = 0;
+  return gc_roots_room(h, n);
+}
+
+bool gc_roots_room(heap_t *h, size_t n)
+{
+  n += h->root_count;
+  if (n <= h->root_capacity) {
+    return true;
+  }
+  size_t capacity = 2*h->root_capacity > n ? 2*h->root_capacity : n;
+  size_t bytes = capacity*sizeof(h_root_t);
+  void *roots;
+  if (h->roots_mapped) {
+    roots = mremap(h->roots, h->root_capacity*sizeof(h_root_t), bytes, MREMAP_MAYMOVE);
+  }
+  else {
+    roots = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (roots != MAP_FAILED) {
+      memcpy(roots, h->roots, h->root_count*sizeof(h_root_t));
+    }
+  }
+  if (roots == MAP_FAILED) {
+    return false;
+  }
+  h->roots = roots;
+  h->root_capacity = capacity;
+  h->roots_mapped = true;
+  return true;
+}
+
+h_root_t *gc_roots_claim(heap_t *h, size_t n)
+{
+  size_t first = __atomic_fetch_add(&h->root_count, n, __ATOMIC_RELAXED);
+  assert(first + n <= h->root_capacity && "Root buffer overflow");
+  return h->roots + first;
+}
+
+void gc_roots_add(void **slot, void *h)
+{
+  heap_t *heap = h;
+  assert(heap->root_count < heap->root_capacity && "Root buffer overflow");
+  heap->roots[heap->root_count].value = *slot;
+  heap->roots[heap->root_count].slot = slot;
+  heap->root_count++;
+}
+
+size_t gc_roots_words(h_stack_t *stacks, size_t n_stacks)
+{
+  size_t words = 0;
+  for (size_t i = 0; i < n_stacks; ++i) {
+    words += (size_t)((char *)stacks[i].bottom - (char *)stacks[i].top)/sizeof(void *);
+  }
+  return words;
+}
+
+void gc_roots_scan(heap_t *h, h_stack_t *stacks, size_t n_stacks)
+{
+  bool reserved = gc_roots_reserve(h, gc_roots_words(stacks, n_stacks));
+  assert(reserved && "Out of memory reserving the root buffer");
+  (void)reserved;
+  for (size_t i = 0; i < n_stacks; ++i) {
+    stack_scan(h, stacks[i].top, stacks[i].bottom, gc_roots_add, h);
+  }
+}
+
+void gc_roots_quicksort(h_root_t *roots, size_t n)
+{
+  while (n > GC_ROOTS_INSERTION) {
+    // Median of three as pivot, so sorted stacks split evenly
+    uintptr_t a = (uintptr_t)roots[0].value;
+    uintptr_t b = (uintptr_t)roots[n/2].value;
+    uintptr_t c = (uintptr_t)roots[n - 1].value;
+    uintptr_t pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+    size_t i = 0;
+    size_t j = n - 1;
+    for (;;) {
+      while ((uintptr_t)roots[i].value < pivot) {
+        ++i;
+      }
+      while ((uintptr_t)roots[j].value > pivot) {
+        --j;
+      }
+      if (i >= j) {
+        break;
+      }
+      h_root_t tmp = roots[i];
+      roots[i] = roots[j];
+      roots[j] = tmp;
+      ++i;
+      --j;
+    }
+    // Recurse into the smaller part, loop on the larger one
+    size_t left = j + 1;
+    if (left < n - left) {
+      gc_roots_quicksort(roots, left);
+      roots += left;
+      n -= left;
+    }
+    else {
+      gc_roots_quicksort(roots + left, n - left);
+      n = left;
+    }
+  }
+
+  for (size_t i = 1; i < n; ++i) {
+    h_root_t root = roots[i];
+    size_t j = i;
+    while (j > 0 && (uintptr_t)roots[j - 1].value > (uintptr_t)root.value) {
+      roots[j] = roots[j - 1];
+      --j;
+    }
+    roots[j] = root;
+  }
+}
+
+void gc_roots_sort(heap_t *h, bool unsafe)
+{
+  gc_roots_quicksort(h->roots, h->root_count);
+  if (!unsafe || h->root_count == 0) {
+    return;
+  }
+  size_t kept = 1;
+  for (size_t i = 1; i < h->root_count; ++i) {
+    if (h->roots[i].value != h->roots[kept - 1].value) {
+      h->roots[kept++] = h->roots[i];
+    }
+  }
+  h->root_count = kept;
+}
+
+bool gc_roots_register(heap_t *h, void **slot)
+{
+  pthread_mutex_lock(&h->root_slot_lock);
+  if (h->root_slot_count == h->root_slot_capacity) {
+    // Collections must not allocate, so the array is grown here
+    size_t capacity = h->root_slot_capacity ? 2*h->root_slot_capacity : 16;
+    void ***grown = realloc(h->root_slots, capacity*sizeof(void **));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&h->root_slot_lock);
+      return false;
+    }
+    h->root_slots = grown;
+    h->root_slot_capacity = capacity;
+  }
+  h->root_slots[h->root_slot_count++] = slot;
+  pthread_mutex_unlock(&h->root_slot_lock);
+  return true;
+}
+
+void gc_roots_unregister(heap_t *h, void **slot)
+{
+  pthread_mutex_lock(&h->root_slot_lock);
+  // The most recently registered roots are the likeliest to go first
+  for (size_t i = h->root_slot_count; i > 0; --i) {
+    if (h->root_slots[i - 1] == slot) {
+      h->root_slots[i - 1] = h->root_slots[--h->root_slot_count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&h->root_slot_lock);
+}
+
+size_t gc_roots_frames(heap_t *h, h_frame_t *frame, bool add)
+{
+  size_t n = 0;
+  for (; frame != NULL; frame = frame->prev) {
+    if (frame->heap != h) {
+      continue;
+    }
+    if (add) {
+      for (size_t i = 0; i < frame->count; ++i) {
+        gc_roots_add(frame->slots[i], h);
+      }
+    }
+    n += frame->count;
+  }
+  return n;
+}
+
+void gc_roots_precise(heap_t *h)
+{
+  h->root_count = 0;
+  gc_roots_add_precise(h);
+}
+
+void gc_roots_add_precise(heap_t *h)
+{
+  h_thread_t *self = h_thread_current(h);
+  h_thread_t *threads = __atomic_load_n(&h->threads, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock(&h->root_slot_lock);
+  size_t n = h->root_slot_count + gc_roots_frames(h, h_frames, false);
+  for (h_thread_t *thread = threads; thread != NULL; thread = thread->next) {
+    if (thread != self && thread->stack_top != NULL) {
+      n += gc_roots_frames(h, *thread->frames, false);
+    }
+  }
+  bool reserved = gc_roots_room(h, n);
+  assert(reserved && "Out of memory reserving the root buffer");
+  (void)reserved;
+
+  for (size_t i = 0; i < h->root_slot_count; ++i) {
+    gc_roots_add(h->root_slots[i], h);
+  }
+  pthread_mutex_unlock(&h->root_slot_lock);
+  gc_roots_frames(h, h_frames, true);
+  for (h_thread_t *thread = threads; thread != NULL; thread = thread->next) {
+    if (thread != self && thread->stack_top != NULL) {
+      gc_roots_frames(h, *thread->frames, true);
+    }
+  }
+}
+
+void gc_roots_free(heap_t *h)
+{
+  if (h->roots_mapped) {
+    munmap(h->roots, h->root_capacity*sizeof(h_root_t));
+  }
+  h->roots = NULL;
+  h->root_capacity = 0;
+  h->roots_mapped = false;
+  free(h->root_slots);
+  h->root_slots = NULL;
+  h->root_slot_count = 0;
+  h->root_slot_capacity = 0;
+}
@@ -0,0 +1,162 @@
+/**
+ *   \file gc_roots.h
+ *   \brief The buffer of roots found on the stacks during a collection
+ *
+ *   Roots are gathered into one contiguous buffer of the heap, which
+ *   is reused by every collection. Its first part is in the heap's
+ *   metadata; when it is too small, a bigger one is mapped directly
+ *   from the system (mmap/mremap), so collections never call the
+ *   system allocator. Before the roots are handled they are sorted
+ *   by the address they point to, so that they are handled in one
+ *   linear pass over the heap and every page is visited once.
+ *
+ *   Precise roots, the slots registered with h_add_root and those in
+ *   the frames of shadow stacks, are gathered into the same buffer
+ *   once the roots found on the stacks have been handled. They are
+ *   always handled as safe roots, i.e. updated in place.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __gc_roots__
+#define __gc_roots__
+
+/**
+ *  \def GC_ROOTS_PREFETCH
+ *  How many roots ahead the pass over the roots prefetches.
+ */
+#define GC_ROOTS_PREFETCH 8
+
+/**
+ *  Empties the root buffer and makes room for \a n roots.
+ *
+ *  \param   h  the heap
+ *  \param   n  the most roots the collection can find
+ *  \return  false if out of memory
+ */
+bool gc_roots_reserve(heap_t *h, size_t n);
+
+/**
+ *  Makes room for \a n more roots, keeping those in the buffer.
+ *
+ *  \param   h  the heap
+ *  \param   n  the most roots about to be added
+ *  \return  false if out of memory
+ */
+bool gc_roots_room(heap_t *h, size_t n);
+
+/**
+ *  Claims room for \a n roots at the end of the buffer. Thread
+ *  safe, the room must have been reserved.
+ *
+ *  \param   h  the heap
+ *  \param   n  amount of roots
+ *  \return  the first of the claimed roots
+ */
+h_root_t *gc_roots_claim(heap_t *h, size_t n);
+
+/**
+ *  stack_root_f adding a root to the buffer (room for it must have
+ *  been reserved).
+ *
+ *  \param   slot  the root
+ *  \param   h     the heap
+ */
+void gc_roots_add(void **slot, void *h);
+
+/**
+ *  Gathers the roots of stacks into the buffer.
+ *
+ *  \param   h         the heap
+ *  \param   stacks    the stacks
+ *  \param   n_stacks  amount of stacks
+ */
+void gc_roots_scan(heap_t *h, h_stack_t *stacks, size_t n_stacks);
+
+/**
+ *  Counts the words of stacks, the most roots they can hold.
+ *
+ *  \param   stacks    the stacks
+ *  \param   n_stacks  amount of stacks
+ *  \return  the amount of words
+ */
+size_t gc_roots_words(h_stack_t *stacks, size_t n_stacks);
+
+/**
+ *  Sorts the roots by the address they point to. Unsafe roots are
+ *  only used to pin what they point into, so all but one root per
+ *  value are then dropped.
+ *
+ *  \param   h       the heap
+ *  \param   unsafe  true if the roots are unsafe
+ */
+void gc_roots_sort(heap_t *h, bool unsafe);
+
+/**
+ *  Prefetches what handling a root reads: the page header of an
+ *  unsafe root, the object (header) of a safe one.
+ *
+ *  \param   h       the heap
+ *  \param   root    the root
+ *  \param   unsafe  true if the root is unsafe
+ */
+static inline void gc_roots_prefetch(heap_t *h, h_root_t *root, bool unsafe)
+{
+  uintptr_t addr = (uintptr_t)root->value;
+  if (unsafe) {
+    addr &= ~(uintptr_t)(h->pagesize - 1);
+  }
+  else {
+    addr -= sizeof(intptr_t);
+  }
+  __builtin_prefetch((void *)addr);
+}
+
+/**
+ *  Registers a precise root, see h_add_root.
+ *
+ *  \param   h     the heap
+ *  \param   slot  the root
+ *  \return  false if out of memory
+ */
+bool gc_roots_register(heap_t *h, void **slot);
+
+/**
+ *  Unregisters a precise root, see h_remove_root.
+ *
+ *  \param   h     the heap
+ *  \param   slot  the root
+ */
+void gc_roots_unregister(heap_t *h, void **slot);
+
+/**
+ *  Empties the root buffer and gathers the precise roots into it:
+ *  the registered ones, and those in the shadow stacks of the
+ *  calling thread and of the parked ones. Only called while the
+ *  world is stopped.
+ *
+ *  \param   h  the heap
+ */
+void gc_roots_precise(heap_t *h);
+
+/**
+ *  Adds the precise roots to the buffer like gc_roots_precise, after
+ *  the roots already in it.
+ *
+ *  \param   h  the heap
+ */
+void gc_roots_add_precise(heap_t *h);
+
+/**
+ *  Unmaps the buffer of a heap being deleted, if it was mapped, and
+ *  frees its registered roots.
+ *
+ *  \param   h  the heap
+ */
+void gc_roots_free(heap_t *h);
+
+#endif
@@ -0,0 +1,39 @@
+#define _POSIX_C_SOURCE 200809L // Must be defined before includes
+
+#include <time.h>
+
+#include "gc_stats.h"
+#include "h_alloc.h"
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+uint64_t gc_stats_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void gc_stats_pause(gc_pause_t *pause, uint64_t start, uint64_t end)
+{
+  uint64_t ns = end > start ? end - start : 0;
+  uint64_t us = ns/1000;
+  size_t bucket = us == 0 ? 0 : 63 - (size_t)__builtin_clzll(us);
+  if (bucket >= GC_STATS_BUCKETS) {
+    bucket = GC_STATS_BUCKETS - 1;
+  }
+  pause->count++;
+  pause->total_ns += ns;
+  if (ns > pause->max_ns) {
+    pause->max_ns = ns;
+  }
+  pause->buckets[bucket]++;
+}
+
+void gc_stats_read(heap_t *h, gc_stats_t *stats)
+{
+  *stats = h->stats;
+  // The pages still allocated into are only counted when retired
+  stats->bytes_allocated = __atomic_load_n(&h->stats.bytes_allocated, __ATOMIC_RELAXED) +
+    h_alloc_pending_bytes(h);
+}
@@ -0,0 +1,61 @@
+/**
+ *   \file gc_stats.h
+ *   \brief Collection statistics and pause timing
+ *
+ *   The statistics of a heap (gc_stats_t) are updated by the
+ *   collectors while the world is stopped, so plain stores suffice,
+ *   except for the root counts of the parallel collector's workers.
+ *   Allocation counts its bytes atomically, but off the fast path: as
+ *   pages are retired, and as objects are put into holes or the large
+ *   object space.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __gc_stats__
+#define __gc_stats__
+
+/**
+ *  Returns the time of a monotonic clock.
+ *
+ *  \return  the time in nanoseconds
+ */
+uint64_t gc_stats_now();
+
+/**
+ *  Records a pause.
+ *
+ *  \param   pause  the pause times of a phase
+ *  \param   start  when the pause started (gc_stats_now)
+ *  \param   end    when it ended
+ */
+void gc_stats_pause(gc_pause_t *pause, uint64_t start, uint64_t end);
+
+/**
+ *  Adds the root counts of one stack scan.
+ *
+ *  \param   h           the heap
+ *  \param   candidates  the stack words that looked like pointers
+ *                       into the heap
+ *  \param   confirmed   how many of those were roots
+ */
+static inline void gc_stats_roots(heap_t *h, size_t candidates, size_t confirmed)
+{
+  // Parallel workers scan stacks concurrently
+  __atomic_fetch_add(&h->stats.root_candidates, candidates, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->stats.roots_confirmed, confirmed, __ATOMIC_RELAXED);
+}
+
+/**
+ *  Copies the statistics of a heap, completing the bytes allocated.
+ *
+ *  \param   h      the heap
+ *  \param   stats  where to store them
+ */
+void gc_stats_read(heap_t *h, gc_stats_t *stats);
+
+#endif
@@ -0,0 +1,358 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "h_alloc.h"
+#include "gc.h"
+#include "gc_incremental.h"
+#include "h_large.h"
+#include "h_policy.h"
+#include "h_profile.h"
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Checks if handing out more pages would put the heap above its
+ *  gc_threshold, and a quarter above the data live after the last
+ *  full collection, or above the trigger of its adaptive policy (see
+ *  h_policy.h). Large objects count as the pages they would fill.
+ *
+ *  \param   h      the heap
+ *  \param   pages  the amount of pages
+ *  \return  true if a garbage collection should run first
+ */
+bool h_alloc_needs_gc(heap_t *h, size_t pages);
+
+/**
+ *  Runs the collection an allocation needs: on a generational heap
+ *  a minor collection when the nursery is full, followed by a full
+ *  one if the heap is still above its gc_threshold.
+ *
+ *  \param   h      the heap
+ *  \param   pages  the amount of pages the allocation needs
+ *  \return  true if a collection ran
+ */
+bool h_alloc_collect(heap_t *h, size_t pages);
+
+/**
+ *  Checks if the allocator should run an incremental step before
+ *  handing out a page, i.e. if it paces steps and either a cycle
+ *  runs or the heap is above half its gc_threshold (or trigger).
+ *
+ *  \param   h  the heap
+ *  \return  true if a step should run
+ */
+bool h_alloc_needs_step(heap_t *h);
+
+/**
+ *  Allocates an object in a hole of a page.
+ *
+ *  \param   page    a page of one size class
+ *  \param   header  header to store in front of the object
+ *  \return  the newly allocated (zeroed) object, NULL if the page
+ *           has no holes
+ */
+void *h_alloc_in_hole(page_t *page, intptr_t header);
+
+/**
+ *  Takes a page with room offered by the last collection. Lock-free:
+ *  pages are only pushed while the world is stopped, so popping with
+ *  a CAS cannot suffer from ABA.
+ *
+ *  \param   h           the heap
+ *  \param   size_class  the size class of the page
+ *  \return  the page, NULL if there is none
+ */
+page_t *h_alloc_take_partial(heap_t *h, size_t size_class);
+
+/**
+ *  Allocates an object without taking a fresh page: at the end of
+ *  the current page of its size class, in a hole of that page, or in
+ *  a page with room offered by the last collection.
+ *
+ *  \param   h           the heap
+ *  \param   size_class  the size class of the object
+ *  \param   bytes       size of the object (excluding header)
+ *  \param   header      header to store in front of the object
+ *  \param   layout      the object's compiled layout, NULL if none
+ *  \param   caller      where h_alloc_slow was called from, for the
+ *                       profiler
+ *  \return  the newly allocated (zeroed) object, NULL if there is no
+ *           room
+ */
+void *h_alloc_reuse(heap_t *h, size_t size_class, size_t bytes, intptr_t header,
+                    struct o_layout *layout, void *caller);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+bool h_alloc_needs_gc(heap_t *h, size_t pages)
+{
+  size_t used_pages = __atomic_load_n(&h->used_pages, __ATOMIC_RELAXED) +
+    __atomic_load_n(&h->large_pages, __ATOMIC_RELAXED);
+  if(h_policy_adaptive(h)) {
+    return used_pages + pages > __atomic_load_n(&h->policy.trigger_pages, __ATOMIC_RELAXED);
+  }
+  size_t limit = __atomic_load_n(&h->limit_pages, __ATOMIC_RELAXED);
+  // Room for every size class to get a page, and a quarter of the
+  // live data, as the adaptive trigger has, so live data past the
+  // threshold does not collect for every page (up to the limit,
+  // where nothing is left but to collect)
+  size_t live = __atomic_load_n(&h->live_pages, __ATOMIC_RELAXED);
+  size_t least = live + live/4 + H_MIXED_CLASS + 1;
+  least = least < limit ? least : limit;
+  return used_pages + pages > least && (float)(used_pages + pages) > h->gc_threshold * (float)limit;
+}
+
+bool h_alloc_needs_step(heap_t *h)
+{
+  if(h->step_ns == 0) {
+    return false;
+  }
+  size_t used_pages = __atomic_load_n(&h->used_pages, __ATOMIC_RELAXED) +
+    __atomic_load_n(&h->large_pages, __ATOMIC_RELAXED);
+  if(gc_incremental_running(h)) {
+    return true;
+  }
+  if(h_policy_adaptive(h)) {
+    return 2*(used_pages + 1) > __atomic_load_n(&h->policy.trigger_pages, __ATOMIC_RELAXED);
+  }
+  size_t limit = __atomic_load_n(&h->limit_pages, __ATOMIC_RELAXED);
+  return (float)(used_pages + 1) > 0.5f * h->gc_threshold * (float)limit;
+}
+
+bool h_alloc_collect(heap_t *h, size_t pages)
+{
+  if(h_alloc_needs_step(h)) {
+    h_gc_step(h, h->step_ns);
+  }
+  if(gc_incremental_running(h)) {
+    if(!h_alloc_needs_gc(h, pages)) {
+      return false;
+    }
+    // Out of time: finish the cycle, collect fully if that is not enough
+    h_gc_step(h, 0);
+  }
+  if(h->tenure_age == 0) {
+    if(!h_alloc_needs_gc(h, pages)) {
+      return false;
+    }
+    h_gc(h);
+    return true;
+  }
+  size_t nursery_pages = __atomic_load_n(&h->nursery_pages, __ATOMIC_RELAXED);
+  if(nursery_pages < h->nursery_limit && !h_alloc_needs_gc(h, pages)) {
+    return false;
+  }
+  h_gc_minor(h);
+  if(h_alloc_needs_gc(h, pages)) {
+    h_gc(h);
+  }
+  return true;
+}
+
+void *h_alloc_in_hole(page_t *page, intptr_t header)
+{
+  if(page->free == 0) {
+    return NULL;
+  }
+  intptr_t *chunk = (intptr_t *)((char *)page + page->free);
+  page->free = (uint32_t)chunk[1];
+  memset(chunk, 0, page->chunk_size);
+  *chunk = header;
+  return chunk + 1;
+}
+
+page_t *h_alloc_take_partial(heap_t *h, size_t size_class)
+{
+  page_t *page = __atomic_load_n(&h->partial[size_class], __ATOMIC_ACQUIRE);
+  while(page != NULL &&
+        !__atomic_compare_exchange_n(&h->partial[size_class], &page, page->next, true,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    // page has been reloaded, retry
+  }
+  return page;
+}
+
+void *h_alloc_reuse(heap_t *h, size_t size_class, size_t bytes, intptr_t header,
+                    struct o_layout *layout, void *caller)
+{
+  page_t **current = h_alloc_current(h) + size_class;
+  page_t *page = *current;
+  size_t step = page->chunk_size != 0 ? page->chunk_size : H_CHUNK_SIZE(bytes);
+  if(page->distance_front + step <= h->pagesize) {
+    // A page the collection left current, its limit is stale
+    void *obj = h_alloc_fast(h, bytes, header, layout);
+    page->limit = h_profile_limit(h, page);
+    return obj;
+  }
+  if(size_class == H_MIXED_CLASS) {
+    return NULL;
+  }
+  void *obj = h_alloc_in_hole(page, header);
+  if(obj == NULL) {
+    page = h_alloc_take_partial(h, size_class);
+    if(page == NULL) {
+      return NULL;
+    }
+    // The limit left from the last time this one was current is stale
+    h_alloc_retire(h, current);
+    h_alloc_use(current, page);
+    page->limit = h->pagesize;
+    obj = h_alloc_in_hole(page, header);
+    if(obj == NULL) {
+      obj = h_alloc_fast(h, bytes, header, layout);
+      page->limit = h_profile_limit(h, page);
+      return obj;
+    }
+    page->limit = h_profile_limit(h, page);
+  }
+  // Holes lie behind the front, so they are counted as they are filled
+  __atomic_fetch_add(&h->stats.bytes_allocated, page->chunk_size, __ATOMIC_RELAXED);
+  if(h_profile_on(h)) {
+    h_profile_chunk(h, obj, page->chunk_size, header, layout, caller);
+  }
+  return obj;
+}
+
+void *h_alloc_slow(heap_t *h, size_t bytes, intptr_t header, struct o_layout *layout)
+{
+  size_t size = H_CHUNK_SIZE(bytes);
+  // The profiler's stacks start at the allocating function
+  void *caller = __builtin_return_address(0);
+  if(size <= h->pagesize - PAGE_HEADER_SIZE) {
+    page_t *page = h_alloc_current(h)[h_size_class(h, size)];
+    size_t step = page->chunk_size != 0 ? page->chunk_size : size;
+    if(page->distance_front + step <= h->pagesize) {
+      // The page has room, it stopped short at a sample point
+      return h_profile_bump(h, page, bytes, header, layout, caller);
+    }
+  }
+
+  // A fresh page is a safepoint, so that allocating threads need not
+  // poll on their own
+  h_thread_safepoint(h);
+  if(size > h->pagesize - PAGE_HEADER_SIZE) {
+    // Young large objects count towards the nursery like pages
+    size_t pages = h_large_pages(h, size);
+    h_alloc_collect(h, pages);
+    void *obj = h_large_alloc(h, size, header);
+    if(obj != NULL) {
+      __atomic_fetch_add(&h->stats.bytes_allocated, size, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&h->nursery_pages, pages, __ATOMIC_RELAXED);
+      if(h_profile_on(h)) {
+        h_profile_chunk(h, obj, size, header, layout, caller);
+      }
+    }
+    return obj;
+  }
+
+  size_t size_class = h_size_class(h, size);
+  // Reusing room comes before fresh pages, and so before collecting
+  void *obj = h_alloc_reuse(h, size_class, bytes, header, layout, caller);
+  if(obj != NULL) {
+    return obj;
+  }
+  if(h_alloc_collect(h, 1)) {
+    // Collection may leave a partially filled page (or pages with
+    // holes) to continue in
+    obj = h_alloc_reuse(h, size_class, bytes, header, layout, caller);
+    if(obj != NULL) {
+      return obj;
+    }
+  }
+
+  page_t *page = h_page_take(h, size_class);
+  if(page == NULL) {
+    return NULL;
+  }
+  page_t **current = h_alloc_current(h) + size_class;
+  h_alloc_retire(h, current);
+  h_alloc_use(current, page);
+  __atomic_fetch_add(&h->nursery_pages, 1, __ATOMIC_RELAXED);
+  obj = h_alloc_fast(h, bytes, header, layout);
+  page->limit = h_profile_limit(h, page);
+  return obj;
+}
+
+size_t h_alloc_free_bytes(heap_t *h)
+{
+  size_t capacity = h->pagesize - PAGE_HEADER_SIZE;
+  size_t used_pages = __atomic_load_n(&h->used_pages, __ATOMIC_RELAXED) +
+    __atomic_load_n(&h->large_pages, __ATOMIC_RELAXED);
+  size_t limit = __atomic_load_n(&h->limit_pages, __ATOMIC_RELAXED);
+  size_t free_pages = used_pages < limit ? limit - used_pages : 0;
+  size_t bytes = free_pages*capacity;
+  for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+    bytes += h->pagesize - h->current[c]->distance_front;
+  }
+  for(h_thread_t *thread = __atomic_load_n(&h->threads, __ATOMIC_ACQUIRE); thread != NULL; thread = thread->next) {
+    if(__atomic_load_n(&thread->active, __ATOMIC_RELAXED)) {
+      for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+        bytes += h->pagesize - thread->pages[c]->distance_front;
+      }
+    }
+  }
+  return bytes;
+}
+
+size_t h_alloc_pending_bytes(heap_t *h)
+{
+  size_t bytes = 0;
+  for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+    page_t *page = h->current[c];
+    if(page != &h->full_page) {
+      bytes += __atomic_load_n(&page->distance_front, __ATOMIC_RELAXED) - page->start;
+    }
+  }
+  for(h_thread_t *thread = __atomic_load_n(&h->threads, __ATOMIC_ACQUIRE); thread != NULL; thread = thread->next) {
+    if(__atomic_load_n(&thread->active, __ATOMIC_RELAXED)) {
+      for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+        page_t *page = thread->pages[c];
+        if(page != &h->full_page) {
+          bytes += __atomic_load_n(&page->distance_front, __ATOMIC_RELAXED) - page->start;
+        }
+      }
+    }
+  }
+  return bytes;
+}
+
+void h_alloc_tlabs_retire(heap_t *h)
+{
+  for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+    h_alloc_retire(h, &h->current[c]);
+  }
+  for(h_thread_t *thread = h->threads; thread != NULL; thread = thread->next) {
+    for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+      h_alloc_retire(h, &thread->pages[c]);
+    }
+  }
+  for(size_t c = 0; c < H_SIZE_CLASSES; c++) {
+    h->partial[c] = NULL;
+  }
+}
+
+void h_alloc_hole(page_t *page, void *chunk)
+{
+  intptr_t *words = chunk;
+  if(page->chunk_size == 0) {
+    words[0] = O_COMPACT_HEADER(O_COMPACT_RAW, (intptr_t)(o_chunk_size(chunk) - sizeof(intptr_t)));
+    return;
+  }
+  words[0] = O_COMPACT_HEADER(O_COMPACT_RAW, (intptr_t)page->chunk_size);
+  words[1] = (intptr_t)page->free;
+  page->free = (uint32_t)((char *)chunk - (char *)page);
+}
+
+void h_alloc_offer(heap_t *h, page_t *page)
+{
+  if(page->chunk_size == 0 || h_page_is_old(h, page)) {
+    return;
+  }
+  if(page->free == 0 && page->distance_front + page->chunk_size > h->pagesize) {
+    return;
+  }
+  page->next = h->partial[page->size_class];
+  h->partial[page->size_class] = page;
+}
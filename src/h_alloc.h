@@ -0,0 +1,244 @@
+/**
+ *   \file h_alloc.h
+ *   \brief Size-class segregated bump-pointer allocation in heap pages
+ *
+ *   Chunk sizes are rounded up to a size class (see H_CLASS_SIZE) and
+ *   every page holds chunks of one class only, so objects of very
+ *   different sizes do not share pages. Chunks too large for the
+ *   heap's size classes go to mixed pages, holding chunks of any
+ *   size. Allocation bumps the current page of the class.
+ *
+ *   Because all chunks of a page have the same size, the chunk of a
+ *   dead object in a page that is kept (a promoted page, or a page
+ *   swept by an incremental collection) becomes a hole that fits any
+ *   later object of the class. The holes of a page are linked into a
+ *   free list, and pages with holes (or room left at their end) are
+ *   offered to the allocator after the collection, before it takes
+ *   fresh pages.
+ *
+ *   Threads registered with a heap allocate into pages of their own
+ *   (thread-local allocation buffers), so the fast path needs no
+ *   synchronisation; only taking a page touches shared state, and
+ *   that is lock-free. Threads that are not registered share the
+ *   heap's current pages and must not allocate concurrently.
+ *
+ *   The fast path does not count the bytes it allocates: a page is
+ *   counted once, when it is retired, by how far its front moved
+ *   since it was taken up.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+#include "h_thread.h"
+#include "object.h"
+
+#ifndef __h_alloc__
+#define __h_alloc__
+
+struct o_layout;
+
+/**
+ *  \def H_CHUNK_SIZE(bytes)
+ *  The amount of page memory taken by an object of \a bytes bytes,
+ *  including its header.
+ */
+#define H_CHUNK_SIZE(bytes)  (H_ALIGN_WORD(bytes) + sizeof(intptr_t))
+
+/**
+ *  Returns the size class of a chunk.
+ *
+ *  \param   h     the heap
+ *  \param   size  size of the chunk, header included
+ *  \return  the smallest class the chunk fits in, H_MIXED_CLASS if
+ *           none of the heap's classes is large enough
+ */
+static inline size_t h_size_class(heap_t *h, size_t size)
+{
+  if(size <= O_SMALLEST_SIZE) {
+    return 0;
+  }
+  // Size is in (2^bits, 2^(bits + 1)], split at 3*2^(bits - 1)
+  size_t bits = 63 - __builtin_clzl(size - 1);
+  size_t size_class = 2*(bits - __builtin_ctzl(O_SMALLEST_SIZE)) +
+    (size <= (size_t)3 << (bits - 1) ? 1 : 2);
+  return size_class < h->size_classes ? size_class : H_MIXED_CLASS;
+}
+
+/**
+ *  Returns the size of a chunk in a page: the page's chunk_size, or
+ *  the size of the chunk's object in a mixed page.
+ *
+ *  \param   page   the page
+ *  \param   chunk  a chunk in the page
+ *  \return  the size, header included
+ */
+static inline size_t h_chunk_size(page_t *page, void *chunk)
+{
+  return page->chunk_size != 0 ? page->chunk_size : o_chunk_size(chunk);
+}
+
+/**
+ *  Checks if a chunk is a hole, see h_alloc_hole.
+ *
+ *  \param   page   the page
+ *  \param   chunk  a chunk in the page
+ *  \return  true if the chunk is a hole
+ */
+static inline bool h_chunk_is_hole(page_t *page, void *chunk)
+{
+  // Holes claim a raw body larger than their chunk, which no object
+  // has
+  return page->chunk_size != 0 &&
+    *(intptr_t *)chunk == (intptr_t)O_COMPACT_HEADER(O_COMPACT_RAW, (intptr_t)page->chunk_size);
+}
+
+/**
+ *  Returns where the calling thread's current pages are kept.
+ *
+ *  \param   h  the heap
+ *  \return  the page slots (one per size class) of the thread's
+ *           allocation buffers, or the heap's current when the
+ *           thread is not registered
+ */
+static inline page_t **h_alloc_current(heap_t *h)
+{
+  h_thread_t *thread = h_thread_current(h);
+  return thread != NULL ? thread->pages : h->current;
+}
+
+/**
+ *  Takes up a page to bump-allocate into, see h_alloc_retire.
+ *
+ *  \param   slot  the page slot of a size class (see h_alloc_current),
+ *                 whose page has been retired
+ *  \param   page  the page
+ */
+static inline void h_alloc_use(page_t **slot, page_t *page)
+{
+  page->start = (uint32_t)page->distance_front;
+  *slot = page;
+}
+
+/**
+ *  Retires the page of a page slot, adding the bytes allocated in it
+ *  since it was taken up to the heap's bytes_allocated. The slot is
+ *  left with full_page.
+ *
+ *  \param   h     the heap
+ *  \param   slot  the page slot of a size class (see h_alloc_current)
+ */
+static inline void h_alloc_retire(heap_t *h, page_t **slot)
+{
+  page_t *page = *slot;
+  if(page != &h->full_page) {
+    size_t front = __atomic_load_n(&page->distance_front, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->stats.bytes_allocated, front - page->start, __ATOMIC_RELAXED);
+  }
+  *slot = &h->full_page;
+}
+
+/**
+ *  Allocation slow path. Called by h_alloc_fast when the current
+ *  page of the size class is full: allocates in a hole of the page,
+ *  or switches to a page with room left by the last collection, or
+ *  else to a fresh page, first triggering garbage collection if the
+ *  heap is under enough pressure. Objects too large for a page are
+ *  allocated in the large object space (see h_large.h). Also called
+ *  when the allocation crosses the limit of a page with room left,
+ *  which the allocation profiler samples (see h_profile.h).
+ *
+ *  \param   h       the heap
+ *  \param   bytes   size of the object (excluding header)
+ *  \param   header  header to store in front of the object
+ *  \param   layout  the object's compiled layout, NULL if it has none
+ *  \return  the newly allocated (zeroed) object, NULL if out of memory
+ */
+void *h_alloc_slow(heap_t *h, size_t bytes, intptr_t header, struct o_layout *layout);
+
+/**
+ *  Allocates an object by bumping the distance_front of the current
+ *  page of its size class, up to the page's limit. The memory of
+ *  fresh pages is always zeroed, so the object is too.
+ *
+ *  \param   h       the heap
+ *  \param   bytes   size of the object (excluding header)
+ *  \param   header  header to store in front of the object
+ *  \param   layout  the object's compiled layout, NULL if it has none.
+ *                   Only passed on to the slow path, for the profiler.
+ *  \return  the newly allocated (zeroed) object, NULL if out of memory
+ */
+static inline void *h_alloc_fast(heap_t *h, size_t bytes, intptr_t header, struct o_layout *layout)
+{
+  size_t size = H_CHUNK_SIZE(bytes);
+  page_t *page = h_alloc_current(h)[h_size_class(h, size)];
+  // Atomic (but not synchronising), as write barriers of other threads
+  // check pointers into the page
+  size_t front = __atomic_load_n(&page->distance_front, __ATOMIC_RELAXED);
+  if(page->chunk_size != 0) {
+    size = page->chunk_size;
+  }
+
+  if(front + size > page->limit) {
+    return h_alloc_slow(h, bytes, header, layout);
+  }
+  __atomic_store_n(&page->distance_front, front + size, __ATOMIC_RELAXED);
+
+  intptr_t *chunk = (intptr_t *)((char *)page + front);
+  *chunk = header;
+  return chunk + 1;
+}
+
+/**
+ *  Returns the amount of bytes that can be allocated without
+ *  switching pages or triggering a garbage collection.
+ *
+ *  \param   h  the heap
+ *  \return  free bytes
+ */
+size_t h_alloc_free_bytes(heap_t *h);
+
+/**
+ *  Returns the bytes allocated into the pages of the heap and its
+ *  threads that are not retired yet, which bytes_allocated does not
+ *  count. Exact only while no other thread allocates.
+ *
+ *  \param   h  the heap
+ *  \return  the bytes
+ */
+size_t h_alloc_pending_bytes(heap_t *h);
+
+/**
+ *  Retires the pages of all allocation buffers (and the heap's
+ *  current pages) and forgets the pages with room, so that
+ *  allocation continues in fresh pages. Only called by a collector,
+ *  while no other thread allocates.
+ *
+ *  \param   h  the heap
+ */
+void h_alloc_tlabs_retire(heap_t *h);
+
+/**
+ *  Turns the chunk of a dead object into raw filler, so that it is
+ *  never scanned again. In a page of one size class the chunk
+ *  becomes a hole: its header claims a raw body as large as the
+ *  chunk, and it is pushed on the page's free list.
+ *
+ *  \param   page   the page
+ *  \param   chunk  the chunk, not already a hole
+ */
+void h_alloc_hole(page_t *page, void *chunk);
+
+/**
+ *  Offers a page that survived a collection to the allocator, if it
+ *  is young, of a size class, and has room (holes or a free tail).
+ *  Only called by a collector, while no other thread allocates.
+ *
+ *  \param   h     the heap
+ *  \param   page  a used page
+ */
+void h_alloc_offer(heap_t *h, page_t *page);
+
+#endif
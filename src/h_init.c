@@ -1,98 +1,295 @@
-#define _POSIX_C_SOURCE 200809L // Must be defined before includes
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS and madvise, must be defined before includes
 
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "h_init.h"
+#include "h_alloc.h"
+#include "o_layout.h"
+#include "gc_parallel.h"
+#include "h_thread.h"
+#include "gc_roots.h"
+#include "h_large.h"
+#include "h_policy.h"
+#include "h_profile.h"
 
-#ifndef WORDSIZE
-#define WORDSIZE sizeof(void *)
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000 // Linux 4.17, older kernels take it as a hint
 #endif
 
-#ifndef PAGESIZE
-#define PAGESIZE 2048
-#endif
-
-#ifndef MAX_HEADER_SIZE
-#define MAX_HEADER_SIZE 1024
-#endif
-
-/**
- * The datatype holding all the heap data
- *
- * gc_threshold  The percentage of the heap that has to be
- *               used to trigger a garbage collection cycle.
- *
- * pagesize      The size (in bytes) of each page in the heap.
- *
- * unsafe_stack  Whether to consider stack pointers to the
- *               heap as unsafe (or safe).
- */
-struct heap {
-  float gc_threshold;
-  size_t pagesize;
-  bool unsafe_stack;
-};
-
-typedef struct heap heap_t;
-
-
 /**
- * A datatype representing one page in the heap.
- *
- * new_space       
- *
- * promoted        Indicates whether unsafe pointers were
- *                 found to be pointing toward the page.
+ * The sizes of the metadata in front of a heap's pages, which cover
+ * every page the heap can grow to.
  *
- * distance_front  Distance (in bytes) from the beginning of
- *                 the page header to the front of the page.
- *                 Must be <= pagesize - sizeof(page header)
- *                 
+ * bitmap        Size of each of the page bitmaps.
+ * marks         Size of the mark bits.
+ * cards         Size of the card table, 0 if not generational.
+ * roots         Size of the root buffer, one root per page.
+ * unit          What pages are committed and released in.
+ * pages_offset  Where the first page is.
  */
-struct page {
-  bool new_space;
-  bool promoted;
-  size_t distance_front;
-};
+typedef struct h_init_sizes {
+  size_t bitmap;
+  size_t marks;
+  size_t cards;
+  size_t roots;
+  size_t unit;
+  size_t pages_offset;
+} h_init_sizes_t;
 
-typedef struct page page_t;
-
-bool valid_bytes(size_t, size_t);
-bool valid_threshold(float);
+void h_init_size(size_t, size_t, unsigned, bool, h_init_sizes_t *);
 void create_pages (void *, int, size_t);
+void h_page_set_used(heap_t *, size_t, bool);
+void *h_reserve(size_t, size_t, bool, void *);
+page_t *h_page_claim(heap_t *, size_t);
+void h_pages_release(heap_t *, size_t, size_t);
 
 heap_t *h_init(size_t bytes, bool unsafe_stack, float gc_threshold)
 {
+  return h_init_opt(bytes, unsafe_stack, gc_threshold, NULL);
+}
+
+heap_t *h_init_opt(size_t bytes, bool unsafe_stack, float gc_threshold, const h_options_t *opts)
+{
+  return h_init_at(bytes, unsafe_stack, gc_threshold, opts, NULL);
+}
+
+heap_t *h_init_at(size_t bytes, bool unsafe_stack, float gc_threshold, const h_options_t *opts, void *addr)
+{
+  size_t pagesize = opts != NULL && opts->page_size != 0 ? opts->page_size : PAGESIZE;
+  bool huge_pages = opts != NULL && opts->huge_pages;
   assert(valid_threshold(gc_threshold));
-  assert(valid_bytes(bytes, MAX_HEADER_SIZE));
+  assert(valid_bytes(bytes, pagesize, MAX_HEADER_SIZE));
+  assert((opts == NULL || opts->tenure_age <= H_MAX_AGE) && "Tenure age too high");
+  assert((opts == NULL || opts->max_bytes == 0 || opts->max_bytes >= bytes) &&
+         "Maximum size below the initial size");
 
-  size_t heap_header_size   = WORDSIZE;
-  int    total_pages        = (bytes-heap_header_size)/PAGESIZE;
-  size_t total_size         = total_pages*PAGESIZE + heap_header_size;
-  int    align_amount       = 12;  // amount to left-shift
-  size_t alignment          = (sizeof(void *)) << align_amount;
+  assert(h_init_valid(bytes, gc_threshold, opts) && "Heap too small for its metadata");
 
-  void *heap_temp;
-  int  result = posix_memalign(&heap_temp, alignment, total_size);
-  if(result != 0) {
-  // TODO: handle errors, see 'man posix_memalign'
+  size_t max_bytes          = opts != NULL && opts->max_bytes > bytes ? opts->max_bytes : bytes;
+  unsigned tenure_age       = opts != NULL ? opts->tenure_age : 0;
+  h_init_sizes_t sizes;
+  h_init_size(max_bytes, pagesize, tenure_age, huge_pages, &sizes);
+  size_t bitmap_size        = sizes.bitmap;
+  size_t marks_size         = sizes.marks;
+  size_t cards_size         = sizes.cards;
+  size_t unit               = sizes.unit;
+  size_t pages_offset       = sizes.pages_offset;
+  size_t total_pages        = (max_bytes-pages_offset)/pagesize;
+  size_t total_size         = total_pages*pagesize + pages_offset;
+  size_t commit_unit        = unit/pagesize;
+  // A growable heap's reserved metadata is not resident until used,
+  // so it does not count against its initial size
+  size_t limit_pages        = max_bytes > bytes ? bytes/pagesize : total_pages;
+  if(limit_pages > total_pages) {
+    limit_pages = total_pages;
+  }
+  size_t committed_pages    = (limit_pages + commit_unit - 1)/commit_unit*commit_unit;
+  if(committed_pages > total_pages) {
+    committed_pages = total_pages;
+  }
+
+  // Aligning the heap to its own (power of 2) size lets a mask
+  // decide whether an address is inside it
+  size_t alignment = unit;
+  while(alignment < total_size) {
+    alignment <<= 1;
+  }
+
+  // Allocation relies on fresh pages being zeroed, as mappings are
+  void *heap_temp = h_reserve(total_size, alignment, huge_pages, addr);
+  if(heap_temp == NULL) {
+    return NULL;
+  }
+  if(mprotect(heap_temp, pages_offset + committed_pages*pagesize, PROT_READ | PROT_WRITE) != 0) {
+    munmap(heap_temp, total_size);
+    return NULL;
   }
 
   heap_t *heap = (heap_t *)heap_temp;
   heap->gc_threshold = gc_threshold;
-  heap->pagesize = PAGESIZE;
+  heap->bytes = bytes;
+  if(opts != NULL) {
+    heap->options = *opts;
+  }
+  heap->pagesize = pagesize;
+  heap->page_shift = __builtin_ctzl(pagesize);
   heap->unsafe_stack = unsafe_stack;
-  void *pages_start = (char *)heap + heap_header_size; // cast to char for incrementation in bytes
-  create_pages(pages_start, total_pages, PAGESIZE);
+  heap->region_mask = ~(uintptr_t)(alignment - 1);
+  heap->pages = (char *)heap + pages_offset; // cast to char for incrementation in bytes
+  heap->total_pages = total_pages;
+  heap->committed_pages = committed_pages;
+  heap->limit_pages = limit_pages;
+  heap->min_pages = limit_pages;
+  heap->commit_unit = commit_unit;
+  heap->used_pages = 0;
+  heap->next_page = 0;
+  heap->page_bitmap = (uint64_t *)((char *)heap + H_ALIGN_WORD(sizeof(heap_t)));
+  heap->released_bitmap = heap->page_bitmap + bitmap_size/sizeof(uint64_t);
+  heap->release = opts != NULL ? opts->release : H_RELEASE_NEVER;
+  heap->full_page.distance_front = pagesize;
+  // Segregate the classes of which a page holds two chunks or more
+  while(heap->size_classes < H_SIZE_CLASSES &&
+        2*H_CLASS_SIZE(heap->size_classes) <= pagesize - PAGE_HEADER_SIZE) {
+    heap->size_classes++;
+  }
+  for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+    heap->current[c] = &heap->full_page;
+    for(size_t age = 0; age <= H_MAX_AGE; age++) {
+      heap->to_space[age][c].page = &heap->full_page;
+    }
+  }
+  heap->mark_bits = (uint64_t *)((char *)heap->released_bitmap + bitmap_size);
+  heap->step_ns = opts != NULL ? opts->gc_step_ns : 0;
+  heap->tenure_age = tenure_age;
+  if(tenure_age > 0) {
+    heap->cards = (unsigned char *)heap->mark_bits + marks_size;
+    heap->nursery_limit = opts->nursery_pages > 0 ? opts->nursery_pages : total_pages/8 + 1;
+  }
+  pthread_mutex_init(&heap->layout_lock, NULL);
+  o_layout_cache_init(heap);
+  pthread_mutex_init(&heap->thread_lock, NULL);
+  pthread_cond_init(&heap->thread_cond, NULL);
+  pthread_mutex_init(&heap->grey_lock, NULL);
+  pthread_mutex_init(&heap->large_lock, NULL);
+  pthread_mutex_init(&heap->commit_lock, NULL);
+  pthread_mutex_init(&heap->root_slot_lock, NULL);
+  heap->precise_roots = opts != NULL && opts->precise_roots;
+  // A block no address is in, until there are large objects
+  heap->large_mask = 0;
+  heap->large_base = 1;
+  heap->roots = (h_root_t *)((char *)heap->mark_bits + marks_size + H_ALIGN_WORD(cards_size));
+  heap->root_capacity = max_bytes/pagesize;
+  heap->stacks = malloc(sizeof(h_stack_t));
+
+  if(heap->stacks == NULL) {
+    h_delete(heap);
+    return NULL;
+  }
+
+  if(opts != NULL && opts->gc_threads > 1) {
+    if(!gc_parallel_init(heap, opts->gc_threads)) {
+      h_delete(heap);
+      return NULL;
+    }
+  }
 
   return heap;
 }
 
 /**
- * Creates the pages of the heap.
+ * Sizes the metadata of a heap.
+ *
+ * \param max_bytes   The size the heap can grow to.
+ * \param pagesize    The size of its pages.
+ * \param tenure_age  Its tenure age, 0 if not generational.
+ * \param huge_pages  Whether it is backed by huge pages.
+ * \param sizes       Set to the sizes.
+ */
+void h_init_size(size_t max_bytes, size_t pagesize, unsigned tenure_age, bool huge_pages, h_init_sizes_t *sizes)
+{
+  sizes->bitmap = H_BITMAP_WORDS(max_bytes/pagesize)*sizeof(uint64_t);
+  sizes->marks = (max_bytes/pagesize)*H_MARK_WORDS(pagesize)*sizeof(uint64_t);
+  sizes->cards = tenure_age > 0 ? (max_bytes/pagesize)*(pagesize >> H_CARD_SHIFT) : 0;
+  sizes->roots = (max_bytes/pagesize)*sizeof(h_root_t);
+  size_t header_size = H_ALIGN_WORD(sizeof(heap_t)) + 2*sizes->bitmap + sizes->marks +
+    H_ALIGN_WORD(sizes->cards) + sizes->roots;
+  // Pages are committed and released in whole system (or huge) pages
+  size_t unit = huge_pages ? H_HUGE_PAGESIZE : (size_t)sysconf(_SC_PAGESIZE);
+  sizes->unit = unit > pagesize ? unit : pagesize;
+  sizes->pages_offset = (header_size + sizes->unit - 1) & ~(sizes->unit - 1);
+}
+
+bool h_init_valid(size_t bytes, float gc_threshold, const h_options_t *opts)
+{
+  size_t pagesize = opts != NULL && opts->page_size != 0 ? opts->page_size : PAGESIZE;
+  if(!valid_threshold(gc_threshold) || !valid_bytes(bytes, pagesize, MAX_HEADER_SIZE)) {
+    return false;
+  }
+  if(opts != NULL && (opts->tenure_age > H_MAX_AGE || opts->release > H_RELEASE_ALL ||
+                      (opts->max_bytes != 0 && opts->max_bytes < bytes))) {
+    return false;
+  }
+  size_t max_bytes = opts != NULL && opts->max_bytes > bytes ? opts->max_bytes : bytes;
+  h_init_sizes_t sizes;
+  h_init_size(max_bytes, pagesize, opts != NULL ? opts->tenure_age : 0,
+              opts != NULL && opts->huge_pages, &sizes);
+  return max_bytes/2 >= pagesize && max_bytes - 2*pagesize >= sizes.pages_offset;
+}
+
+/**
+ * Reserves address space for a heap, without committing any of it.
+ *
+ * \param size        Size of the heap.
+ * \param alignment   The alignment of the heap, a power of 2 of at
+ *                    least the system's page size (and of a huge
+ *                    page with huge_pages).
+ * \param huge_pages  Whether to back the heap with huge pages:
+ *                    explicit ones if the system has enough of
+ *                    them reserved, transparent ones otherwise.
+ * \param addr        Where the space should start (aligned), NULL
+ *                    for anywhere. Only a hint.
+ * \return            The start of the reserved space, NULL if out
+ *                    of address space.
+ */
+void *h_reserve(size_t size, size_t alignment, bool huge_pages, void *addr)
+{
+  size_t granule = huge_pages ? H_HUGE_PAGESIZE : (size_t)sysconf(_SC_PAGESIZE);
+  size = (size + granule - 1) & ~(granule - 1);
+  // Mapped at the hint, the aligned start is the hint itself
+  char *mapping = mmap(addr, size + alignment, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(mapping == MAP_FAILED) {
+    return NULL;
+  }
+  // Unmap the parts in front of and after the aligned heap
+  char *start = (char *)(((uintptr_t)mapping + alignment - 1) & ~(uintptr_t)(alignment - 1));
+  char *end = start + size;
+  if(start > mapping) {
+    munmap(mapping, (size_t)(start - mapping));
+  }
+  if(mapping + size + alignment > end) {
+    munmap(end, (size_t)(mapping + size + alignment - end));
+  }
+  if(!huge_pages) {
+    return start;
+  }
+
+  // Explicit huge pages are reserved when mapped (there is no
+  // MAP_NORESERVE, which would fault when they run out), so mapping
+  // them fails if there are too few. The range is remapped, without
+  // replacing anything mapped there in between.
+  munmap(start, size);
+  void *huge = mmap(start, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED_NOREPLACE, -1, 0);
+  if(huge == start) {
+    return start;
+  }
+  if(huge != MAP_FAILED) {
+    munmap(huge, size);
+  }
+  void *normal = mmap(start, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+  if(normal != start) {
+    if(normal != MAP_FAILED) {
+      munmap(normal, size);
+    }
+    return NULL;
+  }
+  // Transparent huge pages, where the system allows them
+  madvise(start, size, MADV_HUGEPAGE);
+  return start;
+}
+
+/**
+ * Creates the pages of the heap. Pages are created when they are
+ * taken, so that free pages need not be resident.
  *
  * \param start     Address of the first page.
  * \param n_pages   Amount of pages to create.
@@ -104,40 +301,267 @@ void create_pages (void *start, int n_pages, size_t pagesize)
   page_t template;
   template.new_space = false;
   template.promoted = false;
-  size_t page_header_size = 1; // TODO
-  template.distance_front = page_header_size;
-  
+  template.pinned = false;
+  template.age = 0;
+  template.size_class = 0;
+  template.cycle = 0;
+  template.chunk_size = 0;
+  template.free = 0;
+  template.start = PAGE_HEADER_SIZE;
+  template.next = NULL;
+  template.target = NULL;
+  template.distance_front = PAGE_HEADER_SIZE;
+  template.limit = pagesize;
+
   int i;
   for(i = 0; i < n_pages; i++){
-    *((page_t *)page_addr) = template; 
+    *((page_t *)page_addr) = template;
     page_addr += pagesize;
   }
 }
 
+page_t *h_page(heap_t *h, size_t i)
+{
+  return (page_t *)(h->pages + i*h->pagesize);
+}
+
+page_t *h_page_take(heap_t *h, size_t size_class)
+{
+  page_t *page;
+  size_t limit;
+  do {
+    limit = __atomic_load_n(&h->limit_pages, __ATOMIC_ACQUIRE);
+    page = h_page_claim(h, limit);
+    // Grow when the heap is full, unless it cannot grow
+  } while(page == NULL && h_pages_grow(h, limit + 1));
+  if(page == NULL) {
+    return NULL;
+  }
+  create_pages(page, 1, h->pagesize);
+  page->cycle = h->gc_cycle;
+  page->size_class = (unsigned char)size_class;
+  page->chunk_size = size_class != H_MIXED_CLASS ? (uint32_t)H_CLASS_SIZE(size_class) : 0;
+  return page;
+}
+
 /**
- * Validates a size argument for h_init.
+ * Claims a free page, see h_page_take.
  *
- * \param bytes        The amount of bytes.
- * \param header_size  The expected size of the heaps header.
- * \return             True if the size argument is valid,
- *                     false otherwise.
- * \see h_init
- * \see valid_threshold
+ * \param h      the heap
+ * \param limit  the amount of pages the heap may use
+ * \return       the page, NULL if the heap uses limit pages (some
+ *               of them taken up by large objects)
  */
-bool valid_bytes(size_t bytes, size_t header_size)
+page_t *h_page_claim(heap_t *h, size_t limit)
+{
+  // Large objects take their share of the heap's pages
+  if(__atomic_load_n(&h->used_pages, __ATOMIC_RELAXED) +
+     __atomic_load_n(&h->large_pages, __ATOMIC_RELAXED) >= limit) {
+    return NULL;
+  }
+  // Free pages may be anywhere in the committed part
+  size_t committed = __atomic_load_n(&h->committed_pages, __ATOMIC_ACQUIRE);
+  size_t words = H_BITMAP_WORDS(committed);
+  size_t start = __atomic_load_n(&h->next_page, __ATOMIC_RELAXED)/64;
+  size_t i;
+  for(i = 0; i <= words; i++) {
+    size_t word = (start + i) % words;
+    uint64_t bits = __atomic_load_n(&h->page_bitmap[word], __ATOMIC_RELAXED);
+    while(~bits != 0) {
+      size_t index = word*64 + __builtin_ctzll(~bits);
+      if(index >= committed) {
+        break;
+      }
+      // Acquire pairs with the release in h_page_set_used, so the
+      // page is seen zeroed. A failed CAS reloads bits and retries.
+      uint64_t claimed = bits | (1UL << (index%64));
+      if(__atomic_compare_exchange_n(&h->page_bitmap[word], &bits, claimed, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&h->used_pages, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->next_page, index + 1, __ATOMIC_RELAXED);
+        uint64_t bit = 1UL << (index%64);
+        if(__atomic_load_n(&h->released_bitmap[word], __ATOMIC_RELAXED) & bit) {
+          __atomic_fetch_and(&h->released_bitmap[word], ~bit, __ATOMIC_RELAXED);
+        }
+        return h_page(h, index);
+      }
+    }
+  }
+  return NULL;
+}
+
+void h_page_release(heap_t *h, page_t *page)
+{
+  size_t index = ((char *)page - h->pages) >> h->page_shift;
+  assert(h_page_in_use(h, index) && "Releasing a free page");
+  if(h->current[page->size_class] == page) {
+    h_alloc_retire(h, &h->current[page->size_class]);
+  }
+  memset((char *)page + PAGE_HEADER_SIZE, 0, page->distance_front - PAGE_HEADER_SIZE);
+  if(h->cards != NULL) {
+    memset(h_page_cards(h, page), 0, h->pagesize >> H_CARD_SHIFT);
+  }
+  memset(h_page_marks(h, page), 0, H_MARK_WORDS(h->pagesize)*sizeof(uint64_t));
+  page->new_space = false;
+  page->promoted = false;
+  page->age = 0;
+  page->free = 0;
+  page->next = NULL;
+  page->distance_front = PAGE_HEADER_SIZE;
+  __atomic_fetch_sub(&h->used_pages, 1, __ATOMIC_RELAXED);
+  h_page_set_used(h, index, false);
+}
+
+bool h_pages_grow(heap_t *h, size_t pages)
 {
-  return bytes >= 2*PAGESIZE + header_size;
+  if(pages > h->total_pages) {
+    return false;
+  }
+  bool grown = true;
+  pthread_mutex_lock(&h->commit_lock);
+  size_t limit = h->limit_pages;
+  if(limit < pages) {
+    size_t target = limit + limit/2 > pages ? limit + limit/2 : pages;
+    if(target > h->total_pages) {
+      target = h->total_pages;
+    }
+    size_t committed = h->committed_pages;
+    if(committed < target) {
+      size_t extent = (target + h->commit_unit - 1)/h->commit_unit*h->commit_unit;
+      if(extent > h->total_pages) {
+        extent = h->total_pages;
+      }
+      // Releases pair with the acquires in h_page_take, so pages are
+      // accessible before they are seen
+      grown = mprotect(h->pages + committed*h->pagesize, (extent - committed)*h->pagesize,
+                       PROT_READ | PROT_WRITE) == 0;
+      if(grown) {
+        __atomic_store_n(&h->committed_pages, extent, __ATOMIC_RELEASE);
+      }
+    }
+    if(grown) {
+      __atomic_store_n(&h->limit_pages, target, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&h->commit_lock);
+  return grown;
+}
+
+void h_pages_adjust(heap_t *h, bool full)
+{
+  size_t used = h->used_pages + h->large_pages;
+  bool adaptive = h_policy_adaptive(h);
+  if(full) {
+    __atomic_store_n(&h->live_pages, used, __ATOMIC_RELAXED);
+  }
+  // The policy moves its trigger even when the heap cannot change size
+  size_t wanted = adaptive ? h_policy_limit(h, used, full) : 0;
+  if(h->min_pages < h->total_pages) {
+    // Room to allocate as much as survived before the next collection,
+    // or what the policy's trigger needs
+    size_t target = adaptive ? wanted : (size_t)(2.0f*(float)used/h->gc_threshold) + 1;
+    target = target > h->min_pages ? target : h->min_pages;
+    target = target < h->total_pages ? target : h->total_pages;
+    if(target > h->limit_pages) {
+      // Growing by half spares allocation many small steps, the
+      // policy's size is exact
+      if(h_pages_grow(h, target) && adaptive) {
+        __atomic_store_n(&h->limit_pages, target, __ATOMIC_RELEASE);
+      }
+    }
+    else if(full) {
+      // Minor collections leave old garbage, only full ones shrink
+      __atomic_store_n(&h->limit_pages, target, __ATOMIC_RELEASE);
+    }
+  }
+  if(h->release == H_RELEASE_NEVER) {
+    return;
+  }
+
+  // Keep the room allocation uses before the next collection
+  size_t keep = 0;
+  if(h->release == H_RELEASE_EXCESS) {
+    size_t room = adaptive ? h->policy.trigger_pages :
+      (size_t)(h->gc_threshold*(float)h->limit_pages);
+    keep = room > used ? room - used : 0;
+  }
+  // The lowest pages are kept, the search for free pages starts there
+  h->next_page = 0;
+  size_t unit = h->commit_unit;
+  size_t run = 0;
+  for(size_t i = 0; i < h->committed_pages; i += unit) {
+    size_t end = i + unit < h->committed_pages ? i + unit : h->committed_pages;
+    size_t resident = 0;
+    bool free = true;
+    for(size_t j = i; j < end && free; j++) {
+      free = !h_page_in_use(h, j);
+      resident += !((h->released_bitmap[j/64] >> (j%64)) & 1);
+    }
+    if(free && resident > 0 && keep >= resident) {
+      keep -= resident;
+    }
+    else if(free && resident > 0) {
+      keep = 0;
+      continue;
+    }
+    // The unit stays, release the run before it
+    h_pages_release(h, run, i);
+    run = end;
+  }
+  h_pages_release(h, run, h->committed_pages);
+}
+
+/**
+ * Returns the memory of free pages to the system, so that they read
+ * as zeroes and are no longer resident.
+ *
+ * \param h      the heap
+ * \param first  index of the first page
+ * \param end    index after the last page
+ */
+void h_pages_release(heap_t *h, size_t first, size_t end)
+{
+  if(first >= end) {
+    return;
+  }
+  if(first < h->file_pages) {
+    // Dropped pages of a file mapping read the file again, so they
+    // are replaced with fresh (zeroed) memory
+    size_t last = end < h->file_pages ? end : h->file_pages;
+    mmap(h->pages + first*h->pagesize, (last - first)*h->pagesize, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  madvise(h->pages + first*h->pagesize, (end - first)*h->pagesize, MADV_DONTNEED);
+  for(size_t i = first; i < end; i++) {
+    h->released_bitmap[i/64] |= 1UL << (i%64);
+  }
 }
 
 /**
- * Validates a threshold argument for h_init.
+ * Updates the in use bit of a page.
  *
- * \param gc_threshold  The threshold.
- * \return              True if the threshold argument is valid,
- *                      false otherwise.
- * \see h_init
- * \see valid_bytes
+ * \param h      the heap
+ * \param index  index of the page
+ * \param used   the new value of the bit
  */
+void h_page_set_used(heap_t *h, size_t index, bool used)
+{
+  uint64_t bit = 1UL << (index%64);
+  if(used) {
+    __atomic_fetch_or(&h->page_bitmap[index/64], bit, __ATOMIC_RELAXED);
+  }
+  else {
+    __atomic_fetch_and(&h->page_bitmap[index/64], ~bit, __ATOMIC_RELEASE);
+  }
+}
+
+bool valid_bytes(size_t bytes, size_t pagesize, size_t header_size)
+{
+  return (pagesize & (pagesize - 1)) == 0 &&
+    pagesize >= H_MIN_PAGESIZE && pagesize <= H_MAX_PAGESIZE &&
+    bytes >= 2*pagesize + header_size;
+}
+
 bool valid_threshold (float gc_threshold)
 {
   return gc_threshold > 0 && gc_threshold < 1;
@@ -146,7 +570,23 @@ bool valid_threshold (float gc_threshold)
 void h_delete(heap_t *h)
 {
   assert(h != NULL && "Heap is NULL");
-  free(h);
+  gc_parallel_free(h);
+  h_thread_free(h);
+  gc_roots_free(h);
+  h_large_free_all(h);
+  if(h->grey != NULL) {
+    munmap(h->grey, h->grey_capacity*sizeof(void *));
+  }
+  o_layout_cache_free(h);
+  h_profile_free(h);
+  pthread_mutex_destroy(&h->layout_lock);
+  pthread_mutex_destroy(&h->thread_lock);
+  pthread_cond_destroy(&h->thread_cond);
+  pthread_mutex_destroy(&h->grey_lock);
+  pthread_mutex_destroy(&h->large_lock);
+  pthread_mutex_destroy(&h->commit_lock);
+  pthread_mutex_destroy(&h->root_slot_lock);
+  munmap(h, (size_t)(h->pages - (char *)h) + h->total_pages*h->pagesize);
 }
 
 void h_delete_dbg(heap_t *h, void *dbg_value)
@@ -156,11 +596,20 @@ void h_delete_dbg(heap_t *h, void *dbg_value)
 }
 
 
-bool address_within_pages(heap_t *h, void *addr){
-	return true;
+bool address_within_pages(heap_t *h, void *addr)
+{
+  uintptr_t offset = (uintptr_t)addr - (uintptr_t)h->pages;
+  size_t index = offset >> h->page_shift;
+  if(index >= h->total_pages || !h_page_in_use(h, index)) {
+    return false;
+  }
+  size_t distance = offset & (h->pagesize - 1);
+  page_t *page = (page_t *)((char *)addr - distance);
+  size_t front = __atomic_load_n(&page->distance_front, __ATOMIC_RELAXED);
+  return distance >= PAGE_HEADER_SIZE && distance < front;
 }
 
-bool address_inside_heap_memory(heap_t *h, void *addr) {
-	return true;
+bool address_inside_heap_memory(heap_t *h, void *addr)
+{
+  return ((uintptr_t)addr & h->region_mask) == (uintptr_t)h;
 }
-
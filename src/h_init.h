@@ -1,10 +1,641 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include "h_init.c"
+#include <pthread.h>
+
+#include "gc.h"
+#include "object.h"
+
 #ifndef h_init_h
 #define h_init_h
 
+#ifndef WORDSIZE
+#define WORDSIZE sizeof(void *)
+#endif
+
+/**
+ * \def PAGESIZE
+ * The default size (in bytes) of a heap's pages, see h_options_t.
+ */
+#ifndef PAGESIZE
+#define PAGESIZE 2048
+#endif
+
+/**
+ * \def H_MIN_PAGESIZE
+ * The smallest page size, which fits a page header and a few cards.
+ */
+#define H_MIN_PAGESIZE 256
+
+/**
+ * \def H_MAX_PAGESIZE
+ * The largest page size, as offsets inside pages are 32 bits.
+ */
+#define H_MAX_PAGESIZE ((size_t)1 << 30)
+
+/**
+ * \def H_HUGE_PAGESIZE
+ * The size of the system's huge pages backing a heap created with
+ * huge_pages.
+ */
+#define H_HUGE_PAGESIZE ((size_t)2 << 20)
+
+#ifndef MAX_HEADER_SIZE
+#define MAX_HEADER_SIZE 1024
+#endif
+
+/**
+ * \def H_ALIGN_WORD(n)
+ * Rounds \a n up to the closest multiple of WORDSIZE.
+ */
+#define H_ALIGN_WORD(n) (((n) + (WORDSIZE - 1)) & ~(WORDSIZE - 1))
+
+/**
+ * \def H_MAX_AGE
+ * The highest page age, and so the highest tenure age.
+ */
+#define H_MAX_AGE 15
+
+/**
+ * \def H_CARD_SHIFT
+ * Log2 of the size (in bytes) of the cards the write barrier marks.
+ */
+#define H_CARD_SHIFT 7
+
+/**
+ * \def H_SIZE_CLASSES
+ * The amount of size classes. Chunk sizes from O_SMALLEST_SIZE to
+ * O_LARGEST_SIZE are rounded up to a class, two per power of 2.
+ */
+#define H_SIZE_CLASSES 21
+
+/**
+ * \def H_MIXED_CLASS
+ * The pseudo class of pages holding chunks of any size, used for
+ * the chunks larger than a heap's largest size class.
+ */
+#define H_MIXED_CLASS H_SIZE_CLASSES
+
+/**
+ * \def H_CLASS_SIZE(c)
+ * The chunk size (in bytes, header included) of size class \a c:
+ * 16, 24, 32, 48, 64, 96, ... for an O_SMALLEST_SIZE of 16.
+ */
+#define H_CLASS_SIZE(c) ((c) == 0 ? (size_t)O_SMALLEST_SIZE : \
+  ((c) % 2 ? 3*(size_t)O_SMALLEST_SIZE/2 : 2*(size_t)O_SMALLEST_SIZE) << (((c) - 1)/2))
+
+_Static_assert(H_CLASS_SIZE(H_SIZE_CLASSES - 1) == O_LARGEST_SIZE,
+               "H_SIZE_CLASSES does not match O_SMALLEST_SIZE and O_LARGEST_SIZE");
+
+/**
+ * A datatype representing one page in the heap.
+ *
+ * new_space       Indicates that the page is part of to-space
+ *                 during a garbage collection.
+ *
+ * promoted        Indicates whether unsafe pointers were
+ *                 found to be pointing toward the page. All the
+ *                 objects of a promoted page stay in place.
+ *
+ * pinned          Set during a copying collection if unsafe
+ *                 pointers point to objects in the page, whose
+ *                 pin bits (see h_page_marks) are set. Only those
+ *                 objects stay in place, the others are evacuated.
+ *
+ * age             The number of collections the objects in the
+ *                 page have survived, 0 for nursery pages. Pages
+ *                 of the heap's tenure_age (or older) are old.
+ *
+ * size_class      The size class of the page's chunks, or
+ *                 H_MIXED_CLASS.
+ *
+ * cycle           The incremental collection cycle the page was
+ *                 handed out in. Pages of the running cycle only
+ *                 hold objects allocated after its snapshot.
+ *
+ * chunk_size      Size (in bytes) of every chunk in the page, 0
+ *                 in mixed pages, where chunks are as large as
+ *                 their objects.
+ *
+ * free            Offset of the first hole (the chunk of a dead
+ *                 object) in the page, 0 when none. Holes are
+ *                 linked through their first word after the
+ *                 header, see h_alloc_hole. During a compaction,
+ *                 the slot (chunk index) in target the first live
+ *                 object of the page slides to instead.
+ *
+ * start           The front of the page when an allocator took it
+ *                 up to bump-allocate into: what lies between it
+ *                 and the front has been allocated since, and is
+ *                 counted when the page is retired (see
+ *                 h_alloc_retire).
+ *
+ * next            Links the page into the collector's to-space
+ *                 and promoted page lists, and into the lists of
+ *                 pages with room between collections. During a
+ *                 compaction, links the pages of one size class and
+ *                 age in address order.
+ *
+ * target          During a compaction, the page the first live
+ *                 object of the page slides to, NULL when the page
+ *                 is not compacted (see gc_compact.h).
+ *
+ * distance_front  Distance (in bytes) from the beginning of
+ *                 the page header to the front of the page.
+ *                 Must be <= pagesize - sizeof(page header)
+ *
+ * limit           Where bump allocation stops, so that the
+ *                 allocation crossing it takes the slow path: the
+ *                 next sample point of the allocation profiler (see
+ *                 h_profile.h), pagesize when not sampling.
+ *
+ */
+struct page {
+  bool new_space;
+  bool promoted;
+  bool pinned;
+  unsigned char age;
+  unsigned char size_class;
+  unsigned cycle;
+  uint32_t chunk_size;
+  uint32_t free;
+  uint32_t start;
+  struct page *next;
+  struct page *target;
+  size_t distance_front;
+  size_t limit;
+};
+
+typedef struct page page_t;
+
+/**
+ * \def H_BITMAP_WORDS(n)
+ * The amount of 64 bit words needed for a bitmap of \a n bits.
+ */
+#define H_BITMAP_WORDS(n) (((n) + 63)/64)
+
+/**
+ * \def PAGE_HEADER_SIZE
+ * The size (in bytes) of the header at the start of every page.
+ * Objects are allocated directly after the header.
+ */
+#define PAGE_HEADER_SIZE H_ALIGN_WORD(sizeof(page_t))
+
+/**
+ * Where the survivors of one age are copied during a collection.
+ *
+ * page         The page survivors are copied into (full_page
+ *              when none).
+ *
+ * scan_page    The to-space page being scanned (NULL when
+ *              none). Later pages are linked through next.
+ *
+ * scan_offset  Offset of the next object to scan in scan_page.
+ */
+struct h_space {
+  struct page *page;
+  struct page *scan_page;
+  size_t scan_offset;
+};
+
+typedef struct h_space h_space_t;
+
+/**
+ * A thread registered with a heap.
+ *
+ * heap          The heap the thread is registered with.
+ *
+ * pages         The thread's allocation buffers: the page of
+ *               each size class it bump-allocates into without
+ *               synchronisation (full_page when none). A full
+ *               page is retired by simply dropping it.
+ *
+ * active        Set while a thread owns the record. Records of
+ *               unregistered threads are reused by later ones.
+ *
+ * stack_bottom  The highest address of the thread's stack.
+ *
+ * stack_top     The lowest address of the thread's stack in use
+ *               while it is parked, NULL while it runs.
+ *
+ * frames        The top of the thread's shadow stack (its
+ *               h_frames), see H_PUSH_ROOTS.
+ *
+ * next          Links all records of the heap.
+ *
+ * thread_next   Links the records of one thread, which may be
+ *               registered with several heaps.
+ */
+struct h_thread {
+  struct heap *heap;
+  struct page *pages[H_SIZE_CLASSES + 1];
+  bool active;
+  void *stack_bottom;
+  void *stack_top;
+  h_frame_t **frames;
+  struct h_thread *next;
+  struct h_thread *thread_next;
+};
+
+typedef struct h_thread h_thread_t;
+
+/**
+ * The part of a stack in use, scanned for roots.
+ *
+ * top     The lowest address in use.
+ *
+ * bottom  The highest address of the stack.
+ */
+struct h_stack {
+  void *top;
+  void *bottom;
+};
+
+typedef struct h_stack h_stack_t;
+
+/**
+ * A root found on a stack.
+ *
+ * value  The pointer stored in the root.
+ *
+ * slot   Where the root is stored.
+ */
+struct h_root {
+  void *value;
+  void **slot;
+};
+
+typedef struct h_root h_root_t;
+
+/**
+ * The adaptive sizing policy of a heap, see h_policy.h. Unused
+ * (the heap sizes itself by its gc_threshold) while neither target
+ * is set.
+ *
+ * gc_overhead    Target share of time spent collecting, 0 for
+ *                none.
+ *
+ * heap_pages     Target size of the heap (pages and large objects)
+ *                in pages, 0 for none.
+ *
+ * trigger_pages  Used pages (large objects included) at which the
+ *                next full collection runs.
+ *
+ * last_ns        When the last collection (or step) ended, 0 before
+ *                the targets are set.
+ *
+ * mutator_ns     Time spent outside of collections since the last
+ *                full collection started.
+ *
+ * gc_ns          Time spent collecting since the last full
+ *                collection started, its own pause, minor ones and
+ *                steps included.
+ *
+ * allocated      Bytes allocated when the last full collection
+ *                ended.
+ *
+ * cycle_bytes    Bytes in use when the running incremental cycle
+ *                started.
+ *
+ * alloc_rate     Bytes allocated per ns of mutator time.
+ *
+ * cycle_ns       Time spent collecting per full collection.
+ *
+ * survival       Share of the bytes in use that survive a full
+ *                collection.
+ *
+ * samples        Full collections measured.
+ *
+ * The last three are averaged over recent full collections.
+ */
+struct h_policy {
+  float gc_overhead;
+  size_t heap_pages;
+  size_t trigger_pages;
+  uint64_t last_ns;
+  uint64_t mutator_ns;
+  uint64_t gc_ns;
+  uint64_t allocated;
+  size_t cycle_bytes;
+  double alloc_rate;
+  double cycle_ns;
+  double survival;
+  size_t samples;
+};
+
+typedef struct h_policy h_policy_t;
+
+/**
+ * The datatype holding all the heap data
+ *
+ * gc_threshold  The percentage of the heap that has to be
+ *               used to trigger a garbage collection cycle.
+ *
+ * bytes         The size the heap was created with.
+ *
+ * options       The settings the heap was created with, zeroed
+ *               for h_init. Kept for h_snapshot_save.
+ *
+ * pagesize      The size (in bytes) of each page in the heap.
+ *
+ * page_shift    Log2 of pagesize.
+ *
+ * unsafe_stack  Whether to consider stack pointers to the
+ *               heap as unsafe (or safe).
+ *
+ * region_mask   Mask that maps any address inside the heap to
+ *               the heap's address. The heap is aligned to its
+ *               own size, rounded up to a power of 2.
+ *
+ * pages         Address of the first page. Pages are aligned
+ *               to pagesize.
+ *
+ * total_pages   Amount of pages in the heap. Only the first
+ *               committed_pages of them are accessible.
+ *
+ * committed_pages Amount of pages committed (readable and
+ *               writable). total_pages unless the heap is
+ *               growable. Only grows, under commit_lock.
+ *
+ * limit_pages   Amount of pages the heap may use (together with
+ *               its large objects), its current size: the pages
+ *               gc_threshold is a share of. At most
+ *               committed_pages. Changed under commit_lock, or
+ *               while the world is stopped.
+ *
+ * min_pages     The initial size of the heap, below which it
+ *               does not shrink. total_pages unless the heap is
+ *               growable.
+ *
+ * used_pages    Amount of pages handed out to the allocator.
+ *               Updated atomically, as threads take pages
+ *               concurrently.
+ *
+ * next_page     Index where the search for a free page starts.
+ *               Only a hint, updated without synchronisation.
+ *
+ * page_bitmap   One bit per page, set if the page is in use
+ *               (handed out to the allocator).
+ *
+ * commit_unit   Pages committed and released together: as many as
+ *               make up a page of the system (a huge page when
+ *               the heap is backed by them), at least one.
+ *
+ * released_bitmap One bit per page, set if the page is free and
+ *               its memory has been returned to the system.
+ *
+ * release       What collections do with the memory of free
+ *               pages.
+ *
+ * file_pages    The first pages, mapped privately from a snapshot
+ *               file (see h_snapshot_load), 0 for none. Their
+ *               memory is replaced rather than dropped when
+ *               released, as dropping it reads the file again.
+ *
+ * commit_lock   Serialises growing the heap.
+ *
+ * size_classes  The amount of size classes in use: those of at
+ *               most O_LARGEST_SIZE of which a page holds two
+ *               chunks or more. Larger chunks go to mixed pages.
+ *
+ * current       The pages of each size class currently
+ *               bump-allocated into by threads that are not
+ *               registered. Point to full_page when there is no
+ *               such page.
+ *
+ * partial       Per size class, young pages with room (holes or
+ *               a free tail) that survived a collection, linked
+ *               through next. Only pushed while the world is
+ *               stopped, and popped by allocating threads.
+ *
+ * full_page     A page header that is always full, so that the
+ *               allocation fast path needs no NULL-check.
+ *
+ * to_space      Destinations of survivors during a garbage
+ *               collection, one per age they are copied at and
+ *               size class.
+ *
+ * promoted      Promoted pages that have not been scanned yet.
+ *
+ * tenure_age    Age at which pages become old, 0 when the heap
+ *               is not generational.
+ *
+ * minor         Set during a minor collection, which leaves the
+ *               old pages alone.
+ *
+ * to_space_full Set when a copying collection ran out of free
+ *               pages, and kept survivors in their pages instead.
+ *
+ * survivor_pages Pages in use after the last full collection, how
+ *               many the survivors of the next one are expected to
+ *               take (see gc_compact_needed).
+ *
+ * live_pages    Pages in use after the last full collection, large
+ *               objects included, which the static trigger stays
+ *               above (see h_alloc_needs_gc).
+ *
+ * cards         One byte per card of every page, set by the
+ *               write barrier. NULL when not generational.
+ *
+ * nursery_pages Nursery pages handed out since the last
+ *               collection.
+ *
+ * nursery_limit Nursery pages that trigger a minor collection.
+ *
+ * mark_bits     One bit per word of every page, set for the
+ *               objects (at their header) marked by an
+ *               incremental collection. The pin bits of copying
+ *               collections, and the mark bits of compactions.
+ *
+ * gc_phase      What the incremental collection is doing, see
+ *               gc_incremental.h.
+ *
+ * gc_cycle      Number of the current (or last) incremental
+ *               collection cycle.
+ *
+ * grey          Marked objects whose fields have not been marked
+ *               yet, grey_count of them in room for grey_capacity.
+ *               Also the mark stack of compactions.
+ *
+ * grey_overflow Set when the grey stack could not grow, and marked
+ *               objects were left out of it (see
+ *               gc_incremental_rescan).
+ *
+ * sweep_next    Index of the next page to sweep.
+ *
+ * step_ns       Time budget of the incremental steps run by the
+ *               allocator, 0 when it does not run any.
+ *
+ * threads       The records of registered threads, pushed with
+ *               a CAS and only freed with the heap.
+ *
+ * running       Registered threads that are not parked.
+ *
+ * stop          Set while a collector stops the world. Polled
+ *               by h_safepoint.
+ *
+ * thread_lock   Protects running, stop and the stacks array.
+ *
+ * thread_cond   Signalled when a thread parks or unregisters,
+ *               and when the world resumes.
+ *
+ * grey_lock     Serialises pushes on the grey stack by write
+ *               barriers of several threads.
+ *
+ * n_threads     Amount of thread records in threads.
+ *
+ * stacks        The stacks scanned by a collection, room for
+ *               n_threads + 1 (the collecting thread's) of them.
+ *
+ * roots         The roots found by a collection, root_count of
+ *               them in room for root_capacity. Initially in
+ *               the heap's metadata, mapped separately (never
+ *               with malloc) once that is too small. Reused by
+ *               every collection.
+ *
+ * roots_mapped  Whether roots has been mapped separately.
+ *
+ * root_slots    The roots registered with h_add_root,
+ *               root_slot_count of them in room for
+ *               root_slot_capacity.
+ *
+ * root_slot_lock Serialises registering roots, and collections
+ *               reading them.
+ *
+ * precise_roots Whether stacks are left unscanned, see
+ *               h_options_t.
+ *
+ * large         The large objects (see h_large.h), sorted by
+ *               address, large_count of them in room for
+ *               large_capacity.
+ *
+ * large_low     The lowest address of the large objects' chunks.
+ *
+ * large_high    The address after the highest large object's
+ *               chunk.
+ *
+ * large_mask    The smallest aligned block of addresses spanning
+ * large_base    large_low to large_high: addresses that masked
+ *               with large_mask equal large_base. Never matches
+ *               when there are no large objects.
+ *
+ * large_pages   The amount of pages the large objects count as.
+ *               Updated atomically.
+ *
+ * large_bytes   The total size of the large objects' chunks.
+ *               Updated atomically.
+ *
+ * large_lock    Serialises adding large objects.
+ *
+ * large_grey    Marked large objects not scanned yet by a
+ *               (serial) collection.
+ *
+ * layouts       The compiled format string cache, see
+ *               o_layout_intern. Read without locking.
+ *
+ * layout_count  Amount of compiled format strings in the cache.
+ *
+ * layout_lock   Serialises adding format strings to the cache.
+ *
+ * layout_serial Tells the cache apart from those of other heaps,
+ *               including deleted ones at the same address, see
+ *               o_layout_of.
+ *
+ * gc_pool       The worker threads of the parallel collector,
+ *               NULL when collecting on the calling thread only.
+ *
+ * stats         The statistics of the heap, see gc_stats.h. Its
+ *               bytes_allocated counts the bytes of retired pages
+ *               (see h_alloc_retire), of objects put into holes and
+ *               of large objects, updated atomically.
+ *
+ * policy        The adaptive sizing policy.
+ *
+ * profile       The sampling allocation profiler, NULL until it is
+ *               started (see h_profile.h).
+ */
+struct heap {
+  float gc_threshold;
+  size_t bytes;
+  h_options_t options;
+  size_t pagesize;
+  size_t page_shift;
+  bool unsafe_stack;
+  uintptr_t region_mask;
+  char *pages;
+  size_t total_pages;
+  size_t committed_pages;
+  size_t limit_pages;
+  size_t min_pages;
+  size_t commit_unit;
+  size_t used_pages;
+  size_t next_page;
+  uint64_t *page_bitmap;
+  uint64_t *released_bitmap;
+  h_release_t release;
+  size_t file_pages;
+  pthread_mutex_t commit_lock;
+  size_t size_classes;
+  page_t *current[H_SIZE_CLASSES + 1];
+  page_t *partial[H_SIZE_CLASSES];
+  page_t full_page;
+  h_space_t to_space[H_MAX_AGE + 1][H_SIZE_CLASSES + 1];
+  page_t *promoted;
+  unsigned tenure_age;
+  bool minor;
+  bool to_space_full;
+  size_t survivor_pages;
+  size_t live_pages;
+  unsigned char *cards;
+  size_t nursery_pages;
+  size_t nursery_limit;
+  uint64_t *mark_bits;
+  int gc_phase;
+  unsigned gc_cycle;
+  void **grey;
+  size_t grey_count;
+  size_t grey_capacity;
+  bool grey_overflow;
+  size_t sweep_next;
+  uint64_t step_ns;
+  h_thread_t *threads;
+  size_t running;
+  bool stop;
+  pthread_mutex_t thread_lock;
+  pthread_cond_t thread_cond;
+  pthread_mutex_t grey_lock;
+  size_t n_threads;
+  h_stack_t *stacks;
+  h_root_t *roots;
+  size_t root_count;
+  size_t root_capacity;
+  bool roots_mapped;
+  void ***root_slots;
+  size_t root_slot_count;
+  size_t root_slot_capacity;
+  pthread_mutex_t root_slot_lock;
+  bool precise_roots;
+  struct h_large **large;
+  size_t large_count;
+  size_t large_capacity;
+  uintptr_t large_low;
+  uintptr_t large_high;
+  uintptr_t large_mask;
+  uintptr_t large_base;
+  size_t large_pages;
+  size_t large_bytes;
+  pthread_mutex_t large_lock;
+  struct h_large *large_grey;
+  struct o_layout_table *layouts;
+  size_t layout_count;
+  pthread_mutex_t layout_lock;
+  uint64_t layout_serial;
+  struct gc_pool *gc_pool;
+  gc_stats_t stats;
+  h_policy_t policy;
+  struct h_profile *profile;
+};
+
 /**
  * The opaque data type holding all the heap data
  */
@@ -24,6 +655,68 @@ typedef struct heap heap_t;
  */
 heap_t *h_init(size_t bytes, bool unsafe_stack, float gc_threshold);
 
+/**
+ * Create a new heap like h_init, with additional settings.
+ *
+ * \param bytes         the total size of the heap in bytes
+ * \param unsafe_stack  true if pointers on the stack are to be considered unsafe pointers
+ * \param gc_threshold  the memory pressure at which gc should be triggered (1.0 = full memory)
+ * \param opts          the settings, NULL for the defaults
+ * \return              the new heap, NULL if it could not be created
+ * \see h_options_t
+ */
+heap_t *h_init_opt(size_t bytes, bool unsafe_stack, float gc_threshold, const h_options_t *opts);
+
+/**
+ * Create a new heap like h_init_opt, at a given address if that
+ * part of the address space is free.
+ *
+ * \param bytes         the total size of the heap in bytes
+ * \param unsafe_stack  true if pointers on the stack are to be considered unsafe pointers
+ * \param gc_threshold  the memory pressure at which gc should be triggered (1.0 = full memory)
+ * \param opts          the settings, NULL for the defaults
+ * \param addr          where the heap should start, NULL for anywhere
+ * \return              the new heap, NULL if it could not be created
+ */
+heap_t *h_init_at(size_t bytes, bool unsafe_stack, float gc_threshold, const h_options_t *opts, void *addr);
+
+/**
+ * Validates the size arguments for h_init: the page size must be a
+ * power of 2 from H_MIN_PAGESIZE to H_MAX_PAGESIZE, and the heap
+ * must hold at least two pages.
+ *
+ * \param bytes        The amount of bytes.
+ * \param pagesize     The size of the heap's pages.
+ * \param header_size  The expected size of the heaps header.
+ * \return             True if the size arguments are valid,
+ *                     false otherwise.
+ * \see h_init
+ * \see valid_threshold
+ */
+bool valid_bytes(size_t bytes, size_t pagesize, size_t header_size);
+
+/**
+ * Validates a threshold argument for h_init.
+ *
+ * \param gc_threshold  The threshold.
+ * \return              True if the threshold argument is valid,
+ *                      false otherwise.
+ * \see h_init
+ * \see valid_bytes
+ */
+bool valid_threshold(float gc_threshold);
+
+/**
+ * Checks the settings of a heap, as h_init_at asserts them: for
+ * settings that do not come from the program, such as a snapshot's.
+ *
+ * \param bytes         the total size of the heap in bytes
+ * \param gc_threshold  the memory pressure at which gc should be triggered
+ * \param opts          the settings, NULL for the defaults
+ * \return              true if a heap can be created with them
+ */
+bool h_init_valid(size_t bytes, float gc_threshold, const h_options_t *opts);
+
 /**
  *
  * Delete a heap.
@@ -35,22 +728,140 @@ void h_delete(heap_t *h);
 /**
  * Delete a heap and trace, killing off stack pointers.
  *
- * \param h          the heap 
+ * \param h          the heap
  * \param dbg_value  a value to be written into every pointer into h on the stack
  * \see   h_delete
  */
 void h_delete_dbg(heap_t *h, void *dbg_value);
 
+/**
+ * Returns the page with index \a i.
+ *
+ * \param h  the heap
+ * \param i  index of the page, must be < h->total_pages
+ * \return   the page header
+ */
+page_t *h_page(heap_t *h, size_t i);
+
+/**
+ * Checks the in use bit of a page.
+ *
+ * \param h      the heap
+ * \param index  index of the page, must be < h->total_pages
+ * \return       true if the page is handed out to the allocator
+ */
+static inline bool h_page_in_use(heap_t *h, size_t index)
+{
+  // Atomic, as parallel collector threads read it while pages are taken
+  uint64_t word = __atomic_load_n(&h->page_bitmap[index/64], __ATOMIC_RELAXED);
+  return (word >> (index%64)) & 1;
+}
+
+/**
+ * Hands out a free (and zeroed) page to the allocator. Lock-free:
+ * the page is claimed by setting its in use bit with a CAS, so
+ * threads may take pages concurrently. A growable heap grows when
+ * it uses all the pages it may.
+ *
+ * \param h           the heap
+ * \param size_class  the size class of the page's chunks, or
+ *                    H_MIXED_CLASS
+ * \return            a page marked as used, or NULL if all pages
+ *                    are used (or taken up by large objects)
+ * \see h_page_release
+ */
+page_t *h_page_take(heap_t *h, size_t size_class);
+
+/**
+ * Returns a used page to the heap, zeroing its memory so that
+ * later allocations in it need no clearing. The in use bit is
+ * cleared last, so a thread taking the page sees it zeroed.
+ *
+ * \param h     the heap
+ * \param page  a used page
+ * \see h_page_take
+ */
+void h_page_release(heap_t *h, page_t *page);
+
+/**
+ * Grows a growable heap so that it may use at least \a pages
+ * pages, committing more of them when needed. Grows by half its
+ * size or more at a time. Thread safe.
+ *
+ * \param h      the heap
+ * \param pages  the amount of pages needed
+ * \return       false if the heap cannot grow that large
+ */
+bool h_pages_grow(heap_t *h, size_t pages);
+
+/**
+ * Adjusts the pages of a heap after a collection. A growable heap
+ * is resized to leave room for allocating as much as survived
+ * before it reaches its gc_threshold again, or as its adaptive
+ * policy says when it has targets (see h_policy.h); only full
+ * collections shrink it. The memory of free pages is then returned
+ * to the system as the heap's release policy says. Only called
+ * while the world is stopped.
+ *
+ * \param h     the heap
+ * \param full  true after a full collection
+ */
+void h_pages_adjust(heap_t *h, bool full);
+
+/**
+ * Checks if a page is old, i.e. left alone by minor collections.
+ *
+ * \param h     the heap
+ * \param page  a used page
+ * \return      true if the heap is generational and the page old
+ */
+static inline bool h_page_is_old(heap_t *h, page_t *page)
+{
+  return h->tenure_age > 0 && page->age >= h->tenure_age;
+}
+
+/**
+ * Returns the cards of a page.
+ *
+ * \param h     a generational heap
+ * \param page  a page
+ * \return      the first of the page's pagesize >> H_CARD_SHIFT cards
+ */
+static inline unsigned char *h_page_cards(heap_t *h, page_t *page)
+{
+  size_t index = ((char *)page - h->pages) >> h->page_shift;
+  return h->cards + (index << (h->page_shift - H_CARD_SHIFT));
+}
+
+/**
+ * \def H_MARK_WORDS(pagesize)
+ * The amount of 64 bit words of mark bits per page.
+ */
+#define H_MARK_WORDS(pagesize) H_BITMAP_WORDS((pagesize)/WORDSIZE)
+
+/**
+ * Returns the mark bits of a page.
+ *
+ * \param h     the heap
+ * \param page  a page
+ * \return      the first of the page's H_MARK_WORDS words
+ */
+static inline uint64_t *h_page_marks(heap_t *h, page_t *page)
+{
+  size_t index = ((char *)page - h->pages) >> h->page_shift;
+  return h->mark_bits + index*H_MARK_WORDS(h->pagesize);
+}
+
 /**
  * Checks if an address points to somewhere in a heap's
  * in page-area.
  *
  * This doesn't check if the pointer is in an actually
  * *used* memory area, and is thus meant to be used for
- * quick checks of stack pointers.
+ * quick checks of stack pointers. It is a single
+ * mask-and-compare, which also accepts addresses in the
+ * heap's metadata.
  *
- * a page's *used* memory area.
- * 
  * \param h     A heap with pages.
  *
  * \param addr  An address.
@@ -65,9 +876,10 @@ bool address_inside_heap_memory(heap_t *h, void *addr);
 
 /**
  * Checks if an address points to somewhere in a heap's
- * *used* memory area. This is a more exact, but slower
+ * *used* memory area, i.e. inside a page in use and below
+ * its distance_front. This is a more exact, but slower
  * way of checking if an address points to a heap.
- * 
+ *
  * \param h     A heap with pages.
  *
  * \param addr  An address.
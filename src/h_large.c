@@ -0,0 +1,178 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, must be defined before includes
+
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "h_large.h"
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Recomputes the block of addresses the stack scan checks for
+ *  pointers to large objects, from large_low and large_high.
+ *
+ *  \param   h  the heap
+ */
+void h_large_update_block(heap_t *h);
+
+/**
+ *  Returns the index of the first large object at or above an
+ *  address.
+ *
+ *  \param   h     the heap
+ *  \param   addr  the address
+ *  \return  the index, large_count if there is none
+ */
+size_t h_large_search(heap_t *h, uintptr_t addr);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+size_t h_large_pages(heap_t *h, size_t size)
+{
+  return (H_LARGE_HEADER_SIZE + size + h->pagesize - 1)/h->pagesize;
+}
+
+void h_large_update_block(heap_t *h)
+{
+  if(h->large_count == 0) {
+    h->large_mask = 0;
+    h->large_base = 1;
+    return;
+  }
+  uintptr_t differ = h->large_low ^ (h->large_high - 1);
+  size_t bits = differ == 0 ? 0 : 64 - __builtin_clzl(differ);
+  h->large_mask = bits == 64 ? 0 : ~(((uintptr_t)1 << bits) - 1);
+  h->large_base = h->large_low & h->large_mask;
+}
+
+size_t h_large_search(heap_t *h, uintptr_t addr)
+{
+  size_t low = 0;
+  size_t high = h->large_count;
+  while(low < high) {
+    size_t middle = low + (high - low)/2;
+    if((uintptr_t)h->large[middle] < addr) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+void *h_large_alloc(heap_t *h, size_t size, intptr_t header)
+{
+  size_t pages = h_large_pages(h, size);
+  size_t used = __atomic_load_n(&h->used_pages, __ATOMIC_RELAXED) +
+    __atomic_load_n(&h->large_pages, __ATOMIC_RELAXED);
+  // A growable heap grows to fit the object
+  if(used + pages > __atomic_load_n(&h->limit_pages, __ATOMIC_RELAXED) &&
+     !h_pages_grow(h, used + pages)) {
+    return NULL;
+  }
+  size_t system_page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t bytes = O_ALIGN(H_LARGE_HEADER_SIZE + size, system_page);
+  // Fresh mappings are zeroed
+  h_large_t *large = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(large == MAP_FAILED) {
+    return NULL;
+  }
+  large->bytes = bytes;
+  large->chunk_size = size;
+  large->cycle = h->gc_cycle;
+
+  pthread_mutex_lock(&h->large_lock);
+  if(h->large_count == h->large_capacity) {
+    // Collections must not allocate, so the array is grown here
+    size_t capacity = h->large_capacity ? 2*h->large_capacity : 16;
+    h_large_t **grown = realloc(h->large, capacity*sizeof(h_large_t *));
+    if(grown == NULL) {
+      pthread_mutex_unlock(&h->large_lock);
+      munmap(large, bytes);
+      return NULL;
+    }
+    h->large = grown;
+    h->large_capacity = capacity;
+  }
+  size_t index = h_large_search(h, (uintptr_t)large);
+  memmove(h->large + index + 1, h->large + index, (h->large_count - index)*sizeof(h_large_t *));
+  h->large[index] = large;
+  uintptr_t low = (uintptr_t)large + H_LARGE_HEADER_SIZE;
+  uintptr_t high = low + size;
+  if(h->large_count == 0 || low < h->large_low) {
+    h->large_low = low;
+  }
+  if(h->large_count == 0 || high > h->large_high) {
+    h->large_high = high;
+  }
+  h->large_count++;
+  h_large_update_block(h);
+  pthread_mutex_unlock(&h->large_lock);
+
+  __atomic_fetch_add(&h->large_pages, pages, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->large_bytes, size, __ATOMIC_RELAXED);
+  intptr_t *chunk = (intptr_t *)((char *)large + H_LARGE_HEADER_SIZE);
+  *chunk = header;
+  return chunk + 1;
+}
+
+h_large_t *h_large_find(heap_t *h, void *addr)
+{
+  uintptr_t address = (uintptr_t)addr;
+  if(address - h->large_low >= h->large_high - h->large_low) {
+    return NULL;
+  }
+  // The last object starting at or below the address
+  size_t index = h_large_search(h, address + 1);
+  if(index == 0) {
+    return NULL;
+  }
+  h_large_t *large = h->large[index - 1];
+  uintptr_t chunk = (uintptr_t)large + H_LARGE_HEADER_SIZE;
+  return address >= chunk && address < chunk + large->chunk_size ? large : NULL;
+}
+
+size_t h_large_free(heap_t *h, size_t index)
+{
+  h_large_t *large = h->large[index];
+  size_t size = large->chunk_size;
+  __atomic_fetch_sub(&h->large_pages, h_large_pages(h, size), __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&h->large_bytes, size, __ATOMIC_RELAXED);
+  munmap(large, large->bytes);
+  h->large[index] = NULL;
+  return size;
+}
+
+void h_large_compact(heap_t *h)
+{
+  size_t kept = 0;
+  for(size_t i = 0; i < h->large_count; i++) {
+    if(h->large[i] != NULL) {
+      h->large[kept++] = h->large[i];
+    }
+  }
+  h->large_count = kept;
+  if(kept > 0) {
+    h_large_t *last = h->large[kept - 1];
+    h->large_low = (uintptr_t)h->large[0] + H_LARGE_HEADER_SIZE;
+    h->large_high = (uintptr_t)last + H_LARGE_HEADER_SIZE + last->chunk_size;
+  }
+  else {
+    h->large_low = h->large_high = 0;
+  }
+  h_large_update_block(h);
+}
+
+void h_large_free_all(heap_t *h)
+{
+  for(size_t i = 0; i < h->large_count; i++) {
+    munmap(h->large[i], h->large[i]->bytes);
+  }
+  free(h->large);
+  h->large = NULL;
+  h->large_count = 0;
+  h->large_capacity = 0;
+}
@@ -0,0 +1,151 @@
+/**
+ *   \file h_large.h
+ *   \brief The large object space
+ *
+ *   Objects too large for a page get a page-aligned mapping (mmap) of
+ *   their own, holding a small header followed by the object's chunk.
+ *   They are never moved: collections mark them in place, scan the
+ *   marked ones like any other object, and unmap the dead ones.
+ *
+ *   The heap keeps its large objects in an array sorted by address,
+ *   so that a pointer (even an ambiguous one, into the middle of an
+ *   object) is mapped to its large object by binary search. The stack
+ *   scan checks the smallest aligned block of addresses spanning all
+ *   large objects alongside the heap's own region.
+ *
+ *   Large objects count against the size of the heap: together with
+ *   the used pages they never exceed the heap's size (a growable heap
+ *   grows to fit them), and they count towards its
+ *   gc_threshold.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __h_large__
+#define __h_large__
+
+/**
+ * The header of a large object, at the start of its mapping.
+ *
+ * bytes       Size of the mapping.
+ *
+ * chunk_size  Size of the object's chunk, which directly follows
+ *             the header.
+ *
+ * age         The number of collections the object has survived,
+ *             like the age of a page.
+ *
+ * marked      Set when a collection finds the object reachable.
+ *
+ * dirty       Set by the write barrier, the card of an old large
+ *             object.
+ *
+ * cycle       The incremental collection cycle the object was
+ *             allocated in.
+ *
+ * next        Links the marked objects a collection has not
+ *             scanned yet.
+ */
+struct h_large {
+  size_t bytes;
+  size_t chunk_size;
+  unsigned char age;
+  bool marked;
+  bool dirty;
+  unsigned cycle;
+  struct h_large *next;
+};
+
+typedef struct h_large h_large_t;
+
+/**
+ * \def H_LARGE_HEADER_SIZE
+ * The size (in bytes) of the header in front of a large object's
+ * chunk.
+ */
+#define H_LARGE_HEADER_SIZE H_ALIGN_WORD(sizeof(h_large_t))
+
+/**
+ *  Returns the amount of the heap's pages a large object counts as.
+ *
+ *  \param   h     the heap
+ *  \param   size  size of the object's chunk
+ *  \return  the amount of pages
+ */
+size_t h_large_pages(heap_t *h, size_t size);
+
+/**
+ *  Allocates a large object in a mapping of its own.
+ *
+ *  \param   h       the heap
+ *  \param   size    size of the object's chunk, header included
+ *  \param   header  header to store in front of the object
+ *  \return  the newly allocated (zeroed) object, NULL if out of
+ *           memory or if the object does not fit in the heap
+ */
+void *h_large_alloc(heap_t *h, size_t size, intptr_t header);
+
+/**
+ *  Finds the large object an address points into. Must not run
+ *  concurrently with h_large_alloc, i.e. only while the world is
+ *  stopped or with large_lock held.
+ *
+ *  \param   h     the heap
+ *  \param   addr  an address
+ *  \return  the large object whose chunk addr points into, NULL if
+ *           there is none
+ */
+h_large_t *h_large_find(heap_t *h, void *addr);
+
+/**
+ *  Returns the large object of an object pointer.
+ *
+ *  \param   obj  an object in the large object space
+ *  \return  its header
+ */
+static inline h_large_t *h_large_of(void *obj)
+{
+  return (h_large_t *)((char *)o_get_chunk(obj) - H_LARGE_HEADER_SIZE);
+}
+
+/**
+ *  Returns the object of a large object.
+ *
+ *  \param   large  the large object
+ *  \return  the object pointer
+ */
+static inline void *h_large_object(h_large_t *large)
+{
+  return o_chunk_object((char *)large + H_LARGE_HEADER_SIZE);
+}
+
+/**
+ *  Unmaps a dead large object, leaving a NULL in its place in the
+ *  heap's array until h_large_compact. Only called by a collector.
+ *
+ *  \param   h      the heap
+ *  \param   index  index of the object in the heap's array
+ *  \return  the size of the object's chunk
+ */
+size_t h_large_free(heap_t *h, size_t index);
+
+/**
+ *  Drops the freed objects from the heap's array, and recomputes the
+ *  block of addresses spanning the remaining ones.
+ *
+ *  \param   h  the heap
+ */
+void h_large_compact(heap_t *h);
+
+/**
+ *  Unmaps all large objects of a heap being deleted.
+ *
+ *  \param   h  the heap
+ */
+void h_large_free_all(heap_t *h);
+
+#endif
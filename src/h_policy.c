@@ -0,0 +1,154 @@
+#include <assert.h>
+
+#include "h_policy.h"
+#include "gc_stats.h"
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns the pages a full collection triggered at \a trigger needs
+ *  for its survivors, besides the pages in use.
+ *
+ *  \param   h        the heap
+ *  \param   trigger  the trigger, in pages
+ *  \return  the copy reserve, in pages
+ */
+size_t h_policy_reserve(heap_t *h, size_t trigger);
+
+/**
+ *  Returns the highest trigger of which the pages in use and the copy
+ *  reserve fit in a heap of a given size.
+ *
+ *  \param   h      the heap
+ *  \param   pages  the size of the heap, in pages
+ *  \return  the trigger, in pages
+ */
+size_t h_policy_fit(heap_t *h, size_t pages);
+
+/**
+ *  Blends a new sample into an average.
+ *
+ *  \param   average  the average
+ *  \param   sample   the sample
+ *  \param   first    true if there is no average yet
+ *  \return  the new average
+ */
+double h_policy_blend(double average, double sample, bool first);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+void h_policy_set_targets(heap_t *h, float gc_overhead, size_t heap_bytes)
+{
+  assert(gc_overhead >= 0 && gc_overhead < 1);
+  h_policy_t *policy = &h->policy;
+  bool adaptive = h_policy_adaptive(h);
+  policy->gc_overhead = gc_overhead;
+  policy->heap_pages = heap_bytes/h->pagesize;
+  if(adaptive || !h_policy_adaptive(h)) {
+    return;
+  }
+  // Measured from here on, starting out like the static threshold
+  policy->trigger_pages = (size_t)(h->gc_threshold*(float)h->limit_pages);
+  policy->last_ns = gc_stats_now();
+  policy->mutator_ns = 0;
+  policy->gc_ns = 0;
+  policy->samples = 0;
+  gc_stats_t stats;
+  gc_stats_read(h, &stats);
+  policy->allocated = stats.bytes_allocated;
+}
+
+void h_policy_pause(heap_t *h, uint64_t start, uint64_t end)
+{
+  h_policy_t *policy = &h->policy;
+  if(policy->last_ns == 0) {
+    return;
+  }
+  policy->mutator_ns += start > policy->last_ns ? start - policy->last_ns : 0;
+  policy->gc_ns += end > start ? end - start : 0;
+  policy->last_ns = end;
+}
+
+double h_policy_blend(double average, double sample, bool first)
+{
+  return first ? sample : H_POLICY_WEIGHT*sample + (1 - H_POLICY_WEIGHT)*average;
+}
+
+void h_policy_cycle(heap_t *h, uint64_t start, size_t before, size_t after)
+{
+  h_policy_t *policy = &h->policy;
+  if(policy->last_ns == 0) {
+    return;
+  }
+  // The period ends where this collection started
+  h_policy_pause(h, start, start);
+  gc_stats_t stats;
+  gc_stats_read(h, &stats);
+  uint64_t allocated = stats.bytes_allocated;
+  if(policy->mutator_ns > 0 && allocated > policy->allocated) {
+    double rate = (double)(allocated - policy->allocated)/(double)policy->mutator_ns;
+    policy->alloc_rate = h_policy_blend(policy->alloc_rate, rate, policy->alloc_rate == 0);
+  }
+  // The first period has no full collection in it yet
+  if(policy->samples > 0) {
+    policy->cycle_ns = h_policy_blend(policy->cycle_ns, (double)policy->gc_ns, policy->samples == 1);
+  }
+  double survival = before > 0 ? (double)after/(double)before : 1;
+  survival = survival < 1 ? survival : 1;
+  policy->survival = h_policy_blend(policy->survival, survival, policy->samples == 0);
+  policy->samples++;
+  policy->allocated = allocated;
+  policy->mutator_ns = 0;
+  policy->gc_ns = 0;
+}
+
+size_t h_policy_reserve(heap_t *h, size_t trigger)
+{
+  // Until measured, survivors may take as many pages as they had
+  double survival = h->policy.samples > 0 ? h->policy.survival : 1;
+  return (size_t)(survival*(double)trigger) + H_MIXED_CLASS + 1;
+}
+
+size_t h_policy_fit(heap_t *h, size_t pages)
+{
+  double survival = h->policy.samples > 0 ? h->policy.survival : 1;
+  size_t margin = H_MIXED_CLASS + 1;
+  return pages > margin ? (size_t)((double)(pages - margin)/(1 + survival)) : 0;
+}
+
+size_t h_policy_limit(heap_t *h, size_t used, bool full)
+{
+  h_policy_t *policy = &h->policy;
+  size_t trigger = policy->trigger_pages;
+  if(full) {
+    trigger = SIZE_MAX;
+    if(policy->gc_overhead > 0 && policy->cycle_ns > 0 && policy->alloc_rate > 0) {
+      // The mutator time that makes collecting take the target share
+      double mutator_ns = policy->cycle_ns*(1 - policy->gc_overhead)/policy->gc_overhead;
+      double room = policy->alloc_rate*mutator_ns/(double)h->pagesize;
+      trigger = room < (double)(h->total_pages - used) ? used + (size_t)room : h->total_pages;
+    }
+    if(policy->heap_pages > 0) {
+      size_t fit = h_policy_fit(h, policy->heap_pages);
+      trigger = fit < trigger ? fit : trigger;
+    }
+    if(trigger == SIZE_MAX) {
+      // Nothing measured yet
+      trigger = (size_t)(h->gc_threshold*(float)h->limit_pages);
+    }
+    // Room for every size class to get a page, and a quarter of the
+    // live data, so a target below it does not collect all the time
+    size_t least = used + used/4 + H_MIXED_CLASS + 1;
+    trigger = trigger > least ? trigger : least;
+  }
+
+  size_t limit = trigger + h_policy_reserve(h, trigger);
+  limit = limit > h->min_pages ? limit : h->min_pages;
+  limit = limit < h->total_pages ? limit : h->total_pages;
+  // A heap that cannot get larger caps the trigger to fit
+  size_t fit = h_policy_fit(h, limit);
+  trigger = trigger < fit ? trigger : fit;
+  trigger = trigger > used ? trigger : used + 1;
+  __atomic_store_n(&policy->trigger_pages, trigger, __ATOMIC_RELAXED);
+  return limit;
+}
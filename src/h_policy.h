@@ -0,0 +1,114 @@
+/**
+ *   \file h_policy.h
+ *   \brief Adaptive collection trigger and heap sizing
+ *
+ *   By default a heap collects when its used pages reach its
+ *   gc_threshold, a fixed share of its size. Once targets are set
+ *   (h_set_targets), the trigger and the size of the heap follow
+ *   what recent collections measured instead:
+ *
+ *   - the allocation rate, bytes allocated per unit of time spent
+ *     outside of collections,
+ *   - the time spent collecting per full collection (the minor
+ *     collections and incremental steps after it included),
+ *   - the survival rate, the share of the bytes in use that survive
+ *     a full collection.
+ *
+ *   Each is averaged over recent full collections (and incremental
+ *   cycles), weighing the last one by H_POLICY_WEIGHT.
+ *
+ *   A GC overhead target o leaves room to allocate for as long as
+ *   the mutator should run per collection, so that collecting takes
+ *   a share o of the time: cycle_ns*(1 - o)/o, at the allocation
+ *   rate. A heap size target caps the trigger so that the pages in
+ *   use, plus the copy reserve a collection needs for the survivors
+ *   (the survival rate times the trigger, and a partly filled page
+ *   per size class), fit the target. With both, the lower trigger
+ *   wins, but it always leaves room for a quarter of the live data:
+ *   a target below the live data is exceeded rather than have the
+ *   heap do nothing but collect. A growable heap is then sized to
+ *   hold the trigger and its copy reserve; a heap of a fixed size
+ *   caps the trigger to fit.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __h_policy__
+#define __h_policy__
+
+/**
+ * \def H_POLICY_WEIGHT
+ * The weight of the last full collection in the averages of the
+ * policy.
+ */
+#define H_POLICY_WEIGHT 0.5
+
+/**
+ *  Checks if a heap sizes itself by targets rather than by its
+ *  gc_threshold.
+ *
+ *  \param   h  the heap
+ *  \return  true if a target is set
+ */
+static inline bool h_policy_adaptive(heap_t *h)
+{
+  return h->policy.gc_overhead > 0 || h->policy.heap_pages > 0;
+}
+
+/**
+ *  Sets the targets of a heap, see h_set_targets. The trigger starts
+ *  out at the heap's gc_threshold, until a full collection has been
+ *  measured.
+ *
+ *  \param   h            the heap
+ *  \param   gc_overhead  target share of time spent collecting, 0
+ *                        for none
+ *  \param   heap_bytes   target size of the heap, 0 for none
+ */
+void h_policy_set_targets(heap_t *h, float gc_overhead, size_t heap_bytes);
+
+/**
+ *  Records a collection (or incremental step): the mutator time
+ *  before it and its own time. Only called while the world is
+ *  stopped.
+ *
+ *  \param   h      the heap
+ *  \param   start  when it started (gc_stats_now)
+ *  \param   end    when it ended
+ */
+void h_policy_pause(heap_t *h, uint64_t start, uint64_t end);
+
+/**
+ *  Updates the averages at the end of a full collection or an
+ *  incremental cycle, before its own pause is recorded: a period
+ *  runs from the start of one full collection to the start of the
+ *  next, the pause of the first included. Only called while the
+ *  world is stopped.
+ *
+ *  \param   h       the heap
+ *  \param   start   when the collection (or the step ending the
+ *                   cycle) started
+ *  \param   before  bytes in use before it
+ *  \param   after   bytes in use after it
+ */
+void h_policy_cycle(heap_t *h, uint64_t start, size_t before, size_t after);
+
+/**
+ *  Picks the trigger of the next full collection, after a full one,
+ *  and returns the size the heap needs for it and its copy reserve.
+ *  After a minor collection the trigger stays. Only called while
+ *  the world is stopped, for a heap with targets.
+ *
+ *  \param   h     the heap
+ *  \param   used  used pages, large objects included
+ *  \param   full  true after a full collection
+ *  \return  the size in pages, between the heap's initial and total
+ *           size
+ */
+size_t h_policy_limit(heap_t *h, size_t used, bool full);
+
+#endif
@@ -0,0 +1,455 @@
+#include <assert.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc.h"
+#include "h_profile.h"
+#include "h_alloc.h"
+#include "h_thread.h"
+#include "o_layout.h"
+#include "object.h"
+
+/**
+ *  \def H_PROFILE_BUCKETS
+ *  Amount of buckets of the table of sites, a power of two.
+ */
+#define H_PROFILE_BUCKETS 1024
+
+/**
+ *  \def H_PROFILE_INNER
+ *  The most frames of the allocator itself on top of a sample's
+ *  stack, which are dropped.
+ */
+#define H_PROFILE_INNER 8
+
+/**
+ *  What was allocated, the last frame of a site's stack.
+ */
+enum h_profile_kind {
+  H_PROFILE_STRUCT,  ///< a struct, with a format string
+  H_PROFILE_ARRAY,   ///< an array, with the format string of an element
+  H_PROFILE_UNION,   ///< a union
+  H_PROFILE_DATA     ///< raw data
+};
+
+/**
+ *  The samples of one call stack and type.
+ *
+ *  next       Links the sites of a bucket.
+ *  hash       Hash of the stack and type.
+ *  layout     The compiled layout, NULL for unions and data.
+ *  kind       An h_profile_kind.
+ *  depth      Amount of frames.
+ *  frames     Return addresses, the allocating function first.
+ *  samples    Amount of sampled objects.
+ *  survivors  How many of them survived a collection.
+ *  allocated  Estimated bytes allocated.
+ *  survived   Estimated bytes that survived a collection.
+ *  live       Estimated bytes still live.
+ */
+typedef struct h_profile_site {
+  struct h_profile_site *next;
+  uint64_t hash;
+  o_layout_t *layout;
+  int kind;
+  size_t depth;
+  void *frames[H_PROFILE_DEPTH];
+  uint64_t samples;
+  uint64_t survivors;
+  uint64_t allocated;
+  uint64_t survived;
+  uint64_t live;
+} h_profile_site_t;
+
+/**
+ *  A sampled object that is still live.
+ *
+ *  obj       The object.
+ *  site      Its site.
+ *  bytes     The bytes it stands for.
+ *  survived  Set once it has survived a collection.
+ */
+typedef struct h_profile_sample {
+  void *obj;
+  h_profile_site_t *site;
+  uint64_t bytes;
+  bool survived;
+} h_profile_sample_t;
+
+/**
+ *  The profiler of a heap.
+ *
+ *  rate             Mean amount of bytes between samples, 0 while
+ *                   stopped.
+ *  lock             Serialises taking samples, with other threads
+ *                   and with writing them.
+ *  sites            The table of sites.
+ *  samples          The live sampled objects.
+ *  sample_count     Amount of live sampled objects.
+ *  sample_capacity  Room in samples.
+ */
+struct h_profile {
+  size_t rate;
+  pthread_mutex_t lock;
+  h_profile_site_t *sites[H_PROFILE_BUCKETS];
+  h_profile_sample_t *samples;
+  size_t sample_count;
+  size_t sample_capacity;
+};
+
+typedef struct h_profile h_profile_t;
+
+/**
+ *  State of the calling thread's random number generator, seeded
+ *  on first use.
+ */
+static __thread uint64_t h_profile_state;
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns a random distance to the next sample point.
+ *
+ *  \param   rate  the mean distance
+ *  \return  an exponentially distributed distance, in bytes
+ */
+size_t h_profile_distance(size_t rate);
+
+/**
+ *  Counts the sample points that fall in an amount of bytes.
+ *
+ *  \param   rate   the mean distance between points
+ *  \param   bytes  the bytes
+ *  \return  the amount of points, Poisson distributed
+ */
+size_t h_profile_points(size_t rate, size_t bytes);
+
+/**
+ *  Records a sampled object.
+ *
+ *  \param   h       the heap
+ *  \param   obj     the object
+ *  \param   header  header it was allocated with
+ *  \param   layout  its compiled layout, NULL if none
+ *  \param   caller  the first frame of its stack
+ *  \param   points  amount of sample points in its chunk
+ */
+void h_profile_sample(heap_t *h, void *obj, intptr_t header, o_layout_t *layout,
+                      void *caller, size_t points);
+
+/**
+ *  Finds the site of a stack and type, adding it if there is none.
+ *
+ *  \param   profile  the profiler
+ *  \param   frames   the stack
+ *  \param   depth    amount of frames
+ *  \param   layout   the compiled layout, NULL if none
+ *  \param   kind     the h_profile_kind
+ *  \return  the site, NULL if out of memory
+ */
+h_profile_site_t *h_profile_site(h_profile_t *profile, void **frames, size_t depth,
+                                 o_layout_t *layout, int kind);
+
+/**
+ *  Returns the bytes of a site a metric counts.
+ *
+ *  \param   site    the site
+ *  \param   metric  the metric
+ *  \return  the bytes
+ */
+uint64_t h_profile_value(h_profile_site_t *site, h_profile_metric_t metric);
+
+/**
+ *  Writes the function a frame is in, as a frame of a folded stack.
+ *
+ *  \param   file    where to write
+ *  \param   symbol  the frame as backtrace_symbols names it
+ *  \param   frame   the return address
+ */
+void h_profile_write_frame(FILE *file, const char *symbol, void *frame);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+size_t h_profile_distance(size_t rate)
+{
+  if(h_profile_state == 0) {
+    h_profile_state = ((uint64_t)(uintptr_t)&h_profile_state ^ (uint64_t)time(NULL)) | 1;
+  }
+  // xorshift64*
+  h_profile_state ^= h_profile_state >> 12;
+  h_profile_state ^= h_profile_state << 25;
+  h_profile_state ^= h_profile_state >> 27;
+  uint64_t random = (h_profile_state*0x2545F4914F6CDD1DUL >> 11) + 1;
+
+  // -ln(u) for u = random/2^53 in (0, 1], with log2 of the mantissa
+  // approximated by a cubic (error below 0.002)
+  int exponent = 63 - __builtin_clzll(random);
+  double f = (double)random/(double)(1UL << exponent) - 1;
+  double log2 = exponent + f*(1.4234853 + f*(-0.5877338 + f*0.1655588));
+  return (size_t)((53 - log2)*0.6931472*(double)rate);
+}
+
+size_t h_profile_points(size_t rate, size_t bytes)
+{
+  size_t points = 0;
+  for(size_t distance = h_profile_distance(rate); distance < bytes;
+      distance += h_profile_distance(rate)) {
+    points++;
+  }
+  return points;
+}
+
+size_t h_profile_limit(heap_t *h, page_t *page)
+{
+  h_profile_t *profile = __atomic_load_n(&h->profile, __ATOMIC_RELAXED);
+  size_t rate = profile != NULL ? __atomic_load_n(&profile->rate, __ATOMIC_RELAXED) : 0;
+  if(rate == 0) {
+    return h->pagesize;
+  }
+  size_t distance = h_profile_distance(rate);
+  return distance < h->pagesize - page->distance_front ? page->distance_front + distance : h->pagesize;
+}
+
+void *h_profile_bump(heap_t *h, page_t *page, size_t bytes, intptr_t header,
+                     struct o_layout *layout, void *caller)
+{
+  size_t point = page->limit;
+  page->limit = h->pagesize;
+  void *obj = h_alloc_fast(h, bytes, header, layout);
+  size_t front = page->distance_front;
+  h_profile_t *profile = __atomic_load_n(&h->profile, __ATOMIC_RELAXED);
+  size_t rate = profile != NULL ? __atomic_load_n(&profile->rate, __ATOMIC_RELAXED) : 0;
+  // A limit left from before the profiler stopped is no sample point
+  if(rate != 0) {
+    h_profile_sample(h, obj, header, layout, caller, 1 + h_profile_points(rate, front - point - 1));
+  }
+  page->limit = h_profile_limit(h, page);
+  return obj;
+}
+
+void h_profile_chunk(heap_t *h, void *obj, size_t size, intptr_t header,
+                     struct o_layout *layout, void *caller)
+{
+  h_profile_t *profile = __atomic_load_n(&h->profile, __ATOMIC_RELAXED);
+  size_t rate = __atomic_load_n(&profile->rate, __ATOMIC_RELAXED);
+  size_t points = rate != 0 ? h_profile_points(rate, size) : 0;
+  if(points > 0) {
+    h_profile_sample(h, obj, header, layout, caller, points);
+  }
+}
+
+h_profile_site_t *h_profile_site(h_profile_t *profile, void **frames, size_t depth,
+                                 o_layout_t *layout, int kind)
+{
+  // FNV-1a over the words
+  uint64_t hash = 0xcbf29ce484222325UL;
+  hash = (hash ^ (uint64_t)(uintptr_t)layout)*0x100000001b3UL;
+  hash = (hash ^ (uint64_t)kind)*0x100000001b3UL;
+  for(size_t i = 0; i < depth; i++) {
+    hash = (hash ^ (uint64_t)(uintptr_t)frames[i])*0x100000001b3UL;
+  }
+  h_profile_site_t **bucket = &profile->sites[hash & (H_PROFILE_BUCKETS - 1)];
+  for(h_profile_site_t *site = *bucket; site != NULL; site = site->next) {
+    if(site->hash == hash && site->layout == layout && site->kind == kind && site->depth == depth &&
+       memcmp(site->frames, frames, depth*sizeof(void *)) == 0) {
+      return site;
+    }
+  }
+  h_profile_site_t *site = calloc(1, sizeof(h_profile_site_t));
+  if(site == NULL) {
+    return NULL;
+  }
+  site->hash = hash;
+  site->layout = layout;
+  site->kind = kind;
+  site->depth = depth;
+  memcpy(site->frames, frames, depth*sizeof(void *));
+  site->next = *bucket;
+  *bucket = site;
+  return site;
+}
+
+void h_profile_sample(heap_t *h, void *obj, intptr_t header, o_layout_t *layout,
+                      void *caller, size_t points)
+{
+  // The allocator's own frames are dropped, up to the function that
+  // called it. Unwinding takes no lock of the profiler.
+  void *frames[H_PROFILE_INNER + H_PROFILE_DEPTH];
+  int n = backtrace(frames, H_PROFILE_INNER + H_PROFILE_DEPTH);
+  int first = 0;
+  while(first < n && first < H_PROFILE_INNER && frames[first] != caller) {
+    first++;
+  }
+  if(first == n || first == H_PROFILE_INNER) {
+    first = 0;
+  }
+  size_t depth = (size_t)(n - first) < H_PROFILE_DEPTH ? (size_t)(n - first) : H_PROFILE_DEPTH;
+
+  // Unions and arrays are allocated with the prefix in front of their
+  // header, their header is set after
+  int kind = layout != NULL ? H_PROFILE_STRUCT : H_PROFILE_DATA;
+  if(O_HEADER_GET_TYPE(header) == 1) {
+    intptr_t compact_type = O_HEADER_GET_DATA(header) & O_MASK_COMPACT_TYPE;
+    if(compact_type == O_COMPACT_UNION || compact_type == O_COMPACT_ARRAY) {
+      kind = compact_type == O_COMPACT_UNION ? H_PROFILE_UNION : H_PROFILE_ARRAY;
+      obj = (intptr_t *)obj + 1;
+    }
+  }
+
+  h_profile_t *profile = h->profile;
+  uint64_t bytes = (uint64_t)points*profile->rate;
+  pthread_mutex_lock(&profile->lock);
+  h_profile_site_t *site = h_profile_site(profile, frames + first, depth, layout, kind);
+  if(site != NULL && profile->sample_count == profile->sample_capacity) {
+    size_t capacity = profile->sample_capacity ? 2*profile->sample_capacity : 256;
+    h_profile_sample_t *samples = realloc(profile->samples, capacity*sizeof(h_profile_sample_t));
+    if(samples != NULL) {
+      profile->samples = samples;
+      profile->sample_capacity = capacity;
+    }
+  }
+  // Out of memory, the sample is lost
+  if(site != NULL && profile->sample_count < profile->sample_capacity) {
+    site->samples++;
+    site->allocated += bytes;
+    site->live += bytes;
+    profile->samples[profile->sample_count++] = (h_profile_sample_t){ obj, site, bytes, false };
+  }
+  pthread_mutex_unlock(&profile->lock);
+}
+
+void h_profile_survivors(heap_t *h, h_profile_survivor_f survivor)
+{
+  h_profile_t *profile = h->profile;
+  if(profile == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&profile->lock);
+  size_t kept = 0;
+  for(size_t i = 0; i < profile->sample_count; i++) {
+    h_profile_sample_t sample = profile->samples[i];
+    void *moved = survivor(h, sample.obj);
+    if(moved == NULL) {
+      sample.site->live -= sample.bytes;
+      continue;
+    }
+    if(!sample.survived) {
+      sample.survived = true;
+      sample.site->survivors++;
+      sample.site->survived += sample.bytes;
+    }
+    sample.obj = moved;
+    profile->samples[kept++] = sample;
+  }
+  profile->sample_count = kept;
+  pthread_mutex_unlock(&profile->lock);
+}
+
+bool h_profile_start(heap_t *h, size_t rate)
+{
+  // Allocating threads read the profiler
+  h_thread_stop(h);
+  if(h->profile == NULL) {
+    h_profile_t *profile = calloc(1, sizeof(h_profile_t));
+    if(profile == NULL) {
+      h_thread_resume(h);
+      return false;
+    }
+    pthread_mutex_init(&profile->lock, NULL);
+    h->profile = profile;
+  }
+  h->profile->rate = rate != 0 ? rate : H_PROFILE_RATE;
+  h_thread_resume(h);
+  return true;
+}
+
+void h_profile_stop(heap_t *h)
+{
+  h_thread_stop(h);
+  if(h->profile != NULL) {
+    h->profile->rate = 0;
+  }
+  h_thread_resume(h);
+}
+
+uint64_t h_profile_value(h_profile_site_t *site, h_profile_metric_t metric)
+{
+  switch(metric) {
+  case H_PROFILE_SURVIVED:
+    return site->survived;
+  case H_PROFILE_LIVE:
+    return site->live;
+  default:
+    return site->allocated;
+  }
+}
+
+void h_profile_write_frame(FILE *file, const char *symbol, void *frame)
+{
+  // "file(function+0x1f) [0x...]", the function may be missing
+  const char *name = symbol != NULL ? strchr(symbol, '(') : NULL;
+  size_t length = name != NULL ? strcspn(++name, "+)") : 0;
+  if(length == 0) {
+    fprintf(file, "%p", frame);
+    return;
+  }
+  fwrite(name, 1, length, file);
+}
+
+bool h_profile_write(heap_t *h, const char *path, h_profile_metric_t metric)
+{
+  h_profile_t *profile = h->profile;
+  FILE *file = fopen(path, "w");
+  if(file == NULL) {
+    return false;
+  }
+  static const char *kinds[] = { "struct", "array", "union", "data" };
+  if(profile != NULL) {
+    pthread_mutex_lock(&profile->lock);
+    for(size_t b = 0; b < H_PROFILE_BUCKETS; b++) {
+      for(h_profile_site_t *site = profile->sites[b]; site != NULL; site = site->next) {
+        uint64_t value = h_profile_value(site, metric);
+        if(value == 0) {
+          continue;
+        }
+        char **symbols = backtrace_symbols(site->frames, (int)site->depth);
+        for(size_t i = site->depth; i > 0; i--) {
+          h_profile_write_frame(file, symbols != NULL ? symbols[i - 1] : NULL, site->frames[i - 1]);
+          fputc(';', file);
+        }
+        free(symbols);
+        fputs(kinds[site->kind], file);
+        if(site->layout != NULL) {
+          fprintf(file, ":%s", site->layout->string);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)value);
+      }
+    }
+    pthread_mutex_unlock(&profile->lock);
+  }
+  bool ok = !ferror(file);
+  return fclose(file) == 0 && ok;
+}
+
+void h_profile_free(heap_t *h)
+{
+  h_profile_t *profile = h->profile;
+  if(profile == NULL) {
+    return;
+  }
+  for(size_t b = 0; b < H_PROFILE_BUCKETS; b++) {
+    h_profile_site_t *site = profile->sites[b];
+    while(site != NULL) {
+      h_profile_site_t *next = site->next;
+      free(site);
+      site = next;
+    }
+  }
+  free(profile->samples);
+  pthread_mutex_destroy(&profile->lock);
+  free(profile);
+  h->profile = NULL;
+}
@@ -0,0 +1,143 @@
+/**
+ *   \file h_profile.h
+ *   \brief Sampling allocation profiler, keyed by call stack and layout
+ *
+ *   Once started (h_profile_start), the profiler samples an
+ *   allocation about every rate bytes, at random: sample points are
+ *   spread over the bytes allocated as a Poisson process, with
+ *   exponentially distributed distances of mean rate between them.
+ *   A sampled allocation stands for rate bytes per sample point it
+ *   contains, which estimates the bytes allocated without bias
+ *   whatever the sizes of the objects.
+ *
+ *   Bump allocation pays nothing for it. A page stops bump
+ *   allocation at its limit, the next sample point, instead of at
+ *   its end (see h_alloc_fast), so the allocation crossing the point
+ *   takes the slow path, which samples it and sets the next limit.
+ *   As the distances are memoryless, a page becoming current draws
+ *   its first point afresh. Objects allocated in holes and large
+ *   objects, which are not bump allocated, count their points
+ *   directly.
+ *
+ *   A sample records the call stack of the allocation (up to
+ *   H_PROFILE_DEPTH frames, from the function that allocated) and
+ *   what was allocated: the format string of a struct or array, or
+ *   a union or data. Samples with the same stack and type add up in
+ *   one site. The sampled objects are weak references: collections
+ *   update them to where the objects move (h_profile_survivors), and
+ *   drop the dead ones, so a site knows how many of its bytes have
+ *   survived a collection and how many are still live.
+ *
+ *   h_profile_write writes the sites as folded stacks, one line per
+ *   site with its frames from the outermost in, separated by
+ *   semicolons, and its bytes, e.g.
+ *
+ *       main;build_tree;h_alloc_struct;o_alloc_struct;struct:**l 1048576
+ *
+ *   which flame graph tools read directly. Functions are named from
+ *   the program's dynamic symbol table, so a program should be
+ *   linked with -rdynamic; other frames are written as addresses.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __h_profile__
+#define __h_profile__
+
+struct o_layout;
+
+/**
+ *  \def H_PROFILE_RATE
+ *  Mean amount of bytes between samples, when h_profile_start is
+ *  given none.
+ */
+#define H_PROFILE_RATE (512*1024)
+
+/**
+ *  \def H_PROFILE_DEPTH
+ *  The most frames of an allocation's call stack a sample keeps.
+ */
+#define H_PROFILE_DEPTH 24
+
+/**
+ *  Returns where an object is after a collection, NULL if it is
+ *  dead.
+ */
+typedef void *(*h_profile_survivor_f)(heap_t *h, void *obj);
+
+/**
+ *  Checks if a heap has a profiler, i.e. if it has been started.
+ *
+ *  \param   h  the heap
+ *  \return  true if allocations outside of bump allocation must be
+ *           passed to h_profile_chunk
+ */
+static inline bool h_profile_on(heap_t *h)
+{
+  return __atomic_load_n(&h->profile, __ATOMIC_RELAXED) != NULL;
+}
+
+/**
+ *  Returns the limit of a page becoming the current page of a size
+ *  class, see page_t.
+ *
+ *  \param   h     the heap
+ *  \param   page  the page
+ *  \return  the next sample point in the page, pagesize if there is
+ *           none before its end
+ */
+size_t h_profile_limit(heap_t *h, page_t *page);
+
+/**
+ *  Allocates an object in a page that stopped short of its end at
+ *  its limit, sampling it, and sets the next limit. Called by
+ *  h_alloc_slow.
+ *
+ *  \param   h       the heap
+ *  \param   page    the current page, with room for the object
+ *  \param   bytes   size of the object (excluding header)
+ *  \param   header  header to store in front of the object
+ *  \param   layout  the object's compiled layout, NULL if none
+ *  \param   caller  where h_alloc_slow was called from, the first
+ *                   frame of the sample's stack
+ *  \return  the newly allocated (zeroed) object
+ */
+void *h_profile_bump(heap_t *h, page_t *page, size_t bytes, intptr_t header,
+                     struct o_layout *layout, void *caller);
+
+/**
+ *  Samples an object that was not bump allocated (a large object or
+ *  one in a hole), if any sample point falls in its chunk.
+ *
+ *  \param   h       the heap
+ *  \param   obj     the object, its header not necessarily set yet
+ *  \param   size    size of its chunk
+ *  \param   header  header it was allocated with
+ *  \param   layout  the object's compiled layout, NULL if none
+ *  \param   caller  where h_alloc_slow was called from
+ */
+void h_profile_chunk(heap_t *h, void *obj, size_t size, intptr_t header,
+                     struct o_layout *layout, void *caller);
+
+/**
+ *  Updates the sampled objects after a collection has found the
+ *  live ones, and before it frees the others. Does nothing if the
+ *  heap has no profiler. Only called while the world is stopped.
+ *
+ *  \param   h         the heap
+ *  \param   survivor  tells where a sampled object is now
+ */
+void h_profile_survivors(heap_t *h, h_profile_survivor_f survivor);
+
+/**
+ *  Frees the profiler of a heap being deleted.
+ *
+ *  \param   h  the heap
+ */
+void h_profile_free(heap_t *h);
+
+#endif
@@ -0,0 +1,647 @@
+#define _GNU_SOURCE // MAP_FIXED, pread, pwrite and dl_iterate_phdr, must be defined before includes
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gc.h"
+#include "h_snapshot.h"
+#include "h_alloc.h"
+#include "h_large.h"
+#include "gc_roots.h"
+#include "o_layout.h"
+#include "object.h"
+
+/**
+ *  State of h_snapshot_module while looking for the module (the
+ *  program or a shared library) the collector's code is in.
+ *
+ *  code  An address in the module.
+ *  hash  The module's identity, once found.
+ */
+typedef struct h_snapshot_module {
+  uintptr_t code;
+  uint64_t hash;
+} h_snapshot_module_t;
+
+/**
+ *  What a snapshot file saves of a layout or a large object, followed
+ *  by its format string (without the terminating null character) or
+ *  its chunk.
+ *
+ *  address  The address of the layout descriptor, or of the chunk.
+ *  size     The length of the format string, or the chunk's size.
+ */
+typedef struct h_snapshot_entry {
+  uintptr_t address;
+  size_t size;
+} h_snapshot_entry_t;
+
+/**
+ *  A snapshot file being written.
+ *
+ *  fd      The file.
+ *  offset  Where the next bytes go.
+ *  ok      Cleared when a write fails.
+ */
+typedef struct h_snapshot_file {
+  int fd;
+  off_t offset;
+  bool ok;
+} h_snapshot_file_t;
+
+/**
+ *  Where something saved in a snapshot is after loading it.
+ *
+ *  old   The address it had.
+ *  new   The address it has.
+ *  size  The size (in bytes) of the range at old.
+ */
+typedef struct h_snapshot_map {
+  uintptr_t old;
+  uintptr_t new;
+  size_t size;
+} h_snapshot_map_t;
+
+/**
+ *  How the objects of a loaded snapshot are relocated.
+ *
+ *  pages       The address of the first page of the saved heap.
+ *  pages_size  The size of the saved heap's pages.
+ *  delta       How far the pages have moved.
+ *  code        How far the program's code has moved.
+ *  layouts     The layouts, n_layouts of them, sorted by old.
+ *  large       The large objects' chunks, n_large of them, sorted
+ *              by old.
+ */
+typedef struct h_snapshot_reloc {
+  uintptr_t pages;
+  size_t pages_size;
+  intptr_t delta;
+  intptr_t code;
+  h_snapshot_map_t *layouts;
+  size_t n_layouts;
+  h_snapshot_map_t *large;
+  size_t n_large;
+} h_snapshot_reloc_t;
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Appends bytes to a snapshot file.
+ *
+ *  \param   file   the file
+ *  \param   bytes  the bytes
+ *  \param   n      amount of bytes
+ */
+void h_snapshot_write(h_snapshot_file_t *file, const void *bytes, size_t n);
+
+/**
+ *  Reads bytes of a snapshot file.
+ *
+ *  \param   fd      the file
+ *  \param   bytes   where the bytes go
+ *  \param   n       amount of bytes
+ *  \param   offset  where the bytes are, advanced past them
+ *  \return  false if the file could not be read (or is too short)
+ */
+bool h_snapshot_read(int fd, void *bytes, size_t n, off_t *offset);
+
+/**
+ *  o_layout_f saving a layout to a snapshot file.
+ *
+ *  \param   layout  the layout
+ *  \param   file    the h_snapshot_file_t
+ */
+void h_snapshot_write_layout(o_layout_t *layout, void *file);
+
+/**
+ *  Records in a snapshot's header which kinds of headers that need
+ *  relocating the objects of a heap have.
+ *
+ *  \param   h       the heap
+ *  \param   header  the snapshot's header
+ */
+void h_snapshot_headers(heap_t *h, h_snapshot_header_t *header);
+
+/**
+ *  Returns an identity of the module the collector is linked into,
+ *  which the custom trace functions of a snapshot are addresses in:
+ *  a hash of its build-id note, or of its code if it has none.
+ *
+ *  \return  the identity, 0 if the module could not be found
+ */
+uint64_t h_snapshot_binary();
+
+/**
+ *  dl_iterate_phdr callback hashing the module that holds an address.
+ *
+ *  \param   info    a module
+ *  \param   size    size of info
+ *  \param   module  the h_snapshot_module_t
+ *  \return  1 once the module is found, to stop iterating
+ */
+int h_snapshot_module(struct dl_phdr_info *info, size_t size, void *module);
+
+/**
+ *  Adds bytes to an FNV-1a hash.
+ *
+ *  \param   hash   the hash so far
+ *  \param   bytes  the bytes
+ *  \param   n      amount of bytes
+ *  \return  the hash
+ */
+uint64_t h_snapshot_hash(uint64_t hash, const unsigned char *bytes, size_t n);
+
+/**
+ *  Checks if a snapshot's header is one this program can load, and
+ *  that what it tells of the heap is consistent: the header comes
+ *  from a file, which may be damaged.
+ *
+ *  \param   header  the header
+ *  \return  true if the snapshot can be loaded
+ */
+bool h_snapshot_valid(h_snapshot_header_t *header);
+
+/**
+ *  Loads the contents of a snapshot file into a new heap, see
+ *  h_snapshot_load.
+ *
+ *  \param   fd      the file
+ *  \param   header  the file's header
+ *  \param   reloc   filled in with the relocation of the objects, its
+ *                   maps must be freed by the caller
+ *  \return  the heap, NULL if it could not be loaded
+ */
+heap_t *h_snapshot_restore(int fd, h_snapshot_header_t *header, h_snapshot_reloc_t *reloc);
+
+/**
+ *  Finds what was saved at an address.
+ *
+ *  \param   map   the map, sorted by old
+ *  \param   n     amount of entries
+ *  \param   addr  an address in the saved heap's program
+ *  \return  the entry whose old range addr is in, NULL if none
+ */
+h_snapshot_map_t *h_snapshot_find(h_snapshot_map_t *map, size_t n, uintptr_t addr);
+
+/**
+ *  Returns where a pointer of the saved heap points to now.
+ *
+ *  \param   reloc  the relocation
+ *  \param   addr   the pointer
+ *  \return  the relocated pointer, addr itself if it points out of
+ *           the heap
+ */
+uintptr_t h_snapshot_address(h_snapshot_reloc_t *reloc, uintptr_t addr);
+
+/**
+ *  Pointer visitor relocating a slot.
+ *
+ *  \param   slot   the slot
+ *  \param   reloc  the h_snapshot_reloc_t
+ */
+void h_snapshot_relocate_slot(void **slot, void *reloc);
+
+/**
+ *  Relocates the header and the pointers of an object. Only what
+ *  changes is written, so pages stay shared with the file where
+ *  nothing moved.
+ *
+ *  \param   h      the loaded heap
+ *  \param   reloc  the relocation
+ *  \param   obj    the object
+ *  \return  false if its layout is not one the snapshot saved
+ */
+bool h_snapshot_relocate_object(heap_t *h, h_snapshot_reloc_t *reloc, void *obj);
+
+/**
+ *  Orders map entries by old, for qsort.
+ *
+ *  \param   a  an entry
+ *  \param   b  another entry
+ *  \return  negative, zero or positive as a is before, at or after b
+ */
+int h_snapshot_compare(const void *a, const void *b);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+void h_snapshot_write(h_snapshot_file_t *file, const void *bytes, size_t n)
+{
+  const char *cursor = bytes;
+  while(file->ok && n > 0) {
+    ssize_t written = pwrite(file->fd, cursor, n, file->offset);
+    if(written <= 0) {
+      file->ok = false;
+      return;
+    }
+    cursor += written;
+    n -= (size_t)written;
+    file->offset += written;
+  }
+}
+
+bool h_snapshot_read(int fd, void *bytes, size_t n, off_t *offset)
+{
+  char *cursor = bytes;
+  while(n > 0) {
+    ssize_t read = pread(fd, cursor, n, *offset);
+    if(read <= 0) {
+      return false;
+    }
+    cursor += read;
+    n -= (size_t)read;
+    *offset += read;
+  }
+  return true;
+}
+
+void h_snapshot_write_layout(o_layout_t *layout, void *file)
+{
+  h_snapshot_entry_t entry = { (uintptr_t)layout, strlen(layout->string) };
+  h_snapshot_write(file, &entry, sizeof(entry));
+  h_snapshot_write(file, layout->string, entry.size);
+}
+
+void h_snapshot_headers(heap_t *h, h_snapshot_header_t *header)
+{
+  for(size_t i = 0; i < h->committed_pages; i++) {
+    if(!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    char *cursor = (char *)page + PAGE_HEADER_SIZE;
+    while(cursor < (char *)page + page->distance_front) {
+      intptr_t type = O_HEADER_GET_TYPE(o_get_header(o_chunk_object(cursor)));
+      header->layout_headers |= type == 0;
+      header->trace_headers |= type == 2;
+      cursor += h_chunk_size(page, cursor);
+    }
+  }
+  for(size_t i = 0; i < h->large_count; i++) {
+    intptr_t type = O_HEADER_GET_TYPE(o_get_header(h_large_object(h->large[i])));
+    header->layout_headers |= type == 0;
+    header->trace_headers |= type == 2;
+  }
+}
+
+uint64_t h_snapshot_hash(uint64_t hash, const unsigned char *bytes, size_t n)
+{
+  for(size_t i = 0; i < n; i++) {
+    hash = (hash ^ bytes[i])*0x100000001b3UL;
+  }
+  return hash;
+}
+
+int h_snapshot_module(struct dl_phdr_info *info, size_t size, void *module)
+{
+  (void)size;
+  h_snapshot_module_t *found = module;
+  bool contains = false;
+  for(size_t i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    contains |= phdr->p_type == PT_LOAD && found->code - start < phdr->p_memsz;
+  }
+  if(!contains) {
+    return 0;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325UL;
+  bool noted = false;
+  for(size_t i = 0; i < info->dlpi_phnum && !noted; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if(phdr->p_type != PT_NOTE) {
+      continue;
+    }
+    const char *note = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+    const char *end = note + phdr->p_memsz;
+    while(note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+      const char *name = note + sizeof(ElfW(Nhdr));
+      const char *desc = name + O_ALIGN((size_t)nhdr->n_namesz, 4);
+      if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+        hash = h_snapshot_hash(hash, (const unsigned char *)desc, nhdr->n_descsz);
+        noted = true;
+        break;
+      }
+      note = desc + O_ALIGN((size_t)nhdr->n_descsz, 4);
+    }
+  }
+  // Linked without a build-id, the code itself tells builds apart
+  for(size_t i = 0; i < info->dlpi_phnum && !noted; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if(phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+      hash = h_snapshot_hash(hash, (const unsigned char *)(info->dlpi_addr + phdr->p_vaddr), phdr->p_filesz);
+    }
+  }
+  found->hash = hash;
+  return 1;
+}
+
+uint64_t h_snapshot_binary()
+{
+  h_snapshot_module_t module = { (uintptr_t)h_snapshot_save, 0 };
+  dl_iterate_phdr(h_snapshot_module, &module);
+  return module.hash;
+}
+
+bool h_snapshot_save(heap_t *h, const char *path, void *root)
+{
+  // Only the live objects are saved, the root among them whatever
+  // roots the heap has
+  if(!gc_roots_register(h, &root)) {
+    return false;
+  }
+  h_gc(h);
+  gc_roots_unregister(h, &root);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    return false;
+  }
+  h_snapshot_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, H_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = H_SNAPSHOT_VERSION;
+  header.word_size = sizeof(void *);
+  header.page_header_size = PAGE_HEADER_SIZE;
+  header.bytes = h->bytes;
+  header.options = h->options;
+  header.unsafe_stack = h->unsafe_stack;
+  header.gc_threshold = h->gc_threshold;
+  header.heap = (uintptr_t)h;
+  header.pages = (uintptr_t)h->pages;
+  header.code = (uintptr_t)h_snapshot_save;
+  header.pagesize = h->pagesize;
+  header.total_pages = h->total_pages;
+  header.committed_pages = h->committed_pages;
+  header.limit_pages = h->limit_pages;
+  header.used_pages = h->used_pages;
+  header.layout_count = h->layout_count;
+  header.large_count = h->large_count;
+  header.root = (uintptr_t)root;
+  h_snapshot_headers(h, &header);
+  if(header.trace_headers) {
+    header.binary = h_snapshot_binary();
+  }
+
+  h_snapshot_file_t file = { fd, sizeof(header), true };
+  h_snapshot_write(&file, h->page_bitmap, H_BITMAP_WORDS(h->committed_pages)*sizeof(uint64_t));
+  o_layout_foreach(h, h_snapshot_write_layout, &file);
+  for(size_t i = 0; i < h->large_count; i++) {
+    h_large_t *large = h->large[i];
+    char *chunk = (char *)large + H_LARGE_HEADER_SIZE;
+    h_snapshot_entry_t entry = { (uintptr_t)chunk, large->chunk_size };
+    h_snapshot_write(&file, &entry, sizeof(entry));
+    h_snapshot_write(&file, chunk, large->chunk_size);
+  }
+
+  // Pages are saved as loading finds them: out of any list, old, and
+  // of no incremental cycle. Past their front they are zeroed, which
+  // the holes left in the file read as.
+  header.pages_offset = O_ALIGN((size_t)file.offset, (size_t)H_SNAPSHOT_ALIGN);
+  for(size_t i = 0; i < h->committed_pages; i++) {
+    if(!h_page_in_use(h, i)) {
+      continue;
+    }
+    page_t *page = h_page(h, i);
+    page_t saved = *page;
+    saved.new_space = false;
+    saved.promoted = false;
+    saved.pinned = false;
+    saved.age = (unsigned char)h->tenure_age;
+    saved.cycle = 0;
+    saved.next = NULL;
+    saved.target = NULL;
+    file.offset = (off_t)(header.pages_offset + i*h->pagesize);
+    h_snapshot_write(&file, &saved, sizeof(saved));
+    h_snapshot_write(&file, (char *)page + sizeof(saved), page->distance_front - sizeof(saved));
+  }
+  file.offset = 0;
+  h_snapshot_write(&file, &header, sizeof(header));
+  bool ok = file.ok && ftruncate(fd, (off_t)(header.pages_offset + h->committed_pages*h->pagesize)) == 0;
+  return close(fd) == 0 && ok;
+}
+
+bool h_snapshot_valid(h_snapshot_header_t *header)
+{
+  return memcmp(header->magic, H_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+    header->version == H_SNAPSHOT_VERSION &&
+    header->word_size == sizeof(void *) &&
+    header->page_header_size == PAGE_HEADER_SIZE &&
+    header->pages_offset % (size_t)sysconf(_SC_PAGESIZE) == 0 &&
+    header->committed_pages <= header->total_pages &&
+    header->used_pages <= header->committed_pages &&
+    header->limit_pages <= header->total_pages &&
+    h_init_valid(header->bytes, header->gc_threshold, &header->options) &&
+    // Custom trace functions are called, so they must be this build's
+    (!header->trace_headers || (header->binary != 0 && header->binary == h_snapshot_binary()));
+}
+
+int h_snapshot_compare(const void *a, const void *b)
+{
+  uintptr_t x = ((const h_snapshot_map_t *)a)->old;
+  uintptr_t y = ((const h_snapshot_map_t *)b)->old;
+  return (x > y) - (x < y);
+}
+
+heap_t *h_snapshot_restore(int fd, h_snapshot_header_t *header, h_snapshot_reloc_t *reloc)
+{
+  // The pages are mapped from the file, which must hold them all
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < header->pages_offset) {
+    return NULL;
+  }
+  // At the saved address if it is free, so the pages need not move
+  heap_t *h = h_init_at(header->bytes, header->unsafe_stack, header->gc_threshold,
+                        &header->options, (void *)header->heap);
+  if(h == NULL) {
+    return NULL;
+  }
+  // The same settings give the same heap, unless the system's page
+  // size differs
+  size_t committed = header->committed_pages;
+  if(h->pagesize != header->pagesize || h->total_pages != header->total_pages ||
+     ((size_t)st.st_size - header->pages_offset)/h->pagesize < committed) {
+    h_delete(h);
+    return NULL;
+  }
+  off_t offset = sizeof(*header);
+  if(!h_snapshot_read(fd, h->page_bitmap, H_BITMAP_WORDS(committed)*sizeof(uint64_t), &offset) ||
+     mmap(h->pages, committed*h->pagesize, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, fd, (off_t)header->pages_offset) == MAP_FAILED) {
+    h_delete(h);
+    return NULL;
+  }
+  h->file_pages = committed;
+  h->committed_pages = committed > h->committed_pages ? committed : h->committed_pages;
+  h->limit_pages = header->limit_pages > h->limit_pages ? header->limit_pages : h->limit_pages;
+  h->used_pages = header->used_pages;
+
+  reloc->pages = header->pages;
+  reloc->pages_size = header->total_pages*header->pagesize;
+  reloc->delta = (intptr_t)((uintptr_t)h->pages - header->pages);
+  reloc->code = (intptr_t)((uintptr_t)h_snapshot_save - header->code);
+  reloc->layouts = calloc(header->layout_count + 1, sizeof(h_snapshot_map_t));
+  reloc->large = calloc(header->large_count + 1, sizeof(h_snapshot_map_t));
+  bool ok = reloc->layouts != NULL && reloc->large != NULL;
+
+  // Layouts are compiled anew, the headers pointing to them are
+  // relocated below
+  for(size_t i = 0; ok && i < header->layout_count; i++) {
+    h_snapshot_entry_t entry;
+    ok = h_snapshot_read(fd, &entry, sizeof(entry), &offset);
+    char *string = ok ? malloc(entry.size + 1) : NULL;
+    ok = string != NULL && h_snapshot_read(fd, string, entry.size, &offset);
+    o_layout_t *layout = NULL;
+    if(ok) {
+      string[entry.size] = '\0';
+      layout = o_layout_intern(h, string);
+      ok = layout != NULL;
+    }
+    free(string);
+    if(ok) {
+      reloc->layouts[reloc->n_layouts++] = (h_snapshot_map_t){ entry.address, (uintptr_t)layout, sizeof(o_layout_t) };
+    }
+  }
+  qsort(reloc->layouts, reloc->n_layouts, sizeof(h_snapshot_map_t), h_snapshot_compare);
+
+  // Large objects were saved in address order
+  for(size_t i = 0; ok && i < header->large_count; i++) {
+    h_snapshot_entry_t entry;
+    ok = h_snapshot_read(fd, &entry, sizeof(entry), &offset);
+    void *obj = ok ? h_large_alloc(h, entry.size, 0) : NULL;
+    ok = obj != NULL && h_snapshot_read(fd, (intptr_t *)obj - 1, entry.size, &offset);
+    if(ok) {
+      h_large_t *large = h_large_of(obj);
+      large->age = (unsigned char)h->tenure_age;
+      reloc->large[reloc->n_large++] = (h_snapshot_map_t){ entry.address, (uintptr_t)large + H_LARGE_HEADER_SIZE, entry.size };
+    }
+  }
+  if(!ok) {
+    h_delete(h);
+    return NULL;
+  }
+  return h;
+}
+
+h_snapshot_map_t *h_snapshot_find(h_snapshot_map_t *map, size_t n, uintptr_t addr)
+{
+  size_t low = 0;
+  size_t high = n;
+  while(low < high) {
+    size_t mid = low + (high - low)/2;
+    if(map[mid].old + map[mid].size <= addr) {
+      low = mid + 1;
+    }
+    else {
+      high = mid;
+    }
+  }
+  return low < n && addr - map[low].old < map[low].size ? &map[low] : NULL;
+}
+
+uintptr_t h_snapshot_address(h_snapshot_reloc_t *reloc, uintptr_t addr)
+{
+  if(addr - reloc->pages < reloc->pages_size) {
+    return addr + (uintptr_t)reloc->delta;
+  }
+  h_snapshot_map_t *large = h_snapshot_find(reloc->large, reloc->n_large, addr);
+  return large != NULL ? addr - large->old + large->new : addr;
+}
+
+void h_snapshot_relocate_slot(void **slot, void *reloc)
+{
+  void *moved = (void *)h_snapshot_address(reloc, (uintptr_t)*slot);
+  if(moved != *slot) {
+    *slot = moved;
+  }
+}
+
+bool h_snapshot_relocate_object(heap_t *h, h_snapshot_reloc_t *reloc, void *obj)
+{
+  intptr_t *slot = (intptr_t *)obj - 1;
+  intptr_t header = *slot;
+  if(O_HEADER_GET_TYPE(header) == 0) {
+    h_snapshot_map_t *layout = h_snapshot_find(reloc->layouts, reloc->n_layouts,
+                                               (uintptr_t)O_HEADER_GET_LAYOUT(header));
+    if(layout == NULL) {
+      return false;
+    }
+    header = (header & (intptr_t)(O_MASK_TYPE | O_ARRAY_BIT)) | (intptr_t)layout->new;
+  }
+  else if(O_HEADER_GET_TYPE(header) == 2) {
+    intptr_t trace = O_HEADER_GET_DATA(header) + reloc->code;
+    header = O_HEADER_SET_DATA(header, trace);
+  }
+  if(header != *slot) {
+    *slot = header;
+  }
+  o_foreach_pointer(h, obj, h_snapshot_relocate_slot, reloc);
+  return true;
+}
+
+heap_t *h_snapshot_load(const char *path, void **root)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return NULL;
+  }
+  h_snapshot_header_t header;
+  off_t offset = 0;
+  h_snapshot_reloc_t reloc;
+  memset(&reloc, 0, sizeof(reloc));
+  heap_t *h = NULL;
+  if(h_snapshot_read(fd, &header, sizeof(header), &offset) && h_snapshot_valid(&header)) {
+    h = h_snapshot_restore(fd, &header, &reloc);
+  }
+  // The mapping of the pages keeps the file open
+  close(fd);
+  if(h == NULL) {
+    free(reloc.layouts);
+    free(reloc.large);
+    return NULL;
+  }
+
+  // Nothing to do when no address the objects hold has changed
+  bool ok = true;
+  if(reloc.delta != 0 || reloc.n_large > 0 || header.layout_headers ||
+     (header.trace_headers && reloc.code != 0)) {
+    for(size_t i = 0; ok && i < h->committed_pages; i++) {
+      if(!h_page_in_use(h, i)) {
+        continue;
+      }
+      page_t *page = h_page(h, i);
+      char *cursor = (char *)page + PAGE_HEADER_SIZE;
+      while(cursor < (char *)page + page->distance_front) {
+        if(!h_chunk_is_hole(page, cursor) && !h_snapshot_relocate_object(h, &reloc, o_chunk_object(cursor))) {
+          ok = false;
+          break;
+        }
+        // Sized once the header is relocated
+        cursor += h_chunk_size(page, cursor);
+      }
+    }
+    for(size_t i = 0; ok && i < h->large_count; i++) {
+      ok = h_snapshot_relocate_object(h, &reloc, h_large_object(h->large[i]));
+    }
+  }
+  if(!ok) {
+    free(reloc.layouts);
+    free(reloc.large);
+    h_delete(h);
+    return NULL;
+  }
+  if(root != NULL) {
+    *root = (void *)h_snapshot_address(&reloc, header.root);
+  }
+  free(reloc.layouts);
+  free(reloc.large);
+  return h;
+}
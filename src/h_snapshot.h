@@ -0,0 +1,149 @@
+/**
+ *   \file h_snapshot.h
+ *   \brief Saving a heap to a file, and loading it back
+ *
+ *   A snapshot file holds, in order:
+ *
+ *   1. a header with the heap's settings and addresses,
+ *   2. the page table, the bitmap of the pages in use,
+ *   3. the format strings of the heap's compiled layouts, each with
+ *      the address its descriptor had,
+ *   4. the large objects, each with the address its chunk had,
+ *   5. from an offset aligned to H_SNAPSHOT_ALIGN, the committed
+ *      pages as they are in memory. Free pages are left out, as holes
+ *      in the file that read as zeroes.
+ *
+ *   Loading creates a heap with the same settings, at the address the
+ *   saved one had if that is free, and maps the pages of the file over
+ *   its own: a private (copy-on-write) mapping, so a page is only read
+ *   when it is touched. When anything has moved, one pass over the
+ *   objects then relocates
+ *
+ *   - pointers into the pages, if the heap is at another address,
+ *   - pointers into large objects, which are copied into mappings of
+ *     their own,
+ *   - the compiled layout pointers in the headers of objects (00),
+ *   - custom trace functions (10), if the program is loaded at
+ *     another address.
+ *
+ *   A snapshot of objects with compact headers only, loaded at the
+ *   address it was saved from, needs no relocation at all. Pointers
+ *   out of the heap are kept as they are. Custom trace functions are
+ *   addresses in the program's code, so a snapshot with unions can only
+ *   be loaded by the program that saved it: its header then holds the
+ *   build-id of the program (or a hash of its code, without one), and
+ *   other builds reject it.
+ *
+ *   The pages and large objects of a snapshot are loaded old, on a
+ *   generational heap, so minor collections leave them alone.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __h_snapshot__
+#define __h_snapshot__
+
+/**
+ *  \def H_SNAPSHOT_ALIGN
+ *  Alignment (in bytes) of the pages in a snapshot file, at least
+ *  the system's page size, so the pages can be mapped.
+ */
+#define H_SNAPSHOT_ALIGN (64*1024)
+
+/**
+ *  \def H_SNAPSHOT_VERSION
+ *  Version of the snapshot file format.
+ */
+#define H_SNAPSHOT_VERSION 2
+
+/**
+ *  \def H_SNAPSHOT_MAGIC
+ *  The first bytes of a snapshot file.
+ */
+#define H_SNAPSHOT_MAGIC "HSNAPSHT"
+
+/**
+ *  The header of a snapshot file.
+ *
+ *  magic             H_SNAPSHOT_MAGIC.
+ *  version           H_SNAPSHOT_VERSION.
+ *  word_size         sizeof(void *) of the program that saved it.
+ *  page_header_size  PAGE_HEADER_SIZE of the program that saved it.
+ *  bytes             The size the heap was created with.
+ *  options           The settings the heap was created with.
+ *  unsafe_stack      The heap's unsafe_stack.
+ *  gc_threshold      The heap's gc_threshold.
+ *  heap              The address of the heap.
+ *  pages             The address of its first page.
+ *  code              The address of h_snapshot_save, to tell how
+ *                    far the program's code has moved.
+ *  pagesize          The heap's pagesize.
+ *  total_pages       The heap's total_pages.
+ *  committed_pages   The heap's committed_pages, the pages saved.
+ *  limit_pages       The heap's limit_pages.
+ *  used_pages        The heap's used_pages.
+ *  layout_count      Amount of compiled layouts saved.
+ *  large_count       Amount of large objects saved.
+ *  pages_offset      Offset of the pages in the file.
+ *  layout_headers    Set if an object has a compiled layout header
+ *                    (00).
+ *  trace_headers     Set if an object has a custom trace function
+ *                    header (10).
+ *  binary            Identifies the program that saved it, if
+ *                    trace_headers is set (see h_snapshot_binary).
+ *  root              The root object.
+ */
+typedef struct h_snapshot_header {
+  char magic[8];
+  size_t version;
+  size_t word_size;
+  size_t page_header_size;
+  size_t bytes;
+  h_options_t options;
+  bool unsafe_stack;
+  float gc_threshold;
+  uintptr_t heap;
+  uintptr_t pages;
+  uintptr_t code;
+  size_t pagesize;
+  size_t total_pages;
+  size_t committed_pages;
+  size_t limit_pages;
+  size_t used_pages;
+  size_t layout_count;
+  size_t large_count;
+  size_t pages_offset;
+  bool layout_headers;
+  bool trace_headers;
+  uint64_t binary;
+  uintptr_t root;
+} h_snapshot_header_t;
+
+/**
+ *  Saves a heap to a file, after a full collection. No other thread
+ *  may use the heap meanwhile.
+ *
+ *  \param   h     the heap
+ *  \param   path  the file, created or truncated
+ *  \param   root  the object the loaded heap is used from, may be
+ *                 NULL
+ *  \return  false if the file could not be written
+ */
+bool h_snapshot_save(heap_t *h, const char *path, void *root);
+
+/**
+ *  Loads a heap saved with h_snapshot_save.
+ *
+ *  \param   path  the file
+ *  \param   root  set to the object saved as root, may be NULL
+ *  \return  the heap, NULL if the file could not be read, is not a
+ *           snapshot (of this version, word size and page header), or
+ *           its heap could not be created
+ */
+heap_t *h_snapshot_load(const char *path, void **root);
+
+#endif
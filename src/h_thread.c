@@ -0,0 +1,261 @@
+#define _GNU_SOURCE // pthread_getattr_np, must be defined before includes
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "h_thread.h"
+#include "h_alloc.h"
+
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Finds the highest address of the calling thread's stack.
+ *
+ *  \return  the address, NULL if it could not be found
+ */
+void *h_thread_stack_bottom();
+
+/**
+ *  Finds the bottom of the stack of a collecting thread that is not
+ *  registered. environ lies at the bottom of the main thread's
+ *  stack, and is kept there; other threads have their stacks
+ *  elsewhere, and use the bottom of their own.
+ *
+ *  \param   top     the top of the calling thread's stack
+ *  \param   bottom  environ, as found by stack_find_bottom
+ *  \return  the bottom of the calling thread's stack
+ */
+void *h_thread_unregistered_bottom(void *top, void *bottom);
+
+/**
+ *  Publishes the top of the calling thread's stack and waits for the
+ *  world to resume. Called by h_thread_park once the registers are
+ *  spilled into its frame, which lies above this one.
+ *
+ *  \param   h  the heap
+ */
+void h_thread_wait(heap_t *h);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+__thread h_thread_t *h_thread_self = NULL;
+
+/**
+ *  The bottom of the calling thread's stack, found on the first
+ *  collection it runs unregistered.
+ */
+static __thread void *h_thread_own_bottom = NULL;
+
+h_thread_t *h_thread_find(heap_t *h)
+{
+  h_thread_t **link = &h_thread_self;
+  while(*link != NULL && (*link)->heap != h) {
+    link = &(*link)->thread_next;
+  }
+  h_thread_t *thread = *link;
+  if(thread == NULL) {
+    return NULL;
+  }
+  // Move to the front, where h_thread_current finds it
+  *link = thread->thread_next;
+  thread->thread_next = h_thread_self;
+  h_thread_self = thread;
+  return thread;
+}
+
+void *h_thread_stack_bottom()
+{
+  pthread_attr_t attr;
+  if(pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return NULL;
+  }
+  void *addr;
+  size_t size;
+  int result = pthread_attr_getstack(&attr, &addr, &size);
+  pthread_attr_destroy(&attr);
+  return result == 0 ? (char *)addr + size : NULL;
+}
+
+void *h_thread_unregistered_bottom(void *top, void *bottom)
+{
+  if(h_thread_own_bottom == NULL) {
+    h_thread_own_bottom = h_thread_stack_bottom();
+    assert(h_thread_own_bottom != NULL && "The stack of an unregistered thread could not be found");
+  }
+  if((char *)bottom > (char *)top && (char *)bottom <= (char *)h_thread_own_bottom) {
+    return bottom;
+  }
+  return h_thread_own_bottom;
+}
+
+bool h_thread_register(heap_t *h)
+{
+  if(h_thread_current(h) != NULL) {
+    return true;
+  }
+  void *bottom = h_thread_stack_bottom();
+  if(bottom == NULL) {
+    return false;
+  }
+
+  // Reuse the record of a thread that has unregistered
+  h_thread_t *thread;
+  for(thread = __atomic_load_n(&h->threads, __ATOMIC_ACQUIRE); thread != NULL; thread = thread->next) {
+    bool inactive = false;
+    if(__atomic_compare_exchange_n(&thread->active, &inactive, true, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  bool fresh = thread == NULL;
+  if(fresh) {
+    thread = calloc(1, sizeof(h_thread_t));
+    if(thread == NULL) {
+      return false;
+    }
+    thread->heap = h;
+    for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+      thread->pages[c] = &h->full_page;
+    }
+    thread->active = true;
+  }
+  thread->stack_bottom = bottom;
+  thread->frames = &h_frames;
+
+  // A thread must not start running in the middle of a collection
+  pthread_mutex_lock(&h->thread_lock);
+  while(h->stop) {
+    pthread_cond_wait(&h->thread_cond, &h->thread_lock);
+  }
+  if(fresh) {
+    // Collections must not allocate, so the stacks array is grown here
+    h_stack_t *stacks = realloc(h->stacks, (h->n_threads + 2)*sizeof(h_stack_t));
+    if(stacks == NULL) {
+      pthread_mutex_unlock(&h->thread_lock);
+      free(thread);
+      return false;
+    }
+    h->stacks = stacks;
+    h->n_threads++;
+    thread->next = __atomic_load_n(&h->threads, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&h->threads, &thread->next, thread, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      // thread->next has been reloaded, retry
+    }
+  }
+  h->running++;
+  pthread_mutex_unlock(&h->thread_lock);
+
+  thread->thread_next = h_thread_self;
+  h_thread_self = thread;
+  return true;
+}
+
+void h_thread_unregister(heap_t *h)
+{
+  h_thread_t *thread = h_thread_current(h);
+  if(thread == NULL) {
+    return;
+  }
+  // h_thread_current moved the record to the front
+  h_thread_self = thread->thread_next;
+  thread->thread_next = NULL;
+
+  pthread_mutex_lock(&h->thread_lock);
+  for(size_t c = 0; c <= H_MIXED_CLASS; c++) {
+    h_alloc_retire(h, &thread->pages[c]);
+  }
+  __atomic_store_n(&thread->active, false, __ATOMIC_RELEASE);
+  h->running--;
+  pthread_cond_broadcast(&h->thread_cond);
+  pthread_mutex_unlock(&h->thread_lock);
+}
+
+// Must not be inlined, the spilled registers have to be above the
+// published top of the stack
+__attribute__((noinline))
+void h_thread_park(heap_t *h)
+{
+  __builtin_unwind_init();
+  h_thread_wait(h);
+}
+
+__attribute__((noinline))
+void h_thread_wait(heap_t *h)
+{
+  h_thread_t *thread = h_thread_current(h);
+  pthread_mutex_lock(&h->thread_lock);
+  if(thread != NULL) {
+    thread->stack_top = __builtin_frame_address(0);
+    h->running--;
+    pthread_cond_broadcast(&h->thread_cond);
+  }
+  while(h->stop) {
+    pthread_cond_wait(&h->thread_cond, &h->thread_lock);
+  }
+  if(thread != NULL) {
+    thread->stack_top = NULL;
+    h->running++;
+  }
+  pthread_mutex_unlock(&h->thread_lock);
+}
+
+void h_thread_stop(heap_t *h)
+{
+  bool registered = h_thread_current(h) != NULL;
+  pthread_mutex_lock(&h->thread_lock);
+  while(h->stop) {
+    // Another thread is collecting, wait for it like at a safepoint
+    pthread_mutex_unlock(&h->thread_lock);
+    h_thread_park(h);
+    pthread_mutex_lock(&h->thread_lock);
+  }
+  __atomic_store_n(&h->stop, true, __ATOMIC_RELEASE);
+  while(h->running > (registered ? 1 : 0)) {
+    pthread_cond_wait(&h->thread_cond, &h->thread_lock);
+  }
+  pthread_mutex_unlock(&h->thread_lock);
+}
+
+void h_thread_resume(heap_t *h)
+{
+  pthread_mutex_lock(&h->thread_lock);
+  __atomic_store_n(&h->stop, false, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&h->thread_cond);
+  pthread_mutex_unlock(&h->thread_lock);
+}
+
+h_stack_t *h_thread_stacks(heap_t *h, void *top, void *bottom, size_t *count)
+{
+  h_thread_t *self = h_thread_current(h);
+  h_thread_t *threads = __atomic_load_n(&h->threads, __ATOMIC_ACQUIRE);
+  h_stack_t *stacks = h->stacks;
+  // Threads other than the main one have their stacks elsewhere than
+  // environ, so registered threads use the bottom found at registration
+  stacks[0].top = top;
+  stacks[0].bottom = self != NULL ? self->stack_bottom : h_thread_unregistered_bottom(top, bottom);
+  size_t n = 1;
+  for(h_thread_t *thread = threads; thread != NULL; thread = thread->next) {
+    if(thread->stack_top != NULL) {
+      stacks[n].top = thread->stack_top;
+      stacks[n].bottom = thread->stack_bottom;
+      n++;
+    }
+  }
+  *count = n;
+  return stacks;
+}
+
+void h_thread_free(heap_t *h)
+{
+  h_thread_t *thread = h->threads;
+  while(thread != NULL) {
+    h_thread_t *next = thread->next;
+    free(thread);
+    thread = next;
+  }
+  h->threads = NULL;
+  free(h->stacks);
+  h->stacks = NULL;
+}
@@ -0,0 +1,135 @@
+/**
+ *   \file h_thread.h
+ *   \brief Threads registered with a heap, and stopping them for
+ *          collections
+ *
+ *   Every registered thread has a record in the heap, holding its
+ *   allocation buffer (see h_alloc.h) and the bounds of its stack.
+ *
+ *   A collection stops the world: the collecting thread raises the
+ *   heap's stop flag and waits until every other registered thread
+ *   has parked. Threads park at safepoints, i.e. when they call
+ *   h_safepoint or allocate a fresh page while the flag is raised.
+ *   A parked thread has spilled its registers onto its stack and
+ *   published the top of the stack, so the collector scans (and in
+ *   safe mode updates) the whole stack, registers included. The
+ *   world resumes when the collection ends.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "h_init.h"
+
+#ifndef __h_thread__
+#define __h_thread__
+
+/**
+ *  The records of the calling thread, most recently used first.
+ *  NULL when the thread is not registered with any heap.
+ */
+extern __thread h_thread_t *h_thread_self;
+
+/**
+ *  Finds the calling thread's record when its most recently used
+ *  one belongs to another heap, and moves it to the front.
+ *
+ *  \param   h  the heap
+ *  \return  the record, NULL if the thread is not registered with h
+ */
+h_thread_t *h_thread_find(heap_t *h);
+
+/**
+ *  Returns the calling thread's record.
+ *
+ *  \param   h  the heap
+ *  \return  the record, NULL if the thread is not registered with h
+ */
+static inline h_thread_t *h_thread_current(heap_t *h)
+{
+  h_thread_t *thread = h_thread_self;
+  if(thread == NULL || thread->heap == h) {
+    return thread;
+  }
+  return h_thread_find(h);
+}
+
+/**
+ *  Registers the calling thread with a heap. Does nothing if the
+ *  thread is already registered. Waits for a running collection to
+ *  end.
+ *
+ *  \param   h  the heap
+ *  \return  false if out of memory, or if the bounds of the
+ *           thread's stack could not be found
+ */
+bool h_thread_register(heap_t *h);
+
+/**
+ *  Unregisters the calling thread from a heap. Its allocation
+ *  buffer is retired and its record left for later threads to
+ *  reuse.
+ *
+ *  \param   h  the heap
+ */
+void h_thread_unregister(heap_t *h);
+
+/**
+ *  Parks the calling thread until the world resumes. Spills the
+ *  registers first, so the collector finds the pointers in them.
+ *
+ *  \param   h  the heap
+ */
+void h_thread_park(heap_t *h);
+
+/**
+ *  Parks the calling thread if a collector is stopping the world.
+ *
+ *  \param   h  the heap
+ */
+static inline void h_thread_safepoint(heap_t *h)
+{
+  if(__atomic_load_n(&h->stop, __ATOMIC_ACQUIRE)) {
+    h_thread_park(h);
+  }
+}
+
+/**
+ *  Stops the world: returns once every other registered thread is
+ *  parked. If another thread is already collecting, the calling
+ *  thread parks until it is done first.
+ *
+ *  \param   h  the heap
+ */
+void h_thread_stop(heap_t *h);
+
+/**
+ *  Resumes the world stopped by h_thread_stop.
+ *
+ *  \param   h  the heap
+ */
+void h_thread_resume(heap_t *h);
+
+/**
+ *  Returns the stacks to scan for roots while the world is stopped:
+ *  the collecting thread's first, then those of all parked threads.
+ *
+ *  \param   h       the heap
+ *  \param   top     the top of the collecting thread's stack
+ *  \param   bottom  environ, the bottom of the main thread's stack,
+ *                   used if the collecting thread is the main one
+ *                   and not registered
+ *  \param   count   set to the amount of stacks
+ *  \return  the stacks, kept in the heap
+ */
+h_stack_t *h_thread_stacks(heap_t *h, void *top, void *bottom, size_t *count);
+
+/**
+ *  Frees the records (and the stacks array) of a heap being deleted.
+ *
+ *  \param   h  the heap
+ */
+void h_thread_free(heap_t *h);
+
+#endif
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE // dl_iterate_phdr, must be defined before includes
+
+#include <assert.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "o_layout.h"
+#include "h_init.h"
+
+
+/**
+ *  The layout cache of a heap: an open addressing hash table of
+ *  compiled layouts. Slots only ever go from NULL to a layout, so
+ *  threads look layouts up without locking. A full table is replaced
+ *  by a bigger copy rather than rehashed in place; the old one is
+ *  kept (for threads still reading it) until the heap is deleted.
+ *
+ *  capacity  Amount of slots (a power of 2).
+ *
+ *  retired   The table this one replaced.
+ *
+ *  slots     The layouts, at the first free slot from their hash.
+ */
+typedef struct o_layout_table {
+  size_t capacity;
+  struct o_layout_table *retired;
+  o_layout_t *slots[];
+} o_layout_table_t;
+
+/**
+ *  A format string a thread allocated with, and its layout.
+ *
+ *  format  The address of the format string.
+ *
+ *  serial  The layout_serial of the heap the layout is of.
+ *
+ *  layout  The compiled layout.
+ */
+typedef struct o_layout_recent {
+  char *format;
+  uint64_t serial;
+  o_layout_t *layout;
+} o_layout_recent_t;
+
+/**
+ *  The format strings the thread allocated with last, by the address
+ *  of the string.
+ */
+static __thread o_layout_recent_t o_layout_recent[O_LAYOUT_RECENT];
+
+/**
+ *  Hands out the serial numbers of heaps' layout caches.
+ */
+static uint64_t o_layout_serials;
+
+////////////////// INTERNAL PROTOTYPES //////////////////
+/**
+ *  Returns size of satatype represented by character.
+ *  Valid characters are:
+ *
+ *  | CHAR  |  REPRESENTS
+ *  |-------|----------------
+ *  |   i   |  int
+ *  |   l   |  long
+ *  |   f   |  float
+ *  |   c   |  char
+ *  |   d   |  double
+ *  |   *   |  void *
+ *
+ *  \param   c  Char to get size of
+ *  \return  sizeof() datatype represented by char
+ */
+size_t o_size_from_char(char c);
+
+/**
+ *  Returns the compact header bit-representation of the datatype
+ *  represented by a character.
+ *
+ *  \param   c  Char to get bits of
+ *  \return  bits of the datatype, 0 if it has no bit-representation
+ */
+int o_bits_from_char(char c);
+
+/**
+ *  Hashes a format string (FNV-1a).
+ *
+ *  \param   layout  the format string
+ *  \return  hash of the format string
+ */
+size_t o_layout_hash(char *layout);
+
+/**
+ *  Reads the repeat count in front of a format string character,
+ *  e.g. the 3 of "3*", and advances past it.
+ *
+ *  \param   cursor  the position in the format string, left at the
+ *                   character
+ *  \return  the repeat count, 1 if there is none, 0 if it is invalid
+ */
+size_t o_layout_repeat(char **cursor);
+
+/**
+ *  Parses a format string into a new layout descriptor.
+ *
+ *  \param   layout  the format string
+ *  \return  the compiled layout, NULL if the format string is invalid
+ */
+o_layout_t *o_layout_compile(char *layout);
+
+/**
+ *  Frees a layout descriptor created by o_layout_compile.
+ *
+ *  \param   compiled  the layout
+ */
+void o_layout_free(o_layout_t *compiled);
+
+/**
+ *  Looks a format string up in a layout table.
+ *
+ *  \param   table   the table
+ *  \param   layout  the format string
+ *  \param   hash    hash of the format string
+ *  \return  the layout, NULL if it is not in the table
+ */
+o_layout_t *o_layout_table_find(o_layout_table_t *table, char *layout, size_t hash);
+
+/**
+ *  Adds a layout to a table with a free slot. Called with the
+ *  heap's layout_lock held.
+ *
+ *  \param   table     the table
+ *  \param   compiled  the layout
+ *  \param   hash      hash of the layout's format string
+ */
+void o_layout_table_add(o_layout_table_t *table, o_layout_t *compiled, size_t hash);
+
+/**
+ *  Replaces a heap's layout table with one twice the size. Called
+ *  with the heap's layout_lock held.
+ *
+ *  \param   h  the heap
+ *  \return  false if out of memory
+ */
+bool o_layout_cache_grow(heap_t *h);
+
+/**
+ *  dl_iterate_phdr callback finding out if an address is in a
+ *  read-only segment of a module.
+ *
+ *  \param   info     a module
+ *  \param   size     size of info
+ *  \param   address  the address, cleared once found read-only
+ *  \return  1 once the address is found, to stop iterating
+ */
+int o_layout_module(struct dl_phdr_info *info, size_t size, void *address);
+
+/**
+ *  Checks if a format string is in read-only memory, such as a
+ *  string literal, so its contents never change.
+ *
+ *  \param   layout  the format string
+ *  \return  true if the string is read-only
+ */
+bool o_layout_constant(char *layout);
+
+////////////////// FUNCTION IMPLEMENTATIONS //////////////////
+
+size_t o_size_from_char(char c)
+{
+  switch(c)
+    {
+    case '*':
+      return sizeof(void *);
+      break;
+    case 'i':
+      return sizeof(int);
+      break;
+    case 'f':
+      return sizeof(float);
+      break;
+    case 'c':
+      return sizeof(char);
+      break;
+    case 'l':
+      return sizeof(long);
+      break;
+    case 'd':
+      return sizeof(double);
+      break;
+    default:
+      return 0;
+      break;
+    }
+}
+
+size_t o_align_from_char(char c)
+{
+  switch(c)
+    {
+    case '*':
+      return _Alignof(void *);
+    case 'i':
+      return _Alignof(int);
+    case 'f':
+      return _Alignof(float);
+    case 'c':
+      return _Alignof(char);
+    case 'l':
+      return _Alignof(long);
+    case 'd':
+      return _Alignof(double);
+    default:
+      return 0;
+    }
+}
+
+int o_bits_from_char(char c)
+{
+  if (c == '*') {
+    return 3;
+  }
+  size_t size = o_size_from_char(c);
+  if (size != o_align_from_char(c)) {
+    return 0;
+  }
+  if (size == 8) {
+    return 2;
+  }
+  if (size == 4) {
+    return 1;
+  }
+  return 0;
+}
+
+size_t o_layout_hash(char *layout)
+{
+  size_t hash = 14695981039346656037UL;
+  for (char *cursor = layout; *cursor != '\0'; ++cursor) {
+    hash = (hash ^ (unsigned char)*cursor) * 1099511628211UL;
+  }
+  return hash;
+}
+
+size_t o_layout_repeat(char **cursor)
+{
+  size_t count = 0;
+  bool digits = false;
+  for (; **cursor >= '0' && **cursor <= '9'; ++*cursor) {
+    size_t digit = (size_t)(**cursor - '0');
+    if (count > (SIZE_MAX - digit)/10) {
+      return 0;
+    }
+    count = 10*count + digit;
+    digits = true;
+  }
+  return digits ? count : 1;
+}
+
+o_layout_t *o_layout_compile(char *layout)
+{
+  // Count the fields first, repeat counts make them more than the characters
+  size_t n_fields = 0;
+  for (char *cursor = layout; *cursor != '\0'; ++cursor) {
+    size_t count = o_layout_repeat(&cursor);
+    if (count == 0 || o_size_from_char(*cursor) == 0 || n_fields > SIZE_MAX/2 - count) {
+      return NULL;
+    }
+    n_fields += count;
+  }
+
+  size_t length = strlen(layout);
+  o_layout_t *compiled = calloc(1, sizeof(o_layout_t));
+  if (compiled == NULL) {
+    return NULL;
+  }
+  compiled->string = malloc(length + 1);
+  compiled->offsets = calloc(n_fields + 1, sizeof(size_t));
+  compiled->pointer_offsets = calloc(n_fields + 1, sizeof(size_t));
+  if (!compiled->string || !compiled->offsets || !compiled->pointer_offsets) {
+    o_layout_free(compiled);
+    return NULL;
+  }
+  memcpy(compiled->string, layout, length + 1);
+
+  size_t offset = 0;
+  size_t max_align = 1;
+  bool compact = n_fields <= O_VECTOR_MAX_FIELDS;
+  intptr_t vector = 0;
+  for (char *cursor = layout; *cursor != '\0'; ++cursor) {
+    size_t count = o_layout_repeat(&cursor);
+    char c = *cursor;
+    size_t size = o_size_from_char(c);
+    size_t align = o_align_from_char(c);
+    intptr_t bits = o_bits_from_char(c);
+    compact = compact && bits != 0;
+    if (align > max_align) {
+      max_align = align;
+    }
+    for (size_t j = 0; j < count; ++j) {
+      offset = O_ALIGN(offset, align);
+      if (compact) {
+        vector |= bits << (2*compiled->n_fields);
+      }
+      compiled->offsets[compiled->n_fields++] = offset;
+      if (c == '*') {
+        compiled->pointer_offsets[compiled->n_pointers++] = offset;
+      }
+      offset += size;
+    }
+  }
+  compiled->size = O_ALIGN(offset, max_align);
+
+  if (compact) {
+    compiled->header = O_COMPACT_HEADER(O_COMPACT_VECTOR, vector);
+  }
+  else {
+    compiled->header = O_HEADER_SET_PTR(0L, (intptr_t)compiled);
+  }
+  return compiled;
+}
+
+void o_layout_free(o_layout_t *compiled)
+{
+  free(compiled->string);
+  free(compiled->offsets);
+  free(compiled->pointer_offsets);
+  free(compiled);
+}
+
+o_layout_t *o_layout_table_find(o_layout_table_t *table, char *layout, size_t hash)
+{
+  for (size_t i = hash;; ++i) {
+    o_layout_t *cursor = __atomic_load_n(&table->slots[i & (table->capacity - 1)], __ATOMIC_ACQUIRE);
+    if (cursor == NULL) {
+      return NULL;
+    }
+    if (strcmp(cursor->string, layout) == 0) {
+      return cursor;
+    }
+  }
+}
+
+void o_layout_table_add(o_layout_table_t *table, o_layout_t *compiled, size_t hash)
+{
+  size_t i = hash;
+  while (table->slots[i & (table->capacity - 1)] != NULL) {
+    ++i;
+  }
+  // Release, so readers finding the layout see it compiled
+  __atomic_store_n(&table->slots[i & (table->capacity - 1)], compiled, __ATOMIC_RELEASE);
+}
+
+bool o_layout_cache_grow(heap_t *h)
+{
+  o_layout_table_t *old = h->layouts;
+  size_t capacity = old != NULL ? 2*old->capacity : 64;
+  o_layout_table_t *table = calloc(1, sizeof(o_layout_table_t) + capacity*sizeof(o_layout_t *));
+  if (table == NULL) {
+    return false;
+  }
+  table->capacity = capacity;
+  table->retired = old;
+  if (old != NULL) {
+    for (size_t i = 0; i < old->capacity; ++i) {
+      if (old->slots[i] != NULL) {
+        o_layout_table_add(table, old->slots[i], o_layout_hash(old->slots[i]->string));
+      }
+    }
+  }
+  __atomic_store_n(&h->layouts, table, __ATOMIC_RELEASE);
+  return true;
+}
+
+o_layout_t *o_layout_intern(heap_t *h, char *layout)
+{
+  size_t hash = o_layout_hash(layout);
+  o_layout_table_t *table = __atomic_load_n(&h->layouts, __ATOMIC_ACQUIRE);
+  if (table != NULL) {
+    o_layout_t *found = o_layout_table_find(table, layout, hash);
+    if (found != NULL) {
+      return found;
+    }
+  }
+
+  pthread_mutex_lock(&h->layout_lock);
+  // Another thread may have added it (or grown the table) meanwhile
+  o_layout_t *compiled = h->layouts != NULL ? o_layout_table_find(h->layouts, layout, hash) : NULL;
+  if (compiled == NULL) {
+    // Keep at least half of the slots free, so probes stay short
+    if (h->layouts == NULL || 2*(h->layout_count + 1) > h->layouts->capacity) {
+      if (!o_layout_cache_grow(h)) {
+        pthread_mutex_unlock(&h->layout_lock);
+        return NULL;
+      }
+    }
+    compiled = o_layout_compile(layout);
+    if (compiled != NULL) {
+      o_layout_table_add(h->layouts, compiled, hash);
+      h->layout_count++;
+    }
+  }
+  pthread_mutex_unlock(&h->layout_lock);
+  return compiled;
+}
+
+int o_layout_module(struct dl_phdr_info *info, size_t size, void *address)
+{
+  (void)size;
+  uintptr_t *addr = address;
+  for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type == PT_LOAD && *addr - start < phdr->p_memsz) {
+      if (!(phdr->p_flags & PF_W)) {
+        *addr = 0;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+bool o_layout_constant(char *layout)
+{
+  uintptr_t addr = (uintptr_t)layout;
+  dl_iterate_phdr(o_layout_module, &addr);
+  return addr == 0;
+}
+
+o_layout_t *o_layout_of(heap_t *h, char *layout)
+{
+  o_layout_recent_t *recent = &o_layout_recent[((uintptr_t)layout >> 3) & (O_LAYOUT_RECENT - 1)];
+  if (recent->format == layout && recent->serial == h->layout_serial) {
+    return recent->layout;
+  }
+  o_layout_t *compiled = o_layout_intern(h, layout);
+  if (compiled != NULL && o_layout_constant(layout)) {
+    *recent = (o_layout_recent_t){ layout, h->layout_serial, compiled };
+  }
+  return compiled;
+}
+
+void o_layout_cache_init(heap_t *h)
+{
+  h->layout_serial = __atomic_add_fetch(&o_layout_serials, 1, __ATOMIC_RELAXED);
+}
+
+void o_layout_foreach(heap_t *h, o_layout_f f, void *ctx)
+{
+  o_layout_table_t *table = h->layouts;
+  for (size_t i = 0; table != NULL && i < table->capacity; ++i) {
+    if (table->slots[i] != NULL) {
+      f(table->slots[i], ctx);
+    }
+  }
+}
+
+void o_layout_cache_free(heap_t *h)
+{
+  o_layout_table_t *table = h->layouts;
+  if (table != NULL) {
+    for (size_t i = 0; i < table->capacity; ++i) {
+      if (table->slots[i] != NULL) {
+        o_layout_free(table->slots[i]);
+      }
+    }
+  }
+  while (table != NULL) {
+    o_layout_table_t *retired = table->retired;
+    free(table);
+    table = retired;
+  }
+  h->layouts = NULL;
+  h->layout_count = 0;
+}
@@ -0,0 +1,131 @@
+/**
+ *   \file o_layout.h
+ *   \brief Compiled and interned object layouts (format strings)
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "object.h"
+
+#ifndef __o_layout__
+#define __o_layout__
+
+/**
+ *  The opaque data type holding all the heap data
+ */
+typedef struct heap heap_t;
+
+/**
+ *  A format string compiled into a layout descriptor. Each distinct
+ *  format string is compiled once per heap and shared by all objects
+ *  allocated with it.
+ *
+ *  string           The heap's own copy of the format string.
+ *
+ *  size             Size in bytes of an object with the layout,
+ *                   including alignment padding.
+ *
+ *  n_fields         Amount of fields in the layout.
+ *
+ *  offsets          Offset (in bytes) of every field.
+ *
+ *  n_pointers       Amount of pointer fields in the layout.
+ *
+ *  pointer_offsets  Offset (in bytes) of every pointer field.
+ *
+ *  header           The header stored in front of objects with
+ *                   this layout. Either a compact header (01) or
+ *                   a pointer to this descriptor (00).
+ */
+struct o_layout {
+  char *string;
+  size_t size;
+  size_t n_fields;
+  size_t *offsets;
+  size_t n_pointers;
+  size_t *pointer_offsets;
+  intptr_t header;
+};
+
+typedef struct o_layout o_layout_t;
+
+/**
+ *  \def O_VECTOR_MAX_FIELDS
+ *  The amount of fields that fit in a compact header bit vector,
+ *  leaving room for the stop indicator.
+ */
+#define O_VECTOR_MAX_FIELDS ((sizeof(intptr_t)*8 - O_TYPE_BITS - O_COMPACT_TYPE_BITS)/2 - 1)
+
+/**
+ *  Returns the alignment (in bytes) of the datatype represented by
+ *  a format string character.
+ *
+ *  \param   c  Format string character
+ *  \return  Alignment of the datatype, 0 for invalid characters
+ */
+size_t o_align_from_char(char c);
+
+/**
+ *  Returns the compiled layout of a format string, compiling and
+ *  caching it in the heap the first time the string is seen. Thread
+ *  safe: lookups of cached strings take no lock.
+ *
+ *  \param   h       the heap
+ *  \param   layout  the format string
+ *  \return  the layout descriptor, NULL if layout is invalid
+ */
+o_layout_t *o_layout_intern(heap_t *h, char *layout);
+
+/**
+ *  \def O_LAYOUT_RECENT
+ *  Amount of format strings each thread remembers the layouts of by
+ *  their address, see o_layout_of. A power of 2.
+ */
+#define O_LAYOUT_RECENT 64
+
+/**
+ *  Returns the compiled layout of a format string like
+ *  o_layout_intern, looking it up by the address of the string
+ *  first: a thread allocating repeatedly with the same string literal
+ *  neither hashes nor compares it. Only strings in read-only memory
+ *  are remembered so, as their contents cannot change.
+ *
+ *  \param   h       the heap
+ *  \param   layout  the format string
+ *  \return  the layout descriptor, NULL if layout is invalid
+ */
+o_layout_t *o_layout_of(heap_t *h, char *layout);
+
+/**
+ *  The signature of functions called on every layout of a heap.
+ */
+typedef void (*o_layout_f)(o_layout_t *layout, void *ctx);
+
+/**
+ *  Calls \a f on every layout cached in a heap. Must not run
+ *  concurrently with o_layout_intern adding layouts.
+ *
+ *  \param   h    the heap
+ *  \param   f    the function
+ *  \param   ctx  context passed on to \a f
+ */
+void o_layout_foreach(heap_t *h, o_layout_f f, void *ctx);
+
+/**
+ *  Gives a new heap's layout cache its serial number, which tells
+ *  it apart from those of heaps deleted before it.
+ *
+ *  \param   h  the heap
+ */
+void o_layout_cache_init(heap_t *h);
+
+/**
+ *  Frees all layouts cached in a heap.
+ *
+ *  \param   h  the heap
+ */
+void o_layout_cache_free(heap_t *h);
+
+#endif
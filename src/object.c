@@ -3,27 +3,11 @@
 #include <stdint.h>
 
 #include "object.h"
+#include "h_alloc.h"
+#include "o_layout.h"
 
 
 ////////////////// INTERNAL PROTOTYPES //////////////////
-/**
- *  Returns size of satatype represented by character.
- *  Valid characters are:
- *
- *  | CHAR  |  REPRESENTS
- *  |-------|----------------
- *  |   i   |  int
- *  |   l   |  long
- *  |   f   |  float
- *  |   c   |  char
- *  |   d   |  double
- *  |   *   |  void *
- *
- *  \param   c  Char to get size of
- *  \return  sizeof() datatype represented by char
- */
-size_t o_size_from_char(char c);
-
 /**
  *  Returns size of satatype represented by character.
  *  Valid characters are:
@@ -35,19 +19,13 @@ size_t o_size_from_char(char c);
  *   | 0b10  | 8 byte datatype            |
  *   | 0b11  | sizeof(vois *)             |
  *
+ *  Every datatype is aligned to its own size.
+ *
  *  \param   bits Bit-representation to get size of
  *  \return  sizeof() datatype represented by bits
  */
 size_t o_size_from_bits(int bits);
 
-/**
- *  Counts pointers notet in a format-string
- * 
- *  \param   format  Format string describing object
- *  \return  Number of pointers in format string
- */
-size_t o_pointers_in_string_rep(char **format);
-
 /**
  *  Counts pointers in compact header bit-vector
  *
@@ -65,30 +43,44 @@ size_t o_pointers_in_bitvector(intptr_t header_data);
 size_t o_size_from_bitvector(intptr_t header_data);
 
 /**
- *  Calculates size of object described by string format
+ *  Returns pointer at given index if exists
  *
- *  \param   format  String format describing object
- *  \return  Number of pointers in bit-vector
+ *  \param   ptr          the object
+ *  \param   header_data  bitvektor from header
+ *  \param   index        index of pointer
+ *  \return  Pointer to pointer within object, NULL if out of range
  */
-size_t o_size_from_string_rep(char **format);
+void **o_get_pointer_from_bitvector(void *ptr, intptr_t header_data, size_t index);
 
 /**
  *  Returns pointer at given index if exists
  *
- *  \param   header_data  bitvektor from header
- *  \param   index  index of pointer
- *  \return  Number of pointers in bit-vector
+ *  \param   ptr     the object
+ *  \param   layout  compiled layout of object
+ *  \param   index   index of pointer
+ *  \return  Pointer to pointer within object, NULL if out of range
  */
-void **o_get_pointer_from_bitvector(intptr_t header_data, size_t index);
+void **o_get_pointer_from_layout(void *ptr, o_layout_t *layout, size_t index);
 
 /**
- *  Returns pointer at given index if exists
+ *  Trace function handed to custom trace functions by
+ *  o_foreach_pointer. Passes the pointer on to the current visitor
+ *  and returns the (possibly updated) pointer.
  *
- *  \param   format string representation of object
- *  \param   index  index of pointer
- *  \return  Number of pointers in bit-vector
+ *  \param   h    The heap of the object
+ *  \param   obj  Pointer read from the object
+ *  \return  The pointer to store back into the object
+ */
+void *o_trace_visitor(heap_t *h, void *obj);
+
+/**
+ *  The visitor used by o_trace_visitor, set for the duration of
+ *  a custom trace function call.
  */
-void **o_get_pointer_from_string_rep(char **format, size_t index);
+static __thread struct {
+  o_pointer_f f;
+  void *ctx;
+} o_current_visitor;
 
 ////////////////// FUNCTION IMPLEMENTATIONS //////////////////
 
@@ -101,53 +93,88 @@ intptr_t o_get_header(void *ptr)
   #endif
 }
 
+void *o_chunk_object(void *chunk)
+{
+  intptr_t first = *(intptr_t *)chunk;
+  intptr_t compact_type = O_HEADER_GET_DATA(first) & O_MASK_COMPACT_TYPE;
+  if (O_HEADER_GET_TYPE(first) == 1 &&
+      (compact_type == O_COMPACT_UNION || compact_type == O_COMPACT_ARRAY)) {
+    return (intptr_t *)chunk + 2;
+  }
+  return (intptr_t *)chunk + 1;
+}
+
+void *o_get_chunk(void *ptr)
+{
+  intptr_t header = o_get_header(ptr);
+  while (O_HEADER_GET_TYPE(header) == 3) {
+    header = o_get_header((void *)O_HEADER_GET_PTR(header));
+  }
+  return (char *)ptr - sizeof(intptr_t) - O_HEADER_PREFIX_SIZE(header);
+}
+
+size_t o_chunk_size(void *chunk)
+{
+  void *obj = o_chunk_object(chunk);
+  size_t prefix = (char *)obj - (char *)chunk - sizeof(intptr_t);
+  return H_CHUNK_SIZE(o_get_object_size(obj) + prefix);
+}
+
 void *o_alloc_struct(heap_t *h, char *layout)
 {
-  // TODO: Implement o_alloc_struct
-  assert(false && "o_alloc_struct not implemented");
-  return NULL;
+  o_layout_t *compiled = o_layout_of(h, layout);
+  if (compiled == NULL) {
+    return NULL;
+  }
+  return h_alloc_fast(h, compiled->size, compiled->header, compiled);
 }
 
-void *o_alloc_union(heap_t *h, size_t bytes, s_trace_f f)
+void *o_alloc_array(heap_t *h, char *layout, size_t count)
 {
-  // TODO: Implement o_alloc_union
-  assert(false && "o_alloc_union not implemented");
-  return NULL;
+  o_layout_t *compiled = o_layout_of(h, layout);
+  if (compiled == NULL || (compiled->size != 0 && count > SIZE_MAX/2/compiled->size)) {
+    return NULL;
+  }
+  size_t bytes = count*compiled->size;
+  intptr_t prefix = O_COMPACT_HEADER(O_COMPACT_ARRAY, (intptr_t)count);
+  intptr_t *obj = h_alloc_fast(h, bytes + sizeof(intptr_t), prefix, compiled);
+  if (obj == NULL) {
+    return NULL;
+  }
+  // Compact elements get the compiled layout too, it holds the offsets
+  *obj = O_HEADER_SET_PTR(0L, (intptr_t)compiled) | O_ARRAY_BIT;
+  return obj + 1;
 }
 
-void *o_alloc_raw(heap_t *h, size_t bytes)
+size_t o_array_length(void *ptr)
 {
-  // TODO: Implement o_alloc_raw
-  assert(false && "o_alloc_raw not implemented");
-  return NULL;
+  intptr_t header = o_get_header(ptr);
+  while (O_HEADER_GET_TYPE(header) == 3) {
+    ptr = (void *)O_HEADER_GET_PTR(header);
+    header = o_get_header(ptr);
+  }
+  if (!O_HEADER_IS_ARRAY(header)) {
+    return 0;
+  }
+  intptr_t prefix = o_get_header((intptr_t *)ptr - 1);
+  return (size_t)(O_HEADER_GET_DATA(prefix) >> O_COMPACT_TYPE_BITS);
 }
 
-size_t o_size_from_char(char c)
+void *o_alloc_union(heap_t *h, size_t bytes, s_trace_f f)
 {
-  switch(c)
-    {
-    case '*':
-      return sizeof(void *);
-      break;
-    case 'i':
-      return sizeof(int);
-      break;
-    case 'f':
-      return sizeof(float);
-      break;
-    case 'c':
-      return sizeof(char);
-      break;
-    case 'l':
-      return sizeof(long);
-      break;
-    case 'd':
-      return sizeof(double);
-      break;
-    default:
-      return 0; // TODO: How detect this state of 'unknown' type? 
-      break;
-    }
+  intptr_t prefix = O_COMPACT_HEADER(O_COMPACT_UNION, (intptr_t)bytes);
+  intptr_t *obj = h_alloc_fast(h, bytes + sizeof(intptr_t), prefix, NULL);
+  if (obj == NULL) {
+    return NULL;
+  }
+  // Functions need not be aligned, so the pointer is stored shifted
+  *obj = O_HEADER_SET_DATA(2L, (intptr_t)f);
+  return obj + 1;
+}
+
+void *o_alloc_raw(heap_t *h, size_t bytes)
+{
+  return h_alloc_fast(h, bytes, O_COMPACT_HEADER(O_COMPACT_RAW, (intptr_t)bytes), NULL);
 }
 
 size_t o_size_from_bits(int bits)
@@ -173,15 +200,24 @@ void **o_get_pointer_in_object(void *ptr, size_t index)
   // Compact header
   if (header_type == 1) {
     intptr_t data = O_HEADER_GET_DATA(header);
-    int compact_type = (int) (data & 3UL); // TODO: Remove 'magic' constant OR make into MACRO
-    data = data >> 2; // TODO: remove 'magic' constant OR make into MACRO
-    if (compact_type == 1) {
-      return o_get_pointer_from_bitvector(data, index);
+    int compact_type = (int) (data & O_MASK_COMPACT_TYPE);
+    data = data >> O_COMPACT_TYPE_BITS;
+    if (compact_type == O_COMPACT_VECTOR) {
+      return o_get_pointer_from_bitvector(ptr, data, index);
     }
   }
-  // String format
+  // Compiled layout, of every element of an array
   else if (header_type == 0) {
-    return o_get_pointer_from_string_rep((char **)O_HEADER_GET_PTR(header), index);
+    o_layout_t *layout = (o_layout_t *)O_HEADER_GET_LAYOUT(header);
+    if (O_HEADER_IS_ARRAY(header) && layout->n_pointers > 0) {
+      size_t element = index/layout->n_pointers;
+      if (element >= o_array_length(ptr)) {
+        return NULL;
+      }
+      ptr = (char *)ptr + element*layout->size;
+      index %= layout->n_pointers;
+    }
+    return o_get_pointer_from_layout(ptr, layout, index);
   }
   // Forwarding pointer
   else if (header_type == 3) {
@@ -191,25 +227,129 @@ void **o_get_pointer_in_object(void *ptr, size_t index)
   return NULL;
 }
 
-void **o_get_pointer_from_bitvector(intptr_t header_data, size_t index)
+void *o_trace_visitor(heap_t *h, void *obj)
 {
-  // TODO: Implement o_alloc_raw
-  assert(false && "o_get_pointer_from_bitvector not implemented");
-  return NULL;
+  (void)h;
+  void *slot = obj;
+  o_current_visitor.f(&slot, o_current_visitor.ctx);
+  return slot;
+}
+
+void o_foreach_pointer(heap_t *h, void *ptr, o_pointer_f f, void *ctx)
+{
+  o_foreach_pointer_header(h, ptr, o_get_header(ptr), f, ctx);
+}
+
+void o_foreach_pointer_header(heap_t *h, void *ptr, intptr_t header, o_pointer_f f, void *ctx)
+{
+  int header_type = (int) O_HEADER_GET_TYPE(header);
+
+  // Compact header
+  if (header_type == 1) {
+    intptr_t data = O_HEADER_GET_DATA(header);
+    if ((data & O_MASK_COMPACT_TYPE) != O_COMPACT_VECTOR) {
+      return;
+    }
+    data = data >> O_COMPACT_TYPE_BITS;
+    size_t offset = 0;
+    for (int t = (int) (data & 3UL); t != 00; t = (int) (data & 3UL)) {
+      size_t size = o_size_from_bits(t);
+      offset = O_ALIGN(offset, size);
+      if (t == 3) {
+        f((void **)((char *)ptr + offset), ctx);
+      }
+      offset += size;
+      data = data >> 2;
+    }
+  }
+  // Compiled layout
+  else if (header_type == 0) {
+    o_layout_t *layout = (o_layout_t *)O_HEADER_GET_LAYOUT(header);
+    size_t *offsets = layout->pointer_offsets;
+    size_t n_pointers = layout->n_pointers;
+    if (!O_HEADER_IS_ARRAY(header)) {
+      for (size_t i = 0; i < n_pointers; ++i) {
+        f((void **)((char *)ptr + offsets[i]), ctx);
+      }
+      return;
+    }
+    size_t count = (size_t)(O_HEADER_GET_DATA(o_get_header((intptr_t *)ptr - 1)) >> O_COMPACT_TYPE_BITS);
+    if (n_pointers == 0) {
+      return;
+    }
+    if (layout->size == sizeof(void *)) {
+      // Arrays of pointers: prefetch the headers of the objects ahead
+      void **slots = ptr;
+      for (size_t i = 0; i < count; ++i) {
+        if (i + O_ARRAY_PREFETCH < count) {
+          __builtin_prefetch((intptr_t *)slots[i + O_ARRAY_PREFETCH] - 1);
+        }
+        f(&slots[i], ctx);
+      }
+      return;
+    }
+    char *element = ptr;
+    for (size_t e = 0; e < count; ++e, element += layout->size) {
+      for (size_t i = 0; i < n_pointers; ++i) {
+        f((void **)(element + offsets[i]), ctx);
+      }
+    }
+  }
+  // Custom trace function
+  else if (header_type == 2) {
+    s_trace_f trace = (s_trace_f)O_HEADER_GET_DATA(header);
+    // Save the outer visitor, custom trace functions may nest
+    o_pointer_f outer_f = o_current_visitor.f;
+    void *outer_ctx = o_current_visitor.ctx;
+    o_current_visitor.f = f;
+    o_current_visitor.ctx = ctx;
+    trace(h, o_trace_visitor, ptr);
+    o_current_visitor.f = outer_f;
+    o_current_visitor.ctx = outer_ctx;
+  }
+  // Forwarding pointer
+  else {
+    o_foreach_pointer(h, (void *)O_HEADER_GET_PTR(header), f, ctx);
+  }
 }
 
-void **o_get_pointer_from_string_rep(char **format, size_t index)
+void **o_get_pointer_from_bitvector(void *ptr, intptr_t header_data, size_t index)
 {
-  // TODO: Implement o_alloc_raw
-  assert(false && "o_get_pointer_from_string_rep not implemented");
+  int t = (int) (header_data & 3UL);
+  size_t offset = 0;
+  while(t != 00) {
+    size_t size = o_size_from_bits(t);
+    offset = O_ALIGN(offset, size);
+    if (t == 3) {
+      if (index == 0) {
+        return (void **)((char *)ptr + offset);
+      }
+      --index;
+    }
+    offset += size;
+    header_data = header_data >> 2; // TODO: Remove 'magic' constant OR make into MACRO
+    t = (int) (header_data & 3UL); // TODO: Remove 'magic' constant OR make into MACRO
+  }
   return NULL;
 }
 
+void **o_get_pointer_from_layout(void *ptr, o_layout_t *layout, size_t index)
+{
+  if (index >= layout->n_pointers) {
+    return NULL;
+  }
+  return (void **)((char *)ptr + layout->pointer_offsets[index]);
+}
+
 
 size_t o_get_object_size(void *ptr)
+{
+  return o_size_from_header(ptr, o_get_header(ptr));
+}
+
+size_t o_size_from_header(void *ptr, intptr_t header)
 {
   // TODO: Same code as o_pointers_in_object - merge functions
-  intptr_t header = o_get_header(ptr);
   int header_type = (int) O_HEADER_GET_TYPE(header);
 
   // Compact header
@@ -222,15 +362,24 @@ size_t o_get_object_size(void *ptr)
     }
     return (size_t)data;
   }
-  // String format
+  // Compiled layout, the length of an array is kept in its prefix
   else if (header_type == 0) {
-    return o_size_from_string_rep((char **)O_HEADER_GET_PTR(header));
+    size_t size = ((o_layout_t *)O_HEADER_GET_LAYOUT(header))->size;
+    if (O_HEADER_IS_ARRAY(header)) {
+      intptr_t prefix = o_get_header((intptr_t *)ptr - 1);
+      size *= (size_t)(O_HEADER_GET_DATA(prefix) >> O_COMPACT_TYPE_BITS);
+    }
+    return size;
   }
   // Forwarding pointer
   else if (header_type == 3) {
     return o_get_object_size((void *)O_HEADER_GET_PTR(header));
   }
-  // Union or unknown
+  // Union, size is kept in the prefix before the header
+  else if (header_type == 2) {
+    intptr_t prefix = o_get_header((intptr_t *)ptr - 1);
+    return (size_t)(O_HEADER_GET_DATA(prefix) >> O_COMPACT_TYPE_BITS);
+  }
   return 0;
 }
 
@@ -238,25 +387,18 @@ size_t o_size_from_bitvector(intptr_t header_data)
 {
   int t = (int) (header_data & 3UL);
   size_t bytes = 0;
+  size_t max_align = 1;
   while(t != 00) {
-    bytes += o_size_from_bits(t);
+    size_t size = o_size_from_bits(t);
+    bytes = O_ALIGN(bytes, size) + size;
+    if (size > max_align) {
+      max_align = size;
+    }
     // Advance to next bytes in vector
     header_data = header_data >> 2; // TODO: Remove 'magic' constant OR make into MACRO
     t = (int) (header_data & 3UL); // TODO: Remove 'magic' constant OR make into MACRO
   }
-  return bytes;
-}
-
-size_t o_size_from_string_rep(char **format)
-{
-  // TODO: Implement advanced notation (eg. 3* for ***)
-  size_t bytes = 0;
-  char *cursor = (char *)format;
-  while(*cursor != '\0') {
-    bytes += o_size_from_char(*cursor);
-    ++cursor;
-  }
-  return bytes;
+  return O_ALIGN(bytes, max_align);
 }
 
 size_t o_pointers_in_object(void *ptr)
@@ -275,28 +417,15 @@ size_t o_pointers_in_object(void *ptr)
     }
     return 0;
   }
-  // String format
+  // Compiled layout
   else if (header_type == 0) {
-    return o_pointers_in_string_rep((char **)O_HEADER_GET_PTR(header));
+    size_t n_pointers = ((o_layout_t *)O_HEADER_GET_LAYOUT(header))->n_pointers;
+    return O_HEADER_IS_ARRAY(header) ? n_pointers*o_array_length(ptr) : n_pointers;
   }
   // Union or unknown
   return 0;
 }
 
-size_t o_pointers_in_string_rep(char **format)
-{
-  // TODO: Implement advanced notation (eg. 3* for ***)
-  size_t count = 0;
-  char *cursor = (char *)format;
-  while(*cursor != '\0') {
-    if(*cursor == '*') {
-      ++count;
-    }
-    ++cursor;
-  }
-  return count;
-}
-
 size_t o_pointers_in_bitvector(intptr_t header_data){  
   int t = (int) (header_data & 3UL);
   size_t count = 0;
@@ -116,13 +116,21 @@ typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
 #define O_READ_BIT(h,n)         ((h & (1UL << n)) >> n)
 
 
+/**
+ *  \def O_ALIGN(n,a)
+ *  Rounds \a n up to the closest multiple of \a a, which must be
+ *  a power of two.
+ */
+#define O_ALIGN(n,a)            (((n) + (a) - 1) & ~((a) - 1))
+
+
 //////////////////////////// OBJECT HEADER MACROS //////////////////////////////
 /*
  *  COMPACT HEADER DESIGN/DOCUMENTATION  (For internal use)
  *  ============================================================================
  *   
  * There are 4 headertypes.
- * - 00 (0) pointer to formatstring. 
+ * - 00 (0) pointer to compiled formatstring (see o_layout.h).
  * - 01 (1) compact layout representation.
  * - 10 (2) custom garbage collection function.
  * - 11 (3) forwarding adress / copy indicator 
@@ -169,6 +177,17 @@ typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
  *   ‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾‾
  *   (D)  -  represents pointer
  *   (T)  -  represents headertype. (00, 10 or 11)
+ *
+ *   Function pointers need not be aligned, so a custom tracing function
+ *   pointer is stored shifted into the data bits (see O_HEADER_SET_DATA).
+ *   Its object is preceded by an O_COMPACT_UNION prefix holding the size.
+ *
+ *
+ *   ARRAYS
+ *   =================================================
+ *   An array (o_alloc_array) has a compiled format string header (00)
+ *   pointing to the layout of its elements, with O_ARRAY_BIT set. It is
+ *   preceded by an O_COMPACT_ARRAY prefix holding the amount of elements.
  *  
  */
 
@@ -180,7 +199,7 @@ typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
  *
  *  DEC | HEX | DESCRIPTION
  *  ----|-----|-------------------------------------
- *  0   | 00  | Pointer to format-string. 
+ *  0   | 00  | Pointer to compiled format-string. 
  *  1   | 01  | Compact layout representation.
  *  2   | 10  | Custom garbage collection function.
  *  3   | 11  | Forwarding adress / copy indicator 
@@ -237,6 +256,100 @@ typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
 #define O_HEADER_SET_DATA(h,d)  ((h & O_MASK_TYPE) | (d << O_TYPE_BITS))
 
 
+/**
+ *  \def O_COMPACT_TYPE_BITS
+ *  Indicates how many bits of a compact header's data are used for
+ *  the compact type (the A bits).
+ */
+#define O_COMPACT_TYPE_BITS     2
+
+/**
+ *  \def O_MASK_COMPACT_TYPE
+ *  The bitmask for extracting the compact type from compact header data.
+ */
+#define O_MASK_COMPACT_TYPE     3UL
+
+/**
+ *  \def O_COMPACT_RAW
+ *  Compact type: the data bits hold the raw size of the object.
+ */
+#define O_COMPACT_RAW           0
+
+/**
+ *  \def O_COMPACT_VECTOR
+ *  Compact type: the data bits hold a bit vector of the object's fields.
+ */
+#define O_COMPACT_VECTOR        1
+
+/**
+ *  \def O_COMPACT_UNION
+ *  Compact type: the data bits hold the size of an object allocated
+ *  with o_alloc_union. Such a header is a *prefix* stored directly
+ *  before the object's real (custom trace function) header, since a
+ *  trace function pointer leaves no room for a size.
+ */
+#define O_COMPACT_UNION         2
+
+/**
+ *  \def O_COMPACT_ARRAY
+ *  Compact type: the data bits hold the length of an array allocated
+ *  with o_alloc_array. Like O_COMPACT_UNION, a prefix stored directly
+ *  before the array's real (compiled format string) header.
+ */
+#define O_COMPACT_ARRAY         3
+
+/**
+ *  \def O_ARRAY_BIT
+ *  Set in the compiled format string header (00) of an array. Compiled
+ *  layouts are allocated with malloc, so the bit is free in pointers
+ *  to them.
+ */
+#define O_ARRAY_BIT             4L
+
+/**
+ *  \def O_HEADER_IS_ARRAY(h)
+ *  Whether header \a h is the header of an array.
+ *
+ *  \a h should be of type `intptr_t`
+ */
+#define O_HEADER_IS_ARRAY(h)    (O_HEADER_GET_TYPE(h) == 0 && ((h) & O_ARRAY_BIT) != 0)
+
+/**
+ *  \def O_HEADER_GET_LAYOUT(h)
+ *  Extracts the pointer to the compiled layout from compiled format
+ *  string header \a h, of a single object or an array.
+ *
+ *  \a h should be of type `intptr_t`
+ */
+#define O_HEADER_GET_LAYOUT(h)  ((h) & ~(O_MASK_TYPE | O_ARRAY_BIT))
+
+/**
+ *  \def O_HEADER_PREFIX_SIZE(h)
+ *  The size (in bytes) of the prefix before header \a h: a word for
+ *  unions and arrays, none for other objects.
+ *
+ *  \a h should be of type `intptr_t`
+ */
+#define O_HEADER_PREFIX_SIZE(h) \
+  (O_HEADER_GET_TYPE(h) == 2 || O_HEADER_IS_ARRAY(h) ? sizeof(intptr_t) : 0)
+
+/**
+ *  \def O_ARRAY_PREFETCH
+ *  How many elements ahead tracing a pointer array prefetches the
+ *  objects pointed to.
+ */
+#define O_ARRAY_PREFETCH        8
+
+/**
+ *  \def O_COMPACT_HEADER(t,d)
+ *  Creates a compact header (type 01) of compact type \a t holding
+ *  data \a d.
+ *
+ *  \a d should be of type `intptr_t`
+ */
+#define O_COMPACT_HEADER(t,d)   O_HEADER_SET_DATA(1L, (((d) << O_COMPACT_TYPE_BITS) | (t)))
+
+
 /**
  *  Allocate a new object on a heap with a given format string.
  *
@@ -251,14 +364,44 @@ typedef void *(*s_trace_f)(heap_t *h, trace_f f, void *obj);
  *  |   *   |  for a sizeof(void *) bytes pointer value
  *  |   \0  |  null-character terminates the format string
  *
+ *  A character may be preceded by a repeat count, e.g. "3*2i" is the
+ *  same as "***ii".
+ *
+ *  Fields are aligned like the members of a C struct. Each distinct
+ *  format string is compiled once (see o_layout_intern), string
+ *  literals are then found by their address (see o_layout_of), and
+ *  objects whose layout fits in a bit vector get a compact header.
+ *
  *  \param   h       the heap
  *  \param   layout  the format string
- *  \return  the newly allocated object
+ *  \return  the newly allocated object, NULL if layout is invalid
  *
  *  Note: the heap does *not* retain an alias to layout.
  */
 void *o_alloc_struct(heap_t *h, char *layout);
 
+/**
+ *  Allocate an array of \a count elements with a given format string,
+ *  laid out like a C array of the struct. The array has one header
+ *  (and prefix) in all, and tracing it loops over the elements.
+ *
+ *  \param   h       the heap
+ *  \param   layout  the format string of an element, see o_alloc_struct
+ *  \param   count   the amount of elements
+ *  \return  the newly allocated array, NULL if layout is invalid or
+ *           out of memory
+ */
+void *o_alloc_array(heap_t *h, char *layout, size_t count);
+
+/**
+ *  Returns the amount of elements of an array allocated with
+ *  o_alloc_array.
+ *
+ *  \param   ptr  Pointer to the array (may be forwarded)
+ *  \return  Amount of elements
+ */
+size_t o_array_length(void *ptr);
+
 /**
  *  (Optional)
  *  Allocate a new object on a heap with a given size, and
@@ -300,6 +443,8 @@ size_t o_pointers_in_object(void *ptr);
 
 /**
  *  Returns a pointer to the \a n:th pointer within an object.
+ *  Every call decodes the header anew, so use o_foreach_pointer
+ *  to visit all pointers of an object.
  *  
  *  \sa o_pointers_in_object for 
  *
@@ -309,6 +454,74 @@ size_t o_pointers_in_object(void *ptr);
  */ 
 void **o_get_pointer_in_object(void *ptr, size_t n);
 
+/**
+ *  The signature of pointer visitors. Called with the address of a
+ *  pointer field (slot) within an object, which the visitor may
+ *  update, and the context given to o_foreach_pointer.
+ */
+typedef void (*o_pointer_f)(void **slot, void *ctx);
+
+/**
+ *  Calls \a f on every pointer slot of an object, decoding the
+ *  object's header once. Works for all header types:
+ *
+ *  - Compiled layouts and compact bit vectors visit their pointer
+ *    fields in order, arrays those of every element.
+ *  - Objects with a custom trace function (o_alloc_union) are given
+ *    \a h and a trace function that passes each pointer to \a f.
+ *  - Forwarded objects visit the slots of their new copy.
+ *  - Raw objects (o_alloc_raw) have no slots.
+ *
+ *  \param   h    The heap of the object
+ *  \param   ptr  Pointer to object
+ *  \param   f    Visitor called for every pointer slot
+ *  \param   ctx  Context passed on to \a f
+ */
+void o_foreach_pointer(heap_t *h, void *ptr, o_pointer_f f, void *ctx);
+
+/**
+ *  Like o_foreach_pointer, decoding \a header rather than the header
+ *  stored before the object.
+ *
+ *  \param   h       The heap of the object
+ *  \param   ptr     Pointer to object
+ *  \param   header  The object's header
+ *  \param   f       Visitor called for every pointer slot
+ *  \param   ctx     Context passed on to \a f
+ */
+void o_foreach_pointer_header(heap_t *h, void *ptr, intptr_t header, o_pointer_f f, void *ctx);
+
+/**
+ *  Returns the object stored in a page chunk. A chunk is the page
+ *  memory taken by one object: an optional prefix (O_COMPACT_UNION or
+ *  O_COMPACT_ARRAY), the header and the object itself.
+ *
+ *  \param   chunk  Address of the first word of the chunk
+ *  \return  Pointer to the object
+ */
+void *o_chunk_object(void *chunk);
+
+/**
+ *  Returns the address of the chunk holding an object.
+ *
+ *  \sa o_chunk_object
+ *
+ *  \param   ptr  Pointer to object (may be forwarded)
+ *  \return  Address of the first word of the chunk
+ */
+void *o_get_chunk(void *ptr);
+
+/**
+ *  Returns the size of a chunk in bytes, i.e. the distance to the
+ *  next chunk in the page.
+ *
+ *  \sa o_chunk_object
+ *
+ *  \param   chunk  Address of the first word of the chunk
+ *  \return  Size of the chunk in bytes
+ */
+size_t o_chunk_size(void *chunk);
+
 /**
  *  Returns header of object.
  *
@@ -318,15 +531,23 @@ void **o_get_pointer_in_object(void *ptr, size_t n);
 intptr_t o_get_header(void *ptr);
 
 /**
- *  Returns size of object in bytes. Does not work
- *  for objects allocated using o_alloc_union.
- *
- *  TODO
+ *  Returns size of object in bytes (excluding its header).
  *
  *  \param   ptr  Pointer to object
  *  \return  Size of object in bytes
  */
 size_t o_get_object_size(void *ptr);
 
+/**
+ *  Returns size of object in bytes (excluding its header), as given
+ *  by \a header rather than the header stored before the object.
+ *  Used while the stored header is temporarily overwritten.
+ *
+ *  \param   ptr     Pointer to object
+ *  \param   header  The object's header
+ *  \return  Size of object in bytes
+ */
+size_t o_size_from_header(void *ptr, intptr_t header);
+
 
 #endif
@@ -1,111 +1,27 @@
+#include <assert.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "h_init.h"
 #include "stacktrace.h"
 #include "object.h"
+#include "gc_copy.h"
+#include "gc_compact.h"
+#include "gc_parallel.h"
+#include "gc_incremental.h"
+#include "h_thread.h"
+#include "gc_roots.h"
+#include "gc.h"
+#include "h_large.h"
+#include "gc_stats.h"
+#include "h_policy.h"
 
 extern char **environ;
 
 
-typedef struct _node_t node_t;
-typedef struct _list_t list_t;
-typedef struct _iter_t iter_t;
-
-struct _node_t
-{
-    void *element;
-    struct _node_t *next;
-};
-
-struct _list_t
-{
-    node_t *first;
-    node_t *last;
-};
-
-
-
-struct _iter_t
-{
-    node_t *cur;
-};
-
-iter_t *iter(list_t *l)
-{
-    assert(l);
-    iter_t *it = calloc(1, sizeof(struct _iter_t));
-    it->cur = l->first;
-    return it;
-}
-
-void iter_next(iter_t *it)
-{
-    assert(it);
-    if (it->cur)
-        {
-            it->cur = it->cur->next;
-        }
-}
-
-bool iter_done(iter_t *it)
-{
-    assert(it);
-    return !it->cur;
-}
-
-void *iter_get(iter_t *it)
-{
-    assert(it && it->cur);
-    return it->cur->element;
-}
-
-void iter_free(iter_t *it)
-{
-    free(it);
-}
-
-
-
-list_t *list_new()
-{
-    return calloc(1, sizeof(struct _list_t));
-}
-
-
-node_t *list_node_new()
-{
-    return calloc(1, sizeof(struct _node_t));
-}
-
-
-void list_add(list_t *l, void *elt)
-{
-    assert(l);
-    assert((l->first && l->last) || (!l->first && !l->last));
-
-    node_t *new_last = list_node_new();
-    new_last->element = elt;
-
-    if (l->first && l->last)
-        {
-            l->last->next = new_last;
-            l->last = new_last;
-        }
-    else
-        {
-            l->first = l->last = new_last;
-        }
-}
-
-size_t h_used(heap_t *h){ //dummy
-	return 1;
-}
-
-bool heap_is_safe(heap_t *h) { //dummy
-	return true;
-}
-
-#define Dump_registers()						
-    jmp_buf env;								
-    if (setjmp(env)) abort();					
+#define Dump_registers()						\
+    __builtin_unwind_init()
 
 void *stack_find_bottom() {
 	void *bottom = environ;
@@ -113,6 +29,8 @@ void *stack_find_bottom() {
 }
 
 
+// Must not be inlined, the frame of the caller has to be above the top
+__attribute__((noinline))
 void *stack_find_top() {
 	void *top = __builtin_frame_address(0);
 	return top;
@@ -120,131 +38,305 @@ void *stack_find_top() {
 
 
 bool stack_check_pointer(heap_t *h, void *p) { 
-	return ((address_inside_heap_memory(h, p)) && (address_within_pages(h, p)));
+	return ((address_inside_heap_memory(h, p)) && (address_within_pages(h, p))) ||
+		h_large_find(h, p) != NULL;
 }
 
 
-void* stack_trace(heap_t *h, void *current, void *bottom) {
-	while(current < bottom){
-		intptr_t i = *(intptr_t *)current;
-		void *p = (void*)i;   
-		if (stack_check_pointer(h, p)) {
-			printf("First pointer on adr: %ld\n", (long)&p);
-			printf("&First pointer on adr: %ld\n", (long)p);
-			printf("Stack adr to first pointer on adr: %ld\n", (long)current);
-			return current;
+uint64_t stack_candidates_scalar(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n) {
+	uint64_t bits = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (((uintptr_t)words[i] & mask) == base || ((uintptr_t)words[i] & mask2) == base2) {
+			bits |= 1UL << i;
 		}
-		else {current = current+sizeof(void *);}
 	}
-	return NULL;
+	return bits;
 }
 
-
-
-list_t* gc_list(heap_t *h) {
-	list_t *l = list_new();
-	Dump_registers();
-	void *bottom = stack_find_bottom();
-	void *current = stack_find_top();
-
-	while(current != NULL) {
-		current = stack_trace(h, current, bottom);
-
-		if (current==NULL) {break;}
-		list_add(l, current);
-		
-		intptr_t i = *(intptr_t *)current;
-		void *p = (void*)i; 
-		//flag_page_as_new_space(h, p);
-		current = current+sizeof(void*);
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this needs no check at runtime. It has no
+// 64 bit compare: a word matches when both of its 32 bit halves do.
+uint64_t stack_candidates_sse2(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n) {
+	__m128i vmask = _mm_set1_epi64x((long long)mask);
+	__m128i vbase = _mm_set1_epi64x((long long)base);
+	__m128i vmask2 = _mm_set1_epi64x((long long)mask2);
+	__m128i vbase2 = _mm_set1_epi64x((long long)base2);
+	uint64_t bits = 0;
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(words + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(words + i + 2));
+		__m128i a2 = _mm_cmpeq_epi32(_mm_and_si128(a, vmask2), vbase2);
+		__m128i b2 = _mm_cmpeq_epi32(_mm_and_si128(b, vmask2), vbase2);
+		a = _mm_cmpeq_epi32(_mm_and_si128(a, vmask), vbase);
+		b = _mm_cmpeq_epi32(_mm_and_si128(b, vmask), vbase);
+		a = _mm_or_si128(_mm_and_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1))),
+			_mm_and_si128(a2, _mm_shuffle_epi32(a2, _MM_SHUFFLE(2, 3, 0, 1))));
+		b = _mm_or_si128(_mm_and_si128(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1))),
+			_mm_and_si128(b2, _mm_shuffle_epi32(b2, _MM_SHUFFLE(2, 3, 0, 1))));
+		uint64_t found = (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(a)) |
+			(uint64_t)_mm_movemask_pd(_mm_castsi128_pd(b)) << 2;
+		bits |= found << i;
+	}
+	if (i < n) {
+		bits |= stack_candidates_scalar(mask, base, mask2, base2, words + i, n - i) << i;
 	}
+	return bits;
+}
 
-	return l;
+__attribute__((target("avx2")))
+uint64_t stack_candidates_avx2(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n) {
+	__m256i vmask = _mm256_set1_epi64x((long long)mask);
+	__m256i vbase = _mm256_set1_epi64x((long long)base);
+	__m256i vmask2 = _mm256_set1_epi64x((long long)mask2);
+	__m256i vbase2 = _mm256_set1_epi64x((long long)base2);
+	uint64_t bits = 0;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(words + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(words + i + 4));
+		a = _mm256_or_si256(_mm256_cmpeq_epi64(_mm256_and_si256(a, vmask), vbase),
+			_mm256_cmpeq_epi64(_mm256_and_si256(a, vmask2), vbase2));
+		b = _mm256_or_si256(_mm256_cmpeq_epi64(_mm256_and_si256(b, vmask), vbase),
+			_mm256_cmpeq_epi64(_mm256_and_si256(b, vmask2), vbase2));
+		uint64_t found = (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(a)) |
+			(uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(b)) << 4;
+		bits |= found << i;
+	}
+	if (i < n) {
+		bits |= stack_candidates_scalar(mask, base, mask2, base2, words + i, n - i) << i;
+	}
+	return bits;
 }
 
+#endif
 
+uint64_t stack_candidates_resolve(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n);
 
-void* p_free_addr(page_t *p, size_t s){}
+/// The candidate finder for this CPU, chosen on first use
+stack_candidates_f stack_candidates_impl = stack_candidates_resolve;
 
-void* h_free_addr(heap_t *h, size_t s){}
-bool is_page_newspace(heap_t *h, void* a){}
+uint64_t stack_candidates_resolve(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n) {
+	stack_candidates_f impl = stack_candidates_scalar;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	impl = __builtin_cpu_supports("avx2") ? stack_candidates_avx2 : stack_candidates_sse2;
+#endif
+	// Every thread resolves the same function, so racing is harmless
+	__atomic_store_n(&stack_candidates_impl, impl, __ATOMIC_RELAXED);
+	return impl(mask, base, mask2, base2, words, n);
+}
 
-void* o_copy_object(void* p){
-	
+uint64_t stack_candidates(heap_t *h, void **words, size_t n) {
+	assert(n <= 64);
+	stack_candidates_f impl = __atomic_load_n(&stack_candidates_impl, __ATOMIC_RELAXED);
+	return impl(h->region_mask, (uintptr_t)h, h->large_mask, h->large_base, words, n);
 }
 
 
-intptr_t gc_depth(heap_t *h, void *p){
-	intptr_t header = o_get_header(p);
-	if (O_HEADER_GET_TYPE(header)==3) {
-		return O_HEADER_GET_PTR(header);
+void stack_scan(heap_t *h, void *top, void *bottom, stack_root_f f, void *ctx) {
+	void **current = top;
+	size_t found = 0;
+	size_t confirmed = 0;
+	while ((char *)current + sizeof(void *) <= (char *)bottom) {
+		size_t n = ((char *)bottom - (char *)current)/sizeof(void *);
+		if (n > 64) {
+			n = 64;
+		}
+		uint64_t candidates = stack_candidates(h, current, n);
+		found += (size_t)__builtin_popcountll(candidates);
+		while (candidates != 0) {
+			void **slot = current + __builtin_ctzll(candidates);
+			candidates &= candidates - 1;
+			if (address_within_pages(h, *slot) || h_large_find(h, *slot) != NULL) {
+				confirmed++;
+				f(slot, ctx);
+			}
+		}
+		current += n;
 	}
-	size_t number_of_ptrs_in_object = o_pointers_in_object(p);
+	gc_stats_roots(h, found, confirmed);
+}
 
-	for(size_t i = 0;i<=number_of_ptrs_in_object;i++) {
-		if (number_of_ptrs_in_object==0) {
-			if (is_page_newspace(h, p)) {
-				return (intptr_t)p;
+
+void* stack_trace(heap_t *h, void *current, void *bottom) {
+	void **block = current;
+	while ((char *)block + sizeof(void *) <= (char *)bottom) {
+		size_t n = ((char *)bottom - (char *)block)/sizeof(void *);
+		if (n > 64) {
+			n = 64;
+		}
+		uint64_t candidates = stack_candidates(h, block, n);
+		while (candidates != 0) {
+			void **slot = block + __builtin_ctzll(candidates);
+			candidates &= candidates - 1;
+			if (address_within_pages(h, *slot) || h_large_find(h, *slot) != NULL) {
+				return slot;
 			}
-			void* new_address = o_copy_object(p);
-			intptr_t fwd_address = (intptr_t)new_address;
-			return fwd_address;
 		}
-		void** current_object = o_get_pointer_in_object(p,i);
-		if (current_object==NULL) {assert(false);}
-		intptr_t new_address = gc_depth(h, *current_object);
-		number_of_ptrs_in_object--;
+		block += n;
 	}
-	assert(false);
+	return NULL;
 }
 
-size_t h_gc(heap_t *h) {
+
+__attribute__((noinline))
+size_t gc_collect(heap_t *h, void *top, void *bottom, bool unsafe_stack, bool minor) {
+	uint64_t start = gc_stats_now();
+	h_thread_stop(h);
 	size_t start_bytes = h_used(h);
-	Dump_registers();
-	void *bottom = stack_find_bottom();
-	void *current = stack_find_top();
-	if (heap_is_safe(h)) { 
-		while(current != NULL) {
-			current = stack_trace(h, current, bottom);
-			if (current==NULL) {
-
-				size_t end_bytes = h_used(h);
-				return (start_bytes - end_bytes);
+	uint64_t roots = gc_stats_now();
+	size_t n_stacks;
+	h_stack_t *stacks = h_thread_stacks(h, top, bottom, &n_stacks);
+	if (h->precise_roots) {
+		n_stacks = 0;
+	}
+
+	gc_incremental_abort(h);
+
+	uint64_t copy = 0;
+	uint64_t release;
+	bool parallel = h->gc_pool != NULL;
+	bool compact = !minor && gc_compact_needed(h);
+	if (!compact) {
+		if (parallel) {
+			gc_parallel_begin(h, minor);
+			gc_parallel_roots(h, stacks, n_stacks, unsafe_stack);
+			copy = gc_stats_now();
+			gc_parallel_scan(h);
+			release = gc_stats_now();
+			gc_parallel_end(h);
+		}
+		else {
+			gc_copy_begin(h, minor);
+			gc_roots_scan(h, stacks, n_stacks);
+			gc_roots_sort(h, unsafe_stack);
+			for (size_t i = 0; i < h->root_count && !unsafe_stack; i++) {
+				gc_copy_interior(h, h->roots[i].value);
+			}
+			for (size_t i = 0; i < h->root_count; i++) {
+				h_root_t *root = &h->roots[i];
+				if (i + GC_ROOTS_PREFETCH < h->root_count) {
+					gc_roots_prefetch(h, root + GC_ROOTS_PREFETCH, unsafe_stack);
+				}
+				if (unsafe_stack) {
+					gc_copy_pin(h, root->value);
+				}
+				else {
+					gc_copy_root(h, root->slot);
+				}
 			}
-			else {
-				intptr_t i = *(intptr_t *)current;
-				void *p = (void*)i; 
-				i = gc_depth(h, p);
-				current = current+sizeof(void*);
+			// Precise roots come once every page is pinned, an object copied
+			// out of a page pinned later would have two copies
+			gc_roots_precise(h);
+			gc_roots_sort(h, false);
+			for (size_t i = 0; i < h->root_count; i++) {
+				if (i + GC_ROOTS_PREFETCH < h->root_count) {
+					gc_roots_prefetch(h, &h->roots[i + GC_ROOTS_PREFETCH], false);
+				}
+				gc_copy_root(h, h->roots[i].slot);
 			}
+			copy = gc_stats_now();
+			gc_copy_scan(h);
+			release = gc_stats_now();
+			gc_copy_end(h);
 		}
+		// A copy that ran out of free pages left the survivors it could
+		// not fit in their pages, compacting packs them together (and
+		// ages them once more)
+		compact = !minor && h->to_space_full;
 	}
-	list_t *l = gc_list(h); 
-    iter_t *it;
-    for (it = iter(l); !iter_done(it); iter_next(it))
-	{
-		intptr_t i = *(intptr_t *)current;
-		void *p = (void*)i; 
-		gc_depth(h, iter_get(it));
+	if (compact) {
+		gc_compact_begin(h);
+		gc_compact_roots(h, stacks, n_stacks, unsafe_stack);
+		if (copy == 0) {
+			copy = gc_stats_now();
+		}
+		gc_compact_mark(h);
+		gc_compact_move(h);
+		release = gc_stats_now();
+		gc_compact_end(h);
 	}
-    iter_free(it);
 
 	size_t end_bytes = h_used(h);
-	return (start_bytes - end_bytes);	
+	size_t collected = start_bytes > end_bytes ? start_bytes - end_bytes : 0;
+	h->stats.collections++;
+	h->stats.minor_collections += minor;
+	h->stats.compactions += compact;
+	h->stats.bytes_reclaimed += collected;
+	h->stats.bytes_live = end_bytes;
+	if (!minor) {
+		h_policy_cycle(h, start, start_bytes, end_bytes);
+	}
+	h_pages_adjust(h, !minor);
+
+	uint64_t end = gc_stats_now();
+	gc_stats_pause(&h->stats.root_scan, roots, copy);
+	gc_stats_pause(&h->stats.copy, copy, release);
+	gc_stats_pause(&h->stats.page_release, release, end);
+	gc_stats_pause(&h->stats.pause, start, end);
+	h_policy_pause(h, start, end);
+	h_thread_resume(h);
+	return collected;
+}
+
+size_t h_gc(heap_t *h) {
+	return h_gc_dbg(h, h->unsafe_stack);
+}
+
+size_t h_gc_dbg(heap_t *h, bool unsafe_stack) {
+	// Spill the callee-saved registers into this frame, where the stack
+	// scan finds them. Safe pointers updated there are reloaded on return.
+	Dump_registers();
+	volatile size_t collected = gc_collect(h, stack_find_top(), stack_find_bottom(), unsafe_stack, false);
+	return collected;
 }
 
-  
+__attribute__((noinline))
+size_t gc_step(heap_t *h, void *top, void *bottom, uint64_t budget_ns) {
+	uint64_t start = gc_stats_now();
+	h_thread_stop(h);
+	if (!gc_incremental_running(h)) {
+		// The snapshot: stack roots are only scanned when a cycle starts
+		uint64_t roots = gc_stats_now();
+		size_t n_stacks;
+		h_stack_t *stacks = h_thread_stacks(h, top, bottom, &n_stacks);
+		gc_incremental_begin(h);
+		h->policy.cycle_bytes = h_used(h);
+		gc_roots_scan(h, stacks, h->precise_roots ? 0 : n_stacks);
+		for (size_t i = 0; i < h->root_count; i++) {
+			gc_incremental_root(h, h->roots[i].value);
+		}
+		gc_roots_precise(h);
+		for (size_t i = 0; i < h->root_count; i++) {
+			gc_incremental_root(h, h->roots[i].value);
+		}
+		gc_stats_pause(&h->stats.root_scan, roots, gc_stats_now());
+	}
+	size_t collected = gc_incremental_work(h, budget_ns);
+	h->stats.bytes_reclaimed += collected;
+	if (!gc_incremental_running(h)) {
+		h->stats.incremental_cycles++;
+		h->stats.bytes_live = h_used(h);
+		h_policy_cycle(h, start, h->policy.cycle_bytes, h->stats.bytes_live);
+		h_pages_adjust(h, true);
+	}
+	uint64_t end = gc_stats_now();
+	gc_stats_pause(&h->stats.step, start, end);
+	h_policy_pause(h, start, end);
+	h_thread_resume(h);
+	return collected;
+}
 
+size_t h_gc_step(heap_t *h, uint64_t budget_ns) {
+	Dump_registers();
+	volatile size_t collected = gc_step(h, stack_find_top(), stack_find_bottom(), budget_ns);
+	return collected;
+}
 
-int main(int argc, char *argv[])
-{
-  	heap_t *h = h_init(1024*16, true, 0.95);
-	long *a = calloc(1,sizeof(long));
-	*a = 123456;
-	long *b = calloc(1,sizeof(long));
-	*b = 123456;
-	int one = 1;
-	int two = 2;
-	int three = 3;
-	return 0;
+size_t h_gc_minor(heap_t *h) {
+	Dump_registers();
+	volatile size_t collected = gc_collect(h, stack_find_top(), stack_find_bottom(), h->unsafe_stack, true);
+	return collected;
 }
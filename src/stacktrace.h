@@ -44,9 +44,77 @@ bool stack_check_pointer(heap_t *h, void *p);// intptr_t *p
 
 
 /**
- *  Traverse stack and check each adress if it might contain a pointer to the heap
+ *  The signature of the function stack_scan calls for every root.
+ */
+typedef void (*stack_root_f)(void **slot, void *ctx);
+
+
+/**
+ *  A candidate finder: sets bit i of the result if words[i] masked
+ *  with mask equals base, or masked with mask2 equals base2, for
+ *  n <= 64 words.
+ */
+typedef uint64_t (*stack_candidates_f)(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n);
+
+
+/**
+ *  The candidate finder comparing one word at a time, for any CPU.
+ */
+uint64_t stack_candidates_scalar(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n);
+
+
+#if defined(__x86_64__)
+/**
+ *  The candidate finder comparing 4 words at a time with SSE2.
+ */
+uint64_t stack_candidates_sse2(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n);
+
+
+/**
+ *  The candidate finder comparing 8 words at a time with AVX2, only
+ *  to be called where the CPU supports it.
+ */
+uint64_t stack_candidates_avx2(uintptr_t mask, uintptr_t base, uintptr_t mask2, uintptr_t base2, void **words, size_t n);
+#endif
+
+
+/**
+ *  Find the candidate pointers in a block of stack words, i.e. the words
+ *  pointing into the heap's memory (see address_inside_heap_memory) or
+ *  into the block of addresses spanning its large objects (h_large.h).
+ *  Compares 4 (SSE2) or 8 (AVX2) words at a time where the CPU supports it,
+ *  chosen at runtime.
+ *
+ *  \param h      the heap
+ *  \param words  the block
+ *  \param n      amount of words in the block, at most 64
+ *  \return       bit i set if words[i] is a candidate
+ */
+uint64_t stack_candidates(heap_t *h, void **words, size_t n);
+
+
+/**
+ *  Traverse stack and call f for every word pointing into a used area
+ *  of the heap or into a large object. Only the candidates found by stack_candidates get that
+ *  (exact) check.
  *
+ *  \param h       the heap
+ *  \param top     address to start at (the top of the stack)
+ *  \param bottom  address to stop at
+ *  \param f       function called with the address of every root
+ *  \param ctx     passed on to f
+ */
+void stack_scan(heap_t *h, void *top, void *bottom, stack_root_f f, void *ctx);
+
+
+/**
+ *  Traverse stack and check each adress if it might contain a pointer to the heap
  *
+ *  \param h        the heap
+ *  \param current  address to start at (the top of the stack)
+ *  \param bottom   address to stop at
+ *  \return         address of the first stack word pointing into the heap,
+ *                  NULL if there is none
  */
 void* stack_trace(heap_t *h, void *current, void *bottom);
 
@@ -0,0 +1,154 @@
+/**
+ *   \file test_alloc.c
+ *   \brief Tests of the allocator
+ *
+ *   Allocation bumps the front of the current page of a size class,
+ *   and switches pages on the slow path when it is full. Objects
+ *   come zeroed, whichever path they take. The bytes allocated are
+ *   counted as pages are retired.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_alloc.h"
+#include "h_init.h"
+
+/**
+ *  Returns the current page objects of a size go in.
+ */
+static page_t *test_page(heap_t *h, size_t bytes)
+{
+  return h_alloc_current(h)[h_size_class(h, H_CHUNK_SIZE(bytes))];
+}
+
+static void test_bump(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  h_alloc_struct(h, "*l");
+  page_t *page = test_page(h, 2*sizeof(long));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(page);
+  size_t size = page->chunk_size != 0 ? page->chunk_size : H_CHUNK_SIZE(2*sizeof(long));
+
+  // the fast path: each object right after the last, in the same page
+  size_t fits = (page->limit - page->distance_front)/size;
+  for(size_t i = 0; i < fits; i++) {
+    size_t front = page->distance_front;
+    long *obj = h_alloc_struct(h, "*l");
+    CU_ASSERT_PTR_EQUAL(obj, (char *)page + front + sizeof(intptr_t));
+    CU_ASSERT_EQUAL(page->distance_front, front + size);
+    CU_ASSERT(obj[0] == 0 && obj[1] == 0);
+  }
+
+  // the slow path, once the page is full
+  long *obj = h_alloc_struct(h, "*l");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+  CU_ASSERT_PTR_NOT_EQUAL(test_page(h, 2*sizeof(long)), page);
+  CU_ASSERT(obj[0] == 0 && obj[1] == 0);
+  h_delete(h);
+}
+
+static void test_zeroed(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+
+  // objects of every size class and a few pages' worth, dirtied so
+  // that reused memory would show
+  for(int round = 0; round < 3; round++) {
+    for(size_t bytes = 1; bytes < 3000; bytes = bytes*3/2 + 1) {
+      unsigned char *data = h_alloc_data(h, bytes);
+      CU_ASSERT_PTR_NOT_NULL_FATAL(data);
+      bool zeroed = true;
+      for(size_t i = 0; i < bytes; i++) {
+        zeroed &= data[i] == 0;
+      }
+      CU_ASSERT_TRUE(zeroed);
+      memset(data, 0xff, bytes);
+    }
+    h_gc(h);
+  }
+  h_delete(h);
+}
+
+/**
+ *  Returns the bytes a heap has allocated so far.
+ */
+static uint64_t test_allocated(heap_t *h)
+{
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  return stats.bytes_allocated;
+}
+
+static void test_counted(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  uint64_t allocated = test_allocated(h);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h_alloc_struct(h, "*l"));
+  page_t *page = test_page(h, 2*sizeof(long));
+  size_t size = page->chunk_size != 0 ? page->chunk_size : H_CHUNK_SIZE(2*sizeof(long));
+  CU_ASSERT_EQUAL(test_allocated(h), allocated + size);
+
+  // the pages filled and retired along the way count what went in
+  // them, as does the one still allocated into
+  allocated = test_allocated(h);
+  size_t n = 3*h->pagesize/size;
+  for(size_t i = 0; i < n; i++) {
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h_alloc_struct(h, "*l"));
+  }
+  CU_ASSERT_PTR_NOT_EQUAL(test_page(h, 2*sizeof(long)), page);
+  CU_ASSERT_EQUAL(test_allocated(h), allocated + n*size);
+
+  // copying the survivors is not allocation, nor is the room the
+  // collection leaves in the pages it copied into
+  allocated = test_allocated(h);
+  h_gc(h);
+  CU_ASSERT_EQUAL(test_allocated(h), allocated);
+  for(size_t i = 0; i < n; i++) {
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h_alloc_struct(h, "*l"));
+  }
+  CU_ASSERT_EQUAL(test_allocated(h), allocated + n*size);
+
+  // large objects count when they are allocated
+  allocated = test_allocated(h);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h_alloc_data(h, 3*h->pagesize));
+  CU_ASSERT_EQUAL(test_allocated(h), allocated + H_CHUNK_SIZE(3*h->pagesize));
+
+  // the bytes in use are those the last collection left
+  h_gc(h);
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT_EQUAL(stats.bytes_live, h_used(h));
+  CU_ASSERT_EQUAL(stats.bytes_allocated, allocated + H_CHUNK_SIZE(3*h->pagesize));
+  h_delete(h);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("alloc", NULL, NULL);
+  if(suite == NULL ||
+     CU_add_test(suite, "bump pointer", test_bump) == NULL ||
+     CU_add_test(suite, "zeroed", test_zeroed) == NULL ||
+     CU_add_test(suite, "bytes allocated", test_counted) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
@@ -0,0 +1,341 @@
+/**
+ *   \file test_collect.c
+ *   \brief Tests of the collector in each of its modes
+ *
+ *   Every test builds the graph of test_graph.h, collects the heap
+ *   several times while replacing parts of it, and checks after
+ *   each collection that the graph is intact.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_init.h"
+#include "test_graph.h"
+
+/**
+ *  \def TEST_LENGTH
+ *  Amount of nodes of the list of the graphs.
+ */
+#define TEST_LENGTH 20000
+
+/**
+ *  \def TEST_ROUNDS
+ *  Amount of collections the graphs go through.
+ */
+#define TEST_ROUNDS 5
+
+/**
+ *  The root slot of the graph under test.
+ */
+static test_graph_t *graph;
+
+/**
+ *  Creates a heap and registers the root slot of the graph in it.
+ *
+ *  \param   bytes         the size of the heap
+ *  \param   unsafe_stack  whether the stack is scanned conservatively
+ *  \param   opts          the heap's settings, NULL for the defaults
+ *  \return  the heap, NULL if it could not be created
+ */
+static heap_t *test_heap(size_t bytes, bool unsafe_stack, const h_options_t *opts)
+{
+  heap_t *h = h_init_opt(bytes, unsafe_stack, 0.5f, opts);
+  if(h != NULL && !h_add_root(h, (void **)&graph)) {
+    h_delete(h);
+    return NULL;
+  }
+  return h;
+}
+
+/**
+ *  Deletes a heap created by test_heap.
+ */
+static void test_heap_delete(heap_t *h)
+{
+  h_remove_root(h, (void **)&graph);
+  graph = NULL;
+  h_delete(h);
+}
+
+/**
+ *  Builds the graph, then collects it TEST_ROUNDS times, replacing
+ *  some of its nodes and allocating garbage before each collection.
+ *
+ *  \param   h        the heap
+ *  \param   collect  the kind of collection to run
+ */
+static void test_rounds(heap_t *h, size_t (*collect)(heap_t *))
+{
+  test_graph_build(h, &graph, TEST_LENGTH);
+  CU_ASSERT_TRUE(test_graph_check(graph, TEST_LENGTH));
+  for(int round = 0; round < TEST_ROUNDS; round++) {
+    test_graph_renew(h, &graph, round + 2);
+    for(long i = 0; i < TEST_LENGTH; i++) {
+      test_garbage(h);
+    }
+    collect(h);
+    CU_ASSERT_TRUE(test_graph_check(graph, TEST_LENGTH));
+  }
+}
+
+static void test_copy(void)
+{
+  heap_t *h = test_heap(32 << 20, false, NULL);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_rounds(h, h_gc);
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.collections >= TEST_ROUNDS);
+  CU_ASSERT_EQUAL(stats.objects_pinned, 0);
+  test_heap_delete(h);
+}
+
+static void test_parallel(void)
+{
+  h_options_t opts = { .gc_threads = 4, .page_size = 8192 };
+  heap_t *h = test_heap(32 << 20, false, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_rounds(h, h_gc);
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.collections >= TEST_ROUNDS);
+  test_heap_delete(h);
+}
+
+static void test_generational(void)
+{
+  h_options_t opts = { .tenure_age = 2, .nursery_pages = 64 };
+  heap_t *h = test_heap(32 << 20, false, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_rounds(h, h_gc_minor);
+  h_gc(h);
+  CU_ASSERT_TRUE(test_graph_check(graph, TEST_LENGTH));
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.minor_collections >= TEST_ROUNDS);
+  test_heap_delete(h);
+}
+
+/**
+ *  Runs an incremental cycle in small steps to its end.
+ */
+static size_t test_cycle(heap_t *h)
+{
+  size_t collected = h_gc_step(h, 20000);
+  for(int i = 0; i < 8; i++) {
+    test_graph_renew(h, &graph, 50);
+    collected += h_gc_step(h, 20000);
+  }
+  return collected + h_gc_step(h, 0);
+}
+
+static void test_incremental(void)
+{
+  h_options_t opts = { .gc_step_ns = 50000 };
+  heap_t *h = test_heap(32 << 20, false, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_rounds(h, test_cycle);
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.incremental_cycles >= TEST_ROUNDS);
+  CU_ASSERT(stats.step.count > 0);
+  test_heap_delete(h);
+}
+
+static void test_page_sizes(void)
+{
+  // from pages that hardly hold a pointer array of the graph, to
+  // pages that hold its large array
+  size_t sizes[] = { 256, 512, 16384, 65536 };
+  for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    h_options_t opts = { .page_size = sizes[i] };
+    heap_t *h = test_heap(32 << 20, false, &opts);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+    test_rounds(h, h_gc);
+    test_heap_delete(h);
+  }
+  h_options_t huge = { .huge_pages = true };
+  heap_t *h = test_heap(32 << 20, false, &huge);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_rounds(h, h_gc);
+  test_heap_delete(h);
+}
+
+static void test_precise(void)
+{
+  h_options_t opts = { .precise_roots = true };
+  heap_t *h = test_heap(32 << 20, true, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+
+  // a second graph, only reachable from a shadow stack frame
+  test_graph_t *other = NULL;
+  H_PUSH_ROOTS(h, &other);
+  test_graph_build(h, &other, TEST_LENGTH);
+  test_rounds(h, h_gc);
+  CU_ASSERT_TRUE(test_graph_check(other, TEST_LENGTH));
+  H_POP_ROOTS(h);
+
+  // no stack word is taken for a root, so nothing is pinned
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT_EQUAL(stats.objects_pinned, 0);
+  CU_ASSERT_EQUAL(stats.root_candidates, 0);
+  test_heap_delete(h);
+}
+
+static void test_compact(void)
+{
+  // the graph takes over a third of the heap, so the free pages
+  // cannot hold its survivors when the heap runs full
+  heap_t *h = h_init(4 << 20, false, 0.9f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&graph));
+  test_graph_build(h, &graph, 3*TEST_LENGTH);
+  for(int round = 0; round < 4*TEST_ROUNDS; round++) {
+    test_graph_renew(h, &graph, 3);
+    CU_ASSERT_TRUE(test_graph_check(graph, 3*TEST_LENGTH));
+  }
+  h_gc(h);
+  CU_ASSERT_TRUE(test_graph_check(graph, 3*TEST_LENGTH));
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.compactions > 0);
+  test_heap_delete(h);
+}
+
+static void test_near_full(void)
+{
+  // the live data take more of the heap than the threshold allows:
+  // collections must still leave room for a share of them, rather
+  // than run for every page (thousands of times here). Precise
+  // roots, as a stale stack word into a replaced list would keep all
+  // of it alive.
+  h_options_t opts = { .precise_roots = true };
+  heap_t *h = test_heap(4 << 20, false, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_graph_build(h, &graph, 5*TEST_LENGTH);
+  gc_stats_t before;
+  h_stats(h, &before);
+  for(int round = 0; round < TEST_ROUNDS; round++) {
+    test_graph_renew(h, &graph, 1);
+  }
+  CU_ASSERT_TRUE(test_graph_check(graph, 5*TEST_LENGTH));
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.collections - before.collections < 60);
+  test_heap_delete(h);
+}
+
+static void test_pinning(void)
+{
+  heap_t *h = test_heap(32 << 20, true, NULL);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_graph_build(h, &graph, TEST_LENGTH);
+
+  // interior pointers on the stack, which must pin their objects
+  char *volatile pins[TEST_WIDE];
+  for(long i = 0; i < TEST_WIDE; i++) {
+    pins[i] = (char *)graph->wide[i] + sizeof(void *);
+  }
+  for(int round = 0; round < TEST_ROUNDS; round++) {
+    test_graph_renew(h, &graph, round + 2);
+    h_gc(h);
+    CU_ASSERT_TRUE(test_graph_check(graph, TEST_LENGTH));
+    for(long i = 0; i < TEST_WIDE; i++) {
+      CU_ASSERT_PTR_EQUAL(pins[i] - sizeof(void *), graph->wide[i]);
+    }
+  }
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.objects_pinned >= TEST_WIDE);
+  test_heap_delete(h);
+}
+
+/**
+ *  \def TEST_PINNED
+ *  Amount of pages test_pinned_holes pins an object in.
+ */
+#define TEST_PINNED 8
+
+static void test_pinned_holes(void)
+{
+  heap_t *h = h_init(32 << 20, true, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  long *first = h_alloc_struct(h, "*l");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(first);
+  page_t *page = (page_t *)((uintptr_t)first & ~(uintptr_t)(h->pagesize - 1));
+  size_t per_page = (h->pagesize - PAGE_HEADER_SIZE)/page->chunk_size;
+
+  // one object in the middle of each page is kept by an interior
+  // pointer, the rest of the page is garbage
+  char *volatile pins[TEST_PINNED];
+  for(size_t i = 1; i < TEST_PINNED*per_page; i++) {
+    long *obj = h_alloc_struct(h, "*l");
+    if(i % per_page == per_page/2) {
+      obj[1] = (long)i;
+      pins[i/per_page] = (char *)obj + sizeof(long);
+    }
+  }
+  gc_stats_t before;
+  h_stats(h, &before);
+  h_gc(h);
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.objects_pinned - before.objects_pinned >= TEST_PINNED);
+  CU_ASSERT_EQUAL(stats.pages_promoted, before.pages_promoted);
+  for(size_t i = 0; i < TEST_PINNED; i++) {
+    CU_ASSERT_EQUAL(*(long *)pins[i], (long)(i*per_page + per_page/2));
+  }
+
+  // the chunks around the pinned objects are handed out again
+  size_t reused = 0;
+  for(size_t i = 0; i < TEST_PINNED*per_page; i++) {
+    char *obj = h_alloc_struct(h, "*l");
+    for(size_t j = 0; j < TEST_PINNED; j++) {
+      reused += ((uintptr_t)obj ^ (uintptr_t)pins[j]) < h->pagesize;
+    }
+  }
+  CU_ASSERT(reused >= TEST_PINNED*(per_page - 2));
+  h_delete(h);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("collect", NULL, NULL);
+  if(suite == NULL ||
+     CU_add_test(suite, "copying", test_copy) == NULL ||
+     CU_add_test(suite, "parallel", test_parallel) == NULL ||
+     CU_add_test(suite, "generational", test_generational) == NULL ||
+     CU_add_test(suite, "incremental", test_incremental) == NULL ||
+     CU_add_test(suite, "page sizes", test_page_sizes) == NULL ||
+     CU_add_test(suite, "precise roots", test_precise) == NULL ||
+     CU_add_test(suite, "compaction", test_compact) == NULL ||
+     CU_add_test(suite, "near full heap", test_near_full) == NULL ||
+     CU_add_test(suite, "pinning", test_pinning) == NULL ||
+     CU_add_test(suite, "pinned pages keep holes", test_pinned_holes) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
@@ -0,0 +1,228 @@
+/**
+ *   \file test_graph.h
+ *   \brief An object graph the tests build, collect and check
+ *
+ *   The graph has an object of every kind the collector handles: a
+ *   linked list of structs, a pointer array, a union with a custom
+ *   trace function, raw data, a large array (bigger than a page)
+ *   sharing nodes with the pointer array, and a cycle back to its
+ *   root. Building it leaves garbage between the live objects.
+ *
+ *   Pointer stores go through h_write_barrier, so the graph may be
+ *   built and changed on generational heaps and during incremental
+ *   cycles. Every object is reached from the root slot again after
+ *   an allocation, so the graph survives collections that move
+ *   objects on heaps with precise roots.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "gc.h"
+
+#ifndef __test_graph__
+#define __test_graph__
+
+/**
+ *  \def TEST_WIDE
+ *  Amount of nodes the pointer array of a graph points to.
+ */
+#define TEST_WIDE 200
+
+/**
+ *  \def TEST_LARGE
+ *  Amount of slots of the large array of a graph, more than fit in a
+ *  page.
+ */
+#define TEST_LARGE 5000
+
+/**
+ *  \def TEST_DATA
+ *  Amount of longs of the raw data of a graph.
+ */
+#define TEST_DATA 100
+
+/**
+ *  A node of the list, "*l".
+ */
+typedef struct test_node {
+  struct test_node *next;
+  long value;
+} test_node_t;
+
+/**
+ *  The union, a tag telling whether p is a pointer.
+ */
+typedef struct test_box {
+  long tag;
+  void *p;
+} test_box_t;
+
+/**
+ *  The root of a graph, "6*".
+ *
+ *  list   The list, its nodes numbered from length - 1 down to 0.
+ *  wide   Pointer array of TEST_WIDE nodes, numbered from 1000.
+ *  box    The union, pointing to a node numbered 7.
+ *  data   TEST_DATA longs, the squares of their indices.
+ *  large  TEST_LARGE slots, slot i pointing to wide[i % TEST_WIDE].
+ *  self   The root itself.
+ */
+typedef struct test_graph {
+  test_node_t *list;
+  void **wide;
+  test_box_t *box;
+  long *data;
+  void **large;
+  struct test_graph *self;
+} test_graph_t;
+
+/**
+ *  Trace function of test_box_t.
+ */
+static inline void *test_box_trace(heap_t *h, trace_f f, void *obj)
+{
+  test_box_t *box = obj;
+  if(box->tag) {
+    box->p = f(h, box->p);
+  }
+  return obj;
+}
+
+/**
+ *  Allocates an unreachable node, garbage to collect.
+ */
+static inline void test_garbage(heap_t *h)
+{
+  h_alloc_struct(h, "*l");
+}
+
+/**
+ *  Prepends a node to the list of a graph.
+ *
+ *  \param   h      the heap
+ *  \param   root   the slot holding the graph, a root of the heap
+ *  \param   value  the node's value
+ */
+static inline void test_graph_push(heap_t *h, test_graph_t **root, long value)
+{
+  test_node_t *node = h_alloc_struct(h, "*l");
+  node->value = value;
+  node->next = (*root)->list;
+  h_write_barrier(h, *root, (void **)&(*root)->list, node);
+}
+
+/**
+ *  Builds a graph.
+ *
+ *  \param   h       the heap
+ *  \param   root    the slot the graph goes in, a root of the heap
+ *  \param   length  amount of nodes of the list
+ */
+static inline void test_graph_build(heap_t *h, test_graph_t **root, long length)
+{
+  *root = h_alloc_struct(h, "6*");
+  (*root)->self = *root;
+  for(long i = 0; i < length; i++) {
+    test_graph_push(h, root, i);
+    test_garbage(h);
+  }
+
+  void **wide = h_alloc_ptr_array(h, TEST_WIDE);
+  h_write_barrier(h, *root, (void **)&(*root)->wide, wide);
+  for(long i = 0; i < TEST_WIDE; i++) {
+    test_node_t *node = h_alloc_struct(h, "*l");
+    node->value = 1000 + i;
+    h_write_barrier(h, (*root)->wide, &(*root)->wide[i], node);
+    test_garbage(h);
+  }
+
+  test_box_t *box = h_alloc_union(h, sizeof(test_box_t), test_box_trace);
+  box->tag = 1;
+  h_write_barrier(h, *root, (void **)&(*root)->box, box);
+  test_node_t *boxed = h_alloc_struct(h, "*l");
+  boxed->value = 7;
+  h_write_barrier(h, (*root)->box, &(*root)->box->p, boxed);
+
+  long *data = h_alloc_data(h, TEST_DATA*sizeof(long));
+  for(long i = 0; i < TEST_DATA; i++) {
+    data[i] = i*i;
+  }
+  h_write_barrier(h, *root, (void **)&(*root)->data, data);
+
+  void **large = h_alloc_ptr_array(h, TEST_LARGE);
+  h_write_barrier(h, *root, (void **)&(*root)->large, large);
+  for(long i = 0; i < TEST_LARGE; i++) {
+    h_write_barrier(h, (*root)->large, &(*root)->large[i], (*root)->wide[i % TEST_WIDE]);
+  }
+}
+
+/**
+ *  Replaces every stride-th node of the list of a graph by a copy,
+ *  so the nodes it replaces become garbage, and old nodes get
+ *  pointers to young ones.
+ *
+ *  \param   h       the heap
+ *  \param   root    the slot holding the graph, a root of the heap
+ *  \param   stride  how many nodes apart the replaced ones are
+ */
+static inline void test_graph_renew(heap_t *h, test_graph_t **root, long stride)
+{
+  test_node_t *prev = (*root)->list;
+  H_PUSH_ROOTS(h, &prev);
+  while(prev != NULL && prev->next != NULL) {
+    test_node_t *node = h_alloc_struct(h, "*l");
+    test_node_t *old = prev->next;
+    node->value = old->value;
+    node->next = old->next;
+    h_write_barrier(h, prev, (void **)&prev->next, node);
+    for(long i = 0; i < stride && prev != NULL; i++) {
+      prev = prev->next;
+    }
+  }
+  H_POP_ROOTS(h);
+}
+
+/**
+ *  Checks a graph built by test_graph_build.
+ *
+ *  \param   graph   the graph
+ *  \param   length  amount of nodes of its list
+ *  \return  true if every object of the graph is intact
+ */
+static inline bool test_graph_check(test_graph_t *graph, long length)
+{
+  if(graph == NULL || graph->self != graph) {
+    return false;
+  }
+  long count = 0;
+  for(test_node_t *node = graph->list; node != NULL; node = node->next) {
+    if(node->value != length - 1 - count) {
+      return false;
+    }
+    count++;
+  }
+  if(count != length || h_array_length(graph->wide) != TEST_WIDE ||
+     h_array_length(graph->large) != TEST_LARGE) {
+    return false;
+  }
+  for(long i = 0; i < TEST_WIDE; i++) {
+    if(((test_node_t *)graph->wide[i])->value != 1000 + i) {
+      return false;
+    }
+  }
+  for(long i = 0; i < TEST_LARGE; i++) {
+    if(graph->large[i] != graph->wide[i % TEST_WIDE]) {
+      return false;
+    }
+  }
+  for(long i = 0; i < TEST_DATA; i++) {
+    if(graph->data[i] != i*i) {
+      return false;
+    }
+  }
+  return graph->box->tag == 1 && ((test_node_t *)graph->box->p)->value == 7;
+}
+
+#endif
@@ -0,0 +1,434 @@
+/**
+ *   \file test_heap.c
+ *   \brief Tests of the heap's memory
+ *
+ *   A heap is one reservation aligned to its own size: the address
+ *   checks every collector relies on must hold up to its very first
+ *   and last byte, and tell its pages apart from the large objects
+ *   mapped outside of it. Growable heaps commit more of their
+ *   reservation as they grow, and free pages are returned to the
+ *   system as the release policy says, to be handed out zeroed again.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_init.h"
+#include "h_large.h"
+#include "h_policy.h"
+#include "object.h"
+
+static void test_bounds(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  char *first = (char *)h;
+  char *end = h->pages + h->total_pages*h->pagesize;
+  uintptr_t region = ~h->region_mask + 1;
+
+  // the whole aligned region, and nothing around it
+  CU_ASSERT_TRUE(address_inside_heap_memory(h, first));
+  CU_ASSERT_TRUE(address_inside_heap_memory(h, h->pages));
+  CU_ASSERT_TRUE(address_inside_heap_memory(h, end - 1));
+  CU_ASSERT_TRUE(address_inside_heap_memory(h, first + region - 1));
+  CU_ASSERT_FALSE(address_inside_heap_memory(h, first - 1));
+  CU_ASSERT_FALSE(address_inside_heap_memory(h, first + region));
+  CU_ASSERT_FALSE(address_inside_heap_memory(h, NULL));
+
+  // no page is in use yet, and the metadata before the pages and the
+  // addresses after them are never pages
+  CU_ASSERT_FALSE(address_within_pages(h, first));
+  CU_ASSERT_FALSE(address_within_pages(h, h->pages - 1));
+  CU_ASSERT_FALSE(address_within_pages(h, h->pages + PAGE_HEADER_SIZE));
+  CU_ASSERT_FALSE(address_within_pages(h, end - 1));
+  CU_ASSERT_FALSE(address_within_pages(h, end));
+  CU_ASSERT_FALSE(address_within_pages(h, first + region));
+  h_delete(h);
+}
+
+static void test_page_bounds(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  long *obj = h_alloc_struct(h, "*l");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+  page_t *page = (page_t *)((uintptr_t)obj & ~(uintptr_t)(h->pagesize - 1));
+  char *start = (char *)page;
+
+  // the chunks of a page in use, from its header to its front
+  CU_ASSERT_TRUE(address_within_pages(h, obj));
+  CU_ASSERT_TRUE(address_within_pages(h, start + PAGE_HEADER_SIZE));
+  CU_ASSERT_TRUE(address_within_pages(h, start + page->distance_front - 1));
+  CU_ASSERT_FALSE(address_within_pages(h, start));
+  CU_ASSERT_FALSE(address_within_pages(h, start + PAGE_HEADER_SIZE - 1));
+  CU_ASSERT_FALSE(address_within_pages(h, start + page->distance_front));
+  CU_ASSERT_FALSE(address_within_pages(h, start + h->pagesize - 1));
+  CU_ASSERT_TRUE(address_inside_heap_memory(h, start + h->pagesize - 1));
+  h_delete(h);
+}
+
+static void test_large_bounds(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_PTR_NULL(h_large_find(h, h->pages));
+  size_t bytes = 3*h->pagesize;
+  char *obj = h_alloc_data(h, bytes);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+  h_large_t *large = h_large_of(obj);
+  CU_ASSERT_PTR_EQUAL(h_large_object(large), obj);
+
+  // large objects live outside the heap's region, found by the
+  // large object space from the first to the last byte of their chunk
+  char *chunk = (char *)large + H_LARGE_HEADER_SIZE;
+  CU_ASSERT_FALSE(address_inside_heap_memory(h, obj));
+  CU_ASSERT_FALSE(address_within_pages(h, obj));
+  CU_ASSERT_FALSE(address_within_pages(h, chunk + large->chunk_size - 1));
+  CU_ASSERT_PTR_EQUAL(h_large_find(h, chunk), large);
+  CU_ASSERT_PTR_EQUAL(h_large_find(h, obj), large);
+  CU_ASSERT_PTR_EQUAL(h_large_find(h, obj + bytes - 1), large);
+  CU_ASSERT_PTR_EQUAL(h_large_find(h, chunk + large->chunk_size - 1), large);
+  CU_ASSERT_PTR_NULL(h_large_find(h, chunk + large->chunk_size));
+  CU_ASSERT_PTR_NULL(h_large_find(h, chunk - 1));
+  CU_ASSERT_PTR_NULL(h_large_find(h, h->pages));
+
+  // the block the stack scan checks spans the chunk
+  CU_ASSERT_EQUAL((uintptr_t)chunk & h->large_mask, h->large_base);
+  CU_ASSERT_EQUAL((uintptr_t)(chunk + large->chunk_size - 1) & h->large_mask,
+                  h->large_base);
+  h_delete(h);
+}
+
+/**
+ *  Counts the free pages of a heap, and those of them released to
+ *  the system.
+ */
+static size_t test_free_pages(heap_t *h, size_t *released)
+{
+  size_t free = 0;
+  *released = 0;
+  for(size_t i = 0; i < h->committed_pages; i++) {
+    if(!h_page_in_use(h, i)) {
+      free++;
+      *released += (h->released_bitmap[i/64] >> (i%64)) & 1;
+    }
+  }
+  return free;
+}
+
+/**
+ *  Allocates data objects over every free page of a heap (without
+ *  collecting), and checks they come zeroed.
+ */
+static bool test_zeroed(heap_t *h, size_t bytes)
+{
+  bool zeroed = true;
+  size_t pages = h->limit_pages - h->used_pages - h->large_pages;
+  for(size_t i = 0; i < pages*(h->pagesize/bytes)/2; i++) {
+    unsigned char *data = h_alloc_data(h, bytes);
+    for(size_t j = 0; j < bytes && data != NULL; j++) {
+      zeroed &= data[j] == 0;
+    }
+  }
+  return zeroed;
+}
+
+/**
+ *  Builds a list of nodes with dirtied data in a root slot. Keeps no
+ *  pointer into the heap across an allocation, but in the root.
+ */
+static void test_fill(heap_t *h, void ***list, size_t count)
+{
+  for(size_t i = 0; i < count; i++) {
+    void **node = h_alloc_struct(h, "2*");
+    node[0] = *list;
+    *list = node;
+    // the node may move while its data is allocated
+    void *data = h_alloc_data(h, 200);
+    memset(data, 0xff, 200);
+    (*list)[1] = data;
+  }
+}
+
+static void test_grow(void)
+{
+  // precise roots, so that no stale stack word keeps garbage alive
+  h_options_t opts = { .max_bytes = 64 << 20, .release = H_RELEASE_ALL, .precise_roots = true };
+  heap_t *h = h_init_opt(1 << 20, false, 0.5f, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  size_t initial = h->limit_pages;
+  CU_ASSERT_EQUAL(h->min_pages, initial);
+  CU_ASSERT(h->committed_pages >= initial);
+  CU_ASSERT(h->committed_pages < h->total_pages);
+  CU_ASSERT(h->total_pages > 16*initial);
+
+  // grows by half at least, committing whole units
+  CU_ASSERT_FALSE(h_pages_grow(h, h->total_pages + 1));
+  CU_ASSERT_TRUE(h_pages_grow(h, initial + 1));
+  CU_ASSERT_EQUAL(h->limit_pages, initial + initial/2);
+  CU_ASSERT(h->committed_pages >= h->limit_pages);
+  CU_ASSERT(h->committed_pages % h->commit_unit == 0 || h->committed_pages == h->total_pages);
+  CU_ASSERT_TRUE(h_pages_grow(h, initial));
+  CU_ASSERT_EQUAL(h->limit_pages, initial + initial/2);
+
+  // live data of several times the initial size
+  void **list = NULL;
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&list));
+  test_fill(h, &list, 4*(1 << 20)/200);
+  h_gc(h);
+  CU_ASSERT(h->limit_pages > 4*initial);
+  CU_ASSERT(h->committed_pages >= h->limit_pages);
+  size_t count = 0;
+  bool intact = true;
+  for(void **node = list; node != NULL; node = node[0]) {
+    intact &= ((unsigned char *)node[1])[199] == 0xff;
+    count++;
+  }
+  CU_ASSERT_EQUAL(count, 4*(1 << 20)/200);
+  CU_ASSERT_TRUE(intact);
+
+  // once it is garbage, a full collection shrinks the heap and
+  // releases every free page, which comes back zeroed
+  size_t committed = h->committed_pages;
+  list = NULL;
+  h_gc(h);
+  CU_ASSERT_EQUAL(h->limit_pages, initial);
+  CU_ASSERT_EQUAL(h->committed_pages, committed);
+  size_t released;
+  size_t free = test_free_pages(h, &released);
+  CU_ASSERT(free > 4*initial);
+  CU_ASSERT_EQUAL(released, free);
+  CU_ASSERT_TRUE(test_zeroed(h, 200));
+  h_remove_root(h, (void **)&list);
+  h_delete(h);
+}
+
+static void test_release(void)
+{
+  h_release_t policies[] = { H_RELEASE_NEVER, H_RELEASE_EXCESS, H_RELEASE_ALL };
+  for(size_t p = 0; p < sizeof(policies)/sizeof(policies[0]); p++) {
+    h_options_t opts = { .release = policies[p], .precise_roots = true };
+    heap_t *h = h_init_opt(8 << 20, false, 0.5f, &opts);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+    void **list = NULL;
+    CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&list));
+    test_fill(h, &list, (3 << 20)/200);
+    list = NULL;
+    h_gc(h);
+
+    size_t released;
+    size_t free = test_free_pages(h, &released);
+    CU_ASSERT(free > h->total_pages/2);
+    if(policies[p] == H_RELEASE_NEVER) {
+      CU_ASSERT_EQUAL(released, 0);
+    }
+    else if(policies[p] == H_RELEASE_EXCESS) {
+      // the room to allocate before the next collection stays, in
+      // whole units
+      size_t room = (size_t)(h->gc_threshold*(float)h->limit_pages) - h->used_pages;
+      CU_ASSERT(released > 0);
+      CU_ASSERT(free - released <= room);
+      CU_ASSERT(free - released + h->commit_unit > room);
+    }
+    else {
+      CU_ASSERT_EQUAL(released, free);
+    }
+    CU_ASSERT_TRUE(test_zeroed(h, 200));
+    h_remove_root(h, (void **)&list);
+    h_delete(h);
+  }
+}
+
+static void test_release_file(void)
+{
+  // a loaded heap's pages are a private mapping of the snapshot:
+  // released, they must read as zeroes rather than the file again
+  char path[] = "/tmp/test_heap_XXXXXX";
+  int fd = mkstemp(path);
+  CU_ASSERT_FATAL(fd >= 0);
+  close(fd);
+  h_options_t opts = { .release = H_RELEASE_ALL, .precise_roots = true };
+  heap_t *h = h_init_opt(8 << 20, false, 0.5f, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  void **list = NULL;
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&list));
+  test_fill(h, &list, (2 << 20)/200);
+  CU_ASSERT_TRUE_FATAL(h_snapshot_save(h, path, list));
+  h_remove_root(h, (void **)&list);
+  h_delete(h);
+
+  h = h_snapshot_load(path, (void **)&list);
+  unlink(path);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_PTR_NOT_NULL(list);
+  CU_ASSERT(h->file_pages > 0);
+  list = NULL;
+  h_gc(h);
+  size_t released;
+  test_free_pages(h, &released);
+  size_t file_released = 0;
+  for(size_t i = 0; i < h->file_pages; i++) {
+    file_released += (h->released_bitmap[i/64] >> (i%64)) & 1;
+  }
+  CU_ASSERT_EQUAL(file_released, h->file_pages);
+  CU_ASSERT_TRUE(test_zeroed(h, 200));
+  h_delete(h);
+}
+
+static void test_targets(void)
+{
+  h_options_t opts = { .max_bytes = 64 << 20, .precise_roots = true };
+  heap_t *h = h_init_opt(1 << 20, false, 0.5f, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  size_t target = (8 << 20)/h->pagesize;
+  h_set_targets(h, 0, 8 << 20);
+  CU_ASSERT_TRUE(h_policy_adaptive(h));
+  CU_ASSERT_EQUAL(h->policy.heap_pages, target);
+
+  // live data of an eighth of the target, and garbage of many times
+  // the target: the heap grows to the target but never past it, and
+  // collects before the trigger leaves no room for the copy reserve
+  void **list = NULL;
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&list));
+  test_fill(h, &list, (1 << 20)/200);
+  size_t largest = 0;
+  for(size_t i = 0; i < 64*(1 << 20)/256; i++) {
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h_alloc_data(h, 256 - sizeof(intptr_t)));
+    size_t limit = h->limit_pages;
+    largest = limit > largest ? limit : largest;
+    CU_ASSERT(limit <= target);
+    CU_ASSERT(h->policy.trigger_pages < limit);
+  }
+  CU_ASSERT(largest > target/2);
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.collections > 4);
+  CU_ASSERT(h->policy.samples > 0);
+
+  // the policy's own picks for the live pages: a heap of the target
+  // size, whose trigger and copy reserve fit in it
+  h_gc(h);
+  size_t used = h->used_pages + h->large_pages;
+  size_t limit = h_policy_limit(h, used, true);
+  CU_ASSERT(limit <= target);
+  CU_ASSERT(limit >= h->min_pages);
+  size_t trigger = h->policy.trigger_pages;
+  CU_ASSERT(trigger > used + used/4);
+  CU_ASSERT(trigger + (size_t)(h->policy.survival*(double)trigger) <= limit);
+
+  // a target below the live data is exceeded rather than collecting
+  // all the time
+  h_set_targets(h, 0, used*h->pagesize/2);
+  h_gc(h);
+  used = h->used_pages + h->large_pages;
+  CU_ASSERT(h->limit_pages > used);
+  CU_ASSERT(h->policy.trigger_pages >= used + used/4);
+
+  // without targets, the static threshold again
+  h_set_targets(h, 0, 0);
+  CU_ASSERT_FALSE(h_policy_adaptive(h));
+  size_t count = 0;
+  for(void **node = list; node != NULL; node = node[0]) {
+    count += ((unsigned char *)node[1])[199] == 0xff;
+  }
+  CU_ASSERT_EQUAL(count, (1 << 20)/200);
+  h_remove_root(h, (void **)&list);
+  h_delete(h);
+}
+
+static void test_page_sizes(void)
+{
+  // powers of 2 from 256 bytes to 1 GB
+  size_t bytes = (size_t)4 << 30;
+  CU_ASSERT_TRUE(valid_bytes(bytes, H_MIN_PAGESIZE, MAX_HEADER_SIZE));
+  CU_ASSERT_TRUE(valid_bytes(bytes, 4096, MAX_HEADER_SIZE));
+  CU_ASSERT_TRUE(valid_bytes(bytes, H_MAX_PAGESIZE, MAX_HEADER_SIZE));
+  CU_ASSERT_FALSE(valid_bytes(bytes, 0, MAX_HEADER_SIZE));
+  CU_ASSERT_FALSE(valid_bytes(bytes, H_MIN_PAGESIZE/2, MAX_HEADER_SIZE));
+  CU_ASSERT_FALSE(valid_bytes(bytes, H_MIN_PAGESIZE + 1, MAX_HEADER_SIZE));
+  CU_ASSERT_FALSE(valid_bytes(bytes, 3*H_MIN_PAGESIZE, MAX_HEADER_SIZE));
+  CU_ASSERT_FALSE(valid_bytes(bytes, 2*H_MAX_PAGESIZE, MAX_HEADER_SIZE));
+  // and two pages besides the header
+  CU_ASSERT_TRUE(valid_bytes(2*4096 + MAX_HEADER_SIZE, 4096, MAX_HEADER_SIZE));
+  CU_ASSERT_FALSE(valid_bytes(2*4096 + MAX_HEADER_SIZE - 1, 4096, MAX_HEADER_SIZE));
+
+  size_t sizes[] = { H_MIN_PAGESIZE, 4096, 65536 };
+  for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    h_options_t opts = { .page_size = sizes[i] };
+    heap_t *h = h_init_opt(8 << 20, false, 0.5f, &opts);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+    CU_ASSERT_EQUAL(h->pagesize, sizes[i]);
+    CU_ASSERT_EQUAL((uintptr_t)h->pages % sizes[i], 0);
+    CU_ASSERT_EQUAL(h->commit_unit*sizes[i] % (size_t)sysconf(_SC_PAGESIZE), 0);
+    // objects up to a page's room go in pages, larger ones are large
+    char *small = h_alloc_data(h, sizes[i] - PAGE_HEADER_SIZE - sizeof(intptr_t));
+    char *large = h_alloc_data(h, sizes[i]);
+    CU_ASSERT_TRUE(address_within_pages(h, small));
+    CU_ASSERT_PTR_NOT_NULL(h_large_find(h, large));
+    h_delete(h);
+  }
+}
+
+static void test_huge_pages(void)
+{
+  // backed by explicit huge pages if the system has them reserved,
+  // transparent ones otherwise: either way in whole huge pages
+  h_options_t opts = { .huge_pages = true };
+  heap_t *h = h_init_opt(16 << 20, false, 0.5f, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_EQUAL(h->commit_unit, H_HUGE_PAGESIZE/h->pagesize);
+  CU_ASSERT_EQUAL((uintptr_t)h->pages % H_HUGE_PAGESIZE, 0);
+  void **list = NULL;
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&list));
+  test_fill(h, &list, (4 << 20)/200);
+  h_gc(h);
+  size_t count = 0;
+  for(void **node = list; node != NULL; node = node[0]) {
+    count++;
+  }
+  CU_ASSERT_EQUAL(count, (4 << 20)/200);
+  h_remove_root(h, (void **)&list);
+  h_delete(h);
+
+  // a growable heap commits whole huge pages as it grows
+  h_options_t growable = { .huge_pages = true, .max_bytes = 64 << 20 };
+  h = h_init_opt(4 << 20, false, 0.5f, &growable);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_TRUE(h_pages_grow(h, h->limit_pages + 1));
+  CU_ASSERT_EQUAL(h->committed_pages % h->commit_unit, 0);
+  h_delete(h);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("heap", NULL, NULL);
+  if(suite == NULL ||
+     CU_add_test(suite, "region bounds", test_bounds) == NULL ||
+     CU_add_test(suite, "page bounds", test_page_bounds) == NULL ||
+     CU_add_test(suite, "large object bounds", test_large_bounds) == NULL ||
+     CU_add_test(suite, "growable", test_grow) == NULL ||
+     CU_add_test(suite, "release policies", test_release) == NULL ||
+     CU_add_test(suite, "release of file pages", test_release_file) == NULL ||
+     CU_add_test(suite, "targets", test_targets) == NULL ||
+     CU_add_test(suite, "page sizes", test_page_sizes) == NULL ||
+     CU_add_test(suite, "huge pages", test_huge_pages) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
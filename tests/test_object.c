@@ -0,0 +1,401 @@
+/**
+ *   \file test_object.c
+ *   \brief Tests of object layouts and headers
+ *
+ *   Format strings are compiled once per heap and looked up again by
+ *   their address. Objects whose fields fit in a bit vector get a
+ *   compact header, others point to their compiled layout.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_init.h"
+#include "o_layout.h"
+#include "object.h"
+
+static void test_layout_cache(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  char *literal = "*l";
+  o_layout_t *layout = o_layout_of(h, literal);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(layout);
+  CU_ASSERT_STRING_EQUAL(layout->string, "*l");
+  CU_ASSERT_PTR_EQUAL(o_layout_of(h, literal), layout);
+  CU_ASSERT_PTR_EQUAL(o_layout_intern(h, literal), layout);
+
+  // a string that may change is looked up by its contents every time
+  char buffer[] = "*l";
+  CU_ASSERT_PTR_EQUAL(o_layout_of(h, buffer), layout);
+  memcpy(buffer, "l*", 3);
+  o_layout_t *other = o_layout_of(h, buffer);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(other);
+  CU_ASSERT_PTR_NOT_EQUAL(other, layout);
+  CU_ASSERT_STRING_EQUAL(other->string, "l*");
+  CU_ASSERT_EQUAL(h->layout_count, 2);
+  CU_ASSERT_PTR_NULL(o_layout_of(h, "*x"));
+  CU_ASSERT_PTR_NULL(h_alloc_struct(h, "*x"));
+
+  // every heap has layouts of its own, even at the address of a
+  // deleted heap
+  for(int i = 0; i < 2; i++) {
+    heap_t *next = h_init(8 << 20, false, 0.5f);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(next);
+    o_layout_t *own = o_layout_of(next, literal);
+    CU_ASSERT_PTR_NOT_NULL(own);
+    CU_ASSERT_PTR_NOT_EQUAL(own, layout);
+    CU_ASSERT_EQUAL(next->layout_count, 1);
+    h_delete(h);
+    h = next;
+    layout = own;
+  }
+  h_delete(h);
+}
+
+/**
+ *  Allocates a struct and checks the type of its header, and that
+ *  it is the header of the struct's compiled layout.
+ */
+static void test_header(heap_t *h, char *format, intptr_t type)
+{
+  void *obj = h_alloc_struct(h, format);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+  intptr_t header = o_get_header(obj);
+  CU_ASSERT_EQUAL((intptr_t)O_HEADER_GET_TYPE(header), type);
+  CU_ASSERT_EQUAL(header, o_layout_intern(h, format)->header);
+}
+
+static void test_compact_headers(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+
+  // fields of 4 and 8 bytes and pointers fit in a bit vector
+  test_header(h, "*l", 1);
+  test_header(h, "i*d", 1);
+  test_header(h, "2i3*f", 1);
+  // chars do not, nor do more fields than the bit vector holds
+  test_header(h, "*c", 0);
+  char format[16];
+  snprintf(format, sizeof(format), "%zu*", (size_t)O_VECTOR_MAX_FIELDS);
+  test_header(h, format, 1);
+  snprintf(format, sizeof(format), "%zu*", (size_t)O_VECTOR_MAX_FIELDS + 1);
+  test_header(h, format, 0);
+
+  // both kinds of headers give the pointers to follow
+  void **compact = h_alloc_struct(h, "l*l*");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(compact);
+  CU_ASSERT_EQUAL(o_pointers_in_object(compact), 2);
+  CU_ASSERT_PTR_EQUAL(o_get_pointer_in_object(compact, 1), &compact[3]);
+  void **full = h_alloc_struct(h, "c*c*");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(full);
+  CU_ASSERT_EQUAL(o_pointers_in_object(full), 2);
+  CU_ASSERT_PTR_EQUAL(o_get_pointer_in_object(full, 1), &full[3]);
+  h_delete(h);
+}
+
+/**
+ *  The heaps test_box_trace was called with, and how often.
+ */
+static heap_t *traced_heap;
+static size_t traced;
+
+/**
+ *  Trace function of a union of a pointer and a long, the pointer
+ *  first. Records its heap.
+ */
+static void *test_box_trace(heap_t *h, trace_f f, void *obj)
+{
+  void **box = obj;
+  traced_heap = h;
+  traced++;
+  box[0] = f(h, box[0]);
+  return obj;
+}
+
+/**
+ *  What test_visit found of an object.
+ *
+ *  count  Amount of slots visited.
+ *  last   The last slot visited.
+ */
+typedef struct test_slots {
+  size_t count;
+  void **last;
+} test_slots_t;
+
+/**
+ *  Pointer visitor counting the slots, and checking they come in
+ *  order.
+ */
+static void test_visit(void **slot, void *slots)
+{
+  test_slots_t *found = slots;
+  CU_ASSERT(found->last == NULL || slot > found->last);
+  found->last = slot;
+  found->count++;
+}
+
+/**
+ *  Counts the pointer slots o_foreach_pointer visits in an object.
+ */
+static size_t test_slots(heap_t *h, void *obj)
+{
+  test_slots_t found = { 0, NULL };
+  o_foreach_pointer(h, obj, test_visit, &found);
+  return found.count;
+}
+
+static void test_foreach(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_EQUAL(test_slots(h, h_alloc_struct(h, "*l*")), 2);
+  CU_ASSERT_EQUAL(test_slots(h, h_alloc_struct(h, "c*c*c*")), 3);
+  CU_ASSERT_EQUAL(test_slots(h, h_alloc_array(h, "*l", 10)), 10);
+  CU_ASSERT_EQUAL(test_slots(h, h_alloc_ptr_array(h, 100)), 100);
+  CU_ASSERT_EQUAL(test_slots(h, h_alloc_data(h, 64)), 0);
+
+  // custom trace functions get the heap of the object
+  traced_heap = NULL;
+  CU_ASSERT_EQUAL(test_slots(h, h_alloc_union(h, 2*sizeof(void *), test_box_trace)), 1);
+  CU_ASSERT_PTR_EQUAL(traced_heap, h);
+  h_delete(h);
+}
+
+static void test_trace_heap(void)
+{
+  h_options_t parallel = { .gc_threads = 2 };
+  h_options_t incremental = { .gc_step_ns = 100000 };
+  h_options_t *options[] = { NULL, &parallel, &incremental };
+  for(size_t i = 0; i < sizeof(options)/sizeof(options[0]); i++) {
+    heap_t *h = h_init_opt(8 << 20, false, 0.5f, options[i]);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+    void **box = h_alloc_union(h, 2*sizeof(void *), test_box_trace);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(box);
+    CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&box));
+    box[0] = h_alloc_struct(h, "*l");
+    ((long *)box[0])[1] = 42;
+
+    traced_heap = NULL;
+    traced = 0;
+    if(options[i] == &incremental) {
+      h_gc_step(h, 0);
+    }
+    else {
+      h_gc(h);
+    }
+    CU_ASSERT(traced > 0);
+    CU_ASSERT_PTR_EQUAL(traced_heap, h);
+    CU_ASSERT_EQUAL(((long *)box[0])[1], 42);
+    h_remove_root(h, (void **)&box);
+    h_delete(h);
+  }
+}
+
+/**
+ *  \def TEST_ELEMENTS
+ *  Amount of elements of the struct arrays, the large ones have a
+ *  hundred times as many.
+ */
+#define TEST_ELEMENTS 7
+
+/**
+ *  \def TEST_FIELDS
+ *  Most fields a format string of the tests has.
+ */
+#define TEST_FIELDS 16
+
+/**
+ *  Expands the repeat counts of a format string, one character per
+ *  field. Returns the amount of fields.
+ */
+static size_t test_fields(char *format, char *fields)
+{
+  size_t n = 0;
+  for(char *cursor = format; *cursor != '\0'; cursor++) {
+    size_t count = 0;
+    for(; *cursor >= '0' && *cursor <= '9'; cursor++) {
+      count = 10*count + (size_t)(*cursor - '0');
+    }
+    for(size_t i = 0; i < (count != 0 ? count : 1) && n < TEST_FIELDS; i++) {
+      fields[n++] = *cursor;
+    }
+  }
+  return n;
+}
+
+/**
+ *  Sets every field of the elements of a struct array to a value of
+ *  its own, or checks that they still hold it. Pointer fields point
+ *  to a "*l" object holding the value. Returns false if a field
+ *  does not hold its value.
+ */
+static bool test_fill_fields(heap_t *h, char *array, char *format, size_t count, bool check)
+{
+  o_layout_t *layout = o_layout_of(h, format);
+  char fields[TEST_FIELDS];
+  size_t n = test_fields(format, fields);
+  bool intact = layout != NULL && n == layout->n_fields;
+  for(size_t e = 0; e < count && intact; e++) {
+    for(size_t f = 0; f < n; f++) {
+      char *field = array + e*layout->size + layout->offsets[f];
+      long value = (long)(e*TEST_FIELDS + f + 1);
+      switch(fields[f]) {
+      case 'c':
+        if(check) intact &= *field == (char)value; else *field = (char)value;
+        break;
+      case 'i':
+        if(check) intact &= *(int *)field == (int)value; else *(int *)field = (int)value;
+        break;
+      case 'd':
+        if(check) intact &= *(double *)field == (double)value; else *(double *)field = (double)value;
+        break;
+      case '*':
+        if(check) {
+          long *child = *(long **)field;
+          intact &= child != NULL && child[1] == value;
+        }
+        else {
+          long *child = h_alloc_struct(h, "*l");
+          child[1] = value;
+          *(long **)field = child;
+        }
+        break;
+      default:
+        if(check) intact &= *(long *)field == value; else *(long *)field = value;
+        break;
+      }
+    }
+  }
+  return intact;
+}
+
+static void test_repeat_counts(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+
+  // a count repeats the field, and each copy is aligned on its own
+  struct {
+    char *format;
+    size_t size;
+    size_t n_pointers;
+    size_t offsets[TEST_FIELDS];
+  } layouts[] = {
+    { "3*", 24, 3, { 0, 8, 16 } },
+    { "c3*", 32, 3, { 0, 8, 16, 24 } },
+    { "3c*", 16, 1, { 0, 1, 2, 8 } },
+    { "2c2i2*", 32, 2, { 0, 1, 4, 8, 16, 24 } },
+    { "i3dc", 40, 0, { 0, 8, 16, 24, 32 } },
+    { "10c", 10, 0, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 } },
+  };
+  for(size_t i = 0; i < sizeof(layouts)/sizeof(layouts[0]); i++) {
+    o_layout_t *layout = o_layout_of(h, layouts[i].format);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(layout);
+    char fields[TEST_FIELDS];
+    size_t n = test_fields(layouts[i].format, fields);
+    CU_ASSERT_EQUAL(layout->n_fields, n);
+    CU_ASSERT_EQUAL(layout->size, layouts[i].size);
+    CU_ASSERT_EQUAL(layout->n_pointers, layouts[i].n_pointers);
+    for(size_t f = 0; f < n; f++) {
+      CU_ASSERT_EQUAL(layout->offsets[f], layouts[i].offsets[f]);
+    }
+  }
+  CU_ASSERT_PTR_NULL(o_layout_of(h, "0*"));
+  CU_ASSERT_PTR_NULL(o_layout_of(h, "3"));
+  CU_ASSERT_PTR_NULL(o_layout_of(h, "*3"));
+  h_delete(h);
+}
+
+/**
+ *  Allocates a struct, a struct array and a large one of a format,
+ *  and fills them. Only pointers to their last field (of their last
+ *  element) are kept, and one to the start of the struct array.
+ */
+static void test_interior_build(heap_t *h, char *format, char **inside)
+{
+  o_layout_t *layout = o_layout_of(h, format);
+  size_t last = layout->offsets[layout->n_fields - 1];
+  char *obj = h_alloc_struct(h, format);
+  test_fill_fields(h, obj, format, 1, false);
+  inside[0] = obj + last;
+  char *array = h_alloc_array(h, format, TEST_ELEMENTS);
+  test_fill_fields(h, array, format, TEST_ELEMENTS, false);
+  inside[1] = array + (TEST_ELEMENTS - 1)*layout->size + last;
+  inside[3] = array;
+  char *large = h_alloc_array(h, format, 100*TEST_ELEMENTS);
+  test_fill_fields(h, large, format, 100*TEST_ELEMENTS, false);
+  inside[2] = large + (100*TEST_ELEMENTS - 1)*layout->size + last;
+}
+
+static void test_interior(void)
+{
+  char *formats[] = { "3*", "c3*", "3c*", "2c2i2*", "i3d*" };
+  size_t counts[] = { 1, TEST_ELEMENTS, 100*TEST_ELEMENTS };
+  size_t n_formats = sizeof(formats)/sizeof(formats[0]);
+  // safe stacks keep the pages of interior pointers, unsafe ones pin
+  // the objects they point into; the parallel collector too
+  h_options_t parallel = { .gc_threads = 2 };
+  for(int k = 0; k < 3; k++) {
+    heap_t *h = h_init_opt(32 << 20, k == 1, 0.5f, k == 2 ? &parallel : NULL);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+    char *inside[5][4];
+    for(size_t i = 0; i < n_formats; i++) {
+      test_interior_build(h, formats[i], inside[i]);
+    }
+    // garbage in between, so that the pages around are freed and
+    // taken up again
+    for(int round = 0; round < 3; round++) {
+      for(size_t i = 0; i < 20000; i++) {
+        h_alloc_struct(h, "3*");
+      }
+      h_gc(h);
+    }
+    for(size_t i = 0; i < n_formats; i++) {
+      o_layout_t *layout = o_layout_of(h, formats[i]);
+      size_t last = layout->offsets[layout->n_fields - 1];
+      for(size_t j = 0; j < 3; j++) {
+        char *obj = inside[i][j] - (counts[j] - 1)*layout->size - last;
+        CU_ASSERT_TRUE(test_fill_fields(h, obj, formats[i], counts[j], true));
+        CU_ASSERT_EQUAL(h_array_length(obj), j > 0 ? counts[j] : 0);
+      }
+      // an exact pointer did not move the array away from the
+      // interior one
+      CU_ASSERT_PTR_EQUAL(inside[i][3], inside[i][1] - (TEST_ELEMENTS - 1)*layout->size - last);
+    }
+    h_delete(h);
+  }
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("object", NULL, NULL);
+  if(suite == NULL ||
+     CU_add_test(suite, "layout cache", test_layout_cache) == NULL ||
+     CU_add_test(suite, "compact headers", test_compact_headers) == NULL ||
+     CU_add_test(suite, "pointer slots", test_foreach) == NULL ||
+     CU_add_test(suite, "trace function heap", test_trace_heap) == NULL ||
+     CU_add_test(suite, "repeat counts", test_repeat_counts) == NULL ||
+     CU_add_test(suite, "interior references", test_interior) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
@@ -0,0 +1,181 @@
+/**
+ *   \file test_profile.c
+ *   \brief Tests of the allocation profiler
+ *
+ *   Objects are allocated from functions of their own, some kept and
+ *   some not, and the folded stacks the profiler writes are checked
+ *   against what was allocated, what survived and what is live. The
+ *   names of the functions are only found with -rdynamic, and only
+ *   if they are not static.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "test_graph.h"
+
+/**
+ *  \def TEST_NODES
+ *  Amount of nodes each of the allocating functions allocates.
+ */
+#define TEST_NODES 100000
+
+/**
+ *  \def TEST_RATE
+ *  Mean amount of bytes between samples.
+ */
+#define TEST_RATE 4096
+
+/**
+ *  The file of the profiles, made by test_profile_init.
+ */
+static char path[] = "/tmp/test_profile_XXXXXX";
+
+/**
+ *  The root slot of the kept nodes.
+ */
+static test_graph_t *graph;
+
+static int test_profile_init(void)
+{
+  int fd = mkstemp(path);
+  if(fd < 0) {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static int test_profile_clean(void)
+{
+  return unlink(path);
+}
+
+/**
+ *  Allocates nodes that are kept, in the list of the graph.
+ */
+__attribute__((noinline)) void test_profile_kept(heap_t *h)
+{
+  for(long i = 0; i < TEST_NODES; i++) {
+    test_graph_push(h, &graph, i);
+  }
+}
+
+/**
+ *  Allocates nodes that are not kept.
+ */
+__attribute__((noinline)) void test_profile_dropped(heap_t *h)
+{
+  for(long i = 0; i < TEST_NODES; i++) {
+    test_garbage(h);
+  }
+}
+
+/**
+ *  Writes a profile and adds up the bytes of the stacks that pass
+ *  through a function and end in a type. Asserts that every line is
+ *  in the folded stack format.
+ *
+ *  \param   h       the heap
+ *  \param   metric  what to weigh the stacks by
+ *  \param   frame   the name of the function
+ *  \param   type    the last frame, e.g. "struct:*l"
+ *  \return  the bytes of those stacks
+ */
+static unsigned long long test_profile_bytes(heap_t *h, h_profile_metric_t metric,
+                                             const char *frame, const char *type)
+{
+  CU_ASSERT_TRUE_FATAL(h_profile_write(h, path, metric));
+  FILE *file = fopen(path, "r");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+
+  unsigned long long sum = 0;
+  char line[4096];
+  while(fgets(line, sizeof(line), file) != NULL) {
+    char *value = strrchr(line, ' ');
+    char *last = strrchr(line, ';');
+    CU_ASSERT_PTR_NOT_NULL(value);
+    CU_ASSERT_PTR_NOT_NULL(last);
+    if(value == NULL || last == NULL || last > value) {
+      continue;
+    }
+    char *end;
+    unsigned long long bytes = strtoull(value + 1, &end, 10);
+    CU_ASSERT(end > value + 1 && *end == '\n');
+    CU_ASSERT(bytes > 0);
+    *value = '\0';
+
+    // the outermost frames first, the allocating function later
+    char *outer = strstr(line, "main;");
+    char *at = strstr(line, frame);
+    if(at != NULL && strcmp(last + 1, type) == 0) {
+      CU_ASSERT(outer != NULL && outer < at);
+      sum += bytes;
+    }
+  }
+  fclose(file);
+  return sum;
+}
+
+static void test_profile(void)
+{
+  // no stale stack word may keep a dropped node alive
+  h_options_t opts = { .precise_roots = true };
+  heap_t *h = h_init_opt(32 << 20, false, 0.5f, &opts);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&graph));
+  graph = h_alloc_struct(h, "6*");
+  CU_ASSERT_TRUE_FATAL(h_profile_start(h, TEST_RATE));
+  test_profile_kept(h);
+  test_profile_dropped(h);
+  h_profile_stop(h);
+  h_gc(h);
+
+  // an estimate, from about a sample every TEST_RATE bytes: within
+  // a factor of two of the nodes, with or without their headers
+  unsigned long long least = TEST_NODES*sizeof(test_node_t)/2;
+  unsigned long long most = 2*TEST_NODES*(sizeof(test_node_t) + sizeof(void *));
+  unsigned long long kept = test_profile_bytes(h, H_PROFILE_ALLOCATED, ";test_profile_kept;", "struct:*l");
+  unsigned long long dropped = test_profile_bytes(h, H_PROFILE_ALLOCATED, ";test_profile_dropped;", "struct:*l");
+  CU_ASSERT(kept >= least && kept <= most);
+  CU_ASSERT(dropped >= least && dropped <= most);
+
+  CU_ASSERT(test_profile_bytes(h, H_PROFILE_SURVIVED, ";test_profile_kept;", "struct:*l") >= least);
+  CU_ASSERT_EQUAL(test_profile_bytes(h, H_PROFILE_SURVIVED, ";test_profile_dropped;", "struct:*l"), 0);
+  CU_ASSERT(test_profile_bytes(h, H_PROFILE_LIVE, ";test_profile_kept;", "struct:*l") >= least);
+
+  // once dropped and collected, nothing is live
+  graph = NULL;
+  h_gc(h);
+  CU_ASSERT_EQUAL(test_profile_bytes(h, H_PROFILE_LIVE, ";test_profile_kept;", "struct:*l"), 0);
+  CU_ASSERT(test_profile_bytes(h, H_PROFILE_SURVIVED, ";test_profile_kept;", "struct:*l") >= least);
+
+  h_remove_root(h, (void **)&graph);
+  h_delete(h);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("profile", test_profile_init, test_profile_clean);
+  if(suite == NULL ||
+     CU_add_test(suite, "profile", test_profile) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
@@ -0,0 +1,296 @@
+/**
+ *   \file test_snapshot.c
+ *   \brief Tests of saving heaps to files and loading them again
+ *
+ *   The graph of test_graph.h is saved and loaded both while its
+ *   heap is alive, so the loaded heap is relocated, and after the
+ *   heap is deleted. A loaded graph must be intact, and survive
+ *   collections of the loaded heap. Files that are not snapshots,
+ *   are cut short, or whose header does not fit what they hold must
+ *   fail to load.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_snapshot.h"
+#include "object.h"
+#include "test_graph.h"
+
+/**
+ *  \def TEST_LENGTH
+ *  Amount of nodes of the list of the graphs.
+ */
+#define TEST_LENGTH 20000
+
+/**
+ *  The file of the snapshots, made by test_snapshot_init.
+ */
+static char path[] = "/tmp/test_snapshot_XXXXXX";
+
+/**
+ *  The root slot of the graph saved.
+ */
+static test_graph_t *graph;
+
+/**
+ *  The root slot of the graph loaded.
+ */
+static test_graph_t *loaded;
+
+static int test_snapshot_init(void)
+{
+  int fd = mkstemp(path);
+  if(fd < 0) {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static int test_snapshot_clean(void)
+{
+  return unlink(path);
+}
+
+/**
+ *  Builds the graph on a new heap, collects it, and saves it.
+ *
+ *  \return  the heap, NULL if it could not be created or saved
+ */
+static heap_t *test_save(void)
+{
+  heap_t *h = h_init(32 << 20, false, 0.5f);
+  if(h == NULL || !h_add_root(h, (void **)&graph)) {
+    return NULL;
+  }
+  test_graph_build(h, &graph, TEST_LENGTH);
+  h_gc(h);
+  if(!h_snapshot_save(h, path, graph)) {
+    h_delete(h);
+    return NULL;
+  }
+  return h;
+}
+
+/**
+ *  Loads the graph saved by test_save, checks it, then collects and
+ *  changes it and checks it again.
+ *
+ *  \return  the loaded heap
+ */
+static heap_t *test_load(void)
+{
+  heap_t *h = h_snapshot_load(path, (void **)&loaded);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_TRUE(test_graph_check(loaded, TEST_LENGTH));
+  CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&loaded));
+  for(int round = 0; round < 3; round++) {
+    test_graph_renew(h, &loaded, round + 2);
+    h_gc(h);
+    CU_ASSERT_TRUE(test_graph_check(loaded, TEST_LENGTH));
+  }
+  return h;
+}
+
+/**
+ *  Reads the header of the file of the snapshots.
+ *
+ *  \param   header  set to the header
+ *  \return  false if it could not be read
+ */
+static bool test_header_read(h_snapshot_header_t *header)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return false;
+  }
+  bool ok = pread(fd, header, sizeof(*header), 0) == (ssize_t)sizeof(*header);
+  close(fd);
+  return ok;
+}
+
+/**
+ *  Writes bytes into the file of the snapshots.
+ *
+ *  \param   bytes   the bytes
+ *  \param   n       amount of bytes
+ *  \param   offset  where they go
+ *  \return  false if they could not be written
+ */
+static bool test_file_write(const void *bytes, size_t n, off_t offset)
+{
+  int fd = open(path, O_WRONLY);
+  if(fd < 0) {
+    return false;
+  }
+  bool ok = pwrite(fd, bytes, n, offset) == (ssize_t)n;
+  close(fd);
+  return ok;
+}
+
+/**
+ *  Writes a header into the file of the snapshots, and checks that
+ *  the file then fails to load.
+ */
+static void test_rejected(const h_snapshot_header_t *header)
+{
+  CU_ASSERT_TRUE_FATAL(test_file_write(header, sizeof(*header), 0));
+  CU_ASSERT_PTR_NULL(h_snapshot_load(path, NULL));
+}
+
+static void test_round_trip(void)
+{
+  heap_t *h = test_save();
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_graph_t *saved = graph;
+
+  // the saved heap still holds its addresses: the loaded one moves
+  heap_t *copy = test_load();
+  CU_ASSERT_PTR_NOT_EQUAL(loaded, saved);
+  CU_ASSERT_PTR_EQUAL(graph, saved);
+  CU_ASSERT_TRUE(test_graph_check(graph, TEST_LENGTH));
+
+  h_remove_root(copy, (void **)&loaded);
+  h_delete(copy);
+  h_remove_root(h, (void **)&graph);
+  h_delete(h);
+}
+
+static void test_reload(void)
+{
+  heap_t *h = test_save();
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  h_remove_root(h, (void **)&graph);
+  h_delete(h);
+
+  // twice, the file is only mapped copy-on-write
+  for(int i = 0; i < 2; i++) {
+    heap_t *copy = test_load();
+    h_remove_root(copy, (void **)&loaded);
+    h_delete(copy);
+  }
+}
+
+static void test_invalid(void)
+{
+  FILE *file = fopen(path, "w");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+  char junk[4096];
+  memset(junk, 0x5a, sizeof(junk));
+  CU_ASSERT_EQUAL(fwrite(junk, 1, sizeof(junk), file), sizeof(junk));
+  fclose(file);
+
+  loaded = NULL;
+  CU_ASSERT_PTR_NULL(h_snapshot_load(path, (void **)&loaded));
+  CU_ASSERT_PTR_NULL(loaded);
+  CU_ASSERT_PTR_NULL(h_snapshot_load("/nonexistent/snapshot", NULL));
+
+  // a snapshot cut short
+  heap_t *h = test_save();
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  h_remove_root(h, (void **)&graph);
+  h_delete(h);
+  CU_ASSERT_EQUAL(truncate(path, sizeof(junk)), 0);
+  CU_ASSERT_PTR_NULL(h_snapshot_load(path, NULL));
+}
+
+static void test_header(void)
+{
+  heap_t *h = test_save();
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  h_remove_root(h, (void **)&graph);
+  h_delete(h);
+  h_snapshot_header_t saved;
+  CU_ASSERT_TRUE_FATAL(test_header_read(&saved));
+  CU_ASSERT_TRUE_FATAL(saved.committed_pages > 1);
+
+  // counts out of range of the heap the header describes
+  h_snapshot_header_t header = saved;
+  header.committed_pages = saved.total_pages + 1;
+  test_rejected(&header);
+  header = saved;
+  header.used_pages = saved.committed_pages + 1;
+  test_rejected(&header);
+  header = saved;
+  header.limit_pages = saved.total_pages + 1;
+  test_rejected(&header);
+
+  // settings h_init would assert
+  header = saved;
+  header.options.tenure_age = H_MAX_AGE + 1;
+  test_rejected(&header);
+  header = saved;
+  header.options.page_size = 3*H_MIN_PAGESIZE;
+  test_rejected(&header);
+  header = saved;
+  header.options.max_bytes = saved.bytes/2;
+  test_rejected(&header);
+  header = saved;
+  header.gc_threshold = 2.0f;
+  test_rejected(&header);
+  header = saved;
+  header.bytes = 2*H_MIN_PAGESIZE;
+  test_rejected(&header);
+
+  // the pages must all be in the file, not only its header
+  CU_ASSERT_TRUE_FATAL(test_file_write(&saved, sizeof(saved), 0));
+  CU_ASSERT_EQUAL(truncate(path, (off_t)(saved.pages_offset + saved.pagesize)), 0);
+  CU_ASSERT_PTR_NULL(h_snapshot_load(path, NULL));
+}
+
+static void test_missing_layout(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  // chars do not fit a compact header, so the struct has a layout
+  void **obj = h_alloc_struct(h, "c*");
+  CU_ASSERT_PTR_NOT_NULL_FATAL(obj);
+  CU_ASSERT_EQUAL(O_HEADER_GET_TYPE(o_get_header(obj)), 0);
+  CU_ASSERT_TRUE_FATAL(h_snapshot_save(h, path, obj));
+  h_delete(h);
+
+  h_snapshot_header_t header;
+  CU_ASSERT_TRUE_FATAL(test_header_read(&header));
+  CU_ASSERT_TRUE_FATAL(header.layout_headers);
+  CU_ASSERT_EQUAL_FATAL(header.layout_count, 1);
+  // the layout is saved after the page table, at another address
+  // than the object's header points to
+  uintptr_t address = 0;
+  off_t offset = (off_t)(sizeof(header) + H_BITMAP_WORDS(header.committed_pages)*sizeof(uint64_t));
+  CU_ASSERT_TRUE_FATAL(test_file_write(&address, sizeof(address), offset));
+  void *root = NULL;
+  CU_ASSERT_PTR_NULL(h_snapshot_load(path, &root));
+  CU_ASSERT_PTR_NULL(root);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("snapshot", test_snapshot_init, test_snapshot_clean);
+  if(suite == NULL ||
+     CU_add_test(suite, "round trip", test_round_trip) == NULL ||
+     CU_add_test(suite, "reload", test_reload) == NULL ||
+     CU_add_test(suite, "invalid", test_invalid) == NULL ||
+     CU_add_test(suite, "header", test_header) == NULL ||
+     CU_add_test(suite, "missing layout", test_missing_layout) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
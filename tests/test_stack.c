@@ -0,0 +1,157 @@
+/**
+ *   \file test_stack.c
+ *   \brief Tests of the conservative stack scan
+ *
+ *   The stack scan first picks candidate words in blocks of up to 64,
+ *   with the widest vector instructions the CPU has. Every finder
+ *   must pick exactly the words the scalar one does.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_init.h"
+#include "h_large.h"
+#include "stacktrace.h"
+
+/**
+ *  \def TEST_WORDS
+ *  Amount of words of the buffer the finders run on.
+ */
+#define TEST_WORDS 1024
+
+/**
+ *  A xorshift generator, so that every run sees the same words.
+ */
+static uint64_t test_random(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/**
+ *  Fills a buffer with words into the heap's region and its large
+ *  objects, words just outside of them, words that only match in
+ *  one of their 32 bit halves, and random words.
+ */
+static void test_words(heap_t *h, char *large, size_t large_bytes, void **words, size_t n)
+{
+  uintptr_t region = ~h->region_mask + 1;
+  uint64_t state = 0x9e3779b97f4a7c15;
+  for(size_t i = 0; i < n; i++) {
+    uint64_t r = test_random(&state);
+    uintptr_t word;
+    switch(r % 9) {
+    case 0: word = (uintptr_t)h + (r >> 8) % region; break;
+    case 1: word = (uintptr_t)h + ((r >> 8) & 1 ? region - 1 : 0); break;
+    case 2: word = (uintptr_t)h + ((r >> 8) & 1 ? region : (uintptr_t)-1); break;
+    case 3: word = (uintptr_t)large + (r >> 8) % large_bytes; break;
+    case 4: word = (uintptr_t)h ^ ((uintptr_t)1 << (32 + (r >> 8) % 16)); break;
+    case 5: word = (uintptr_t)h ^ ((uintptr_t)1 << (r >> 8) % 32) ^ region; break;
+    case 6: word = (uintptr_t)h + (uint32_t)r; break;
+    case 7: word = 0; break;
+    default: word = r; break;
+    }
+    words[i] = (void *)word;
+  }
+}
+
+static void test_finders(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  size_t large_bytes = 3*h->pagesize;
+  char *large = h_alloc_data(h, large_bytes);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(large);
+  void **words = malloc(TEST_WORDS*sizeof(void *));
+  CU_ASSERT_PTR_NOT_NULL_FATAL(words);
+  test_words(h, large, large_bytes, words, TEST_WORDS);
+
+  uintptr_t mask = h->region_mask;
+  uintptr_t base = (uintptr_t)h;
+  size_t found = 0;
+  // every block length, from every alignment of the buffer
+  for(size_t start = 0; start + 64 <= TEST_WORDS; start += 61) {
+    for(size_t n = 0; n <= 64; n++) {
+      void **block = words + start;
+      uint64_t scalar = stack_candidates_scalar(mask, base, h->large_mask, h->large_base, block, n);
+      for(size_t i = 0; i < n; i++) {
+        bool inside = address_inside_heap_memory(h, block[i]) ||
+          ((uintptr_t)block[i] & h->large_mask) == h->large_base;
+        CU_ASSERT_EQUAL((scalar >> i) & 1, inside);
+      }
+      if(n < 64) {
+        CU_ASSERT_EQUAL(scalar >> n, 0);
+      }
+      CU_ASSERT_EQUAL(stack_candidates(h, block, n), scalar);
+#if defined(__x86_64__)
+      CU_ASSERT_EQUAL(stack_candidates_sse2(mask, base, h->large_mask, h->large_base, block, n), scalar);
+      if(__builtin_cpu_supports("avx2")) {
+        CU_ASSERT_EQUAL(stack_candidates_avx2(mask, base, h->large_mask, h->large_base, block, n), scalar);
+      }
+#endif
+      found += (size_t)__builtin_popcountll(scalar);
+    }
+  }
+  CU_ASSERT(found > 0);
+
+  // without large objects, only the heap's region
+  uint64_t none = stack_candidates_scalar(mask, base, 0, 1, words, 64);
+#if defined(__x86_64__)
+  CU_ASSERT_EQUAL(stack_candidates_sse2(mask, base, 0, 1, words, 64), none);
+  if(__builtin_cpu_supports("avx2")) {
+    CU_ASSERT_EQUAL(stack_candidates_avx2(mask, base, 0, 1, words, 64), none);
+  }
+#endif
+  free(words);
+  h_delete(h);
+}
+
+static void test_scan(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  void *words[100] = { NULL };
+  long *obj = h_alloc_struct(h, "*l");
+  char *large = h_alloc_data(h, 3*h->pagesize);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(large);
+  words[3] = obj;
+  words[70] = large + 5;
+  words[71] = (char *)h->pages;
+  words[99] = (char *)obj + 1;
+
+  // only words into used chunks or large objects are roots
+  CU_ASSERT_PTR_EQUAL(stack_trace(h, words, words + 100), &words[3]);
+  CU_ASSERT_PTR_EQUAL(stack_trace(h, words + 4, words + 100), &words[70]);
+  CU_ASSERT_PTR_EQUAL(stack_trace(h, words + 71, words + 100), &words[99]);
+  CU_ASSERT_PTR_NULL(stack_trace(h, words + 71, words + 99));
+  CU_ASSERT_PTR_NULL(stack_trace(h, words + 4, words + 70));
+  h_delete(h);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("stack", NULL, NULL);
+  if(suite == NULL ||
+     CU_add_test(suite, "candidate finders", test_finders) == NULL ||
+     CU_add_test(suite, "scan", test_scan) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}
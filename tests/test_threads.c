@@ -0,0 +1,436 @@
+/**
+ *   \file test_threads.c
+ *   \brief Tests of heaps shared by several threads
+ *
+ *   Registered threads allocate into pages of their own, and park at
+ *   safepoints while another thread collects, which scans their
+ *   stacks along with its own. The workers here only record what
+ *   they find, the main thread checks it: CUnit asserts are not
+ *   meant to be called from several threads.
+ */
+
+#define _GNU_SOURCE // pthread_getattr_np, must be defined before includes
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include "gc.h"
+#include "h_alloc.h"
+#include "h_init.h"
+#include "h_thread.h"
+#include "test_graph.h"
+
+/**
+ *  \def TEST_THREADS
+ *  Amount of worker threads sharing a heap.
+ */
+#define TEST_THREADS 4
+
+/**
+ *  \def TEST_LENGTH
+ *  Amount of nodes of the list each worker builds.
+ */
+#define TEST_LENGTH 20000
+
+/**
+ *  A worker thread and what it found.
+ *
+ *  h           The heap shared by the workers.
+ *  list        The worker's list, a root slot of the heap.
+ *  registered  Whether the worker could register.
+ *  page        The page the worker's first object went in.
+ *  buffer      The worker's current page of that size class just
+ *              after allocating its first object.
+ *  built       Whether its list was intact once built.
+ *  parked      Whether its list was still intact after the worker
+ *              sat at safepoints while others collected.
+ */
+typedef struct test_worker {
+  heap_t *h;
+  test_node_t *list;
+  bool registered;
+  page_t *page;
+  page_t *buffer;
+  bool built;
+  bool parked;
+} test_worker_t;
+
+/**
+ *  Holds the workers until all of them have taken a page, and the
+ *  main thread until then too.
+ */
+static pthread_barrier_t test_barrier;
+
+/**
+ *  Amount of workers done building their lists.
+ */
+static unsigned test_built;
+
+/**
+ *  Set when the workers may stop polling safepoints.
+ */
+static bool test_done;
+
+/**
+ *  Checks a list counts down from length - 1 to 0.
+ */
+static bool test_list_check(test_node_t *list, long length)
+{
+  for(long i = length - 1; i >= 0; i--) {
+    if(list == NULL || list->value != i) {
+      return false;
+    }
+    list = list->next;
+  }
+  return list == NULL;
+}
+
+/**
+ *  Builds a list of nodes counting down from length - 1 to 0, with
+ *  garbage between them. Only the stack refers to it.
+ */
+static test_node_t *test_list_build(heap_t *h, long length)
+{
+  test_node_t *volatile list = NULL;
+  for(long i = 0; i < length; i++) {
+    test_node_t *node = h_alloc_struct(h, "*l");
+    node->value = i;
+    node->next = list;
+    list = node;
+    test_garbage(h);
+  }
+  return list;
+}
+
+/**
+ *  Registers with the heap, builds a list with garbage between its
+ *  nodes, then polls safepoints until the main thread is done
+ *  collecting.
+ */
+static void *test_worker_run(void *arg)
+{
+  test_worker_t *worker = arg;
+  heap_t *h = worker->h;
+  worker->registered = h_register_thread(h);
+  if(!worker->registered) {
+    pthread_barrier_wait(&test_barrier);
+    __atomic_add_fetch(&test_built, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  // the first object goes in a page no other thread allocates into
+  test_node_t *first = h_alloc_struct(h, "*l");
+  worker->page = (page_t *)((uintptr_t)first & ~(uintptr_t)(h->pagesize - 1));
+  worker->buffer = h_alloc_current(h)[h_size_class(h, H_CHUNK_SIZE(sizeof(test_node_t)))];
+  pthread_barrier_wait(&test_barrier);
+
+  for(long i = 0; i < TEST_LENGTH; i++) {
+    test_node_t *node = h_alloc_struct(h, "*l");
+    node->value = i;
+    node->next = worker->list;
+    worker->list = node;
+    test_garbage(h);
+  }
+  worker->built = test_list_check(worker->list, TEST_LENGTH);
+  __atomic_add_fetch(&test_built, 1, __ATOMIC_RELEASE);
+
+  while(!__atomic_load_n(&test_done, __ATOMIC_ACQUIRE)) {
+    h_safepoint(h);
+  }
+  worker->parked = test_list_check(worker->list, TEST_LENGTH);
+  h_unregister_thread(h);
+  return NULL;
+}
+
+static void test_workers(void)
+{
+  heap_t *h = h_init(32 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  CU_ASSERT_EQUAL_FATAL(pthread_barrier_init(&test_barrier, NULL, TEST_THREADS + 1), 0);
+  test_built = 0;
+  test_done = false;
+
+  test_worker_t workers[TEST_THREADS] = { { 0 } };
+  pthread_t threads[TEST_THREADS];
+  for(int i = 0; i < TEST_THREADS; i++) {
+    workers[i].h = h;
+    CU_ASSERT_TRUE_FATAL(h_add_root(h, (void **)&workers[i].list));
+    CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[i], NULL, test_worker_run, &workers[i]), 0);
+  }
+
+  // collect while the workers allocate, and while they are parked
+  pthread_barrier_wait(&test_barrier);
+  size_t collections = 0;
+  while(__atomic_load_n(&test_built, __ATOMIC_ACQUIRE) < TEST_THREADS) {
+    h_gc(h);
+    collections++;
+  }
+  for(int i = 0; i < 3; i++) {
+    h_gc(h);
+    collections++;
+  }
+  __atomic_store_n(&test_done, true, __ATOMIC_RELEASE);
+  for(int i = 0; i < TEST_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for(int i = 0; i < TEST_THREADS; i++) {
+    CU_ASSERT_TRUE(workers[i].registered);
+    CU_ASSERT_PTR_NOT_NULL(workers[i].page);
+    CU_ASSERT_PTR_EQUAL(workers[i].buffer, workers[i].page);
+    CU_ASSERT_PTR_NOT_EQUAL(workers[i].buffer, &h->full_page);
+    for(int j = 0; j < i; j++) {
+      CU_ASSERT_PTR_NOT_EQUAL(workers[i].page, workers[j].page);
+    }
+    CU_ASSERT_TRUE(workers[i].built);
+    CU_ASSERT_TRUE(workers[i].parked);
+    h_remove_root(h, (void **)&workers[i].list);
+  }
+  CU_ASSERT_EQUAL(h->n_threads, TEST_THREADS);
+  CU_ASSERT_EQUAL(h->running, 0);
+
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.collections >= collections);
+  pthread_barrier_destroy(&test_barrier);
+  h_delete(h);
+}
+
+/**
+ *  Registers with the heap and builds a list only its stack refers
+ *  to, then polls safepoints until the main thread is done
+ *  collecting.
+ */
+static void *test_holder_run(void *arg)
+{
+  test_worker_t *worker = arg;
+  heap_t *h = worker->h;
+  worker->registered = h_register_thread(h);
+  if(!worker->registered) {
+    __atomic_add_fetch(&test_built, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+  test_node_t *volatile list = test_list_build(h, TEST_LENGTH);
+  worker->built = test_list_check(list, TEST_LENGTH);
+  __atomic_add_fetch(&test_built, 1, __ATOMIC_RELEASE);
+
+  while(!__atomic_load_n(&test_done, __ATOMIC_ACQUIRE)) {
+    h_safepoint(h);
+  }
+  worker->parked = test_list_check(list, TEST_LENGTH);
+  h_unregister_thread(h);
+  return NULL;
+}
+
+static void test_other_stack(void)
+{
+  // the list is only referred to by the parked thread's stack: if
+  // collections missed it, the garbage allocated meanwhile would
+  // reuse its memory
+  heap_t *h = h_init(32 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  test_built = 0;
+  test_done = false;
+  test_worker_t worker = { .h = h };
+  pthread_t thread;
+  CU_ASSERT_EQUAL_FATAL(pthread_create(&thread, NULL, test_holder_run, &worker), 0);
+  while(__atomic_load_n(&test_built, __ATOMIC_ACQUIRE) < 1) {
+    sched_yield();
+  }
+  for(int round = 0; round < 3; round++) {
+    h_gc(h);
+    for(long i = 0; i < 4*TEST_LENGTH; i++) {
+      test_garbage(h);
+    }
+  }
+  __atomic_store_n(&test_done, true, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+
+  CU_ASSERT_TRUE(worker.registered);
+  CU_ASSERT_TRUE(worker.built);
+  CU_ASSERT_TRUE(worker.parked);
+  gc_stats_t stats;
+  h_stats(h, &stats);
+  CU_ASSERT(stats.collections >= 3);
+  h_delete(h);
+}
+
+/**
+ *  A thread's records, as seen from the thread registering.
+ *
+ *  h          The heap to register with.
+ *  other      A second heap to register with.
+ *  record     Its record of h.
+ *  other_record  Its record of other.
+ *  again      Whether registering once more kept the same record.
+ *  unregistered  Whether unregistering dropped its record of h, and
+ *             of h only.
+ */
+typedef struct test_records {
+  heap_t *h;
+  heap_t *other;
+  h_thread_t *record;
+  h_thread_t *other_record;
+  bool again;
+  bool unregistered;
+} test_records_t;
+
+/**
+ *  Registers with both heaps, unregisters from the first, and waits
+ *  at the barrier (not at a safepoint) before unregistering from the
+ *  second.
+ */
+static void *test_records_run(void *arg)
+{
+  test_records_t *records = arg;
+  if(h_register_thread(records->h) && h_register_thread(records->other)) {
+    records->record = h_thread_current(records->h);
+    records->other_record = h_thread_current(records->other);
+    records->again = h_register_thread(records->h) &&
+      h_thread_current(records->h) == records->record;
+    h_alloc_struct(records->h, "*l");
+    h_unregister_thread(records->h);
+    records->unregistered = h_thread_current(records->h) == NULL &&
+      h_thread_current(records->other) == records->other_record;
+  }
+  pthread_barrier_wait(&test_barrier);
+  pthread_barrier_wait(&test_barrier);
+  h_unregister_thread(records->other);
+  return NULL;
+}
+
+static void test_unregister(void)
+{
+  heap_t *h = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  heap_t *other = h_init(8 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(other);
+  CU_ASSERT_EQUAL_FATAL(pthread_barrier_init(&test_barrier, NULL, 2), 0);
+
+  test_records_t first = { .h = h, .other = other };
+  test_records_t second = { .h = h, .other = other };
+  test_records_t *runs[] = { &first, &second };
+  for(int i = 0; i < 2; i++) {
+    pthread_t thread;
+    CU_ASSERT_EQUAL_FATAL(pthread_create(&thread, NULL, test_records_run, runs[i]), 0);
+    pthread_barrier_wait(&test_barrier);
+    // the thread unregistered from h, which must not wait for it
+    h_gc(h);
+    CU_ASSERT_EQUAL(h->running, 0);
+    CU_ASSERT_EQUAL(other->running, 1);
+    pthread_barrier_wait(&test_barrier);
+    pthread_join(thread, NULL);
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(runs[i]->record);
+    CU_ASSERT_PTR_EQUAL(runs[i]->record->heap, h);
+    CU_ASSERT_PTR_EQUAL(runs[i]->other_record->heap, other);
+    CU_ASSERT_TRUE(runs[i]->again);
+    CU_ASSERT_TRUE(runs[i]->unregistered);
+    CU_ASSERT_FALSE(runs[i]->record->active);
+    CU_ASSERT_PTR_EQUAL(runs[i]->record->pages[H_MIXED_CLASS], &h->full_page);
+  }
+
+  // the second thread took over the record the first one left
+  CU_ASSERT_PTR_EQUAL(second.record, first.record);
+  CU_ASSERT_PTR_EQUAL(second.other_record, first.other_record);
+  CU_ASSERT_EQUAL(h->n_threads, 1);
+  CU_ASSERT_EQUAL(other->n_threads, 1);
+  CU_ASSERT_EQUAL(other->running, 0);
+  pthread_barrier_destroy(&test_barrier);
+  h_delete(other);
+  h_delete(h);
+}
+
+/**
+ *  What an unregistered collecting thread found.
+ *
+ *  h       The heap.
+ *  bottom  The bottom of its stack the collector would scan to.
+ *  own     The actual bottom of its stack.
+ *  built   Whether its list survived the collections.
+ */
+typedef struct test_collector {
+  heap_t *h;
+  void *bottom;
+  void *own;
+  bool built;
+} test_collector_t;
+
+/**
+ *  Collects the heap without registering, holding a list on its
+ *  stack only.
+ */
+static void *test_collector_run(void *arg)
+{
+  test_collector_t *collector = arg;
+  heap_t *h = collector->h;
+  test_node_t *volatile list = test_list_build(h, TEST_LENGTH);
+  for(int round = 0; round < 3; round++) {
+    h_gc(h);
+    for(long i = 0; i < 4*TEST_LENGTH; i++) {
+      test_garbage(h);
+    }
+  }
+  collector->built = test_list_check(list, TEST_LENGTH);
+
+  // given the bottom of the main thread's stack, it still scans its
+  // own stack only
+  size_t count;
+  h_stack_t *stacks = h_thread_stacks(h, __builtin_frame_address(0), collector->own, &count);
+  collector->bottom = count == 1 ? stacks[0].bottom : NULL;
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+  if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+    if(pthread_attr_getstack(&attr, &addr, &size) == 0) {
+      collector->own = (char *)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  return NULL;
+}
+
+static void test_unregistered_collector(void)
+{
+  heap_t *h = h_init(32 << 20, false, 0.5f);
+  CU_ASSERT_PTR_NOT_NULL_FATAL(h);
+  // the main thread's stack, far from the collecting thread's
+  int here;
+  test_collector_t collector = { .h = h, .own = &here };
+  pthread_t thread;
+  CU_ASSERT_EQUAL_FATAL(pthread_create(&thread, NULL, test_collector_run, &collector), 0);
+  pthread_join(thread, NULL);
+
+  CU_ASSERT_TRUE(collector.built);
+  CU_ASSERT_PTR_NOT_NULL(collector.bottom);
+  CU_ASSERT_PTR_EQUAL(collector.bottom, collector.own);
+  h_delete(h);
+}
+
+int main(void)
+{
+  if(CU_initialize_registry() != CUE_SUCCESS) {
+    return CU_get_error();
+  }
+  CU_pSuite suite = CU_add_suite("threads", NULL, NULL);
+  if(suite == NULL ||
+     CU_add_test(suite, "allocating workers", test_workers) == NULL ||
+     CU_add_test(suite, "stack of a parked thread", test_other_stack) == NULL ||
+     CU_add_test(suite, "unregister and reuse", test_unregister) == NULL ||
+     CU_add_test(suite, "unregistered collector", test_unregistered_collector) == NULL) {
+    CU_cleanup_registry();
+    return CU_get_error();
+  }
+
+  CU_basic_set_mode(CU_BRM_VERBOSE);
+  CU_basic_run_tests();
+  unsigned failures = CU_get_number_of_failures();
+  CU_cleanup_registry();
+  return failures != 0;
+}